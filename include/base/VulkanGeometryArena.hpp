@@ -0,0 +1,468 @@
+/*
+* Vulkan geometry arena
+*
+* Large device local vertex and index buffers shared by all the meshes of an application, sub-allocated
+* with free lists so meshes can be loaded and unloaded at any time. Every mesh is addressed with the
+* firstIndex / vertexOffset of the draw commands, so all draws of a chunk are issued from the same bound buffers
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+#include "vulkan/vulkan.h"
+#include "VulkanTools.h"
+
+namespace vks
+{
+	/** @brief First fit free list over [0, capacity), adjacent free ranges are merged when freed */
+	class FreeList
+	{
+	public:
+		static constexpr uint32_t invalid = ~0u;
+
+		void reset(uint32_t capacity)
+		{
+			ranges.clear();
+			if (capacity > 0) {
+				ranges[0] = capacity;
+			}
+			this->capacity = capacity;
+		}
+
+		/** @brief Returns the offset of a free range of the given size, or invalid if none is large enough */
+		uint32_t allocate(uint32_t size)
+		{
+			if (size == 0) {
+				return 0;
+			}
+			for (auto it = ranges.begin(); it != ranges.end(); ++it) {
+				if (it->second >= size) {
+					const uint32_t offset = it->first;
+					const uint32_t remaining = it->second - size;
+					ranges.erase(it);
+					if (remaining > 0) {
+						ranges[offset + size] = remaining;
+					}
+					return offset;
+				}
+			}
+			return invalid;
+		}
+
+		void free(uint32_t offset, uint32_t size)
+		{
+			if (size == 0) {
+				return;
+			}
+			auto next = ranges.lower_bound(offset);
+			// merge with the following range
+			if (next != ranges.end() && offset + size == next->first) {
+				size += next->second;
+				next = ranges.erase(next);
+			}
+			// merge with the preceding range
+			if (next != ranges.begin()) {
+				auto prev = std::prev(next);
+				if (prev->first + prev->second == offset) {
+					prev->second += size;
+					return;
+				}
+			}
+			ranges[offset] = size;
+		}
+
+		uint32_t freeSpace() const
+		{
+			uint32_t total = 0;
+			for (const auto& range : ranges) {
+				total += range.second;
+			}
+			return total;
+		}
+
+		uint32_t size() const { return capacity; }
+
+	private:
+		std::map<uint32_t, uint32_t> ranges; // offset -> size of the free ranges
+		uint32_t capacity = 0;
+	};
+
+	/**
+	* @brief Device local vertex streams and index buffers shared by several meshes, split in fixed size chunks
+	* @note All streams are indexed with the same vertex index, so each stream has a fixed stride and the
+	* vertices of a mesh sit at the same index in every stream. All meshes use the index type of the arena
+	* @note A mesh never straddles two chunks: chunks are added when no existing one has room for a mesh, and each
+	* buffer of a chunk stays within maxMemoryAllocationSize (and maxStorageBufferRange for storage buffers)
+	*/
+	class GeometryArena
+	{
+	public:
+		/** @brief Range of vertices and indices of a mesh in a chunk, drawn with firstIndex and vertexOffset = firstVertex */
+		struct Allocation {
+			uint32_t chunk = 0;
+			uint32_t firstVertex = FreeList::invalid;
+			uint32_t vertexCount = 0;
+			uint32_t firstIndex = FreeList::invalid;
+			uint32_t indexCount = 0;
+			bool valid() const { return firstVertex != FreeList::invalid && firstIndex != FreeList::invalid; }
+		};
+
+		/**
+		* @brief Creates the first chunk, with one buffer per vertex stream (none for streams with a zero stride) and an index buffer
+		* @param chunkVertexCapacity, chunkIndexCapacity Size of every chunk, clamped to the buffer size limits of the device
+		* @param usage Usage flags added to all buffers (e.g. storage buffers for vertex pulling)
+		*/
+		void create(VkDevice device, VkPhysicalDevice physicalDevice, const std::vector<uint32_t>& streamStrides,
+			uint32_t chunkVertexCapacity, uint32_t chunkIndexCapacity, VkIndexType indexType, VkBufferUsageFlags usage = 0)
+		{
+			this->device = device;
+			this->physicalDevice = physicalDevice;
+			this->indexType = indexType;
+			this->usage = usage;
+			this->streamStrides = streamStrides;
+			indexSize = indexType == VK_INDEX_TYPE_UINT16 ? 2 : 4;
+
+			VkPhysicalDeviceMaintenance3Properties maintenance3{};
+			maintenance3.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MAINTENANCE_3_PROPERTIES;
+			VkPhysicalDeviceProperties2 properties{};
+			properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+			properties.pNext = &maintenance3;
+			vkGetPhysicalDeviceProperties2(physicalDevice, &properties);
+			VkDeviceSize maxBufferSize = maintenance3.maxMemoryAllocationSize;
+			if (usage & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT) {
+				maxBufferSize = std::min<VkDeviceSize>(maxBufferSize, properties.properties.limits.maxStorageBufferRange);
+			}
+			uint32_t maxStride = 1;
+			for (uint32_t stride : streamStrides) {
+				maxStride = std::max(maxStride, stride);
+			}
+			vertexCapacity = static_cast<uint32_t>(std::min<VkDeviceSize>(chunkVertexCapacity, maxBufferSize / maxStride));
+			indexCapacity = static_cast<uint32_t>(std::min<VkDeviceSize>(chunkIndexCapacity, maxBufferSize / indexSize));
+			addChunk();
+		}
+
+		void destroy()
+		{
+			for (Chunk& chunk : chunks) {
+				for (Stream& stream : chunk.streams) {
+					if (stream.buffer != VK_NULL_HANDLE) {
+						vkDestroyBuffer(device, stream.buffer, nullptr);
+						vkFreeMemory(device, stream.memory, nullptr);
+					}
+				}
+				vkDestroyBuffer(device, chunk.indexBuffer, nullptr);
+				vkFreeMemory(device, chunk.indexMemory, nullptr);
+			}
+			chunks.clear();
+		}
+
+		/**
+		* @brief Reserves vertexCount vertices in every stream and indexCount indices in the first chunk with room for them,
+		* adds a chunk if none has, throws if the mesh is larger than a chunk
+		*/
+		Allocation allocate(uint32_t vertexCount, uint32_t indexCount)
+		{
+			if (vertexCount > vertexCapacity || indexCount > indexCapacity) {
+				throw std::runtime_error("failed to allocate geometry: the mesh is larger than a chunk of the arena!");
+			}
+			for (uint32_t i = 0; i <= chunks.size(); i++) {
+				if (i == chunks.size()) {
+					addChunk();
+				}
+				Allocation allocation;
+				allocation.chunk = i;
+				allocation.vertexCount = vertexCount;
+				allocation.indexCount = indexCount;
+				allocation.firstVertex = chunks[i].vertexRanges.allocate(vertexCount);
+				allocation.firstIndex = chunks[i].indexRanges.allocate(indexCount);
+				if (allocation.valid()) {
+					return allocation;
+				}
+				free(allocation);
+			}
+			return Allocation{};
+		}
+
+		/** @brief Returns the ranges of a mesh to the free lists of its chunk (the GPU must be done with them) */
+		void free(Allocation& allocation)
+		{
+			if (allocation.chunk < chunks.size()) {
+				Chunk& chunk = chunks[allocation.chunk];
+				if (allocation.firstVertex != FreeList::invalid) {
+					chunk.vertexRanges.free(allocation.firstVertex, allocation.vertexCount);
+				}
+				if (allocation.firstIndex != FreeList::invalid) {
+					chunk.indexRanges.free(allocation.firstIndex, allocation.indexCount);
+				}
+			}
+			allocation = Allocation{};
+		}
+
+		/**
+		* @brief Starts a batch of uploads through a staging buffer of stagingSize bytes, whatever the amount of data staged
+		* @note The staging buffer is split in two halves: the copies of one half run while the other one is filled
+		*/
+		void beginUpload(VkCommandPool commandPool, VkQueue queue, VkDeviceSize stagingSize = 32 * 1024 * 1024)
+		{
+			uploadPool = commandPool;
+			uploadQueue = queue;
+			stagingSlotSize = stagingSize / 2;
+			createBuffer(stagingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, stagingBuffer, stagingMemory,
+				VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+			VK_CHECK_RESULT(vkMapMemory(device, stagingMemory, 0, VK_WHOLE_SIZE, 0, reinterpret_cast<void**>(&stagingMapped)));
+			VkFenceCreateInfo fenceInfo{};
+			fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+			for (StagingSlot& slot : stagingSlots) {
+				VK_CHECK_RESULT(vkCreateFence(device, &fenceInfo, nullptr, &slot.fence));
+				slot.pending = false;
+			}
+			currentSlot = 0;
+			beginSlot();
+		}
+
+		/**
+		* @brief Copies the vertices of each stream (vertexCount * stride bytes, null for empty streams) and the indices
+		* (indexCount indices of the arena index type) of an allocation to the staging buffer, which is flushed whenever
+		* it is full: the data can be freed as soon as this returns
+		*/
+		void stage(const Allocation& allocation, const std::vector<const void*>& streamData, const void* indexData)
+		{
+			const Chunk& chunk = chunks[allocation.chunk];
+			for (size_t i = 0; i < chunk.streams.size(); i++) {
+				const VkDeviceSize size = static_cast<VkDeviceSize>(allocation.vertexCount) * chunk.streams[i].stride;
+				if (size == 0 || i >= streamData.size() || streamData[i] == nullptr) {
+					continue;
+				}
+				stageCopy(chunk.streams[i].buffer, static_cast<VkDeviceSize>(allocation.firstVertex) * chunk.streams[i].stride,
+					static_cast<const uint8_t*>(streamData[i]), size);
+			}
+			const VkDeviceSize indexBytes = static_cast<VkDeviceSize>(allocation.indexCount) * indexSize;
+			if (indexBytes > 0 && indexData != nullptr) {
+				stageCopy(chunk.indexBuffer, static_cast<VkDeviceSize>(allocation.firstIndex) * indexSize,
+					static_cast<const uint8_t*>(indexData), indexBytes);
+			}
+		}
+
+		/** @brief Submits the remaining copies, waits for all of them and frees the staging buffer */
+		void endUpload()
+		{
+			flushSlot();
+			for (StagingSlot& slot : stagingSlots) {
+				waitSlot(slot);
+				vkDestroyFence(device, slot.fence, nullptr);
+			}
+			vkUnmapMemory(device, stagingMemory);
+			vkDestroyBuffer(device, stagingBuffer, nullptr);
+			vkFreeMemory(device, stagingMemory, nullptr);
+			stagingBuffer = VK_NULL_HANDLE;
+		}
+
+		/** @brief Uploads a single allocation (see stage) and waits for the copy */
+		void upload(VkCommandPool commandPool, VkQueue queue, const Allocation& allocation, const std::vector<const void*>& streamData, const void* indexData)
+		{
+			VkDeviceSize size = static_cast<VkDeviceSize>(allocation.indexCount) * indexSize;
+			for (uint32_t stride : streamStrides) {
+				size += static_cast<VkDeviceSize>(allocation.vertexCount) * stride;
+			}
+			if (size == 0) {
+				return;
+			}
+			beginUpload(commandPool, queue, std::min<VkDeviceSize>(size * 2, 32 * 1024 * 1024));
+			stage(allocation, streamData, indexData);
+			endUpload();
+		}
+
+		/** @brief Binds the first streamCount vertex streams (at bindings 0..streamCount-1) and the index buffer of a chunk */
+		void bind(VkCommandBuffer commandBuffer, uint32_t chunk = 0, uint32_t streamCount = ~0u) const
+		{
+			VkBuffer buffers[8];
+			VkDeviceSize offsets[8] = {};
+			uint32_t count = 0;
+			for (const Stream& stream : chunks[chunk].streams) {
+				if (count == streamCount || count == 8 || stream.buffer == VK_NULL_HANDLE) {
+					break;
+				}
+				buffers[count++] = stream.buffer;
+			}
+			if (count > 0) {
+				vkCmdBindVertexBuffers(commandBuffer, 0, count, buffers, offsets);
+			}
+			vkCmdBindIndexBuffer(commandBuffer, chunks[chunk].indexBuffer, 0, indexType);
+		}
+
+		VkBuffer vertexBuffer(uint32_t stream, uint32_t chunk = 0) const { return stream < streamStrides.size() ? chunks[chunk].streams[stream].buffer : VK_NULL_HANDLE; }
+		uint32_t stride(uint32_t stream) const { return stream < streamStrides.size() ? streamStrides[stream] : 0; }
+		uint32_t streamCount() const { return static_cast<uint32_t>(streamStrides.size()); }
+		VkBuffer getIndexBuffer(uint32_t chunk = 0) const { return chunks[chunk].indexBuffer; }
+		VkIndexType getIndexType() const { return indexType; }
+		uint32_t chunkCount() const { return static_cast<uint32_t>(chunks.size()); }
+		uint32_t chunkVertexCapacity() const { return vertexCapacity; }
+		uint32_t chunkIndexCapacity() const { return indexCapacity; }
+		uint32_t freeVertices(uint32_t chunk) const { return chunks[chunk].vertexRanges.freeSpace(); }
+		uint32_t freeIndices(uint32_t chunk) const { return chunks[chunk].indexRanges.freeSpace(); }
+
+	private:
+		struct Stream {
+			VkBuffer buffer = VK_NULL_HANDLE;
+			VkDeviceMemory memory = VK_NULL_HANDLE;
+			uint32_t stride = 0;
+		};
+		struct Chunk {
+			std::vector<Stream> streams;
+			VkBuffer indexBuffer = VK_NULL_HANDLE;
+			VkDeviceMemory indexMemory = VK_NULL_HANDLE;
+			FreeList vertexRanges; // in vertices
+			FreeList indexRanges;  // in indices
+		};
+		struct StagingSlot {
+			VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+			VkFence fence = VK_NULL_HANDLE;
+			bool pending = false;
+		};
+
+		VkDevice device = VK_NULL_HANDLE;
+		VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+		std::vector<uint32_t> streamStrides;
+		std::vector<Chunk> chunks;
+		uint32_t vertexCapacity = 0; // per chunk
+		uint32_t indexCapacity = 0;  // per chunk
+		VkIndexType indexType = VK_INDEX_TYPE_UINT32;
+		uint32_t indexSize = 4;
+		VkBufferUsageFlags usage = 0;
+
+		// Staging ring of the uploads in flight (see beginUpload)
+		VkCommandPool uploadPool = VK_NULL_HANDLE;
+		VkQueue uploadQueue = VK_NULL_HANDLE;
+		VkBuffer stagingBuffer = VK_NULL_HANDLE;
+		VkDeviceMemory stagingMemory = VK_NULL_HANDLE;
+		uint8_t* stagingMapped = nullptr;
+		VkDeviceSize stagingSlotSize = 0;
+		VkDeviceSize stagingHead = 0;
+		StagingSlot stagingSlots[2];
+		uint32_t currentSlot = 0;
+
+		void addChunk()
+		{
+			Chunk chunk;
+			chunk.streams.resize(streamStrides.size());
+			for (size_t i = 0; i < chunk.streams.size(); i++) {
+				chunk.streams[i].stride = streamStrides[i];
+				if (chunk.streams[i].stride > 0) {
+					createBuffer(static_cast<VkDeviceSize>(vertexCapacity) * chunk.streams[i].stride,
+						VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage,
+						chunk.streams[i].buffer, chunk.streams[i].memory);
+				}
+			}
+			createBuffer(static_cast<VkDeviceSize>(indexCapacity) * indexSize,
+				VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage,
+				chunk.indexBuffer, chunk.indexMemory);
+			chunk.vertexRanges.reset(vertexCapacity);
+			chunk.indexRanges.reset(indexCapacity);
+			chunks.push_back(std::move(chunk));
+		}
+
+		// Copies size bytes to the staging buffer and records their copy to dst, in pieces if they do not fit in the current half
+		void stageCopy(VkBuffer dst, VkDeviceSize dstOffset, const uint8_t* data, VkDeviceSize size)
+		{
+			while (size > 0) {
+				if (stagingHead == stagingSlotSize) {
+					flushSlot();
+					beginSlot();
+				}
+				const VkDeviceSize bytes = std::min(size, stagingSlotSize - stagingHead);
+				const VkDeviceSize stagingOffset = currentSlot * stagingSlotSize + stagingHead;
+				memcpy(stagingMapped + stagingOffset, data, static_cast<size_t>(bytes));
+				VkBufferCopy region{ stagingOffset, dstOffset, bytes };
+				vkCmdCopyBuffer(stagingSlots[currentSlot].commandBuffer, stagingBuffer, dst, 1, &region);
+				stagingHead += bytes;
+				dstOffset += bytes;
+				data += bytes;
+				size -= bytes;
+			}
+		}
+
+		// Waits for the previous copies of the current half, then starts recording new ones
+		void beginSlot()
+		{
+			StagingSlot& slot = stagingSlots[currentSlot];
+			waitSlot(slot);
+			VkCommandBufferAllocateInfo allocInfo{};
+			allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+			allocInfo.commandPool = uploadPool;
+			allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+			allocInfo.commandBufferCount = 1;
+			VK_CHECK_RESULT(vkAllocateCommandBuffers(device, &allocInfo, &slot.commandBuffer));
+			VkCommandBufferBeginInfo beginInfo{};
+			beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+			beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+			VK_CHECK_RESULT(vkBeginCommandBuffer(slot.commandBuffer, &beginInfo));
+			stagingHead = 0;
+		}
+
+		// Submits the copies of the current half and switches to the other one
+		void flushSlot()
+		{
+			StagingSlot& slot = stagingSlots[currentSlot];
+			VK_CHECK_RESULT(vkEndCommandBuffer(slot.commandBuffer));
+			VkSubmitInfo submitInfo{};
+			submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+			submitInfo.commandBufferCount = 1;
+			submitInfo.pCommandBuffers = &slot.commandBuffer;
+			VK_CHECK_RESULT(vkQueueSubmit(uploadQueue, 1, &submitInfo, slot.fence));
+			slot.pending = true;
+			currentSlot ^= 1;
+		}
+
+		void waitSlot(StagingSlot& slot)
+		{
+			if (slot.pending) {
+				VK_CHECK_RESULT(vkWaitForFences(device, 1, &slot.fence, VK_TRUE, UINT64_MAX));
+				VK_CHECK_RESULT(vkResetFences(device, 1, &slot.fence));
+				vkFreeCommandBuffers(device, uploadPool, 1, &slot.commandBuffer);
+				slot.pending = false;
+			}
+		}
+
+		void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer& buffer, VkDeviceMemory& memory,
+			VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+		{
+			VkBufferCreateInfo bufferInfo{};
+			bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+			bufferInfo.size = size;
+			bufferInfo.usage = usage;
+			bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+			VK_CHECK_RESULT(vkCreateBuffer(device, &bufferInfo, nullptr, &buffer));
+
+			VkMemoryRequirements memRequirements;
+			vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
+			VkPhysicalDeviceMemoryProperties memProperties;
+			vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+			uint32_t memoryType = ~0u;
+			for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+				if ((memRequirements.memoryTypeBits & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+					memoryType = i;
+					break;
+				}
+			}
+			if (memoryType == ~0u) {
+				throw std::runtime_error("failed to find suitable memory type!");
+			}
+
+			VkMemoryAllocateInfo allocInfo{};
+			allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+			allocInfo.allocationSize = memRequirements.size;
+			allocInfo.memoryTypeIndex = memoryType;
+			VK_CHECK_RESULT(vkAllocateMemory(device, &allocInfo, nullptr, &memory));
+			VK_CHECK_RESULT(vkBindBufferMemory(device, buffer, memory, 0));
+		}
+	};
+}
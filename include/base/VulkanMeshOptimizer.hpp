@@ -0,0 +1,349 @@
+/*
+* Vulkan mesh optimization
+*
+* Triangle list reordering for the post-transform vertex cache (Tipsify), overdraw-aware
+* cluster ordering, vertex fetch remapping and cache statistics
+* Works on plain index and vertex arrays, so it can run when loading a model or when cooking assets
+*
+* Reference: Sander, Nehab, Barczak - Fast Triangle Reordering for Vertex Locality and Reduced Overdraw (2007)
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "vulkan/vulkan.h"
+
+#include <glm/glm.hpp>
+
+namespace vks
+{
+	namespace mesh
+	{
+		/** @brief Post-transform vertex cache statistics of an index buffer */
+		struct CacheStatistics {
+			float acmr = 0.0f; // average cache miss ratio: transformed vertices per triangle (0.5 best, 3 worst)
+			float atvr = 0.0f; // average transform to vertex ratio: transformed vertices per referenced vertex (1 best)
+		};
+
+		/** @brief Simulates a FIFO post-transform cache of cacheSize entries */
+		inline CacheStatistics analyzeVertexCache(const uint32_t* indices, size_t indexCount, uint32_t vertexCount, uint32_t cacheSize = 16)
+		{
+			CacheStatistics statistics;
+			if (indexCount < 3 || vertexCount == 0) {
+				return statistics;
+			}
+			// a vertex is in the cache if it was inserted less than cacheSize misses ago
+			std::vector<uint32_t> insertedAt(vertexCount, 0);
+			std::vector<bool> referenced(vertexCount, false);
+			uint32_t misses = 0;
+			uint32_t referencedCount = 0;
+			for (size_t i = 0; i < indexCount; i++) {
+				const uint32_t v = indices[i];
+				if (insertedAt[v] == 0 || misses - insertedAt[v] + 1 > cacheSize) {
+					misses++;
+					insertedAt[v] = misses;
+				}
+				if (!referenced[v]) {
+					referenced[v] = true;
+					referencedCount++;
+				}
+			}
+			statistics.acmr = static_cast<float>(misses) / static_cast<float>(indexCount / 3);
+			statistics.atvr = static_cast<float>(misses) / static_cast<float>(referencedCount);
+			return statistics;
+		}
+
+		/**
+		* @brief Reorders the triangles for the post-transform vertex cache (Tipsify)
+		* @param clusters (Optional) Receives the first triangle of each cluster: the places where the cache is flushed anyway,
+		* between which triangles can be reordered without hurting the cache (see optimizeOverdraw)
+		*/
+		inline void optimizeVertexCache(uint32_t* indices, size_t indexCount, uint32_t vertexCount, uint32_t cacheSize = 16, std::vector<uint32_t>* clusters = nullptr)
+		{
+			const uint32_t triangleCount = static_cast<uint32_t>(indexCount / 3);
+			if (clusters) {
+				clusters->assign(1, 0);
+			}
+			if (triangleCount == 0) {
+				return;
+			}
+
+			// vertex -> triangles adjacency
+			std::vector<uint32_t> adjacencyOffsets(vertexCount + 1, 0);
+			for (size_t i = 0; i < triangleCount * 3; i++) {
+				adjacencyOffsets[indices[i] + 1]++;
+			}
+			for (uint32_t v = 0; v < vertexCount; v++) {
+				adjacencyOffsets[v + 1] += adjacencyOffsets[v];
+			}
+			std::vector<uint32_t> liveTriangles(vertexCount);
+			for (uint32_t v = 0; v < vertexCount; v++) {
+				liveTriangles[v] = adjacencyOffsets[v + 1] - adjacencyOffsets[v];
+			}
+			std::vector<uint32_t> adjacency(triangleCount * 3);
+			{
+				std::vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+				for (uint32_t t = 0; t < triangleCount; t++) {
+					for (uint32_t k = 0; k < 3; k++) {
+						adjacency[fill[indices[t * 3 + k]]++] = t;
+					}
+				}
+			}
+
+			std::vector<uint32_t> cacheTime(vertexCount, 0);
+			std::vector<bool> emitted(triangleCount, false);
+			std::vector<uint32_t> deadEnd;
+			std::vector<uint32_t> candidates;
+			std::vector<uint32_t> result;
+			result.reserve(triangleCount * 3);
+			uint32_t timeStamp = cacheSize + 1;
+			uint32_t cursor = 0;
+			int64_t fanning = indices[0];
+
+			while (fanning >= 0) {
+				// emit all remaining triangles around the fanning vertex
+				candidates.clear();
+				for (uint32_t a = adjacencyOffsets[fanning]; a < adjacencyOffsets[fanning + 1]; a++) {
+					const uint32_t t = adjacency[a];
+					if (emitted[t]) {
+						continue;
+					}
+					for (uint32_t k = 0; k < 3; k++) {
+						const uint32_t v = indices[t * 3 + k];
+						result.push_back(v);
+						deadEnd.push_back(v);
+						candidates.push_back(v);
+						liveTriangles[v]--;
+						if (timeStamp - cacheTime[v] > cacheSize) {
+							cacheTime[v] = timeStamp++;
+						}
+					}
+					emitted[t] = true;
+				}
+
+				// next fanning vertex: the candidate that is still in the cache after its remaining triangles are emitted,
+				// and that has been in it for the longest time
+				int64_t next = -1;
+				int64_t best = -1;
+				for (uint32_t v : candidates) {
+					if (liveTriangles[v] == 0) {
+						continue;
+					}
+					int64_t priority = 0;
+					if (timeStamp - cacheTime[v] + 2 * liveTriangles[v] <= cacheSize) {
+						priority = timeStamp - cacheTime[v];
+					}
+					if (priority > best) {
+						best = priority;
+						next = v;
+					}
+				}
+
+				// dead end: fall back to the recently used vertices, then to the next vertex in input order
+				if (next == -1) {
+					while (!deadEnd.empty() && next == -1) {
+						const uint32_t v = deadEnd.back();
+						deadEnd.pop_back();
+						if (liveTriangles[v] > 0) {
+							next = v;
+						}
+					}
+					while (next == -1 && cursor < vertexCount) {
+						if (liveTriangles[cursor] > 0) {
+							next = cursor;
+							// the cache is cold again: a hard boundary between clusters
+							if (clusters && result.size() < triangleCount * 3) {
+								clusters->push_back(static_cast<uint32_t>(result.size() / 3));
+							}
+						}
+						cursor++;
+					}
+				}
+				fanning = next;
+			}
+
+			memcpy(indices, result.data(), result.size() * sizeof(uint32_t));
+		}
+
+		/**
+		* @brief Splits the clusters of a cache-optimized index buffer further: a new cluster starts as soon as the current one,
+		* simulated from a cold cache, reaches an ACMR of threshold times the ACMR of the whole buffer
+		*/
+		inline void splitClusters(const uint32_t* indices, size_t indexCount, uint32_t vertexCount, std::vector<uint32_t>& clusters, float threshold, uint32_t cacheSize)
+		{
+			const uint32_t triangleCount = static_cast<uint32_t>(indexCount / 3);
+			const float limit = threshold * analyzeVertexCache(indices, indexCount, vertexCount, cacheSize).acmr;
+			std::vector<uint32_t> insertedAt(vertexCount, 0);
+			std::vector<uint32_t> result;
+			uint32_t misses = 0;
+			for (size_t c = 0; c < clusters.size(); c++) {
+				const uint32_t last = c + 1 < clusters.size() ? clusters[c + 1] : triangleCount;
+				uint32_t first = clusters[c];
+				uint32_t missBase = misses; // vertices inserted before the cluster started are not in its (cold) cache
+				result.push_back(first);
+				for (uint32_t t = first; t < last; t++) {
+					for (uint32_t k = 0; k < 3; k++) {
+						const uint32_t v = indices[t * 3 + k];
+						if (insertedAt[v] <= missBase || misses - insertedAt[v] + 1 > cacheSize) {
+							misses++;
+							insertedAt[v] = misses;
+						}
+					}
+					if (t + 1 < last && static_cast<float>(misses - missBase) <= limit * static_cast<float>(t + 1 - first)) {
+						first = t + 1;
+						missBase = misses;
+						result.push_back(first);
+					}
+				}
+			}
+			clusters = result;
+		}
+
+		/**
+		* @brief Reorders the clusters of a cache-optimized index buffer so that outward facing clusters come first,
+		* which reduces overdraw from any view point while keeping the vertex cache efficiency inside each cluster
+		* @param positions Vertex positions (3 floats), positionStride bytes apart
+		* @param clusters First triangle of each cluster, as returned by optimizeVertexCache (see splitClusters)
+		*/
+		inline void optimizeOverdraw(uint32_t* indices, size_t indexCount, const float* positions, size_t positionStride, const std::vector<uint32_t>& clusters)
+		{
+			const uint32_t triangleCount = static_cast<uint32_t>(indexCount / 3);
+			if (clusters.size() < 2) {
+				return;
+			}
+			auto position = [&](uint32_t v) {
+				const float* p = reinterpret_cast<const float*>(reinterpret_cast<const uint8_t*>(positions) + v * positionStride);
+				return glm::vec3(p[0], p[1], p[2]);
+			};
+
+			struct Cluster {
+				uint32_t firstTriangle;
+				uint32_t triangleCount;
+				glm::vec3 centroid;
+				glm::vec3 normal;
+				float sortKey;
+			};
+			std::vector<Cluster> sorted(clusters.size());
+			glm::vec3 meshCentroid(0.0f);
+			float meshArea = 0.0f;
+			for (size_t c = 0; c < clusters.size(); c++) {
+				Cluster& cluster = sorted[c];
+				cluster.firstTriangle = clusters[c];
+				cluster.triangleCount = (c + 1 < clusters.size() ? clusters[c + 1] : triangleCount) - clusters[c];
+				cluster.centroid = glm::vec3(0.0f);
+				cluster.normal = glm::vec3(0.0f);
+				float area = 0.0f;
+				for (uint32_t t = cluster.firstTriangle; t < cluster.firstTriangle + cluster.triangleCount; t++) {
+					const glm::vec3 p0 = position(indices[t * 3 + 0]);
+					const glm::vec3 p1 = position(indices[t * 3 + 1]);
+					const glm::vec3 p2 = position(indices[t * 3 + 2]);
+					const glm::vec3 n = glm::cross(p1 - p0, p2 - p0); // area weighted normal
+					const float a = glm::length(n);
+					cluster.centroid += (p0 + p1 + p2) * (a / 3.0f);
+					cluster.normal += n;
+					area += a;
+				}
+				meshCentroid += cluster.centroid;
+				meshArea += area;
+				cluster.centroid = area > 0.0f ? cluster.centroid / area : position(indices[cluster.firstTriangle * 3]);
+			}
+			if (meshArea > 0.0f) {
+				meshCentroid /= meshArea;
+			}
+			for (Cluster& cluster : sorted) {
+				const float length = glm::length(cluster.normal);
+				cluster.sortKey = length > 0.0f ? glm::dot(cluster.centroid - meshCentroid, cluster.normal / length) : 0.0f;
+			}
+			std::stable_sort(sorted.begin(), sorted.end(), [](const Cluster& a, const Cluster& b) { return a.sortKey > b.sortKey; });
+
+			std::vector<uint32_t> result;
+			result.reserve(triangleCount * 3);
+			for (const Cluster& cluster : sorted) {
+				result.insert(result.end(), indices + cluster.firstTriangle * 3, indices + (cluster.firstTriangle + cluster.triangleCount) * 3);
+			}
+			memcpy(indices, result.data(), result.size() * sizeof(uint32_t));
+		}
+
+		/**
+		* @brief Renumbers the vertices in the order the index buffer first references them, so vertex fetches are sequential
+		* Rewrites the indices and returns the remap table (old index -> new index), apply it to the vertices with remapVertices
+		* Unreferenced vertices are moved to the end
+		*/
+		inline std::vector<uint32_t> optimizeVertexFetch(uint32_t* indices, size_t indexCount, uint32_t vertexCount)
+		{
+			const uint32_t unused = ~0u;
+			std::vector<uint32_t> remap(vertexCount, unused);
+			uint32_t next = 0;
+			for (size_t i = 0; i < indexCount; i++) {
+				uint32_t& target = remap[indices[i]];
+				if (target == unused) {
+					target = next++;
+				}
+				indices[i] = target;
+			}
+			for (uint32_t& target : remap) {
+				if (target == unused) {
+					target = next++;
+				}
+			}
+			return remap;
+		}
+
+		template<typename T>
+		void remapVertices(T* vertices, uint32_t vertexCount, const std::vector<uint32_t>& remap)
+		{
+			std::vector<T> source(vertices, vertices + vertexCount);
+			for (uint32_t v = 0; v < vertexCount; v++) {
+				vertices[remap[v]] = source[v];
+			}
+		}
+
+		/** @brief Smallest index type able to address vertexCount vertices */
+		inline VkIndexType indexTypeFor(uint32_t vertexCount)
+		{
+			return vertexCount < 65536 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+		}
+
+		inline uint32_t indexTypeSize(VkIndexType indexType)
+		{
+			return indexType == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t) : sizeof(uint32_t);
+		}
+
+		/** @brief Copies indices into a buffer of the given index type */
+		inline std::vector<uint8_t> packIndices(const uint32_t* indices, size_t indexCount, VkIndexType indexType)
+		{
+			std::vector<uint8_t> result(indexCount * indexTypeSize(indexType));
+			if (indexType == VK_INDEX_TYPE_UINT16) {
+				uint16_t* dst = reinterpret_cast<uint16_t*>(result.data());
+				for (size_t i = 0; i < indexCount; i++) {
+					dst[i] = static_cast<uint16_t>(indices[i]);
+				}
+			} else {
+				memcpy(result.data(), indices, indexCount * sizeof(uint32_t));
+			}
+			return result;
+		}
+
+		/**
+		* @brief Runs the whole pipeline on a triangle list: vertex cache, overdraw and vertex fetch optimization
+		* Vertices are reordered in place, positions are read as 3 floats at positionOffset bytes of each vertex
+		* @param overdrawThreshold ACMR increase allowed to reduce overdraw (1.05 = at most about 5% more vertex transforms)
+		*/
+		template<typename T>
+		void optimizeMesh(uint32_t* indices, size_t indexCount, T* vertices, uint32_t vertexCount, size_t positionOffset = 0, float overdrawThreshold = 1.05f, uint32_t cacheSize = 16)
+		{
+			std::vector<uint32_t> clusters;
+			optimizeVertexCache(indices, indexCount, vertexCount, cacheSize, &clusters);
+			splitClusters(indices, indexCount, vertexCount, clusters, overdrawThreshold, cacheSize);
+			optimizeOverdraw(indices, indexCount, reinterpret_cast<const float*>(reinterpret_cast<const uint8_t*>(vertices) + positionOffset), sizeof(T), clusters);
+			const std::vector<uint32_t> remap = optimizeVertexFetch(indices, indexCount, vertexCount);
+			remapVertices(vertices, vertexCount, remap);
+		}
+	}
+}
@@ -0,0 +1,242 @@
+/*
+* Vulkan mesh simplification
+*
+* Quadric error metric edge collapse on plain index and vertex arrays, used to build LOD chains
+* Collapses only move a vertex onto one of its neighbours, so every LOD reuses the vertices of the
+* original mesh: the levels only differ by their index ranges and can share a single vertex buffer
+*
+* Reference: Garland, Heckbert - Surface Simplification Using Quadric Error Metrics (1997)
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+namespace vks
+{
+	namespace mesh
+	{
+		/** @brief Sum of squared distances to a set of planes, weighted by the area of the triangles they come from */
+		struct Quadric {
+			double a2 = 0, ab = 0, ac = 0, ad = 0;
+			double b2 = 0, bc = 0, bd = 0;
+			double c2 = 0, cd = 0;
+			double d2 = 0;
+			double weight = 0;
+
+			static Quadric fromPlane(const glm::dvec3& n, double d, double weight)
+			{
+				Quadric q;
+				q.a2 = n.x * n.x * weight; q.ab = n.x * n.y * weight; q.ac = n.x * n.z * weight; q.ad = n.x * d * weight;
+				q.b2 = n.y * n.y * weight; q.bc = n.y * n.z * weight; q.bd = n.y * d * weight;
+				q.c2 = n.z * n.z * weight; q.cd = n.z * d * weight;
+				q.d2 = d * d * weight;
+				q.weight = weight;
+				return q;
+			}
+
+			void add(const Quadric& q)
+			{
+				a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+				b2 += q.b2; bc += q.bc; bd += q.bd;
+				c2 += q.c2; cd += q.cd;
+				d2 += q.d2;
+				weight += q.weight;
+			}
+
+			/** @brief Mean squared distance of p to the planes */
+			double error(const glm::vec3& p) const
+			{
+				const double x = p.x, y = p.y, z = p.z;
+				const double e = a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x
+					+ b2 * y * y + 2 * bc * y * z + 2 * bd * y
+					+ c2 * z * z + 2 * cd * z
+					+ d2;
+				return weight > 0 ? std::max(0.0, e / weight) : 0.0;
+			}
+		};
+
+		/**
+		* @brief Simplifies a triangle list until it has at most targetIndexCount indices, or no collapse is possible
+		* @note Vertices on open borders and attribute seams (edges with a single triangle) never move, so the
+		* silhouette of open meshes and the texture mapping are kept
+		* @param resultError If not null, receives the largest geometric error introduced (distance, in position units)
+		* @return The indices of the simplified mesh, referencing the original vertices
+		*/
+		inline std::vector<uint32_t> simplifyMesh(const uint32_t* indices, size_t indexCount, const float* positions, size_t positionStride,
+			uint32_t vertexCount, size_t targetIndexCount, float* resultError = nullptr)
+		{
+			auto position = [&](uint32_t v) {
+				const float* p = reinterpret_cast<const float*>(reinterpret_cast<const uint8_t*>(positions) + v * positionStride);
+				return glm::vec3(p[0], p[1], p[2]);
+			};
+
+			std::vector<uint32_t> result(indices, indices + (indexCount / 3) * 3);
+
+			// plane quadric of each triangle, accumulated on its vertices
+			std::vector<Quadric> quadrics(vertexCount);
+			for (size_t t = 0; t < result.size(); t += 3) {
+				const glm::dvec3 p0 = position(result[t]), p1 = position(result[t + 1]), p2 = position(result[t + 2]);
+				glm::dvec3 n = glm::cross(p1 - p0, p2 - p0);
+				const double length = glm::length(n);
+				if (length == 0.0) {
+					continue;
+				}
+				n /= length;
+				const Quadric q = Quadric::fromPlane(n, -glm::dot(n, p0), length * 0.5);
+				for (uint32_t k = 0; k < 3; k++) {
+					quadrics[result[t + k]].add(q);
+				}
+			}
+
+			// lock the vertices of edges that are not shared by exactly two triangles
+			std::vector<uint8_t> locked(vertexCount, 0);
+			{
+				std::unordered_map<uint64_t, uint32_t> edgeCount;
+				edgeCount.reserve(result.size());
+				for (size_t t = 0; t < result.size(); t += 3) {
+					for (uint32_t k = 0; k < 3; k++) {
+						const uint32_t a = result[t + k], b = result[t + (k + 1) % 3];
+						edgeCount[(static_cast<uint64_t>(std::min(a, b)) << 32) | std::max(a, b)]++;
+					}
+				}
+				for (const auto& edge : edgeCount) {
+					if (edge.second != 2) {
+						locked[edge.first >> 32] = 1;
+						locked[edge.first & 0xffffffff] = 1;
+					}
+				}
+			}
+
+			struct Collapse {
+				uint32_t from, to;
+				double cost;
+			};
+			std::vector<Collapse> collapses;
+			std::vector<uint32_t> triangleOffsets(vertexCount + 1);
+			std::vector<uint32_t> vertexTriangles;
+			std::vector<uint8_t> touched(vertexCount);
+			double maxError = 0.0;
+
+			// each pass collapses the cheapest edges whose neighbourhoods do not overlap, then rebuilds the triangle list
+			while (result.size() > targetIndexCount) {
+				collapses.clear();
+				for (size_t t = 0; t < result.size(); t += 3) {
+					for (uint32_t k = 0; k < 3; k++) {
+						const uint32_t a = result[t + k], b = result[t + (k + 1) % 3];
+						// interior edges appear in both directions, only keep one of them
+						if (a > b || (locked[a] && locked[b])) {
+							continue;
+						}
+						Quadric q = quadrics[a];
+						q.add(quadrics[b]);
+						const double costAB = locked[a] ? DBL_MAX : q.error(position(b));
+						const double costBA = locked[b] ? DBL_MAX : q.error(position(a));
+						collapses.push_back(costAB <= costBA ? Collapse{ a, b, costAB } : Collapse{ b, a, costBA });
+					}
+				}
+				if (collapses.empty()) {
+					break;
+				}
+				std::sort(collapses.begin(), collapses.end(), [](const Collapse& l, const Collapse& r) { return l.cost < r.cost; });
+
+				// triangles around each vertex, to reject collapses that flip a triangle
+				std::fill(triangleOffsets.begin(), triangleOffsets.end(), 0);
+				for (uint32_t v : result) {
+					triangleOffsets[v + 1]++;
+				}
+				for (uint32_t v = 0; v < vertexCount; v++) {
+					triangleOffsets[v + 1] += triangleOffsets[v];
+				}
+				vertexTriangles.resize(result.size());
+				{
+					std::vector<uint32_t> fill(triangleOffsets.begin(), triangleOffsets.end() - 1);
+					for (size_t i = 0; i < result.size(); i++) {
+						vertexTriangles[fill[result[i]]++] = static_cast<uint32_t>(i / 3);
+					}
+				}
+
+				auto flips = [&](uint32_t from, uint32_t to) {
+					const glm::vec3 target = position(to);
+					for (uint32_t i = triangleOffsets[from]; i < triangleOffsets[from + 1]; i++) {
+						const uint32_t* tri = &result[vertexTriangles[i] * 3];
+						if (tri[0] == to || tri[1] == to || tri[2] == to) {
+							continue; // removed by the collapse
+						}
+						glm::vec3 p[3], q[3];
+						for (uint32_t k = 0; k < 3; k++) {
+							p[k] = position(tri[k]);
+							q[k] = tri[k] == from ? target : p[k];
+						}
+						const glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+						const glm::vec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+						if (glm::dot(before, after) <= 0.25f * glm::length(before) * glm::length(after)) {
+							return true;
+						}
+					}
+					return false;
+				};
+
+				const size_t triangleCount = result.size() / 3;
+				const size_t targetTriangles = targetIndexCount / 3;
+				size_t removedTriangles = 0;
+				std::fill(touched.begin(), touched.end(), 0);
+				std::vector<uint32_t> remap;
+				for (const Collapse& collapse : collapses) {
+					if (touched[collapse.from] || touched[collapse.to] || flips(collapse.from, collapse.to)) {
+						continue;
+					}
+					if (remap.empty()) {
+						remap.resize(vertexCount);
+						for (uint32_t v = 0; v < vertexCount; v++) {
+							remap[v] = v;
+						}
+					}
+					remap[collapse.from] = collapse.to;
+					quadrics[collapse.to].add(quadrics[collapse.from]);
+					maxError = std::max(maxError, collapse.cost);
+
+					// the neighbourhood of the moved vertex changed, its other edges wait for the next pass
+					for (uint32_t i = triangleOffsets[collapse.from]; i < triangleOffsets[collapse.from + 1]; i++) {
+						const uint32_t* tri = &result[vertexTriangles[i] * 3];
+						touched[tri[0]] = touched[tri[1]] = touched[tri[2]] = 1;
+					}
+					// an interior edge collapse removes two triangles
+					removedTriangles += 2;
+					if (triangleCount - std::min(triangleCount, removedTriangles) <= targetTriangles) {
+						break;
+					}
+				}
+				if (remap.empty()) {
+					break;
+				}
+
+				// apply the collapses and drop the degenerate triangles
+				size_t write = 0;
+				for (size_t t = 0; t < result.size(); t += 3) {
+					const uint32_t a = remap[result[t]], b = remap[result[t + 1]], c = remap[result[t + 2]];
+					if (a != b && b != c && a != c) {
+						result[write++] = a;
+						result[write++] = b;
+						result[write++] = c;
+					}
+				}
+				result.resize(write);
+			}
+
+			if (resultError) {
+				*resultError = static_cast<float>(std::sqrt(maxError));
+			}
+			return result;
+		}
+	}
+}
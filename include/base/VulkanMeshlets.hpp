@@ -0,0 +1,148 @@
+/*
+* Vulkan meshlets
+*
+* Splits triangle lists into small clusters (meshlets) with a bounding sphere and a normal cone,
+* used to cull whole clusters on the GPU (compute or task shaders) before any vertex work is done
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+namespace vks
+{
+	namespace mesh
+	{
+		/**
+		* @brief Cluster of at most maxVertices vertices and maxTriangles triangles, laid out for std430 buffers
+		* @note Cull a meshlet seen from the camera position if dot(center - camera, coneAxis) >= coneCutoff * length(center - camera) + radius
+		*/
+		struct Meshlet {
+			glm::vec3 center;        // bounding sphere
+			float radius;
+			glm::vec3 coneAxis;      // average normal of the triangles
+			float coneCutoff;        // sine of the cone half angle, 1 if the triangles face too many directions to ever be culled
+			uint32_t vertexOffset;   // first entry in Meshlets::vertices
+			uint32_t triangleOffset; // first entry in Meshlets::triangles
+			uint32_t vertexCount;
+			uint32_t triangleCount;
+		};
+
+		struct Meshlets {
+			std::vector<Meshlet> meshlets;
+			std::vector<uint32_t> vertices;  // meshlet local vertex -> vertex of the mesh
+			std::vector<uint32_t> triangles; // 3 local vertex indices packed in 8 bits each
+		};
+
+		inline uint32_t packMeshletTriangle(uint32_t a, uint32_t b, uint32_t c)
+		{
+			return a | (b << 8) | (c << 16);
+		}
+
+		/**
+		* @brief Builds meshlets from a triangle list, keeping the triangle order (run optimizeVertexCache first for tight clusters)
+		* @param positions Vertex positions (3 floats), positionStride bytes apart
+		* @param indexOffset Added to all vertex indices stored in the meshlets (e.g. the first vertex of the mesh in a shared buffer)
+		*/
+		inline void buildMeshlets(Meshlets& result, const uint32_t* indices, size_t indexCount, const float* positions, size_t positionStride,
+			uint32_t vertexCount, uint32_t indexOffset = 0, uint32_t maxVertices = 64, uint32_t maxTriangles = 124)
+		{
+			auto position = [&](uint32_t v) {
+				const float* p = reinterpret_cast<const float*>(reinterpret_cast<const uint8_t*>(positions) + v * positionStride);
+				return glm::vec3(p[0], p[1], p[2]);
+			};
+
+			// local index of each vertex in the current meshlet, valid if its tag is the current meshlet
+			std::vector<uint32_t> localIndex(vertexCount, 0);
+			std::vector<uint32_t> localTag(vertexCount, ~0u);
+			std::vector<glm::vec3> normals;
+
+			auto finish = [&](Meshlet& meshlet) {
+				// bounding sphere: center of the bounding box, radius to the farthest vertex
+				glm::vec3 min(FLT_MAX), max(-FLT_MAX);
+				for (uint32_t i = 0; i < meshlet.vertexCount; i++) {
+					const glm::vec3 p = position(result.vertices[meshlet.vertexOffset + i] - indexOffset);
+					min = glm::min(min, p);
+					max = glm::max(max, p);
+				}
+				meshlet.center = (min + max) * 0.5f;
+				meshlet.radius = 0.0f;
+				for (uint32_t i = 0; i < meshlet.vertexCount; i++) {
+					const glm::vec3 p = position(result.vertices[meshlet.vertexOffset + i] - indexOffset);
+					meshlet.radius = std::max(meshlet.radius, glm::length(p - meshlet.center));
+				}
+
+				// normal cone: average normal, and the widest angle between it and a triangle normal
+				glm::vec3 axis(0.0f);
+				for (const glm::vec3& n : normals) {
+					axis += n;
+				}
+				const float length = glm::length(axis);
+				meshlet.coneAxis = length > 0.0f ? axis / length : glm::vec3(0.0f, 0.0f, 1.0f);
+				float minDot = length > 0.0f ? 1.0f : -1.0f;
+				for (const glm::vec3& n : normals) {
+					minDot = std::min(minDot, glm::dot(n, meshlet.coneAxis));
+				}
+				// the triangles face more than a half space: the cluster is visible from everywhere
+				meshlet.coneCutoff = minDot <= 0.0f ? 1.0f : std::sqrt(1.0f - minDot * minDot);
+				if (minDot <= 0.0f) {
+					meshlet.coneAxis = glm::vec3(0.0f);
+				}
+				normals.clear();
+			};
+
+			Meshlet meshlet{};
+			meshlet.vertexOffset = static_cast<uint32_t>(result.vertices.size());
+			meshlet.triangleOffset = static_cast<uint32_t>(result.triangles.size());
+			uint32_t tag = static_cast<uint32_t>(result.meshlets.size());
+
+			for (size_t t = 0; t + 2 < indexCount; t += 3) {
+				const uint32_t v[3] = { indices[t], indices[t + 1], indices[t + 2] };
+				uint32_t newVertices = 0;
+				for (uint32_t k = 0; k < 3; k++) {
+					if (localTag[v[k]] != tag && (k < 1 || v[k] != v[0]) && (k < 2 || v[k] != v[1])) {
+						newVertices++;
+					}
+				}
+				// the triangle does not fit: close the meshlet and start a new one
+				if (meshlet.vertexCount + newVertices > maxVertices || meshlet.triangleCount + 1 > maxTriangles) {
+					finish(meshlet);
+					result.meshlets.push_back(meshlet);
+					meshlet = Meshlet{};
+					meshlet.vertexOffset = static_cast<uint32_t>(result.vertices.size());
+					meshlet.triangleOffset = static_cast<uint32_t>(result.triangles.size());
+					tag++;
+				}
+				uint32_t local[3];
+				for (uint32_t k = 0; k < 3; k++) {
+					if (localTag[v[k]] != tag) {
+						localTag[v[k]] = tag;
+						localIndex[v[k]] = meshlet.vertexCount++;
+						result.vertices.push_back(v[k] + indexOffset);
+					}
+					local[k] = localIndex[v[k]];
+				}
+				result.triangles.push_back(packMeshletTriangle(local[0], local[1], local[2]));
+				meshlet.triangleCount++;
+
+				const glm::vec3 n = glm::cross(position(v[1]) - position(v[0]), position(v[2]) - position(v[0]));
+				const float area = glm::length(n);
+				if (area > 0.0f) {
+					normals.push_back(n / area);
+				}
+			}
+			if (meshlet.triangleCount > 0) {
+				finish(meshlet);
+				result.meshlets.push_back(meshlet);
+			}
+		}
+	}
+}
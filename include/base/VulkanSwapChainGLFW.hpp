@@ -40,6 +40,7 @@ public:
 	std::vector<VkImage> images;
 	std::vector<SwapChainBuffer> buffers;
 	uint32_t queueNodeIndex = UINT32_MAX;
+	VkImageUsageFlags imageUsage = 0;	// usage the images were created with (transfers when the surface supports them)
 
 
 
@@ -258,6 +259,7 @@ public:
     }
 
     VK_CHECK_RESULT(vkCreateSwapchainKHR(device, &swapchainCI, nullptr, &swapChain));
+    imageUsage = swapchainCI.imageUsage;
 
     // If an existing swap chain is re-created, destroy the old swap chain
     // This also cleans up all the presentable images
@@ -0,0 +1,141 @@
+/*
+* Vulkan uniform ring
+*
+* One persistently mapped host visible buffer split in a region per frame in flight. Each frame writes its uniform
+* blocks at aligned offsets of its own region and binds them with dynamic offsets (VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC),
+* so a single buffer and a single descriptor set per layout serve all frames
+* Created with the storage buffer usage, it serves per-frame storage blocks the same way (VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC),
+* and blocks written by the GPU can be read back once the frame is done
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include "vulkan/vulkan.h"
+#include "VulkanTools.h"
+
+namespace vks
+{
+	class UniformRing
+	{
+	public:
+		/**
+		* @brief Creates the buffer, with room for blockCount blocks totalling frameSize bytes in each of the frameCount frames
+		* @note Every block starts at an aligned offset, so each one after the first may waste up to an alignment of space
+		*/
+		void create(VkDevice device, VkPhysicalDevice physicalDevice, VkDeviceSize frameSize, uint32_t frameCount, uint32_t blockCount = 1,
+			VkBufferUsageFlags usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT)
+		{
+			this->device = device;
+			VkPhysicalDeviceProperties properties;
+			vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+			const VkDeviceSize offsetAlignment = (usage & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT) ?
+				properties.limits.minStorageBufferOffsetAlignment : properties.limits.minUniformBufferOffsetAlignment;
+			alignment = std::max<VkDeviceSize>(offsetAlignment, 16);
+			this->frameSize = align(frameSize) + (blockCount - 1) * alignment;
+			this->frameCount = frameCount;
+
+			VkBufferCreateInfo bufferInfo{};
+			bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+			bufferInfo.size = this->frameSize * frameCount;
+			bufferInfo.usage = usage;
+			bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+			VK_CHECK_RESULT(vkCreateBuffer(device, &bufferInfo, nullptr, &buffer));
+
+			VkMemoryRequirements memRequirements;
+			vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
+			VkPhysicalDeviceMemoryProperties memProperties;
+			vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+			const VkMemoryPropertyFlags flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+			uint32_t memoryType = ~0u;
+			for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+				if ((memRequirements.memoryTypeBits & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & flags) == flags) {
+					memoryType = i;
+					break;
+				}
+			}
+			if (memoryType == ~0u) {
+				throw std::runtime_error("failed to find suitable memory type!");
+			}
+
+			VkMemoryAllocateInfo allocInfo{};
+			allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+			allocInfo.allocationSize = memRequirements.size;
+			allocInfo.memoryTypeIndex = memoryType;
+			VK_CHECK_RESULT(vkAllocateMemory(device, &allocInfo, nullptr, &memory));
+			VK_CHECK_RESULT(vkBindBufferMemory(device, buffer, memory, 0));
+			VK_CHECK_RESULT(vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, reinterpret_cast<void**>(&mapped)));
+		}
+
+		void destroy()
+		{
+			if (buffer != VK_NULL_HANDLE) {
+				vkUnmapMemory(device, memory);
+				vkDestroyBuffer(device, buffer, nullptr);
+				vkFreeMemory(device, memory, nullptr);
+				buffer = VK_NULL_HANDLE;
+			}
+		}
+
+		/** @brief Starts writing the region of a frame, whose previous contents the GPU must be done with */
+		void beginFrame(uint32_t frame)
+		{
+			frameOffset = frameSize * (frame % frameCount);
+			head = 0;
+		}
+
+		/** @brief Copies a uniform block to the region of the current frame, returns its dynamic offset */
+		uint32_t push(const void* data, VkDeviceSize size)
+		{
+			if (head + size > frameSize) {
+				throw std::runtime_error("failed to allocate uniform data: the frame region of the ring is full!");
+			}
+			const VkDeviceSize offset = frameOffset + head;
+			memcpy(mapped + offset, data, static_cast<size_t>(size));
+			head += align(size);
+			return static_cast<uint32_t>(offset);
+		}
+
+		template <typename T>
+		uint32_t push(const T& data)
+		{
+			return push(&data, sizeof(T));
+		}
+
+		/** @brief Descriptor of a block of the given size, to write in VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC (or STORAGE_BUFFER_DYNAMIC) bindings */
+		VkDescriptorBufferInfo descriptor(VkDeviceSize range) const
+		{
+			return { buffer, 0, range };
+		}
+
+		/** @brief Block at a dynamic offset returned by push, to read back what the GPU wrote there once it is done with the frame */
+		const void* mappedBlock(uint32_t offset) const
+		{
+			return mapped + offset;
+		}
+
+		VkBuffer getBuffer() const { return buffer; }
+
+	private:
+		VkDevice device = VK_NULL_HANDLE;
+		VkBuffer buffer = VK_NULL_HANDLE;
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		uint8_t* mapped = nullptr;
+		VkDeviceSize alignment = 256;
+		VkDeviceSize frameSize = 0;
+		uint32_t frameCount = 1;
+		VkDeviceSize frameOffset = 0;
+		VkDeviceSize head = 0;
+
+		VkDeviceSize align(VkDeviceSize size) const
+		{
+			return (size + alignment - 1) / alignment * alignment;
+		}
+	};
+}
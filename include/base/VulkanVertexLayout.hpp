@@ -0,0 +1,364 @@
+/*
+* Vulkan vertex layouts
+*
+* Packed, optionally quantized vertex formats described at compile time, from which
+* the vertex struct, the binding and the attribute descriptions are generated
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "vulkan/vulkan.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+namespace vks
+{
+	/** @brief Which value of a vertex an attribute stores */
+	enum class VertexSemantic { Position, Normal, UV, Color, Tangent, Joint0, Weight0 };
+
+	/** @brief How an attribute is stored in vertex memory */
+	enum class VertexEncoding {
+		Float2,    //  8 bytes, R32G32_SFLOAT
+		Float3,    // 12 bytes, R32G32B32_SFLOAT
+		Float4,    // 16 bytes, R32G32B32A32_SFLOAT
+		Half2,     //  4 bytes, R16G16_SFLOAT (texture coordinates)
+		Half4,     //  8 bytes, R16G16B16A16_SFLOAT
+		Snorm16x4, //  8 bytes, R16G16B16A16_SNORM (normals, tangents)
+		Oct16,     //  4 bytes, R16G16_SNORM, octahedral unit vector, decoded in the shader (normals)
+		Unorm8x4,  //  4 bytes, R8G8B8A8_UNORM (colors, weights)
+		Unorm16x4, //  8 bytes, R16G16B16A16_UNORM (weights)
+		Uint8x4,   //  4 bytes, R8G8B8A8_UINT, read as uvec4 in the shader (joint indices)
+		Uint16x4,  //  8 bytes, R16G16B16A16_UINT, read as uvec4 in the shader (joint indices)
+	};
+
+	/** @brief Size in bytes of an encoded attribute, always a multiple of 4 to keep attributes aligned */
+	constexpr uint32_t vertexEncodingSize(VertexEncoding encoding)
+	{
+		switch (encoding) {
+			case VertexEncoding::Float2: return 8;
+			case VertexEncoding::Float3: return 12;
+			case VertexEncoding::Float4: return 16;
+			case VertexEncoding::Half4:
+			case VertexEncoding::Snorm16x4:
+			case VertexEncoding::Unorm16x4:
+			case VertexEncoding::Uint16x4: return 8;
+			default: return 4;
+		}
+	}
+
+	inline VkFormat vertexEncodingFormat(VertexEncoding encoding)
+	{
+		switch (encoding) {
+			case VertexEncoding::Float2: return VK_FORMAT_R32G32_SFLOAT;
+			case VertexEncoding::Float3: return VK_FORMAT_R32G32B32_SFLOAT;
+			case VertexEncoding::Float4: return VK_FORMAT_R32G32B32A32_SFLOAT;
+			case VertexEncoding::Half2: return VK_FORMAT_R16G16_SFLOAT;
+			case VertexEncoding::Half4: return VK_FORMAT_R16G16B16A16_SFLOAT;
+			case VertexEncoding::Snorm16x4: return VK_FORMAT_R16G16B16A16_SNORM;
+			case VertexEncoding::Oct16: return VK_FORMAT_R16G16_SNORM;
+			case VertexEncoding::Unorm8x4: return VK_FORMAT_R8G8B8A8_UNORM;
+			case VertexEncoding::Unorm16x4: return VK_FORMAT_R16G16B16A16_UNORM;
+			case VertexEncoding::Uint8x4: return VK_FORMAT_R8G8B8A8_UINT;
+			case VertexEncoding::Uint16x4: return VK_FORMAT_R16G16B16A16_UINT;
+			default: return VK_FORMAT_UNDEFINED;
+		}
+	}
+
+	/** @brief Maps a unit vector to the [-1, 1] square (octahedral encoding), zero vectors map to +Z */
+	inline glm::vec2 octEncode(const glm::vec3& n)
+	{
+		const float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+		if (l1 == 0.0f) {
+			return glm::vec2(0.0f);
+		}
+		glm::vec2 p = glm::vec2(n) / l1;
+		if (n.z < 0.0f) {
+			const glm::vec2 signs(p.x >= 0.0f ? 1.0f : -1.0f, p.y >= 0.0f ? 1.0f : -1.0f);
+			p = (1.0f - glm::abs(glm::vec2(p.y, p.x))) * signs;
+		}
+		return p;
+	}
+
+	inline glm::vec3 octDecode(const glm::vec2& e)
+	{
+		glm::vec3 n(e, 1.0f - std::abs(e.x) - std::abs(e.y));
+		if (n.z < 0.0f) {
+			const glm::vec2 signs(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+			const glm::vec2 xy = (1.0f - glm::abs(glm::vec2(n.y, n.x))) * signs;
+			n.x = xy.x;
+			n.y = xy.y;
+		}
+		return glm::normalize(n);
+	}
+
+	/** @brief Writes a value with the given encoding to dst (unused components are ignored) */
+	inline void encodeVertexAttribute(VertexEncoding encoding, const glm::vec4& value, void* dst)
+	{
+		switch (encoding) {
+			case VertexEncoding::Float2:
+			case VertexEncoding::Float3:
+			case VertexEncoding::Float4:
+				memcpy(dst, &value[0], vertexEncodingSize(encoding));
+				break;
+			case VertexEncoding::Half2: {
+				const uint32_t packed = glm::packHalf2x16(glm::vec2(value));
+				memcpy(dst, &packed, sizeof(packed));
+				break;
+			}
+			case VertexEncoding::Half4: {
+				const uint64_t packed = glm::packHalf4x16(value);
+				memcpy(dst, &packed, sizeof(packed));
+				break;
+			}
+			case VertexEncoding::Snorm16x4: {
+				const uint64_t packed = glm::packSnorm4x16(value);
+				memcpy(dst, &packed, sizeof(packed));
+				break;
+			}
+			case VertexEncoding::Oct16: {
+				const uint32_t packed = glm::packSnorm2x16(octEncode(glm::vec3(value)));
+				memcpy(dst, &packed, sizeof(packed));
+				break;
+			}
+			case VertexEncoding::Unorm8x4: {
+				const uint32_t packed = glm::packUnorm4x8(value);
+				memcpy(dst, &packed, sizeof(packed));
+				break;
+			}
+			case VertexEncoding::Unorm16x4: {
+				const uint64_t packed = glm::packUnorm4x16(value);
+				memcpy(dst, &packed, sizeof(packed));
+				break;
+			}
+			case VertexEncoding::Uint8x4: {
+				const glm::u8vec4 packed(glm::clamp(glm::round(value), 0.0f, 255.0f));
+				memcpy(dst, &packed, sizeof(packed));
+				break;
+			}
+			case VertexEncoding::Uint16x4: {
+				const glm::u16vec4 packed(glm::clamp(glm::round(value), 0.0f, 65535.0f));
+				memcpy(dst, &packed, sizeof(packed));
+				break;
+			}
+		}
+	}
+
+	/**
+	* @brief Runtime description of a packed vertex format
+	* @note Used where the layout is only known when loading (e.g. glTF models), see VertexLayout::format()
+	*/
+	struct VertexFormat
+	{
+		struct Attribute {
+			VertexSemantic semantic;
+			VertexEncoding encoding;
+			uint32_t offset;
+		};
+		std::vector<Attribute> attributes;
+		uint32_t stride = 0;
+
+		VertexFormat() = default;
+
+		/** @brief Packs the attributes tightly in the given order */
+		VertexFormat(std::initializer_list<std::pair<VertexSemantic, VertexEncoding>> list)
+		{
+			for (const auto& attribute : list) {
+				attributes.push_back({ attribute.first, attribute.second, stride });
+				stride += vertexEncodingSize(attribute.second);
+			}
+		}
+
+		const Attribute* find(VertexSemantic semantic) const
+		{
+			for (const Attribute& attribute : attributes) {
+				if (attribute.semantic == semantic) {
+					return &attribute;
+				}
+			}
+			return nullptr;
+		}
+
+		bool has(VertexSemantic semantic) const
+		{
+			return find(semantic) != nullptr;
+		}
+
+		/** @brief Sub-format with the attributes that are (or are not) of the given semantic, repacked tightly */
+		VertexFormat split(VertexSemantic semantic, bool matching) const
+		{
+			VertexFormat result;
+			for (const Attribute& attribute : attributes) {
+				if ((attribute.semantic == semantic) == matching) {
+					result.attributes.push_back({ attribute.semantic, attribute.encoding, result.stride });
+					result.stride += vertexEncodingSize(attribute.encoding);
+				}
+			}
+			return result;
+		}
+
+		/** @brief Encodes a value into a vertex of this format, attributes not in the format are dropped */
+		void encode(VertexSemantic semantic, const glm::vec4& value, void* vertex) const
+		{
+			if (const Attribute* attribute = find(semantic)) {
+				encodeVertexAttribute(attribute->encoding, value, static_cast<uint8_t*>(vertex) + attribute->offset);
+			}
+		}
+
+		VkVertexInputBindingDescription bindingDescription(uint32_t binding) const
+		{
+			return VkVertexInputBindingDescription({ binding, stride, VK_VERTEX_INPUT_RATE_VERTEX });
+		}
+
+		/** @brief Attribute descriptions for the requested semantics, at consecutive locations starting at 0 */
+		std::vector<VkVertexInputAttributeDescription> attributeDescriptions(uint32_t binding, const std::vector<VertexSemantic>& semantics) const
+		{
+			std::vector<VkVertexInputAttributeDescription> result;
+			uint32_t location = 0;
+			for (VertexSemantic semantic : semantics) {
+				const Attribute* attribute = find(semantic);
+				if (!attribute) {
+					throw std::runtime_error("vertex format does not contain a requested attribute!");
+				}
+				result.push_back({ location++, binding, vertexEncodingFormat(attribute->encoding), attribute->offset });
+			}
+			return result;
+		}
+	};
+
+	/** @brief One attribute of a VertexLayout */
+	template<VertexSemantic Semantic, VertexEncoding Encoding>
+	struct VertexAttribute
+	{
+		static constexpr VertexSemantic semantic = Semantic;
+		static constexpr VertexEncoding encoding = Encoding;
+		static constexpr uint32_t size = vertexEncodingSize(Encoding);
+	};
+
+	/** @brief Raw packed vertex, compared byte-wise so that vertices equal after quantization are merged */
+	template<uint32_t Stride>
+	struct alignas(4) PackedVertex
+	{
+		uint8_t data[Stride];
+
+		bool operator==(const PackedVertex& other) const
+		{
+			return memcmp(data, other.data, Stride) == 0;
+		}
+	};
+
+	/**
+	* @brief Compile-time vertex layout, attributes are packed tightly in the given order
+	* and get consecutive shader locations starting at 0
+	*
+	* e.g. VertexLayout<VertexAttribute<VertexSemantic::Position, VertexEncoding::Float3>,
+	*                   VertexAttribute<VertexSemantic::UV, VertexEncoding::Half2>> is 16 bytes per vertex
+	*/
+	template<typename... Attributes>
+	struct VertexLayout
+	{
+		static constexpr uint32_t attributeCount = sizeof...(Attributes);
+		static constexpr uint32_t stride = (Attributes::size + ...);
+
+		using Vertex = PackedVertex<stride>;
+
+		template<VertexSemantic Semantic>
+		static constexpr bool has()
+		{
+			return ((Attributes::semantic == Semantic) || ...);
+		}
+
+		template<VertexSemantic Semantic>
+		static constexpr uint32_t offset()
+		{
+			constexpr VertexSemantic semantics[] = { Attributes::semantic... };
+			constexpr uint32_t sizes[] = { Attributes::size... };
+			uint32_t result = 0;
+			for (uint32_t i = 0; i < attributeCount && semantics[i] != Semantic; i++) {
+				result += sizes[i];
+			}
+			return result;
+		}
+
+		template<VertexSemantic Semantic>
+		static constexpr VertexEncoding encoding()
+		{
+			constexpr VertexSemantic semantics[] = { Attributes::semantic... };
+			constexpr VertexEncoding encodings[] = { Attributes::encoding... };
+			for (uint32_t i = 0; i < attributeCount; i++) {
+				if (semantics[i] == Semantic) {
+					return encodings[i];
+				}
+			}
+			return VertexEncoding::Float4;
+		}
+
+		template<VertexSemantic Semantic>
+		static void set(Vertex& vertex, const glm::vec4& value)
+		{
+			static_assert(has<Semantic>(), "attribute is not part of the vertex layout");
+			encodeVertexAttribute(encoding<Semantic>(), value, vertex.data + offset<Semantic>());
+		}
+
+		template<VertexSemantic Semantic>
+		static void set(Vertex& vertex, const glm::vec3& value)
+		{
+			set<Semantic>(vertex, glm::vec4(value, 0.0f));
+		}
+
+		template<VertexSemantic Semantic>
+		static void set(Vertex& vertex, const glm::vec2& value)
+		{
+			set<Semantic>(vertex, glm::vec4(value, 0.0f, 0.0f));
+		}
+
+		static VkVertexInputBindingDescription bindingDescription(uint32_t binding = 0)
+		{
+			return VkVertexInputBindingDescription({ binding, stride, VK_VERTEX_INPUT_RATE_VERTEX });
+		}
+
+		static std::array<VkVertexInputAttributeDescription, attributeCount> attributeDescriptions(uint32_t binding = 0)
+		{
+			constexpr VertexEncoding encodings[] = { Attributes::encoding... };
+			constexpr uint32_t sizes[] = { Attributes::size... };
+			std::array<VkVertexInputAttributeDescription, attributeCount> result{};
+			uint32_t offset = 0;
+			for (uint32_t i = 0; i < attributeCount; i++) {
+				result[i] = { i, binding, vertexEncodingFormat(encodings[i]), offset };
+				offset += sizes[i];
+			}
+			return result;
+		}
+
+		static VertexFormat format()
+		{
+			return VertexFormat({ { Attributes::semantic, Attributes::encoding }... });
+		}
+	};
+}
+
+namespace std
+{
+	template<uint32_t Stride> struct hash<vks::PackedVertex<Stride>> {
+		size_t operator()(const vks::PackedVertex<Stride>& vertex) const {
+			// FNV-1a over the packed bytes
+			uint64_t h = 14695981039346656037ull;
+			for (uint32_t i = 0; i < Stride; i++) {
+				h = (h ^ vertex.data[i]) * 1099511628211ull;
+			}
+			return static_cast<size_t>(h);
+		}
+	};
+}
@@ -19,10 +19,17 @@
 
 #include "VulkanglTFModel.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VKGLTF_USE_SSE
+#include <emmintrin.h>
+#endif
+
 VkDescriptorSetLayout vkglTF::descriptorSetLayoutImage = VK_NULL_HANDLE;
-VkDescriptorSetLayout vkglTF::descriptorSetLayoutUbo = VK_NULL_HANDLE;
+VkDescriptorSetLayout vkglTF::descriptorSetLayoutTransforms = VK_NULL_HANDLE;
 VkMemoryPropertyFlags vkglTF::memoryPropertyFlags = 0;
 uint32_t vkglTF::descriptorBindingFlags = vkglTF::DescriptorBindingFlags::ImageBaseColor;
+vks::VertexFormat vkglTF::vertexFormat = vkglTF::Vertex::defaultFormat();
+vks::GeometryArena* vkglTF::geometryArena = nullptr;
 
 /*
 	We use a custom image loading function with tinyglTF, so we can do custom stuff loading ktx textures
@@ -481,32 +488,6 @@ void vkglTF::Primitive::setDimensions(glm::vec3 min, glm::vec3 max) {
 	dimensions.radius = glm::distance(min, max) / 2.0f;
 }
 
-/*
-	glTF mesh
-*/
-vkglTF::Mesh::Mesh(vks::VulkanDevice *device, glm::mat4 matrix) {
-	this->device = device;
-	this->uniformBlock.matrix = matrix;
-	VK_CHECK_RESULT(device->createBuffer(
-		VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		sizeof(uniformBlock),
-		&uniformBuffer.buffer,
-		&uniformBuffer.memory,
-		&uniformBlock));
-	VK_CHECK_RESULT(vkMapMemory(device->logicalDevice, uniformBuffer.memory, 0, sizeof(uniformBlock), 0, &uniformBuffer.mapped));
-	uniformBuffer.descriptor = { uniformBuffer.buffer, 0, sizeof(uniformBlock) };
-};
-
-vkglTF::Mesh::~Mesh() {
-	vkDestroyBuffer(device->logicalDevice, uniformBuffer.buffer, nullptr);
-	vkFreeMemory(device->logicalDevice, uniformBuffer.memory, nullptr);
-    for(auto primitive : primitives)
-    {
-        delete primitive;
-    }
-}
-
 /*
 	glTF node
 */
@@ -524,28 +505,34 @@ glm::mat4 vkglTF::Node::getMatrix() {
 	return m;
 }
 
-void vkglTF::Node::update() {
-	if (mesh) {
-		glm::mat4 m = getMatrix();
-		if (skin) {
-			mesh->uniformBlock.matrix = m;
-			// Update join matrices
-			glm::mat4 inverseTransform = glm::inverse(m);
-			for (size_t i = 0; i < skin->joints.size(); i++) {
-				vkglTF::Node *jointNode = skin->joints[i];
-				glm::mat4 jointMat = jointNode->getMatrix() * skin->inverseBindMatrices[i];
-				jointMat = inverseTransform * jointMat;
-				mesh->uniformBlock.jointMatrix[i] = jointMat;
+/*
+	Flattened scene graph
+*/
+void vkglTF::SceneGraph::update()
+{
+	// Parents come before their children, so a parent's world matrix is always up to date when its children are visited
+	const uint32_t count = size();
+	for (uint32_t i = 0; i < count; i++) {
+		bool changed = dirty[i] != 0;
+		if (changed) {
+			glm::mat4 m = glm::mat4_cast(rotations[i]);
+			m[0] *= scales[i].x;
+			m[1] *= scales[i].y;
+			m[2] *= scales[i].z;
+			m[3] = glm::vec4(translations[i], 1.0f);
+			localMatrices[i] = hasMatrix[i] ? m * matrices[i] : m;
+			dirty[i] = 0;
+		}
+		const int32_t parent = parents[i];
+		if (parent >= 0) {
+			changed = changed || worldChanged[parent];
+			if (changed) {
+				worldMatrices[i] = worldMatrices[parent] * localMatrices[i];
 			}
-			mesh->uniformBlock.jointcount = (float)skin->joints.size();
-			memcpy(mesh->uniformBuffer.mapped, &mesh->uniformBlock, sizeof(mesh->uniformBlock));
-		} else {
-			memcpy(mesh->uniformBuffer.mapped, &m, sizeof(glm::mat4));
+		} else if (changed) {
+			worldMatrices[i] = localMatrices[i];
 		}
-	}
-
-	for (auto& child : children) {
-		child->update();
+		worldChanged[i] = changed;
 	}
 }
 
@@ -562,52 +549,72 @@ vkglTF::Node::~Node() {
 	glTF default vertex layout with easy Vulkan mapping functions
 */
 
-VkVertexInputBindingDescription vkglTF::Vertex::vertexInputBindingDescription;
+std::vector<VkVertexInputBindingDescription> vkglTF::Vertex::vertexInputBindingDescriptions;
 std::vector<VkVertexInputAttributeDescription> vkglTF::Vertex::vertexInputAttributeDescriptions;
 VkPipelineVertexInputStateCreateInfo vkglTF::Vertex::pipelineVertexInputStateCreateInfo;
 
-VkVertexInputBindingDescription vkglTF::Vertex::inputBindingDescription(uint32_t binding) {
-	return VkVertexInputBindingDescription({ binding, sizeof(Vertex), VK_VERTEX_INPUT_RATE_VERTEX });
+vks::VertexFormat vkglTF::Vertex::streamFormat(VertexStream stream) {
+	return vertexFormat.split(VertexComponent::Position, stream == VertexStream::PositionStream);
 }
 
-VkVertexInputAttributeDescription vkglTF::Vertex::inputAttributeDescription(uint32_t binding, uint32_t location, VertexComponent component) {
-	switch (component) {
-		case VertexComponent::Position: 
-			return VkVertexInputAttributeDescription({ location, binding, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, pos) });
-		case VertexComponent::Normal:
-			return VkVertexInputAttributeDescription({ location, binding, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, normal) });
-		case VertexComponent::UV:
-			return VkVertexInputAttributeDescription({ location, binding, VK_FORMAT_R32G32_SFLOAT, offsetof(Vertex, uv) });
-		case VertexComponent::Color:
-			return VkVertexInputAttributeDescription({ location, binding, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(Vertex, color) });
-		case VertexComponent::Tangent:
-			return VkVertexInputAttributeDescription({ location, binding, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(Vertex, tangent)} );
-		case VertexComponent::Joint0:
-			return VkVertexInputAttributeDescription({ location, binding, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(Vertex, joint0) });
-		case VertexComponent::Weight0:
-			return VkVertexInputAttributeDescription({ location, binding, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(Vertex, weight0) });
-		default:
-			return VkVertexInputAttributeDescription({});
-	}
+VkVertexInputBindingDescription vkglTF::Vertex::inputBindingDescription(VertexStream stream) {
+	return streamFormat(stream).bindingDescription(stream);
+}
+
+VkVertexInputAttributeDescription vkglTF::Vertex::inputAttributeDescription(uint32_t location, VertexComponent component) {
+	const VertexStream stream = (component == VertexComponent::Position) ? VertexStream::PositionStream : VertexStream::AttributeStream;
+	VkVertexInputAttributeDescription description = streamFormat(stream).attributeDescriptions(stream, { component })[0];
+	description.location = location;
+	return description;
 }
 
-std::vector<VkVertexInputAttributeDescription> vkglTF::Vertex::inputAttributeDescriptions(uint32_t binding, const std::vector<VertexComponent> components) {
+vks::VertexFormat vkglTF::Vertex::defaultFormat() {
+	return vks::VertexFormat({
+		{ VertexComponent::Position, vks::VertexEncoding::Float3 },
+		{ VertexComponent::Normal, vks::VertexEncoding::Float3 },
+		{ VertexComponent::UV, vks::VertexEncoding::Float2 },
+		{ VertexComponent::Color, vks::VertexEncoding::Float4 },
+		{ VertexComponent::Joint0, vks::VertexEncoding::Float4 },
+		{ VertexComponent::Weight0, vks::VertexEncoding::Float4 },
+		{ VertexComponent::Tangent, vks::VertexEncoding::Float4 },
+	});
+}
+
+void vkglTF::Vertex::encode(const vks::VertexFormat& format, void* dst) const {
+	format.encode(VertexComponent::Position, glm::vec4(pos, 1.0f), dst);
+	format.encode(VertexComponent::Normal, glm::vec4(normal, 0.0f), dst);
+	format.encode(VertexComponent::UV, glm::vec4(uv, 0.0f, 0.0f), dst);
+	format.encode(VertexComponent::Color, color, dst);
+	format.encode(VertexComponent::Joint0, joint0, dst);
+	format.encode(VertexComponent::Weight0, weight0, dst);
+	format.encode(VertexComponent::Tangent, tangent, dst);
+}
+
+std::vector<VkVertexInputAttributeDescription> vkglTF::Vertex::inputAttributeDescriptions(const std::vector<VertexComponent> components) {
 	std::vector<VkVertexInputAttributeDescription> result;
 	uint32_t location = 0;
 	for (VertexComponent component : components) {
-		result.push_back(Vertex::inputAttributeDescription(binding, location, component));
+		result.push_back(Vertex::inputAttributeDescription(location, component));
 		location++;
 	}
 	return result;
 }
 
-/** @brief Returns the default pipeline vertex input state create info structure for the requested vertex components */
+/** @brief Returns the default pipeline vertex input state create info structure for the requested vertex components, only the streams they are in are bound */
 VkPipelineVertexInputStateCreateInfo* vkglTF::Vertex::getPipelineVertexInputState(const std::vector<VertexComponent> components) {
-	vertexInputBindingDescription = Vertex::inputBindingDescription(0);
-	Vertex::vertexInputAttributeDescriptions = Vertex::inputAttributeDescriptions(0, components);
+	Vertex::vertexInputAttributeDescriptions = Vertex::inputAttributeDescriptions(components);
+	Vertex::vertexInputBindingDescriptions.clear();
+	for (VertexStream stream : { VertexStream::PositionStream, VertexStream::AttributeStream }) {
+		for (const VkVertexInputAttributeDescription& attribute : Vertex::vertexInputAttributeDescriptions) {
+			if (attribute.binding == stream) {
+				Vertex::vertexInputBindingDescriptions.push_back(Vertex::inputBindingDescription(stream));
+				break;
+			}
+		}
+	}
 	pipelineVertexInputStateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	pipelineVertexInputStateCreateInfo.vertexBindingDescriptionCount = 1;
-	pipelineVertexInputStateCreateInfo.pVertexBindingDescriptions = &Vertex::vertexInputBindingDescription;
+	pipelineVertexInputStateCreateInfo.vertexBindingDescriptionCount = static_cast<uint32_t>(Vertex::vertexInputBindingDescriptions.size());
+	pipelineVertexInputStateCreateInfo.pVertexBindingDescriptions = Vertex::vertexInputBindingDescriptions.data();
 	pipelineVertexInputStateCreateInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(Vertex::vertexInputAttributeDescriptions.size());
 	pipelineVertexInputStateCreateInfo.pVertexAttributeDescriptions = Vertex::vertexInputAttributeDescriptions.data();
 	return &pipelineVertexInputStateCreateInfo;
@@ -730,10 +737,14 @@ void vkglTF::Model::createEmptyTexture(VkQueue transferQueue)
 */
 vkglTF::Model::~Model()
 {
-	vkDestroyBuffer(device->logicalDevice, vertices.buffer, nullptr);
-	vkFreeMemory(device->logicalDevice, vertices.memory, nullptr);
-	vkDestroyBuffer(device->logicalDevice, indices.buffer, nullptr);
-	vkFreeMemory(device->logicalDevice, indices.memory, nullptr);
+	if (arena == &privateArena) {
+		privateArena.destroy();
+	} else if (arena) {
+		// The ranges are reused by the next models loaded into the arena
+		for (auto& allocation : arenaAllocations) {
+			arena->free(allocation);
+		}
+	}
 	for (auto texture : textures) {
 		texture.destroy();
 	}
@@ -743,9 +754,11 @@ vkglTF::Model::~Model()
     for (auto skin : skins) {
         delete skin;
     }
-	if (descriptorSetLayoutUbo != VK_NULL_HANDLE) {
-		vkDestroyDescriptorSetLayout(device->logicalDevice, descriptorSetLayoutUbo, nullptr);
-		descriptorSetLayoutUbo = VK_NULL_HANDLE;
+	transforms.destroy();
+	joints.destroy();
+	if (descriptorSetLayoutTransforms != VK_NULL_HANDLE) {
+		vkDestroyDescriptorSetLayout(device->logicalDevice, descriptorSetLayoutTransforms, nullptr);
+		descriptorSetLayoutTransforms = VK_NULL_HANDLE;
 	}
 	if (descriptorSetLayoutImage != VK_NULL_HANDLE) {
 		vkDestroyDescriptorSetLayout(device->logicalDevice, descriptorSetLayoutImage, nullptr);
@@ -755,7 +768,137 @@ vkglTF::Model::~Model()
 	emptyTexture.destroy();
 }
 
-void vkglTF::Model::loadNode(vkglTF::Node *parent, const tinygltf::Node &node, uint32_t nodeIndex, const tinygltf::Model &model, std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer, float globalscale)
+// Decodes the vertices and indices of a primitive, the indices are relative to its first vertex
+static void loadPrimitiveGeometry(const tinygltf::Model &model, const tinygltf::Primitive &primitive, std::vector<vkglTF::Vertex>& vertexBuffer, std::vector<uint32_t>& indexBuffer)
+{
+	vertexBuffer.clear();
+	indexBuffer.clear();
+	bool hasSkin = false;
+	// Vertices
+	{
+		const float *bufferPos = nullptr;
+		const float *bufferNormals = nullptr;
+		const float *bufferTexCoords = nullptr;
+		const float* bufferColors = nullptr;
+		const float *bufferTangents = nullptr;
+		uint32_t numColorComponents;
+		const uint16_t *bufferJoints = nullptr;
+		const float *bufferWeights = nullptr;
+
+		const tinygltf::Accessor &posAccessor = model.accessors[primitive.attributes.find("POSITION")->second];
+		const tinygltf::BufferView &posView = model.bufferViews[posAccessor.bufferView];
+		bufferPos = reinterpret_cast<const float *>(&(model.buffers[posView.buffer].data[posAccessor.byteOffset + posView.byteOffset]));
+
+		if (primitive.attributes.find("NORMAL") != primitive.attributes.end()) {
+			const tinygltf::Accessor &normAccessor = model.accessors[primitive.attributes.find("NORMAL")->second];
+			const tinygltf::BufferView &normView = model.bufferViews[normAccessor.bufferView];
+			bufferNormals = reinterpret_cast<const float *>(&(model.buffers[normView.buffer].data[normAccessor.byteOffset + normView.byteOffset]));
+		}
+
+		if (primitive.attributes.find("TEXCOORD_0") != primitive.attributes.end()) {
+			const tinygltf::Accessor &uvAccessor = model.accessors[primitive.attributes.find("TEXCOORD_0")->second];
+			const tinygltf::BufferView &uvView = model.bufferViews[uvAccessor.bufferView];
+			bufferTexCoords = reinterpret_cast<const float *>(&(model.buffers[uvView.buffer].data[uvAccessor.byteOffset + uvView.byteOffset]));
+		}
+
+		if (primitive.attributes.find("COLOR_0") != primitive.attributes.end())
+		{
+			const tinygltf::Accessor& colorAccessor = model.accessors[primitive.attributes.find("COLOR_0")->second];
+			const tinygltf::BufferView& colorView = model.bufferViews[colorAccessor.bufferView];
+			// Color buffer are either of type vec3 or vec4
+			numColorComponents = colorAccessor.type == TINYGLTF_PARAMETER_TYPE_FLOAT_VEC3 ? 3 : 4;
+			bufferColors = reinterpret_cast<const float*>(&(model.buffers[colorView.buffer].data[colorAccessor.byteOffset + colorView.byteOffset]));
+		}
+
+		if (primitive.attributes.find("TANGENT") != primitive.attributes.end())
+		{
+			const tinygltf::Accessor &tangentAccessor = model.accessors[primitive.attributes.find("TANGENT")->second];
+			const tinygltf::BufferView &tangentView = model.bufferViews[tangentAccessor.bufferView];
+			bufferTangents = reinterpret_cast<const float *>(&(model.buffers[tangentView.buffer].data[tangentAccessor.byteOffset + tangentView.byteOffset]));
+		}
+
+		// Skinning
+		// Joints
+		if (primitive.attributes.find("JOINTS_0") != primitive.attributes.end()) {
+			const tinygltf::Accessor &jointAccessor = model.accessors[primitive.attributes.find("JOINTS_0")->second];
+			const tinygltf::BufferView &jointView = model.bufferViews[jointAccessor.bufferView];
+			bufferJoints = reinterpret_cast<const uint16_t *>(&(model.buffers[jointView.buffer].data[jointAccessor.byteOffset + jointView.byteOffset]));
+		}
+
+		if (primitive.attributes.find("WEIGHTS_0") != primitive.attributes.end()) {
+			const tinygltf::Accessor &uvAccessor = model.accessors[primitive.attributes.find("WEIGHTS_0")->second];
+			const tinygltf::BufferView &uvView = model.bufferViews[uvAccessor.bufferView];
+			bufferWeights = reinterpret_cast<const float *>(&(model.buffers[uvView.buffer].data[uvAccessor.byteOffset + uvView.byteOffset]));
+		}
+
+		hasSkin = (bufferJoints && bufferWeights);
+
+		vertexBuffer.reserve(posAccessor.count);
+		for (size_t v = 0; v < posAccessor.count; v++) {
+			vkglTF::Vertex vert{};
+			vert.pos = glm::vec4(glm::make_vec3(&bufferPos[v * 3]), 1.0f);
+			vert.normal = glm::normalize(glm::vec3(bufferNormals ? glm::make_vec3(&bufferNormals[v * 3]) : glm::vec3(0.0f)));
+			vert.uv = bufferTexCoords ? glm::make_vec2(&bufferTexCoords[v * 2]) : glm::vec3(0.0f);
+			if (bufferColors) {
+				switch (numColorComponents) {
+					case 3: 
+						vert.color = glm::vec4(glm::make_vec3(&bufferColors[v * 3]), 1.0f);
+					case 4:
+						vert.color = glm::make_vec4(&bufferColors[v * 4]);
+				}
+			}
+			else {
+				vert.color = glm::vec4(1.0f);
+			}
+			vert.tangent = bufferTangents ? glm::vec4(glm::make_vec4(&bufferTangents[v * 4])) : glm::vec4(0.0f);
+			vert.joint0 = hasSkin ? glm::vec4(glm::make_vec4(&bufferJoints[v * 4])) : glm::vec4(0.0f);
+			vert.weight0 = hasSkin ? glm::make_vec4(&bufferWeights[v * 4]) : glm::vec4(0.0f);
+			vertexBuffer.push_back(vert);
+		}
+	}
+	// Indices
+	{
+		const tinygltf::Accessor &accessor = model.accessors[primitive.indices];
+		const tinygltf::BufferView &bufferView = model.bufferViews[accessor.bufferView];
+		const tinygltf::Buffer &buffer = model.buffers[bufferView.buffer];
+
+		indexBuffer.reserve(accessor.count);
+		switch (accessor.componentType) {
+		case TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT: {
+			uint32_t *buf = new uint32_t[accessor.count];
+			memcpy(buf, &buffer.data[accessor.byteOffset + bufferView.byteOffset], accessor.count * sizeof(uint32_t));
+			for (size_t index = 0; index < accessor.count; index++) {
+				indexBuffer.push_back(buf[index]);
+			}
+			delete[] buf;
+			break;
+		}
+		case TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT: {
+			uint16_t *buf = new uint16_t[accessor.count];
+			memcpy(buf, &buffer.data[accessor.byteOffset + bufferView.byteOffset], accessor.count * sizeof(uint16_t));
+			for (size_t index = 0; index < accessor.count; index++) {
+				indexBuffer.push_back(buf[index]);
+			}
+			delete[] buf;
+			break;
+		}
+		case TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE: {
+			uint8_t *buf = new uint8_t[accessor.count];
+			memcpy(buf, &buffer.data[accessor.byteOffset + bufferView.byteOffset], accessor.count * sizeof(uint8_t));
+			for (size_t index = 0; index < accessor.count; index++) {
+				indexBuffer.push_back(buf[index]);
+			}
+			delete[] buf;
+			break;
+		}
+		default:
+			// Primitives with other index types are skipped by loadNode
+			break;
+		}
+	}
+}
+
+void vkglTF::Model::loadNode(vkglTF::Node *parent, const tinygltf::Node &node, uint32_t nodeIndex, const tinygltf::Model &model, std::vector<const tinygltf::Primitive*>& primitiveSources, float globalscale)
 {
 	vkglTF::Node *newNode = new Node{};
 	newNode->index = nodeIndex;
@@ -790,162 +933,41 @@ void vkglTF::Model::loadNode(vkglTF::Node *parent, const tinygltf::Node &node, u
 	// Node with children
 	if (node.children.size() > 0) {
 		for (auto i = 0; i < node.children.size(); i++) {
-			loadNode(newNode, model.nodes[node.children[i]], node.children[i], model, indexBuffer, vertexBuffer, globalscale);
+			loadNode(newNode, model.nodes[node.children[i]], node.children[i], model, primitiveSources, globalscale);
 		}
 	}
 
 	// Node contains mesh data
 	if (node.mesh > -1) {
-		const tinygltf::Mesh mesh = model.meshes[node.mesh];
-		Mesh *newMesh = new Mesh(device, newNode->matrix);
+		const tinygltf::Mesh &mesh = model.meshes[node.mesh];
+		Mesh *newMesh = new Mesh{};
 		newMesh->name = mesh.name;
+		newMesh->firstPrimitive = static_cast<uint32_t>(primitives.size());
 		for (size_t j = 0; j < mesh.primitives.size(); j++) {
 			const tinygltf::Primitive &primitive = mesh.primitives[j];
 			if (primitive.indices < 0) {
 				continue;
 			}
-			uint32_t indexStart = static_cast<uint32_t>(indexBuffer.size());
-			uint32_t vertexStart = static_cast<uint32_t>(vertexBuffer.size());
-			uint32_t indexCount = 0;
-			uint32_t vertexCount = 0;
-			glm::vec3 posMin{};
-			glm::vec3 posMax{};
-			bool hasSkin = false;
-			// Vertices
-			{
-				const float *bufferPos = nullptr;
-				const float *bufferNormals = nullptr;
-				const float *bufferTexCoords = nullptr;
-				const float* bufferColors = nullptr;
-				const float *bufferTangents = nullptr;
-				uint32_t numColorComponents;
-				const uint16_t *bufferJoints = nullptr;
-				const float *bufferWeights = nullptr;
-
-				// Position attribute is required
-				assert(primitive.attributes.find("POSITION") != primitive.attributes.end());
-
-				const tinygltf::Accessor &posAccessor = model.accessors[primitive.attributes.find("POSITION")->second];
-				const tinygltf::BufferView &posView = model.bufferViews[posAccessor.bufferView];
-				bufferPos = reinterpret_cast<const float *>(&(model.buffers[posView.buffer].data[posAccessor.byteOffset + posView.byteOffset]));
-				posMin = glm::vec3(posAccessor.minValues[0], posAccessor.minValues[1], posAccessor.minValues[2]);
-				posMax = glm::vec3(posAccessor.maxValues[0], posAccessor.maxValues[1], posAccessor.maxValues[2]);
-
-				if (primitive.attributes.find("NORMAL") != primitive.attributes.end()) {
-					const tinygltf::Accessor &normAccessor = model.accessors[primitive.attributes.find("NORMAL")->second];
-					const tinygltf::BufferView &normView = model.bufferViews[normAccessor.bufferView];
-					bufferNormals = reinterpret_cast<const float *>(&(model.buffers[normView.buffer].data[normAccessor.byteOffset + normView.byteOffset]));
-				}
-
-				if (primitive.attributes.find("TEXCOORD_0") != primitive.attributes.end()) {
-					const tinygltf::Accessor &uvAccessor = model.accessors[primitive.attributes.find("TEXCOORD_0")->second];
-					const tinygltf::BufferView &uvView = model.bufferViews[uvAccessor.bufferView];
-					bufferTexCoords = reinterpret_cast<const float *>(&(model.buffers[uvView.buffer].data[uvAccessor.byteOffset + uvView.byteOffset]));
-				}
-
-				if (primitive.attributes.find("COLOR_0") != primitive.attributes.end())
-				{
-					const tinygltf::Accessor& colorAccessor = model.accessors[primitive.attributes.find("COLOR_0")->second];
-					const tinygltf::BufferView& colorView = model.bufferViews[colorAccessor.bufferView];
-					// Color buffer are either of type vec3 or vec4
-					numColorComponents = colorAccessor.type == TINYGLTF_PARAMETER_TYPE_FLOAT_VEC3 ? 3 : 4;
-					bufferColors = reinterpret_cast<const float*>(&(model.buffers[colorView.buffer].data[colorAccessor.byteOffset + colorView.byteOffset]));
-				}
-
-				if (primitive.attributes.find("TANGENT") != primitive.attributes.end())
-				{
-					const tinygltf::Accessor &tangentAccessor = model.accessors[primitive.attributes.find("TANGENT")->second];
-					const tinygltf::BufferView &tangentView = model.bufferViews[tangentAccessor.bufferView];
-					bufferTangents = reinterpret_cast<const float *>(&(model.buffers[tangentView.buffer].data[tangentAccessor.byteOffset + tangentView.byteOffset]));
-				}
-
-				// Skinning
-				// Joints
-				if (primitive.attributes.find("JOINTS_0") != primitive.attributes.end()) {
-					const tinygltf::Accessor &jointAccessor = model.accessors[primitive.attributes.find("JOINTS_0")->second];
-					const tinygltf::BufferView &jointView = model.bufferViews[jointAccessor.bufferView];
-					bufferJoints = reinterpret_cast<const uint16_t *>(&(model.buffers[jointView.buffer].data[jointAccessor.byteOffset + jointView.byteOffset]));
-				}
-
-				if (primitive.attributes.find("WEIGHTS_0") != primitive.attributes.end()) {
-					const tinygltf::Accessor &uvAccessor = model.accessors[primitive.attributes.find("WEIGHTS_0")->second];
-					const tinygltf::BufferView &uvView = model.bufferViews[uvAccessor.bufferView];
-					bufferWeights = reinterpret_cast<const float *>(&(model.buffers[uvView.buffer].data[uvAccessor.byteOffset + uvView.byteOffset]));
-				}
-
-				hasSkin = (bufferJoints && bufferWeights);
-
-				vertexCount = static_cast<uint32_t>(posAccessor.count);
-
-				for (size_t v = 0; v < posAccessor.count; v++) {
-					Vertex vert{};
-					vert.pos = glm::vec4(glm::make_vec3(&bufferPos[v * 3]), 1.0f);
-					vert.normal = glm::normalize(glm::vec3(bufferNormals ? glm::make_vec3(&bufferNormals[v * 3]) : glm::vec3(0.0f)));
-					vert.uv = bufferTexCoords ? glm::make_vec2(&bufferTexCoords[v * 2]) : glm::vec3(0.0f);
-					if (bufferColors) {
-						switch (numColorComponents) {
-							case 3: 
-								vert.color = glm::vec4(glm::make_vec3(&bufferColors[v * 3]), 1.0f);
-							case 4:
-								vert.color = glm::make_vec4(&bufferColors[v * 4]);
-						}
-					}
-					else {
-						vert.color = glm::vec4(1.0f);
-					}
-					vert.tangent = bufferTangents ? glm::vec4(glm::make_vec4(&bufferTangents[v * 4])) : glm::vec4(0.0f);
-					vert.joint0 = hasSkin ? glm::vec4(glm::make_vec4(&bufferJoints[v * 4])) : glm::vec4(0.0f);
-					vert.weight0 = hasSkin ? glm::make_vec4(&bufferWeights[v * 4]) : glm::vec4(0.0f);
-					vertexBuffer.push_back(vert);
-				}
-			}
-			// Indices
-			{
-				const tinygltf::Accessor &accessor = model.accessors[primitive.indices];
-				const tinygltf::BufferView &bufferView = model.bufferViews[accessor.bufferView];
-				const tinygltf::Buffer &buffer = model.buffers[bufferView.buffer];
-
-				indexCount = static_cast<uint32_t>(accessor.count);
-
-				switch (accessor.componentType) {
-				case TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT: {
-					uint32_t *buf = new uint32_t[accessor.count];
-					memcpy(buf, &buffer.data[accessor.byteOffset + bufferView.byteOffset], accessor.count * sizeof(uint32_t));
-					for (size_t index = 0; index < accessor.count; index++) {
-						indexBuffer.push_back(buf[index] + vertexStart);
-					}
-                    delete[] buf;
-					break;
-				}
-				case TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT: {
-					uint16_t *buf = new uint16_t[accessor.count];
-					memcpy(buf, &buffer.data[accessor.byteOffset + bufferView.byteOffset], accessor.count * sizeof(uint16_t));
-					for (size_t index = 0; index < accessor.count; index++) {
-						indexBuffer.push_back(buf[index] + vertexStart);
-					}
-                    delete[] buf;
-                    break;
-				}
-				case TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE: {
-					uint8_t *buf = new uint8_t[accessor.count];
-					memcpy(buf, &buffer.data[accessor.byteOffset + bufferView.byteOffset], accessor.count * sizeof(uint8_t));
-					for (size_t index = 0; index < accessor.count; index++) {
-						indexBuffer.push_back(buf[index] + vertexStart);
-					}
-                    delete[] buf;
-                    break;
-				}
-				default:
-					std::cerr << "Index component type " << accessor.componentType << " not supported!" << std::endl;
-					return;
-				}
+			// Position attribute is required
+			assert(primitive.attributes.find("POSITION") != primitive.attributes.end());
+			const tinygltf::Accessor &posAccessor = model.accessors[primitive.attributes.find("POSITION")->second];
+			const tinygltf::Accessor &indexAccessor = model.accessors[primitive.indices];
+			if (indexAccessor.componentType != TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT && indexAccessor.componentType != TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT
+				&& indexAccessor.componentType != TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE) {
+				std::cerr << "Index component type " << indexAccessor.componentType << " not supported!" << std::endl;
+				continue;
 			}
-			Primitive *newPrimitive = new Primitive(indexStart, indexCount, primitive.material > -1 ? materials[primitive.material] : materials.back());
-			newPrimitive->firstVertex = vertexStart;
-			newPrimitive->vertexCount = vertexCount;
-			newPrimitive->setDimensions(posMin, posMax);
-			newMesh->primitives.push_back(newPrimitive);
+			// The vertices and indices are decoded when the primitive is streamed to the arena, its ranges are set then
+			Primitive newPrimitive(0, static_cast<uint32_t>(indexAccessor.count), primitive.material > -1 ? materials[primitive.material] : materials.back());
+			newPrimitive.firstVertex = 0;
+			newPrimitive.vertexCount = static_cast<uint32_t>(posAccessor.count);
+			newPrimitive.setDimensions(glm::vec3(posAccessor.minValues[0], posAccessor.minValues[1], posAccessor.minValues[2]),
+				glm::vec3(posAccessor.maxValues[0], posAccessor.maxValues[1], posAccessor.maxValues[2]));
+			primitives.push_back(newPrimitive);
+			primitiveSources.push_back(&primitive);
 		}
+		// Primitive pointers are set once all primitives are loaded (see flattenSceneGraph)
+		newMesh->primitiveCount = static_cast<uint32_t>(primitives.size()) - newMesh->firstPrimitive;
 		newNode->mesh = newMesh;
 	}
 	if (parent) {
@@ -1131,6 +1153,14 @@ void vkglTF::Model::loadAnimations(tinygltf::Model &gltfModel)
 				}
 			}
 
+			// SoA copy of the outputs used by updateAnimation
+			for (uint32_t c = 0; c < 4; c++) {
+				sampler.outputs[c].resize(sampler.outputsVec4.size());
+				for (size_t index = 0; index < sampler.outputsVec4.size(); index++) {
+					sampler.outputs[c][index] = sampler.outputsVec4[index][c];
+				}
+			}
+
 			animation.samplers.push_back(sampler);
 		}
 
@@ -1166,6 +1196,7 @@ void vkglTF::Model::loadAnimations(tinygltf::Model &gltfModel)
 
 void vkglTF::Model::loadFromFile(std::string filename, vks::VulkanDevice *device, VkQueue transferQueue, uint32_t fileLoadingFlags, float scale)
 {
+	this->fileLoadingFlags = fileLoadingFlags;
 	tinygltf::Model gltfModel;
 	tinygltf::TinyGLTF gltfContext;
 	if (fileLoadingFlags & FileLoadingFlags::DontLoadImages) {
@@ -1192,8 +1223,8 @@ void vkglTF::Model::loadFromFile(std::string filename, vks::VulkanDevice *device
 #endif
 	bool fileLoaded = gltfContext.LoadASCIIFromFile(&gltfModel, &error, &warning, filename);
 
-	std::vector<uint32_t> indexBuffer;
-	std::vector<Vertex> vertexBuffer;
+	// Only the accessors of the primitives are read while loading the nodes, their geometry is streamed below
+	std::vector<const tinygltf::Primitive*> primitiveSources;
 
 	if (fileLoaded) {
 		if (!(fileLoadingFlags & FileLoadingFlags::DontLoadImages)) {
@@ -1203,60 +1234,29 @@ void vkglTF::Model::loadFromFile(std::string filename, vks::VulkanDevice *device
 		const tinygltf::Scene &scene = gltfModel.scenes[gltfModel.defaultScene > -1 ? gltfModel.defaultScene : 0];
 		for (size_t i = 0; i < scene.nodes.size(); i++) {
 			const tinygltf::Node node = gltfModel.nodes[scene.nodes[i]];
-			loadNode(nullptr, node, scene.nodes[i], gltfModel, indexBuffer, vertexBuffer, scale);
+			loadNode(nullptr, node, scene.nodes[i], gltfModel, primitiveSources, scale);
 		}
 		if (gltfModel.animations.size() > 0) {
 			loadAnimations(gltfModel);
 		}
 		loadSkins(gltfModel);
 
+		// Assign skins
 		for (auto node : linearNodes) {
-			// Assign skins
 			if (node->skinIndex > -1) {
 				node->skin = skins[node->skinIndex];
 			}
-			// Initial pose
-			if (node->mesh) {
-				node->update();
-			}
 		}
+		// Initial pose
+		flattenSceneGraph();
+		createTransformBuffers();
+		updateTransforms();
 	}
 	else {
 		vks::tools::exitFatal("Could not load glTF file \"" + filename + "\": " + error, -1);
 		return;
 	}
 
-	// Pre-Calculations for requested features
-	if ((fileLoadingFlags & FileLoadingFlags::PreTransformVertices) || (fileLoadingFlags & FileLoadingFlags::PreMultiplyVertexColors) || (fileLoadingFlags & FileLoadingFlags::FlipY)) {
-		const bool preTransform = fileLoadingFlags & FileLoadingFlags::PreTransformVertices;
-		const bool preMultiplyColor = fileLoadingFlags & FileLoadingFlags::PreMultiplyVertexColors;
-		const bool flipY = fileLoadingFlags & FileLoadingFlags::FlipY;
-		for (Node* node : linearNodes) {
-			if (node->mesh) {
-				const glm::mat4 localMatrix = node->getMatrix();
-				for (Primitive* primitive : node->mesh->primitives) {
-					for (uint32_t i = 0; i < primitive->vertexCount; i++) {
-						Vertex& vertex = vertexBuffer[primitive->firstVertex + i];
-						// Pre-transform vertex positions by node-hierarchy
-						if (preTransform) {
-							vertex.pos = glm::vec3(localMatrix * glm::vec4(vertex.pos, 1.0f));
-							vertex.normal = glm::normalize(glm::mat3(localMatrix) * vertex.normal);
-						}
-						// Flip Y-Axis of vertex positions
-						if (flipY) {
-							vertex.pos.y *= -1.0f;
-							vertex.normal.y *= -1.0f;
-						}
-						// Pre-Multiply vertex colors with material base color
-						if (preMultiplyColor) {
-							vertex.color = primitive->material.baseColorFactor * vertex.color;
-						}
-					}
-				}
-			}
-		}
-	}
-
 	for (auto extension : gltfModel.extensionsUsed) {
 		if (extension == "KHR_materials_pbrSpecularGlossiness") {
 			std::cout << "Required extension: " << extension;
@@ -1264,87 +1264,145 @@ void vkglTF::Model::loadFromFile(std::string filename, vks::VulkanDevice *device
 		}
 	}
 
-	size_t vertexBufferSize = vertexBuffer.size() * sizeof(Vertex);
-	size_t indexBufferSize = indexBuffer.size() * sizeof(uint32_t);
-	indices.count = static_cast<uint32_t>(indexBuffer.size());
-	vertices.count = static_cast<uint32_t>(vertexBuffer.size());
-
-	assert((vertexBufferSize > 0) && (indexBufferSize > 0));
-
-	struct StagingBuffer {
-		VkBuffer buffer;
-		VkDeviceMemory memory;
-	} vertexStaging, indexStaging;
-
-	// Create staging buffers
-	// Vertex data
-	VK_CHECK_RESULT(device->createBuffer(
-		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		vertexBufferSize,
-		&vertexStaging.buffer,
-		&vertexStaging.memory,
-		vertexBuffer.data()));
-	// Index data
-	VK_CHECK_RESULT(device->createBuffer(
-		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		indexBufferSize,
-		&indexStaging.buffer,
-		&indexStaging.memory,
-		indexBuffer.data()));
-
-	// Create device local buffers
-	// Vertex buffer
-	VK_CHECK_RESULT(device->createBuffer(
-	    VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | memoryPropertyFlags,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-		vertexBufferSize,
-		&vertices.buffer,
-		&vertices.memory));
-	// Index buffer
-	VK_CHECK_RESULT(device->createBuffer(
-	    VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | memoryPropertyFlags,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-		indexBufferSize,
-		&indices.buffer,
-		&indices.memory));
-
-	// Copy from staging buffers
-	VkCommandBuffer copyCmd = device->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+	// Indices are relative to the first vertex of their primitive (drawn with a vertex offset), so the smallest
+	// index type that addresses all primitives is enough
+	uint32_t maxPrimitiveVertices = 0;
+	uint64_t totalVertices = 0, totalIndices = 0;
+	for (const Primitive& primitive : primitives) {
+		maxPrimitiveVertices = std::max(maxPrimitiveVertices, primitive.vertexCount);
+		totalVertices += primitive.vertexCount;
+		totalIndices += primitive.indexCount;
+	}
+
+	// Encode the vertices with the requested format, dropping the components it does not contain,
+	// and split them in a position stream and an attribute stream
+	vertexFormat = vkglTF::vertexFormat;
+	const vks::VertexFormat positionFormat = Vertex::streamFormat(VertexStream::PositionStream);
+	const vks::VertexFormat attributeFormat = Vertex::streamFormat(VertexStream::AttributeStream);
+
+	arena = vkglTF::geometryArena;
+	if (arena) {
+		if (vks::mesh::indexTypeFor(maxPrimitiveVertices) == VK_INDEX_TYPE_UINT32 && arena->getIndexType() == VK_INDEX_TYPE_UINT16) {
+			throw std::runtime_error("failed to load " + filename + ": primitives with more than 65536 vertices need a geometry arena with 32 bit indices!");
+		}
+		if (arena->stride(VertexStream::PositionStream) != positionFormat.stride || arena->stride(VertexStream::AttributeStream) != attributeFormat.stride) {
+			throw std::runtime_error("failed to load " + filename + ": the vertex format does not match the geometry arena!");
+		}
+	} else {
+		// Chunks as large as the model (plus its levels of detail) allows, the arena splits larger models in several chunks
+		const uint64_t indexCapacity = (fileLoadingFlags & FileLoadingFlags::GenerateLODs) ? totalIndices * 2 : totalIndices;
+		privateArena.create(device->logicalDevice, device->physicalDevice, { positionFormat.stride, attributeFormat.stride },
+			static_cast<uint32_t>(std::min<uint64_t>(std::max<uint64_t>(totalVertices, 1), UINT32_MAX)),
+			static_cast<uint32_t>(std::min<uint64_t>(std::max<uint64_t>(indexCapacity, 1), UINT32_MAX)),
+			vks::mesh::indexTypeFor(maxPrimitiveVertices), memoryPropertyFlags);
+		arena = &privateArena;
+	}
+
+	// Stream the geometry one primitive at a time: decode, pre-transform, optimize and simplify it, then copy it to its own
+	// allocation of the arena through a fixed size staging buffer. The host only holds the largest primitive at once
+	const bool preTransform = fileLoadingFlags & FileLoadingFlags::PreTransformVertices;
+	const bool preMultiplyColor = fileLoadingFlags & FileLoadingFlags::PreMultiplyVertexColors;
+	const bool flipY = fileLoadingFlags & FileLoadingFlags::FlipY;
+	float missesBefore = 0.0f, missesAfter = 0.0f;
+	uint32_t triangleCount = 0, referencedVertices = 0;
+	uint64_t lodIndices = 0;
+	std::vector<Vertex> vertexBuffer;
+	std::vector<uint32_t> indexBuffer;
+	std::vector<uint8_t> positionBuffer, attributeBuffer;
+	arena->beginUpload(device->commandPool, transferQueue);
+	for (Node* node : linearNodes) {
+		if (!node->mesh) {
+			continue;
+		}
+		const glm::mat4 localMatrix = sceneGraph.worldMatrices[node->flatIndex];
+		for (Primitive* primitive : node->mesh->primitives) {
+			loadPrimitiveGeometry(gltfModel, *primitiveSources[primitive - primitives.data()], vertexBuffer, indexBuffer);
+
+			// Pre-Calculations for requested features
+			if (preTransform || preMultiplyColor || flipY) {
+				for (Vertex& vertex : vertexBuffer) {
+					// Pre-transform vertex positions by node-hierarchy
+					if (preTransform) {
+						vertex.pos = glm::vec3(localMatrix * glm::vec4(vertex.pos, 1.0f));
+						vertex.normal = glm::normalize(glm::mat3(localMatrix) * vertex.normal);
+					}
+					// Flip Y-Axis of vertex positions
+					if (flipY) {
+						vertex.pos.y *= -1.0f;
+						vertex.normal.y *= -1.0f;
+					}
+					// Pre-Multiply vertex colors with material base color
+					if (preMultiplyColor) {
+						vertex.color = primitive->material.baseColorFactor * vertex.color;
+					}
+				}
+			}
 
-	VkBufferCopy copyRegion = {};
+			if (fileLoadingFlags & FileLoadingFlags::OptimizeMeshes) {
+				const uint32_t primitiveTriangles = primitive->indexCount / 3;
+				missesBefore += vks::mesh::analyzeVertexCache(indexBuffer.data(), primitive->indexCount, primitive->vertexCount).acmr * primitiveTriangles;
+				vks::mesh::optimizeMesh(indexBuffer.data(), primitive->indexCount, vertexBuffer.data(), primitive->vertexCount, offsetof(Vertex, pos));
+				missesAfter += vks::mesh::analyzeVertexCache(indexBuffer.data(), primitive->indexCount, primitive->vertexCount).acmr * primitiveTriangles;
+				triangleCount += primitiveTriangles;
+				referencedVertices += primitive->vertexCount;
+			}
 
-	copyRegion.size = vertexBufferSize;
-	vkCmdCopyBuffer(copyCmd, vertexStaging.buffer, vertices.buffer, 1, &copyRegion);
+			// The full mesh is the first level of detail, the simplified ones are appended to the indices of the primitive
+			primitive->lods = { { 0, primitive->indexCount, 0.0f } };
+			if (fileLoadingFlags & FileLoadingFlags::GenerateLODs) {
+				generateLODs(*primitive, indexBuffer, vertexBuffer);
+				lodIndices += indexBuffer.size() - primitive->indexCount;
+			}
 
-	copyRegion.size = indexBufferSize;
-	vkCmdCopyBuffer(copyCmd, indexStaging.buffer, indices.buffer, 1, &copyRegion);
+			std::vector<uint8_t> packedIndexBuffer = vks::mesh::packIndices(indexBuffer.data(), indexBuffer.size(), arena->getIndexType());
+			positionBuffer.resize(vertexBuffer.size() * positionFormat.stride);
+			attributeBuffer.resize(vertexBuffer.size() * attributeFormat.stride);
+			for (size_t i = 0; i < vertexBuffer.size(); i++) {
+				vertexBuffer[i].encode(positionFormat, &positionBuffer[i * positionFormat.stride]);
+				if (attributeFormat.stride > 0) {
+					vertexBuffer[i].encode(attributeFormat, &attributeBuffer[i * attributeFormat.stride]);
+				}
+			}
 
-	device->flushCommandBuffer(copyCmd, transferQueue, true);
+			const vks::GeometryArena::Allocation allocation = arena->allocate(primitive->vertexCount, static_cast<uint32_t>(indexBuffer.size()));
+			arena->stage(allocation, { positionBuffer.data(), attributeFormat.stride > 0 ? attributeBuffer.data() : nullptr }, packedIndexBuffer.data());
+			arenaAllocations.push_back(allocation);
+			// Address the primitive inside the chunk
+			primitive->chunk = allocation.chunk;
+			primitive->firstVertex = allocation.firstVertex;
+			primitive->firstIndex = allocation.firstIndex;
+			for (Primitive::LOD& lod : primitive->lods) {
+				lod.firstIndex += allocation.firstIndex;
+			}
+			vertexCount += allocation.vertexCount;
+			indexCount += allocation.indexCount;
+		}
+	}
+	arena->endUpload();
 
-	vkDestroyBuffer(device->logicalDevice, vertexStaging.buffer, nullptr);
-	vkFreeMemory(device->logicalDevice, vertexStaging.memory, nullptr);
-	vkDestroyBuffer(device->logicalDevice, indexStaging.buffer, nullptr);
-	vkFreeMemory(device->logicalDevice, indexStaging.memory, nullptr);
+	if ((fileLoadingFlags & FileLoadingFlags::OptimizeMeshes) && triangleCount > 0) {
+		std::cout << "Optimized meshes of " << filename << ":"
+			<< " ACMR " << missesBefore / triangleCount << " -> " << missesAfter / triangleCount << ","
+			<< " ATVR " << missesBefore / referencedVertices << " -> " << missesAfter / referencedVertices << std::endl;
+	}
+	if (fileLoadingFlags & FileLoadingFlags::GenerateLODs) {
+		std::cout << "Generated LODs: " << totalIndices / 3 << " triangles in the full meshes, "
+			<< lodIndices / 3 << " in the simplified levels" << std::endl;
+	}
 
 	getSceneDimensions();
 
 	// Setup descriptors
-	uint32_t uboCount{ 0 };
+	// A single set holds the transforms of all meshes
+	uint32_t transformSetCount = meshSlots.empty() ? 0 : 1;
 	uint32_t imageCount{ 0 };
-	for (auto node : linearNodes) {
-		if (node->mesh) {
-			uboCount++;
-		}
-	}
 	for (auto material : materials) {
 		if (material.baseColorTexture != nullptr) {
 			imageCount++;
 		}
 	}
 	std::vector<VkDescriptorPoolSize> poolSizes = {
-		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, uboCount },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2 },
 	};
 	if (imageCount > 0) {
 		if (descriptorBindingFlags & DescriptorBindingFlags::ImageBaseColor) {
@@ -1358,24 +1416,31 @@ void vkglTF::Model::loadFromFile(std::string filename, vks::VulkanDevice *device
 	descriptorPoolCI.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
 	descriptorPoolCI.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
 	descriptorPoolCI.pPoolSizes = poolSizes.data();
-	descriptorPoolCI.maxSets = uboCount + imageCount;
+	descriptorPoolCI.maxSets = transformSetCount + imageCount;
 	VK_CHECK_RESULT(vkCreateDescriptorPool(device->logicalDevice, &descriptorPoolCI, nullptr, &descriptorPool));
 
-	// Descriptors for per-node uniform buffers
+	// Descriptors for the transform and joint buffers
 	{
 		// Layout is global, so only create if it hasn't already been created before
-		if (descriptorSetLayoutUbo == VK_NULL_HANDLE) {
+		if (descriptorSetLayoutTransforms == VK_NULL_HANDLE) {
 			std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings = {
-				vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 0),
+				vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 0),
+				vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 1),
 			};
 			VkDescriptorSetLayoutCreateInfo descriptorLayoutCI{};
 			descriptorLayoutCI.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
 			descriptorLayoutCI.bindingCount = static_cast<uint32_t>(setLayoutBindings.size());
 			descriptorLayoutCI.pBindings = setLayoutBindings.data();
-			VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device->logicalDevice, &descriptorLayoutCI, nullptr, &descriptorSetLayoutUbo));
+			VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device->logicalDevice, &descriptorLayoutCI, nullptr, &descriptorSetLayoutTransforms));
 		}
-		for (auto node : nodes) {
-			prepareNodeDescriptor(node, descriptorSetLayoutUbo);
+		if (transformSetCount > 0) {
+			VkDescriptorSetAllocateInfo descriptorSetAllocInfo = vks::initializers::descriptorSetAllocateInfo(descriptorPool, &descriptorSetLayoutTransforms, 1);
+			VK_CHECK_RESULT(vkAllocateDescriptorSets(device->logicalDevice, &descriptorSetAllocInfo, &transformsDescriptorSet));
+			std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
+				vks::initializers::writeDescriptorSet(transformsDescriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 0, &transforms.descriptor),
+				vks::initializers::writeDescriptorSet(transformsDescriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, &joints.descriptor),
+			};
+			vkUpdateDescriptorSets(device->logicalDevice, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
 		}
 	}
 
@@ -1404,66 +1469,427 @@ void vkglTF::Model::loadFromFile(std::string filename, vks::VulkanDevice *device
 	}
 }
 
-void vkglTF::Model::bindBuffers(VkCommandBuffer commandBuffer)
+// Simplifies the full mesh (the first indexCount indices) of a primitive into its levels of detail, appended to its indices
+void vkglTF::Model::generateLODs(Primitive& primitive, std::vector<uint32_t>& indexBuffer, const std::vector<Vertex>& vertexBuffer)
 {
-	const VkDeviceSize offsets[1] = {0};
-	vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertices.buffer, offsets);
-	vkCmdBindIndexBuffer(commandBuffer, indices.buffer, 0, VK_INDEX_TYPE_UINT32);
+	const float* positions = &vertexBuffer[0].pos.x;
+	const std::vector<uint32_t> source(indexBuffer.begin(), indexBuffer.begin() + primitive.indexCount);
+	// Every level halves the triangle count, simplified from the full mesh so the errors do not accumulate
+	for (uint32_t level = 1; level < maxLODs; level++) {
+		const size_t previousCount = primitive.lods.back().indexCount;
+		const size_t targetCount = (previousCount / 6) * 3;
+		float error = 0.0f;
+		std::vector<uint32_t> lodIndices = vks::mesh::simplifyMesh(source.data(), source.size(), positions, sizeof(Vertex), primitive.vertexCount, targetCount, &error);
+		// Stop when the simplification gets stuck (locked borders and seams) or nothing is left
+		if (lodIndices.empty() || lodIndices.size() > previousCount * 9 / 10) {
+			break;
+		}
+		vks::mesh::optimizeVertexCache(lodIndices.data(), lodIndices.size(), primitive.vertexCount);
+		Primitive::LOD lod;
+		lod.firstIndex = static_cast<uint32_t>(indexBuffer.size());
+		lod.indexCount = static_cast<uint32_t>(lodIndices.size());
+		lod.error = std::max(error, primitive.lods.back().error);
+		primitive.lods.push_back(lod);
+		indexBuffer.insert(indexBuffer.end(), lodIndices.begin(), lodIndices.end());
+	}
+}
+
+void vkglTF::Model::bindBuffers(VkCommandBuffer commandBuffer, uint32_t renderFlags)
+{
+	bindVertexStreams(commandBuffer, renderFlags, 0);
 	buffersBound = true;
 }
 
-void vkglTF::Model::drawNode(Node *node, VkCommandBuffer commandBuffer, uint32_t renderFlags, VkPipelineLayout pipelineLayout, uint32_t bindImageSet)
+void vkglTF::Model::bindVertexStreams(VkCommandBuffer commandBuffer, uint32_t renderFlags, uint32_t chunk) const
+{
+	if (!(renderFlags & RenderFlags::PullVertices)) {
+		const VkDeviceSize offsets[2] = {0, 0};
+		const VkBuffer buffers[2] = {arena->vertexBuffer(VertexStream::PositionStream, chunk), arena->vertexBuffer(VertexStream::AttributeStream, chunk)};
+		const bool positionsOnly = (renderFlags & RenderFlags::PositionsOnly) || (buffers[1] == VK_NULL_HANDLE);
+		vkCmdBindVertexBuffers(commandBuffer, VertexStream::PositionStream, positionsOnly ? 1 : 2, buffers, offsets);
+	}
+	vkCmdBindIndexBuffer(commandBuffer, arena->getIndexBuffer(chunk), 0, arena->getIndexType());
+}
+
+// Returns true if the render flags filter out the alpha mode of the material
+static bool skipMaterial(const vkglTF::Material& material, uint32_t renderFlags)
+{
+	bool skip = false;
+	if (renderFlags & vkglTF::RenderFlags::RenderOpaqueNodes) {
+		skip = (material.alphaMode != vkglTF::Material::ALPHAMODE_OPAQUE);
+	}
+	if (renderFlags & vkglTF::RenderFlags::RenderAlphaMaskedNodes) {
+		skip = (material.alphaMode != vkglTF::Material::ALPHAMODE_MASK);
+	}
+	if (renderFlags & vkglTF::RenderFlags::RenderAlphaBlendedNodes) {
+		skip = (material.alphaMode != vkglTF::Material::ALPHAMODE_BLEND);
+	}
+	return skip;
+}
+
+void vkglTF::Model::drawPrimitive(Primitive *primitive, uint32_t transformIndex, VkCommandBuffer commandBuffer, uint32_t renderFlags, VkPipelineLayout pipelineLayout, uint32_t bindImageSet, uint32_t& boundChunk)
+{
+	const vkglTF::Material& material = primitive->material;
+	if (!skipMaterial(material, renderFlags)) {
+		if (primitive->chunk != boundChunk) {
+			bindVertexStreams(commandBuffer, renderFlags, primitive->chunk);
+			boundChunk = primitive->chunk;
+		}
+		if (renderFlags & RenderFlags::BindImages) {
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, bindImageSet, 1, &material.descriptorSet, 0, nullptr);
+		}
+		vkCmdDrawIndexed(commandBuffer, primitive->indexCount, 1, primitive->firstIndex, primitive->firstVertex, transformIndex);
+	}
+}
+
+void vkglTF::Model::drawNode(Node *node, VkCommandBuffer commandBuffer, uint32_t renderFlags, VkPipelineLayout pipelineLayout, uint32_t bindImageSet, uint32_t& boundChunk)
 {
 	if (node->mesh) {
 		for (Primitive* primitive : node->mesh->primitives) {
-			bool skip = false;
-			const vkglTF::Material& material = primitive->material;
-			if (renderFlags & RenderFlags::RenderOpaqueNodes) {
-				skip = (material.alphaMode != Material::ALPHAMODE_OPAQUE);
-			}
-			if (renderFlags & RenderFlags::RenderAlphaMaskedNodes) {
-				skip = (material.alphaMode != Material::ALPHAMODE_MASK);
-			}
-			if (renderFlags & RenderFlags::RenderAlphaBlendedNodes) {
-				skip = (material.alphaMode != Material::ALPHAMODE_BLEND);
-			}
-			if (!skip) {
-				if (renderFlags & RenderFlags::BindImages) {
-					vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, bindImageSet, 1, &material.descriptorSet, 0, nullptr);
-				}
-				vkCmdDrawIndexed(commandBuffer, primitive->indexCount, 1, primitive->firstIndex, 0, 0);
-			}
+			drawPrimitive(primitive, node->mesh->transformIndex, commandBuffer, renderFlags, pipelineLayout, bindImageSet, boundChunk);
 		}
 	}
 	for (auto& child : node->children) {
-		drawNode(child, commandBuffer, renderFlags, pipelineLayout, bindImageSet);
+		drawNode(child, commandBuffer, renderFlags, pipelineLayout, bindImageSet, boundChunk);
 	}
 }
 
+void vkglTF::Model::drawNode(Node *node, VkCommandBuffer commandBuffer, uint32_t renderFlags, VkPipelineLayout pipelineLayout, uint32_t bindImageSet)
+{
+	// The buffers of a chunk are bound before its first primitive, bindBuffers binds the first chunk
+	uint32_t boundChunk = buffersBound ? 0 : ~0u;
+	drawNode(node, commandBuffer, renderFlags, pipelineLayout, bindImageSet, boundChunk);
+}
+
 void vkglTF::Model::draw(VkCommandBuffer commandBuffer, uint32_t renderFlags, VkPipelineLayout pipelineLayout, uint32_t bindImageSet)
 {
-	if (!buffersBound) {
-		const VkDeviceSize offsets[1] = {0};
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertices.buffer, offsets);
-		vkCmdBindIndexBuffer(commandBuffer, indices.buffer, 0, VK_INDEX_TYPE_UINT32);
-	}
+	uint32_t boundChunk = buffersBound ? 0 : ~0u;
 	for (auto& node : nodes) {
-		drawNode(node, commandBuffer, renderFlags, pipelineLayout, bindImageSet);
+		drawNode(node, commandBuffer, renderFlags, pipelineLayout, bindImageSet, boundChunk);
+	}
+}
+
+void vkglTF::Model::drawPrimitives(VkCommandBuffer commandBuffer, uint32_t firstPrimitive, uint32_t primitiveCount, uint32_t renderFlags, VkPipelineLayout pipelineLayout, uint32_t bindImageSet)
+{
+	// Always bind the buffers: this is meant to be called from several (secondary) command buffers
+	// at once, so it must neither depend on nor modify the buffersBound state of the model
+	uint32_t boundChunk = ~0u;
+	const uint32_t lastPrimitive = std::min(firstPrimitive + primitiveCount, static_cast<uint32_t>(linearPrimitives.size()));
+	for (uint32_t i = firstPrimitive; i < lastPrimitive; i++) {
+		drawPrimitive(linearPrimitives[i], linearPrimitiveNodes[i]->mesh->transformIndex, commandBuffer, renderFlags, pipelineLayout, bindImageSet, boundChunk);
+	}
+}
+
+void vkglTF::Model::gatherNodes(Node *node, int32_t parentSlot)
+{
+	const uint32_t slot = sceneGraph.size();
+	node->flatIndex = static_cast<int32_t>(slot);
+	glm::quat rotation = node->rotation;
+	if (glm::dot(rotation, rotation) == 0.0f) {
+		rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+	}
+	sceneGraph.nodes.push_back(node);
+	sceneGraph.parents.push_back(parentSlot);
+	sceneGraph.translations.push_back(node->translation);
+	sceneGraph.rotations.push_back(rotation);
+	sceneGraph.scales.push_back(node->scale);
+	sceneGraph.matrices.push_back(node->matrix);
+	sceneGraph.hasMatrix.push_back(node->matrix != glm::mat4(1.0f));
+	for (auto& child : node->children) {
+		gatherNodes(child, static_cast<int32_t>(slot));
+	}
+}
+
+void vkglTF::Model::flattenSceneGraph()
+{
+	// Nodes in pre-order, which is both a topological order and the order draw() renders them in
+	sceneGraph = SceneGraph{};
+	for (auto node : nodes) {
+		gatherNodes(node, -1);
+	}
+	const uint32_t count = sceneGraph.size();
+	sceneGraph.localMatrices.resize(count);
+	sceneGraph.worldMatrices.resize(count);
+	sceneGraph.dirty.assign(count, 1);
+	sceneGraph.worldChanged.assign(count, 1);
+
+	// The primitives array does not grow anymore, so meshes can point into it
+	meshSlots.clear();
+	linearPrimitives.clear();
+	linearPrimitiveNodes.clear();
+	for (uint32_t slot = 0; slot < count; slot++) {
+		Node* node = sceneGraph.nodes[slot];
+		if (!node->mesh) {
+			continue;
+		}
+		meshSlots.push_back(slot);
+		Mesh* mesh = node->mesh;
+		mesh->primitives.resize(mesh->primitiveCount);
+		for (uint32_t i = 0; i < mesh->primitiveCount; i++) {
+			mesh->primitives[i] = &primitives[mesh->firstPrimitive + i];
+			linearPrimitives.push_back(mesh->primitives[i]);
+			linearPrimitiveNodes.push_back(node);
+		}
+	}
+}
+
+void vkglTF::Model::createTransformBuffers()
+{
+	// Assign the entries of the meshes and the ranges of their joints
+	uint32_t jointCount = 0;
+	for (uint32_t i = 0; i < static_cast<uint32_t>(meshSlots.size()); i++) {
+		Node* node = sceneGraph.nodes[meshSlots[i]];
+		node->mesh->transformIndex = i;
+		node->mesh->jointOffset = jointCount;
+		node->mesh->jointCount = node->skin ? static_cast<uint32_t>(node->skin->joints.size()) : 0;
+		jointCount += node->mesh->jointCount;
+	}
+	if (meshSlots.empty()) {
+		return;
+	}
+
+	// Host visible and coherent, written in place by updateTransforms
+	const VkMemoryPropertyFlags memoryFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	VK_CHECK_RESULT(device->createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, memoryFlags, &transforms, meshSlots.size() * sizeof(MeshTransform)));
+	// Storage buffers can not be empty
+	VK_CHECK_RESULT(device->createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, memoryFlags, &joints, std::max(jointCount, 1u) * sizeof(glm::mat4)));
+	VK_CHECK_RESULT(transforms.map());
+	VK_CHECK_RESULT(joints.map());
+}
+
+void vkglTF::Model::updateTransforms()
+{
+	sceneGraph.update();
+	if (transforms.mapped == nullptr) {
+		return;
+	}
+
+	// Write the matrices of the meshes whose node (or one of whose joints) moved
+	MeshTransform* meshTransforms = static_cast<MeshTransform*>(transforms.mapped);
+	glm::mat4* jointMatrices = static_cast<glm::mat4*>(joints.mapped);
+	for (uint32_t slot : meshSlots) {
+		Node* node = sceneGraph.nodes[slot];
+		Mesh* mesh = node->mesh;
+		bool changed = sceneGraph.worldChanged[slot];
+		if (node->skin) {
+			for (size_t i = 0; i < node->skin->joints.size() && !changed; i++) {
+				changed = sceneGraph.worldChanged[node->skin->joints[i]->flatIndex];
+			}
+		}
+		if (!changed) {
+			continue;
+		}
+		const glm::mat4& m = sceneGraph.worldMatrices[slot];
+		MeshTransform& transform = meshTransforms[mesh->transformIndex];
+		transform.matrix = m;
+		transform.jointOffset = mesh->jointOffset;
+		transform.jointCount = mesh->jointCount;
+		if (node->skin) {
+			// Joint matrices are relative to the node
+			glm::mat4 inverseTransform = glm::inverse(m);
+			for (uint32_t i = 0; i < mesh->jointCount; i++) {
+				const glm::mat4& jointWorld = sceneGraph.worldMatrices[node->skin->joints[i]->flatIndex];
+				jointMatrices[mesh->jointOffset + i] = inverseTransform * jointWorld * node->skin->inverseBindMatrices[i];
+			}
+		}
+	}
+}
+
+void vkglTF::Model::bindTransforms(VkCommandBuffer commandBuffer, VkPipelineLayout pipelineLayout, uint32_t set)
+{
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, set, 1, &transformsDescriptorSet, 0, nullptr);
+}
+
+// LSD radix sort of the draw items by key, 8 bits per pass, skipping the passes where all keys share the same digit
+static void radixSortDrawItems(std::vector<vkglTF::DrawList::Item>::iterator first, std::vector<vkglTF::DrawList::Item>::iterator last, std::vector<vkglTF::DrawList::Item>& scratch)
+{
+	const size_t count = static_cast<size_t>(last - first);
+	if (count < 2) {
+		return;
+	}
+	scratch.resize(count);
+	vkglTF::DrawList::Item* src = &*first;
+	vkglTF::DrawList::Item* dst = scratch.data();
+	for (uint32_t shift = 0; shift < 64; shift += 8) {
+		size_t histogram[256] = {};
+		for (size_t i = 0; i < count; i++) {
+			histogram[(src[i].key >> shift) & 0xff]++;
+		}
+		if (histogram[(src[0].key >> shift) & 0xff] == count) {
+			continue;
+		}
+		size_t offset = 0;
+		for (size_t& bin : histogram) {
+			size_t binCount = bin;
+			bin = offset;
+			offset += binCount;
+		}
+		for (size_t i = 0; i < count; i++) {
+			dst[histogram[(src[i].key >> shift) & 0xff]++] = src[i];
+		}
+		std::swap(src, dst);
+	}
+	if (src != &*first) {
+		std::copy(src, src + count, first);
+	}
+}
+
+glm::vec3 vkglTF::Model::getDrawnPosition(const glm::mat4& matrix, glm::vec3 position) const
+{
+	// Follow the transformations applied to the vertices at load time (see loadFromFile)
+	const bool flipY = fileLoadingFlags & FileLoadingFlags::FlipY;
+	if (fileLoadingFlags & FileLoadingFlags::PreTransformVertices) {
+		position = glm::vec3(matrix * glm::vec4(position, 1.0f));
+		if (flipY) {
+			position.y *= -1.0f;
+		}
+	} else {
+		if (flipY) {
+			position.y *= -1.0f;
+		}
+		position = glm::vec3(matrix * glm::vec4(position, 1.0f));
+	}
+	return position;
+}
+
+glm::vec3 vkglTF::Model::getPrimitiveCenter(uint32_t primitiveIndex)
+{
+	const glm::mat4& matrix = sceneGraph.worldMatrices[linearPrimitiveNodes[primitiveIndex]->flatIndex];
+	return getDrawnPosition(matrix, linearPrimitives[primitiveIndex]->dimensions.center);
+}
+
+void vkglTF::Model::getPrimitiveBounds(uint32_t primitiveIndex, glm::vec3& min, glm::vec3& max)
+{
+	const Primitive::Dimensions& dimensions = linearPrimitives[primitiveIndex]->dimensions;
+	const glm::mat4& matrix = sceneGraph.worldMatrices[linearPrimitiveNodes[primitiveIndex]->flatIndex];
+	min = glm::vec3(FLT_MAX);
+	max = glm::vec3(-FLT_MAX);
+	for (uint32_t c = 0; c < 8; c++) {
+		const glm::vec3 corner((c & 1) ? dimensions.max.x : dimensions.min.x, (c & 2) ? dimensions.max.y : dimensions.min.y, (c & 4) ? dimensions.max.z : dimensions.min.z);
+		const glm::vec3 position = getDrawnPosition(matrix, corner);
+		min = glm::min(min, position);
+		max = glm::max(max, position);
+	}
+}
+
+uint32_t vkglTF::Model::selectLOD(uint32_t primitiveIndex, const LODSelection& selection)
+{
+	const Primitive* primitive = linearPrimitives[primitiveIndex];
+	const uint32_t lodCount = static_cast<uint32_t>(primitive->lods.size());
+	if (lodCount < 2) {
+		return 0;
+	}
+	// The errors are measured on the vertices as stored, scale them if the node transform is applied when drawing
+	float scale = 1.0f;
+	if (!(fileLoadingFlags & FileLoadingFlags::PreTransformVertices)) {
+		const glm::mat4& matrix = sceneGraph.worldMatrices[linearPrimitiveNodes[primitiveIndex]->flatIndex];
+		scale = std::max({ glm::length(glm::vec3(matrix[0])), glm::length(glm::vec3(matrix[1])), glm::length(glm::vec3(matrix[2])) });
+	}
+	// Distance to the bounding sphere: the full mesh is used from inside it
+	const float distance = glm::distance(selection.viewPosition, getPrimitiveCenter(primitiveIndex)) - primitive->dimensions.radius * scale;
+	uint32_t lod = 0;
+	if (distance > 0.0f) {
+		const float pixelsPerUnit = selection.projectionScale * scale / distance;
+		while (lod + 1 < lodCount && primitive->lods[lod + 1].error * pixelsPerUnit <= selection.threshold) {
+			lod++;
+		}
+	}
+	return std::min(lod + selection.bias, lodCount - 1);
+}
+
+void vkglTF::Model::buildDrawList(DrawList& drawList, const glm::mat4* view, const LODSelection* lodSelection)
+{
+	const uint32_t primitiveCount = static_cast<uint32_t>(linearPrimitives.size());
+	drawList.items.resize(primitiveCount);
+
+	// Count the items of each bucket, so a single pass over the primitives can place them
+	uint32_t bucketCount[3] = {};
+	for (Primitive* primitive : linearPrimitives) {
+		bucketCount[primitive->material.alphaMode]++;
+	}
+	uint32_t bucketOffset[3] = { 0, bucketCount[0], bucketCount[0] + bucketCount[1] };
+	for (uint32_t bucket = 0; bucket < 3; bucket++) {
+		drawList.firstItem[bucket] = bucketOffset[bucket];
+		drawList.itemCount[bucket] = bucketCount[bucket];
+	}
+
+	for (uint32_t i = 0; i < primitiveCount; i++) {
+		const Material& material = linearPrimitives[i]->material;
+		const uint64_t pipeline = static_cast<uint64_t>(material.alphaMode) & 0xf;
+		const uint64_t chunk = static_cast<uint64_t>(linearPrimitives[i]->chunk) & 0xff;
+		const uint64_t materialIndex = static_cast<uint64_t>(&material - materials.data()) & 0xfffff;
+
+		// Positive floats keep their order when compared as unsigned integers
+		uint32_t depthBits = 0;
+		if (view) {
+			float depth = std::max(0.0f, -((*view) * glm::vec4(getPrimitiveCenter(i), 1.0f)).z);
+			memcpy(&depthBits, &depth, sizeof(depthBits));
+		}
+
+		DrawList::Item item;
+		item.primitiveIndex = i;
+		item.lod = lodSelection ? selectLOD(i, *lodSelection) : 0;
+		if (material.alphaMode == Material::ALPHAMODE_BLEND) {
+			item.key = (static_cast<uint64_t>(~depthBits) << 32) | (pipeline << 28) | (chunk << 20) | materialIndex;
+		} else {
+			item.key = (pipeline << 60) | (chunk << 52) | (materialIndex << 32) | depthBits;
+		}
+		drawList.items[bucketOffset[material.alphaMode]++] = item;
+	}
+
+	drawList.signature = 14695981039346656037ull;
+	for (uint32_t bucket = 0; bucket < 3; bucket++) {
+		auto first = drawList.items.begin() + drawList.firstItem[bucket];
+		radixSortDrawItems(first, first + drawList.itemCount[bucket], drawList.scratch);
+	}
+	for (const DrawList::Item& item : drawList.items) {
+		drawList.signature = (drawList.signature ^ item.primitiveIndex) * 1099511628211ull;
+		drawList.signature = (drawList.signature ^ item.lod) * 1099511628211ull;
+	}
+}
+
+void vkglTF::Model::drawList(VkCommandBuffer commandBuffer, const DrawList& drawList, uint32_t firstItem, uint32_t itemCount, uint32_t renderFlags, VkPipelineLayout pipelineLayout, uint32_t bindImageSet)
+{
+	uint32_t boundChunk = ~0u;
+	VkDescriptorSet boundSet = VK_NULL_HANDLE;
+	const uint32_t lastItem = std::min(firstItem + itemCount, static_cast<uint32_t>(drawList.items.size()));
+	for (uint32_t i = firstItem; i < lastItem; i++) {
+		const DrawList::Item& item = drawList.items[i];
+		const Primitive* primitive = linearPrimitives[item.primitiveIndex];
+		const Material& material = primitive->material;
+		if (skipMaterial(material, renderFlags)) {
+			continue;
+		}
+		// Items are sorted by chunk and material, so the buffers and the set only change between groups of draws
+		if (primitive->chunk != boundChunk) {
+			bindVertexStreams(commandBuffer, renderFlags, primitive->chunk);
+			boundChunk = primitive->chunk;
+		}
+		if ((renderFlags & RenderFlags::BindImages) && (material.descriptorSet != boundSet)) {
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, bindImageSet, 1, &material.descriptorSet, 0, nullptr);
+			boundSet = material.descriptorSet;
+		}
+		const Primitive::LOD& lod = primitive->lods[item.lod];
+		const uint32_t transformIndex = linearPrimitiveNodes[item.primitiveIndex]->mesh->transformIndex;
+		vkCmdDrawIndexed(commandBuffer, lod.indexCount, 1, lod.firstIndex, primitive->firstVertex, transformIndex);
 	}
 }
 
 void vkglTF::Model::getNodeDimensions(Node *node, glm::vec3 &min, glm::vec3 &max)
 {
 	if (node->mesh) {
+		// All corners of the bounds are transformed (a rotation moves the extremes to other corners), in the space the
+		// primitives are drawn in: node matrix and FlipY applied like to the vertices
+		const glm::mat4 matrix = node->getMatrix();
 		for (Primitive *primitive : node->mesh->primitives) {
-			glm::vec4 locMin = glm::vec4(primitive->dimensions.min, 1.0f) * node->getMatrix();
-			glm::vec4 locMax = glm::vec4(primitive->dimensions.max, 1.0f) * node->getMatrix();
-			if (locMin.x < min.x) { min.x = locMin.x; }
-			if (locMin.y < min.y) { min.y = locMin.y; }
-			if (locMin.z < min.z) { min.z = locMin.z; }
-			if (locMax.x > max.x) { max.x = locMax.x; }
-			if (locMax.y > max.y) { max.y = locMax.y; }
-			if (locMax.z > max.z) { max.z = locMax.z; }
+			for (uint32_t c = 0; c < 8; c++) {
+				const glm::vec3 corner((c & 1) ? primitive->dimensions.max.x : primitive->dimensions.min.x,
+				                       (c & 2) ? primitive->dimensions.max.y : primitive->dimensions.min.y,
+				                       (c & 4) ? primitive->dimensions.max.z : primitive->dimensions.min.z);
+				const glm::vec3 position = getDrawnPosition(matrix, corner);
+				min = glm::min(min, position);
+				max = glm::max(max, position);
+			}
 		}
 	}
 	for (auto child : node->children) {
@@ -1483,6 +1909,159 @@ void vkglTF::Model::getSceneDimensions()
 	dimensions.radius = glm::distance(dimensions.min, dimensions.max) / 2.0f;
 }
 
+uint32_t vkglTF::AnimationSampler::findKey(float time, uint32_t& cursor) const
+{
+	const uint32_t last = static_cast<uint32_t>(inputs.size()) - 2;
+	cursor = std::min(cursor, last);
+	// Playback moves forward by less than a keyframe most of the time: try the cached interval and the next one first
+	if (time >= inputs[cursor]) {
+		if (cursor == last || time < inputs[cursor + 1]) {
+			return cursor;
+		}
+		if (cursor + 1 == last || time < inputs[cursor + 2]) {
+			return ++cursor;
+		}
+	}
+	// Binary search fallback (first evaluation, seeking, looping)
+	auto upper = std::upper_bound(inputs.begin(), inputs.end(), time);
+	uint32_t key = (upper == inputs.begin()) ? 0 : static_cast<uint32_t>(upper - inputs.begin()) - 1;
+	cursor = std::min(key, last);
+	return cursor;
+}
+
+namespace
+{
+	// A batch of channels evaluated together, one lane per channel, each vector stored in SoA layout ([component][lane])
+	// Every interpolation mode is written as the cubic Hermite form: h00 * a + h10 * m0 + h01 * b + h11 * m1
+	// (linear: h00 = 1 - u, h01 = u; step: h00 = 1 or h01 = 1; cubic spline: Hermite basis scaled by the interval duration)
+	constexpr uint32_t animationBatchSize = 4;
+	struct AnimationBatch {
+		alignas(16) float a[4][animationBatchSize];
+		alignas(16) float b[4][animationBatchSize];
+		alignas(16) float m0[4][animationBatchSize];
+		alignas(16) float m1[4][animationBatchSize];
+		alignas(16) float h00[animationBatchSize];
+		alignas(16) float h01[animationBatchSize];
+		alignas(16) float h10[animationBatchSize];
+		alignas(16) float h11[animationBatchSize];
+		alignas(16) float normalize[animationBatchSize]; // all bits set for rotations (nlerp), zero otherwise
+		alignas(16) float result[4][animationBatchSize];
+	};
+
+	void loadOutput(const vkglTF::AnimationSampler& sampler, uint32_t index, float (*dst)[animationBatchSize], uint32_t lane, float sign = 1.0f)
+	{
+		for (uint32_t c = 0; c < 4; c++) {
+			dst[c][lane] = sign * sampler.outputs[c][index];
+		}
+	}
+
+	// Find the keyframes of the channel and fill its lane of the batch
+	void gatherChannel(const vkglTF::AnimationSampler& sampler, vkglTF::AnimationChannel& channel, float time, AnimationBatch& batch, uint32_t lane)
+	{
+		const bool cubic = (sampler.interpolation == vkglTF::AnimationSampler::InterpolationType::CUBICSPLINE);
+		const bool rotation = (channel.path == vkglTF::AnimationChannel::PathType::ROTATION);
+		const uint32_t normalizeBits = rotation ? 0xffffffff : 0;
+		memcpy(&batch.normalize[lane], &normalizeBits, sizeof(float));
+		batch.h10[lane] = batch.h11[lane] = 0.0f;
+		for (uint32_t c = 0; c < 4; c++) {
+			batch.m0[c][lane] = batch.m1[c][lane] = 0.0f;
+		}
+
+		// Single keyframe: constant value
+		if (sampler.inputs.size() < 2) {
+			loadOutput(sampler, cubic ? 1 : 0, batch.a, lane);
+			loadOutput(sampler, cubic ? 1 : 0, batch.b, lane);
+			batch.h00[lane] = 1.0f;
+			batch.h01[lane] = 0.0f;
+			return;
+		}
+
+		const uint32_t key = sampler.findKey(time, channel.cursor);
+		const float t0 = sampler.inputs[key];
+		const float dt = sampler.inputs[key + 1] - t0;
+		const float u = (dt > 0.0f) ? std::min(std::max((time - t0) / dt, 0.0f), 1.0f) : 0.0f;
+
+		switch (sampler.interpolation) {
+		case vkglTF::AnimationSampler::InterpolationType::STEP:
+			loadOutput(sampler, key, batch.a, lane);
+			loadOutput(sampler, key + 1, batch.b, lane);
+			batch.h00[lane] = (u < 1.0f) ? 1.0f : 0.0f;
+			batch.h01[lane] = 1.0f - batch.h00[lane];
+			break;
+		case vkglTF::AnimationSampler::InterpolationType::CUBICSPLINE: {
+			loadOutput(sampler, 3 * key + 1, batch.a, lane);       // value k
+			loadOutput(sampler, 3 * key + 2, batch.m0, lane);      // out-tangent k
+			loadOutput(sampler, 3 * (key + 1), batch.m1, lane);    // in-tangent k + 1
+			loadOutput(sampler, 3 * (key + 1) + 1, batch.b, lane); // value k + 1
+			const float u2 = u * u;
+			const float u3 = u2 * u;
+			batch.h00[lane] = 2.0f * u3 - 3.0f * u2 + 1.0f;
+			batch.h10[lane] = (u3 - 2.0f * u2 + u) * dt;
+			batch.h01[lane] = -2.0f * u3 + 3.0f * u2;
+			batch.h11[lane] = (u3 - u2) * dt;
+			break;
+		}
+		default: {
+			loadOutput(sampler, key, batch.a, lane);
+			// Rotations take the shortest path: flip the second quaternion if needed
+			float sign = 1.0f;
+			if (rotation) {
+				float dot = 0.0f;
+				for (uint32_t c = 0; c < 4; c++) {
+					dot += sampler.outputs[c][key] * sampler.outputs[c][key + 1];
+				}
+				sign = (dot < 0.0f) ? -1.0f : 1.0f;
+			}
+			loadOutput(sampler, key + 1, batch.b, lane, sign);
+			batch.h00[lane] = 1.0f - u;
+			batch.h01[lane] = u;
+			break;
+		}
+		}
+	}
+
+	// Evaluate all the lanes of the batch at once
+	void evaluateBatch(AnimationBatch& batch)
+	{
+#if defined(VKGLTF_USE_SSE)
+		const __m128 h00 = _mm_load_ps(batch.h00);
+		const __m128 h01 = _mm_load_ps(batch.h01);
+		const __m128 h10 = _mm_load_ps(batch.h10);
+		const __m128 h11 = _mm_load_ps(batch.h11);
+		__m128 r[4];
+		for (uint32_t c = 0; c < 4; c++) {
+			r[c] = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(h00, _mm_load_ps(batch.a[c])), _mm_mul_ps(h01, _mm_load_ps(batch.b[c]))),
+				_mm_add_ps(_mm_mul_ps(h10, _mm_load_ps(batch.m0[c])), _mm_mul_ps(h11, _mm_load_ps(batch.m1[c]))));
+		}
+		// nlerp: normalize the rotation lanes
+		__m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r[0], r[0]), _mm_mul_ps(r[1], r[1])), _mm_add_ps(_mm_mul_ps(r[2], r[2]), _mm_mul_ps(r[3], r[3])));
+		__m128 invLength = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(_mm_max_ps(length2, _mm_set1_ps(1e-12f))));
+		const __m128 mask = _mm_load_ps(batch.normalize);
+		for (uint32_t c = 0; c < 4; c++) {
+			r[c] = _mm_or_ps(_mm_and_ps(mask, _mm_mul_ps(r[c], invLength)), _mm_andnot_ps(mask, r[c]));
+			_mm_store_ps(batch.result[c], r[c]);
+		}
+#else
+		for (uint32_t lane = 0; lane < animationBatchSize; lane++) {
+			float length2 = 0.0f;
+			for (uint32_t c = 0; c < 4; c++) {
+				batch.result[c][lane] = batch.h00[lane] * batch.a[c][lane] + batch.h01[lane] * batch.b[c][lane] + batch.h10[lane] * batch.m0[c][lane] + batch.h11[lane] * batch.m1[c][lane];
+				length2 += batch.result[c][lane] * batch.result[c][lane];
+			}
+			uint32_t normalize;
+			memcpy(&normalize, &batch.normalize[lane], sizeof(normalize));
+			if (normalize) {
+				const float invLength = 1.0f / std::sqrt(std::max(length2, 1e-12f));
+				for (uint32_t c = 0; c < 4; c++) {
+					batch.result[c][lane] *= invLength;
+				}
+			}
+		}
+#endif
+	}
+}
+
 void vkglTF::Model::updateAnimation(uint32_t index, float time)
 {
 	if (index > static_cast<uint32_t>(animations.size()) - 1) {
@@ -1491,52 +2070,53 @@ void vkglTF::Model::updateAnimation(uint32_t index, float time)
 	}
 	Animation &animation = animations[index];
 
+	// Channels with valid samplers, evaluated in batches
+	AnimationBatch batch{};
+	AnimationChannel* lanes[animationBatchSize];
+	uint32_t laneCount = 0;
 	bool updated = false;
+	auto flush = [&]() {
+		evaluateBatch(batch);
+		for (uint32_t lane = 0; lane < laneCount; lane++) {
+			AnimationChannel& channel = *lanes[lane];
+			const glm::vec4 value(batch.result[0][lane], batch.result[1][lane], batch.result[2][lane], batch.result[3][lane]);
+			switch (channel.path) {
+			case AnimationChannel::PathType::TRANSLATION:
+				channel.node->translation = glm::vec3(value);
+				sceneGraph.setTranslation(channel.node->flatIndex, channel.node->translation);
+				break;
+			case AnimationChannel::PathType::SCALE:
+				channel.node->scale = glm::vec3(value);
+				sceneGraph.setScale(channel.node->flatIndex, channel.node->scale);
+				break;
+			case AnimationChannel::PathType::ROTATION:
+				channel.node->rotation = glm::quat(value.w, value.x, value.y, value.z);
+				sceneGraph.setRotation(channel.node->flatIndex, channel.node->rotation);
+				break;
+			}
+		}
+		updated = updated || (laneCount > 0);
+		laneCount = 0;
+	};
+
 	for (auto& channel : animation.channels) {
-		vkglTF::AnimationSampler &sampler = animation.samplers[channel.samplerIndex];
-		if (sampler.inputs.size() > sampler.outputsVec4.size()) {
+		const AnimationSampler &sampler = animation.samplers[channel.samplerIndex];
+		const size_t valuesPerKey = (sampler.interpolation == AnimationSampler::InterpolationType::CUBICSPLINE) ? 3 : 1;
+		if (sampler.inputs.empty() || (sampler.inputs.size() * valuesPerKey > sampler.outputsVec4.size())) {
 			continue;
 		}
-
-		for (auto i = 0; i < sampler.inputs.size() - 1; i++) {
-			if ((time >= sampler.inputs[i]) && (time <= sampler.inputs[i + 1])) {
-				float u = std::max(0.0f, time - sampler.inputs[i]) / (sampler.inputs[i + 1] - sampler.inputs[i]);
-				if (u <= 1.0f) {
-					switch (channel.path) {
-					case vkglTF::AnimationChannel::PathType::TRANSLATION: {
-						glm::vec4 trans = glm::mix(sampler.outputsVec4[i], sampler.outputsVec4[i + 1], u);
-						channel.node->translation = glm::vec3(trans);
-						break;
-					}
-					case vkglTF::AnimationChannel::PathType::SCALE: {
-						glm::vec4 trans = glm::mix(sampler.outputsVec4[i], sampler.outputsVec4[i + 1], u);
-						channel.node->scale = glm::vec3(trans);
-						break;
-					}
-					case vkglTF::AnimationChannel::PathType::ROTATION: {
-						glm::quat q1;
-						q1.x = sampler.outputsVec4[i].x;
-						q1.y = sampler.outputsVec4[i].y;
-						q1.z = sampler.outputsVec4[i].z;
-						q1.w = sampler.outputsVec4[i].w;
-						glm::quat q2;
-						q2.x = sampler.outputsVec4[i + 1].x;
-						q2.y = sampler.outputsVec4[i + 1].y;
-						q2.z = sampler.outputsVec4[i + 1].z;
-						q2.w = sampler.outputsVec4[i + 1].w;
-						channel.node->rotation = glm::normalize(glm::slerp(q1, q2, u));
-						break;
-					}
-					}
-					updated = true;
-				}
-			}
+		gatherChannel(sampler, channel, time, batch, laneCount);
+		lanes[laneCount++] = &channel;
+		if (laneCount == animationBatchSize) {
+			flush();
 		}
 	}
+	if (laneCount > 0) {
+		flush();
+	}
+
 	if (updated) {
-		for (auto &node : nodes) {
-			node->update();
-		}
+		updateTransforms();
 	}
 }
 
@@ -1568,26 +2148,3 @@ vkglTF::Node* vkglTF::Model::nodeFromIndex(uint32_t index) {
 	return nodeFound;
 }
 
-void vkglTF::Model::prepareNodeDescriptor(vkglTF::Node* node, VkDescriptorSetLayout descriptorSetLayout) {
-	if (node->mesh) {
-		VkDescriptorSetAllocateInfo descriptorSetAllocInfo{};
-		descriptorSetAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-		descriptorSetAllocInfo.descriptorPool = descriptorPool;
-		descriptorSetAllocInfo.pSetLayouts = &descriptorSetLayout;
-		descriptorSetAllocInfo.descriptorSetCount = 1;
-		VK_CHECK_RESULT(vkAllocateDescriptorSets(device->logicalDevice, &descriptorSetAllocInfo, &node->mesh->uniformBuffer.descriptorSet));
-
-		VkWriteDescriptorSet writeDescriptorSet{};
-		writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-		writeDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-		writeDescriptorSet.descriptorCount = 1;
-		writeDescriptorSet.dstSet = node->mesh->uniformBuffer.descriptorSet;
-		writeDescriptorSet.dstBinding = 0;
-		writeDescriptorSet.pBufferInfo = &node->mesh->uniformBuffer.descriptor;
-
-		vkUpdateDescriptorSets(device->logicalDevice, 1, &writeDescriptorSet, 0, nullptr);
-	}
-	for (auto& child : node->children) {
-		prepareNodeDescriptor(child, descriptorSetLayout);
-	}
-}
@@ -22,6 +22,10 @@
 
 #include "vulkan/vulkan.h"
 #include "VulkanDevice.h"
+#include "VulkanGeometryArena.hpp"
+#include "VulkanVertexLayout.hpp"
+#include "VulkanMeshOptimizer.hpp"
+#include "VulkanMeshSimplifier.hpp"
 
 #include <ktx.h>
 #include <ktxvulkan.h>
@@ -50,9 +54,14 @@ namespace vkglTF
 	};
 
 	extern VkDescriptorSetLayout descriptorSetLayoutImage;
-	extern VkDescriptorSetLayout descriptorSetLayoutUbo;
+	/** @brief Layout of the set with the transform and joint storage buffers of a model (see Model::bindTransforms) */
+	extern VkDescriptorSetLayout descriptorSetLayoutTransforms;
 	extern VkMemoryPropertyFlags memoryPropertyFlags;
 	extern uint32_t descriptorBindingFlags;
+	/** @brief Packed format of the vertex buffers created by loadFromFile, attributes missing from it are dropped */
+	extern vks::VertexFormat vertexFormat;
+	/** @brief If set, loadFromFile sub-allocates the vertex streams and indices of the models from this arena instead of a private one */
+	extern vks::GeometryArena* geometryArena;
 
 	struct Node;
 
@@ -110,8 +119,18 @@ namespace vkglTF
 		uint32_t indexCount;
 		uint32_t firstVertex;
 		uint32_t vertexCount;
+		uint32_t chunk = 0; // chunk of the geometry arena holding the vertices and indices
 		Material& material;
 
+		// Levels of detail, from the full mesh (lods[0], the range above) to the coarsest one
+		// All levels index the vertices of the primitive, their indices are stored after the ones of the full mesh
+		struct LOD {
+			uint32_t firstIndex;
+			uint32_t indexCount;
+			float error; // largest distance to the full mesh, in vertex units
+		};
+		std::vector<LOD> lods;
+
 		struct Dimensions {
 			glm::vec3 min = glm::vec3(FLT_MAX);
 			glm::vec3 max = glm::vec3(-FLT_MAX);
@@ -128,27 +147,30 @@ namespace vkglTF
 		glTF mesh
 	*/
 	struct Mesh {
-		vks::VulkanDevice* device;
-
+		// Primitives are owned by the model (Model::primitives), the mesh uses the range [firstPrimitive, firstPrimitive + primitiveCount)
 		std::vector<Primitive*> primitives;
+		uint32_t firstPrimitive = 0;
+		uint32_t primitiveCount = 0;
 		std::string name;
 
-		struct UniformBuffer {
-			VkBuffer buffer;
-			VkDeviceMemory memory;
-			VkDescriptorBufferInfo descriptor;
-			VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
-			void* mapped;
-		} uniformBuffer;
-
-		struct UniformBlock {
-			glm::mat4 matrix;
-			glm::mat4 jointMatrix[64]{};
-			float jointcount{ 0 };
-		} uniformBlock;
-
-		Mesh(vks::VulkanDevice* device, glm::mat4 matrix);
-		~Mesh();
+		// Entry of the mesh in the transform buffer of the model, the draws pass it as their first instance (gl_InstanceIndex)
+		uint32_t transformIndex = 0;
+		// Joint matrices of the skin of the node in the joint buffer of the model
+		uint32_t jointOffset = 0;
+		uint32_t jointCount = 0;
+	};
+
+	/*
+		Entry of the transform storage buffer (std430):
+		struct MeshTransform { mat4 matrix; uint jointOffset; uint jointCount; };
+		layout (set = N, binding = 0) readonly buffer Transforms { MeshTransform transforms[]; };
+		layout (set = N, binding = 1) readonly buffer Joints { mat4 jointMatrices[]; };
+	*/
+	struct MeshTransform {
+		glm::mat4 matrix;     // world matrix of the node
+		uint32_t jointOffset; // first matrix of the skin in the joint buffer
+		uint32_t jointCount;  // 0 if the mesh is not skinned
+		uint32_t padding[2];
 	};
 
 	/*
@@ -173,15 +195,40 @@ namespace vkglTF
 		Mesh* mesh;
 		Skin* skin;
 		int32_t skinIndex = -1;
+		int32_t flatIndex = -1;
 		glm::vec3 translation{};
 		glm::vec3 scale{ 1.0f };
 		glm::quat rotation{};
 		glm::mat4 localMatrix();
 		glm::mat4 getMatrix();
-		void update();
 		~Node();
 	};
 
+	/*
+		Flattened scene graph: nodes stored in parallel arrays in topological order (parents before
+		children), so world matrices are updated in a single linear pass, only for dirty nodes
+	*/
+	struct SceneGraph {
+		std::vector<Node*> nodes;             // node of each slot
+		std::vector<int32_t> parents;         // slot of the parent node, -1 for root nodes
+		std::vector<glm::vec3> translations;  // local translation
+		std::vector<glm::quat> rotations;     // local rotation
+		std::vector<glm::vec3> scales;        // local scale
+		std::vector<glm::mat4> matrices;      // static local matrix from the file (Node::matrix)
+		std::vector<uint8_t> hasMatrix;       // false if the static matrix is the identity
+		std::vector<glm::mat4> localMatrices; // T * R * S * matrix
+		std::vector<glm::mat4> worldMatrices; // parent world matrix * local matrix
+		std::vector<uint8_t> dirty;           // local TRS changed since the last update
+		std::vector<uint8_t> worldChanged;    // world matrix changed in the last update
+
+		uint32_t size() const { return static_cast<uint32_t>(nodes.size()); }
+		void setTranslation(uint32_t slot, const glm::vec3& translation) { translations[slot] = translation; dirty[slot] = 1; }
+		void setRotation(uint32_t slot, const glm::quat& rotation) { rotations[slot] = rotation; dirty[slot] = 1; }
+		void setScale(uint32_t slot, const glm::vec3& scale) { scales[slot] = scale; dirty[slot] = 1; }
+		/** @brief Recomputes the local matrices of dirty nodes and the world matrices of dirty nodes and their descendants */
+		void update();
+	};
+
 	/*
 		glTF animation channel
 	*/
@@ -190,6 +237,7 @@ namespace vkglTF
 		PathType path;
 		Node* node;
 		uint32_t samplerIndex;
+		uint32_t cursor = 0;  // keyframe interval found by the last evaluation, usually still the right one on the next frame
 	};
 
 	/*
@@ -200,6 +248,11 @@ namespace vkglTF
 		InterpolationType interpolation;
 		std::vector<float> inputs;
 		std::vector<glm::vec4> outputsVec4;
+		// Outputs in SoA layout (one array per component), built from outputsVec4 at load time
+		// Cubic spline samplers store three outputs per keyframe: in-tangent, value, out-tangent
+		std::vector<float> outputs[4];
+		/** @brief Returns the keyframe interval [i, i + 1] containing time (clamped), starting the search from the cached cursor */
+		uint32_t findKey(float time, uint32_t& cursor) const;
 	};
 
 	/*
@@ -214,9 +267,16 @@ namespace vkglTF
 	};
 
 	/*
-		glTF default vertex layout with easy Vulkan mapping functions
+		glTF vertex with all components at full precision, used while loading
+		The vertex buffers store it encoded with vkglTF::vertexFormat, split in two streams:
+		the positions alone (all depth-only passes need), and all other components
 	*/
-	enum class VertexComponent { Position, Normal, UV, Color, Tangent, Joint0, Weight0 };
+	using VertexComponent = vks::VertexSemantic;
+
+	enum VertexStream {
+		PositionStream = 0,  // vertex input binding of the positions
+		AttributeStream = 1  // vertex input binding of the other components
+	};
 
 	struct Vertex {
 		glm::vec3 pos;
@@ -226,14 +286,49 @@ namespace vkglTF
 		glm::vec4 joint0;
 		glm::vec4 weight0;
 		glm::vec4 tangent;
-		static VkVertexInputBindingDescription vertexInputBindingDescription;
+		static std::vector<VkVertexInputBindingDescription> vertexInputBindingDescriptions;
 		static std::vector<VkVertexInputAttributeDescription> vertexInputAttributeDescriptions;
 		static VkPipelineVertexInputStateCreateInfo pipelineVertexInputStateCreateInfo;
-		static VkVertexInputBindingDescription inputBindingDescription(uint32_t binding);
-		static VkVertexInputAttributeDescription inputAttributeDescription(uint32_t binding, uint32_t location, VertexComponent component);
-		static std::vector<VkVertexInputAttributeDescription> inputAttributeDescriptions(uint32_t binding, const std::vector<VertexComponent> components);
-		/** @brief Returns the default pipeline vertex input state create info structure for the requested vertex components */
+		/** @brief Format of one of the vertex streams (a part of vkglTF::vertexFormat) */
+		static vks::VertexFormat streamFormat(VertexStream stream);
+		static VkVertexInputBindingDescription inputBindingDescription(VertexStream stream);
+		/** @brief The binding of the attribute is the stream that contains the component */
+		static VkVertexInputAttributeDescription inputAttributeDescription(uint32_t location, VertexComponent component);
+		static std::vector<VkVertexInputAttributeDescription> inputAttributeDescriptions(const std::vector<VertexComponent> components);
+		/** @brief Returns the default pipeline vertex input state create info structure for the requested vertex components, only the streams they are in are bound */
 		static VkPipelineVertexInputStateCreateInfo* getPipelineVertexInputState(const std::vector<VertexComponent> components);
+		/** @brief Full precision format, matching the layout of this struct */
+		static vks::VertexFormat defaultFormat();
+		/** @brief Encodes the components present in format into dst */
+		void encode(const vks::VertexFormat& format, void* dst) const;
+	};
+
+	/*
+		glTF draw list: primitives bucketed by alpha mode, each bucket sorted by a 64 bit key
+		opaque and masked: pipeline (4) | geometry chunk (8) | material (20) | front-to-back depth (32)
+		blended:           back-to-front depth (32) | pipeline (4) | geometry chunk (8) | material (20)
+	*/
+	struct DrawList {
+		struct Item {
+			uint64_t key;
+			uint32_t primitiveIndex; // index into Model::linearPrimitives
+			uint32_t lod = 0;        // index into Primitive::lods
+		};
+		std::vector<Item> items;      // opaque items, then alpha masked items, then alpha blended items
+		uint32_t firstItem[3]{};      // first item of each bucket (indexed by Material::AlphaMode)
+		uint32_t itemCount[3]{};      // number of items in each bucket
+		uint64_t signature = 0;       // hash of the draw order and levels of detail, changes whenever they change
+		std::vector<Item> scratch;    // radix sort scratch buffer, kept to avoid allocations every frame
+	};
+
+	/*
+		LOD selection: the coarsest level whose error, projected at the distance of the primitive, stays below threshold pixels
+	*/
+	struct LODSelection {
+		glm::vec3 viewPosition;        // camera (or light) position in world space
+		float projectionScale;         // pixels per world unit at distance 1: viewport height / (2 tan(fovy / 2))
+		float threshold = 1.0f;        // largest accepted error in pixels
+		uint32_t bias = 0;             // levels added to the selected one (e.g. coarser levels for shadow maps)
 	};
 
 	enum FileLoadingFlags {
@@ -241,14 +336,18 @@ namespace vkglTF
 		PreTransformVertices = 0x00000001,
 		PreMultiplyVertexColors = 0x00000002,
 		FlipY = 0x00000004,
-		DontLoadImages = 0x00000008
+		DontLoadImages = 0x00000008,
+		OptimizeMeshes = 0x00000010, // reorder triangles and vertices for the vertex cache, overdraw and vertex fetch
+		GenerateLODs = 0x00000020    // simplify every primitive into a chain of up to maxLODs levels of detail
 	};
 
 	enum RenderFlags {
 		BindImages = 0x00000001,
 		RenderOpaqueNodes = 0x00000002,
 		RenderAlphaMaskedNodes = 0x00000004,
-		RenderAlphaBlendedNodes = 0x00000008
+		RenderAlphaBlendedNodes = 0x00000008,
+		PositionsOnly = 0x00000010, // bind the position stream only (depth-only passes)
+		PullVertices = 0x00000020   // bind the index buffer only, the vertex shader fetches the streams from storage buffers
 	};
 
 	/*
@@ -259,24 +358,50 @@ namespace vkglTF
 		vkglTF::Texture* getTexture(uint32_t index);
 		vkglTF::Texture emptyTexture;
 		void createEmptyTexture(VkQueue transferQueue);
+		void drawPrimitive(Primitive* primitive, uint32_t transformIndex, VkCommandBuffer commandBuffer, uint32_t renderFlags, VkPipelineLayout pipelineLayout, uint32_t bindImageSet, uint32_t& boundChunk);
+		void drawNode(Node* node, VkCommandBuffer commandBuffer, uint32_t renderFlags, VkPipelineLayout pipelineLayout, uint32_t bindImageSet, uint32_t& boundChunk);
+		void createTransformBuffers();
+		void bindVertexStreams(VkCommandBuffer commandBuffer, uint32_t renderFlags, uint32_t chunk) const;
+		void flattenSceneGraph();
+		void gatherNodes(Node* node, int32_t parentSlot);
+		glm::vec3 getDrawnPosition(const glm::mat4& matrix, glm::vec3 position) const;
+		glm::vec3 getPrimitiveCenter(uint32_t primitiveIndex);
+		void generateLODs(Primitive& primitive, std::vector<uint32_t>& indexBuffer, const std::vector<Vertex>& vertexBuffer);
+		uint32_t fileLoadingFlags = 0;
 	public:
 		vks::VulkanDevice* device;
 		VkDescriptorPool descriptorPool;
 
-		struct Vertices {
-			int count;
-			VkBuffer buffer;
-			VkDeviceMemory memory;
-		} vertices;
-		struct Indices {
-			int count;
-			VkBuffer buffer;
-			VkDeviceMemory memory;
-		} indices;
+		// Format of the vertex streams (copy of vkglTF::vertexFormat at load time): a tightly packed position stream
+		// and an attribute stream with all other vertex components
+		vks::VertexFormat vertexFormat;
+		// Number of vertices and indices (levels of detail included) of all primitives
+		uint32_t vertexCount = 0;
+		uint32_t indexCount = 0;
+		// Buffers the model was loaded into: vkglTF::geometryArena at load time if set, the private arena otherwise
+		// Each primitive has its own allocation, in the chunk and at the firstIndex / firstVertex of the primitive
+		// Indices are relative to the first vertex of their primitive, 16 bit in the private arena if all primitives have less than 65536 vertices
+		vks::GeometryArena* arena = nullptr;
+		vks::GeometryArena privateArena;
+		std::vector<vks::GeometryArena::Allocation> arenaAllocations;
+
+		// One MeshTransform per mesh and the joint matrices of all skinned meshes, in two persistently mapped storage
+		// buffers: the memory and descriptors used by the transforms do not depend on the number of meshes
+		vks::Buffer transforms;
+		vks::Buffer joints;
+		VkDescriptorSet transformsDescriptorSet = VK_NULL_HANDLE;
 
 		std::vector<Node*> nodes;
 		std::vector<Node*> linearNodes;
 
+		// Flattened scene graph and contiguous primitives (see flattenSceneGraph)
+		SceneGraph sceneGraph;
+		std::vector<Primitive> primitives;
+		std::vector<uint32_t> meshSlots;      // scene graph slots of the nodes with a mesh
+		// All primitives of the scene, in the same order as draw() renders them, and the node of each one
+		std::vector<Primitive*> linearPrimitives;
+		std::vector<Node*> linearPrimitiveNodes;
+
 		std::vector<Skin*> skins;
 
 		std::vector<Texture> textures;
@@ -297,20 +422,38 @@ namespace vkglTF
 
 		Model() {};
 		~Model();
-		void loadNode(vkglTF::Node* parent, const tinygltf::Node& node, uint32_t nodeIndex, const tinygltf::Model& model, std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer, float globalscale);
+		/** @brief Creates the node and its primitives, whose geometry is only read later (see loadFromFile) from the sources appended to primitiveSources */
+		void loadNode(vkglTF::Node* parent, const tinygltf::Node& node, uint32_t nodeIndex, const tinygltf::Model& model, std::vector<const tinygltf::Primitive*>& primitiveSources, float globalscale);
 		void loadSkins(tinygltf::Model& gltfModel);
 		void loadImages(tinygltf::Model& gltfModel, vks::VulkanDevice* device, VkQueue transferQueue);
 		void loadMaterials(tinygltf::Model& gltfModel);
 		void loadAnimations(tinygltf::Model& gltfModel);
 		void loadFromFile(std::string filename, vks::VulkanDevice* device, VkQueue transferQueue, uint32_t fileLoadingFlags = vkglTF::FileLoadingFlags::None, float scale = 1.0f);
-		void bindBuffers(VkCommandBuffer commandBuffer);
+		/** @brief Binds the index buffer and the vertex streams (only the positions with RenderFlags::PositionsOnly, none with RenderFlags::PullVertices) of the first geometry chunk */
+		void bindBuffers(VkCommandBuffer commandBuffer, uint32_t renderFlags = 0);
 		void drawNode(Node* node, VkCommandBuffer commandBuffer, uint32_t renderFlags = 0, VkPipelineLayout pipelineLayout = VK_NULL_HANDLE, uint32_t bindImageSet = 1);
 		void draw(VkCommandBuffer commandBuffer, uint32_t renderFlags = 0, VkPipelineLayout pipelineLayout = VK_NULL_HANDLE, uint32_t bindImageSet = 1);
+		/** @brief Draws the primitives [firstPrimitive, firstPrimitive + primitiveCount) of linearPrimitives, binding the buffers of their geometry chunks, safe to call from multiple threads */
+		void drawPrimitives(VkCommandBuffer commandBuffer, uint32_t firstPrimitive, uint32_t primitiveCount, uint32_t renderFlags = 0, VkPipelineLayout pipelineLayout = VK_NULL_HANDLE, uint32_t bindImageSet = 1);
+		/** @brief Maximum number of levels of detail per primitive (including the full mesh) built with FileLoadingFlags::GenerateLODs */
+		uint32_t maxLODs = 5;
+		/** @brief Fills the draw list with all primitives, bucketed by alpha mode and sorted by state, then by depth along the view matrix (state only if view is null)
+		  * The level of detail of each item is picked with lodSelection, the full meshes are drawn if it is null */
+		void buildDrawList(DrawList& drawList, const glm::mat4* view = nullptr, const LODSelection* lodSelection = nullptr);
+		/** @brief Level of detail of a primitive of linearPrimitives for the given selection */
+		uint32_t selectLOD(uint32_t primitiveIndex, const LODSelection& selection);
+		/** @brief Draws the items [firstItem, firstItem + itemCount) of a draw list, binding the buffers of a geometry chunk and material descriptor sets only when they change */
+		void drawList(VkCommandBuffer commandBuffer, const DrawList& drawList, uint32_t firstItem, uint32_t itemCount, uint32_t renderFlags = 0, VkPipelineLayout pipelineLayout = VK_NULL_HANDLE, uint32_t bindImageSet = 1);
+		/** @brief Axis aligned bounds of a primitive of linearPrimitives in the space it is drawn in (node transform and FlipY applied) */
+		void getPrimitiveBounds(uint32_t primitiveIndex, glm::vec3& min, glm::vec3& max);
 		void getNodeDimensions(Node* node, glm::vec3& min, glm::vec3& max);
 		void getSceneDimensions();
 		void updateAnimation(uint32_t index, float time);
+		/** @brief Updates the world matrices of the scene graph in one linear pass and uploads the changed mesh (and joint) matrices */
+		void updateTransforms();
+		/** @brief Binds the transform and joint buffers (descriptorSetLayoutTransforms) at the given set of the pipeline layout */
+		void bindTransforms(VkCommandBuffer commandBuffer, VkPipelineLayout pipelineLayout, uint32_t set);
 		Node* findNode(Node* parent, uint32_t index);
 		Node* nodeFromIndex(uint32_t index);
-		void prepareNodeDescriptor(vkglTF::Node* node, VkDescriptorSetLayout descriptorSetLayout);
 	};
 }
\ No newline at end of file
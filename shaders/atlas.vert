@@ -0,0 +1,48 @@
+#version 450
+
+// must match MAX_SHADOW_LIGHTS in shadow_mapping.cpp
+#define MAX_LIGHTS 32
+
+// spot lights of the shadow atlas, bound with a dynamic offset in the light ring
+struct ShadowLight {
+	mat4 viewProj;
+	vec4 tile;
+	vec4 position;
+	vec4 direction;
+	vec4 color;
+};
+layout (std430, binding = 4) readonly buffer Lights {
+	ShadowLight lights[MAX_LIGHTS];
+};
+
+// per-draw data: the light of the tile drawn (its viewport and scissor place it in the atlas)
+layout (push_constant) uniform PushConstants {
+	mat4 model;
+	uint light;
+} pc;
+
+#ifdef VERTEX_PULLING
+// position stream of the geometry arena (3 floats per vertex)
+layout (std430, binding = 2) readonly buffer Positions { float positions[]; };
+
+vec3 inPos;
+
+void fetchVertex() {
+	uint vertex = 3 * uint(gl_VertexIndex); // includes the vertexOffset of the draw
+	inPos = vec3(positions[vertex], positions[vertex + 1], positions[vertex + 2]);
+}
+#else
+layout (location = 0) in vec3 inPos;
+#endif
+
+out gl_PerVertex {
+  vec4 gl_Position;
+};
+
+
+void main() {
+#ifdef VERTEX_PULLING
+	fetchVertex();
+#endif
+	gl_Position = lights[pc.light].viewProj * pc.model * vec4(inPos, 1.0);
+}
@@ -7,8 +7,26 @@ fi
 
 mkdir -p "$outdir"
 
-for shader_file in *.vert *.frag; do
+for shader_file in *.vert *.frag *.comp; do
   output_file="$outdir/${shader_file}.spv"
   glslc "$shader_file" -o "$output_file"
   echo "Compiled $shader_file to $output_file"
 done
+
+# vertex pulling variants: the vertices are fetched from storage buffers by gl_VertexIndex
+for shader_file in tutorial.vert scene.vert depth.vert offscreen.vert atlas.vert; do
+  output_file="$outdir/${shader_file%.vert}_pull.vert.spv"
+  glslc -DVERTEX_PULLING "$shader_file" -o "$output_file"
+  echo "Compiled $shader_file (VERTEX_PULLING) to $output_file"
+done
+
+# moment shadow maps variant of the scene: filtered moments instead of depth comparisons
+glslc -DMOMENT_SHADOWS scene.frag -o "$outdir/scene_moments.frag.spv"
+echo "Compiled scene.frag (MOMENT_SHADOWS) to $outdir/scene_moments.frag.spv"
+
+# VK_EXT_mesh_shader needs SPIR-V 1.4 (Vulkan 1.2)
+for shader_file in *.task *.mesh; do
+  output_file="$outdir/${shader_file}.spv"
+  glslc --target-env=vulkan1.2 "$shader_file" -o "$output_file"
+  echo "Compiled $shader_file to $output_file"
+done
@@ -1,14 +1,22 @@
 #version 450
 
-layout (binding = 1) uniform sampler2D samplerColor;
+// must match MAX_SHADOW_LAYERS in shadow_mapping.cpp
+#define MAX_LAYERS 6
+
+layout (binding = 1) uniform sampler2DArray samplerColor;
 layout (binding = 0) uniform UBO {
 	mat4 projection;
 	mat4 view;
-	mat4 model;
-	mat4 lightSpace;
+	mat4 lightSpace[MAX_LAYERS];
+	vec4 cascadeSplits;
 	vec4 lightPos;
 	float zNear;
 	float zFar;
+	int cascadeCount;
+	int debugCascade;
+	int cubeShadows;
+	int shadowLightCount;
+	float shadowScale; // fraction of each layer rendered, from its corner (frame budget)
 } ubo;
 
 layout (location = 0) in vec2 inUV;
@@ -17,12 +25,16 @@ layout (location = 0) out vec4 outFragColor;
 
 
 void main() {
-	float depth = texture(samplerColor, inUV).r;
+	float depth = texture(samplerColor, vec3(inUV * ubo.shadowScale, ubo.debugCascade)).r;
 
-  float n = ubo.zNear;
-  float f = ubo.zFar;
-  float z = depth;
-  float linearDepth = (2.0 * n) / (f + n - z * (f - n));
+  // the cascades are orthographic, their depth is already linear (the point light has cascadeCount 1)
+  float linearDepth = depth;
+  if (ubo.cascadeCount == 1) {
+    float n = ubo.zNear;
+    float f = ubo.zFar;
+    float z = depth;
+    linearDepth = (2.0 * n) / (f + n - z * (f - n));
+  }
 
 	outFragColor = vec4(vec3(1.0-linearDepth), 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,41 @@
+#version 450
+
+// per-frame data, bound with a dynamic offset in the uniform ring (same block as scene.vert, only its matrices are read)
+layout (binding = 0) uniform UBO {
+	mat4 projection;
+	mat4 view;
+} ubo;
+
+// per-draw data
+layout (push_constant) uniform PushConstants {
+	mat4 model;
+} pc;
+
+#ifdef VERTEX_PULLING
+// position stream of the geometry arena (3 floats per vertex)
+layout (std430, binding = 2) readonly buffer Positions { float positions[]; };
+
+vec3 inPos;
+
+void fetchVertex() {
+	uint vertex = 3 * uint(gl_VertexIndex); // includes the vertexOffset of the draw
+	inPos = vec3(positions[vertex], positions[vertex + 1], positions[vertex + 2]);
+}
+#else
+layout (location = 0) in vec3 inPos;
+#endif
+
+// the scene pass tests its depth for EQUAL against this prepass: both compute it with the same operations
+out gl_PerVertex {
+	invariant vec4 gl_Position;
+};
+
+
+void main() {
+#ifdef VERTEX_PULLING
+	fetchVertex();
+#endif
+	vec4 pos = pc.model * vec4(inPos, 1.0);
+	vec4 viewPos = ubo.view * pos;
+	gl_Position = ubo.projection * viewPos;
+}
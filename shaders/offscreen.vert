@@ -1,10 +1,37 @@
 #version 450
 
+// all layers of the shadow map are rendered in a single multiview pass
+#extension GL_EXT_multiview : enable
+
+// must match MAX_SHADOW_LAYERS in shadow_mapping.cpp
+#define MAX_LAYERS 6
+// must match MAX_SHADOW_CASTER_MESHES in shadow_mapping.cpp
+#define MAX_CASTER_MESHES 1024
+
+// per-frame data, bound with a dynamic offset in the uniform ring
 layout (binding = 0) uniform UBO {
-	mat4 depthMVP;
+	mat4 depthVP[MAX_LAYERS];
+	uvec4 layerMasks[MAX_CASTER_MESHES / 4]; // per mesh, a bit per layer whose frustum it touches
 } ubo;
 
+// per-draw data
+layout (push_constant) uniform PushConstants {
+	mat4 model;
+} pc;
+
+#ifdef VERTEX_PULLING
+// position stream of the geometry arena (3 floats per vertex)
+layout (std430, binding = 2) readonly buffer Positions { float positions[]; };
+
+vec3 inPos;
+
+void fetchVertex() {
+	uint vertex = 3 * uint(gl_VertexIndex); // includes the vertexOffset of the draw
+	inPos = vec3(positions[vertex], positions[vertex + 1], positions[vertex + 2]);
+}
+#else
 layout (location = 0) in vec3 inPos;
+#endif
 
 out gl_PerVertex {
   vec4 gl_Position;   
@@ -12,5 +39,15 @@ out gl_PerVertex {
 
 
 void main() {
-	gl_Position =  ubo.depthMVP * vec4(inPos, 1.0);
+#ifdef VERTEX_PULLING
+	fetchVertex();
+#endif
+	// the draws pass their mesh as first instance, meshes outside the frustum of this layer are culled
+	uint mesh = uint(gl_InstanceIndex);
+	uint layerMask = mesh < MAX_CASTER_MESHES ? ubo.layerMasks[mesh / 4][mesh % 4] : ~0u;
+	if ((layerMask & (1u << gl_ViewIndex)) == 0u) {
+		gl_Position = vec4(0.0, 0.0, -2.0, 1.0);
+		return;
+	}
+	gl_Position =  ubo.depthVP[gl_ViewIndex] * pc.model * vec4(inPos, 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,14 @@
+#version 450
+
+// moments of the warped depth (EVSM, positive warp only), for the moment shadow maps of shadow_mapping.cpp
+// they are blurred and mipmapped, then filtered like any texture in scene.frag (MOMENT_SHADOWS)
+
+// warp of the depth, must match scene.frag (set from the same value in shadow_mapping.cpp)
+layout (constant_id = 0) const float EVSM_EXPONENT = 40.0;
+
+layout (location = 0) out vec2 outMoments;
+
+void main() {
+	float warped = exp(EVSM_EXPONENT * (2.0 * gl_FragCoord.z - 1.0));
+	outMoments = vec2(warped, warped * warped);
+}
@@ -1,37 +1,224 @@
 #version 450
 
-layout (binding = 1) uniform sampler2D shadowMap;
+// must match MAX_SHADOW_LAYERS in shadow_mapping.cpp
+#define MAX_LAYERS 6
+// must match MAX_SHADOW_LIGHTS in shadow_mapping.cpp
+#define MAX_LIGHTS 32
+
+layout (binding = 0) uniform UBO {
+	mat4 projection;
+	mat4 view;
+	mat4 lightSpace[MAX_LAYERS];
+	vec4 cascadeSplits;
+	vec4 lightPos;
+	float zNear;
+	float zFar;
+	int cascadeCount;
+	int debugCascade;
+	int cubeShadows;
+	int shadowLightCount;
+	float shadowScale; // fraction of each layer rendered, from its corner (frame budget)
+} ubo;
+
+// spot lights of the shadow atlas, each one with its matrix and tile (bound with a dynamic offset in the light ring)
+struct ShadowLight {
+	mat4 viewProj;
+	vec4 tile;      // offset and size in the atlas, a size of 0 for a light without shadows
+	vec4 position;  // range in w
+	vec4 direction; // cosine of the half angle of the cone in w
+	vec4 color;
+};
+layout (std430, binding = 4) readonly buffer Lights {
+	ShadowLight lights[MAX_LIGHTS];
+};
+
+// tiles of all spot lights, sampled with a LESS_OR_EQUAL comparison
+layout (binding = 5) uniform sampler2DShadow shadowAtlas;
+
+#ifdef MOMENT_SHADOWS
+// one layer per cascade (or cube face): moments of the warped depth, blurred and mipmapped (see offscreen_moments.frag)
+layout (binding = 1) uniform sampler2DArray shadowMap;
+
+// warp of the depth, must match offscreen_moments.frag (set from the same value in shadow_mapping.cpp)
+layout (constant_id = 1) const float EVSM_EXPONENT = 40.0;
+#else
+// one layer per cascade (or cube face), sampled with a LESS_OR_EQUAL comparison
+layout (binding = 1) uniform sampler2DArrayShadow shadowMap;
+
+// PCF kernel: PCF_RADIUS gathers per side, each one compares 2x2 texels (set from ShadowMapping::pcfRadius)
+// 0 takes a single comparison, bilinearly filtered by the sampler
+layout (constant_id = 0) const int PCF_RADIUS = 2;
+#endif
 
 layout (location = 0) in vec3 inNormal;
 layout (location = 1) in vec3 inColor;
 layout (location = 2) in vec3 inViewVec;
 layout (location = 3) in vec3 inLightVec;
-layout (location = 4) in vec4 inShadowCoord;
+layout (location = 4) in vec3 inWorldPos;
+layout (location = 5) in float inViewDepth;
 
 layout (location = 0) out vec4 outFragColor;
 
 // ambient light intensity
 #define ambient 0.1
 
-// samples the shadow map to determine if the fragment is in shadow
-float textureProj(vec4 shadowCoord) {
+// matrix to convert coordinates from [-1, 1] to [0, 1]
+// we need this because the shadow map is in [0, 1] range
+// but the shadow coord is in [-1, 1] range
+const mat4 biasMat = mat4( 
+	0.5, 0.0, 0.0, 0.0,
+	0.0, 0.5, 0.0, 0.0,
+	0.0, 0.0, 1.0, 0.0,
+	0.5, 0.5, 0.0, 1.0
+);
+
+#ifdef MOMENT_SHADOWS
+// fraction of the light reaching the fragment: Chebyshev upper bound of the filtered moments (a single trilinear
+// or anisotropic fetch), with the light bleeding of overlapping occluders cut off
+// the gradients are computed by the caller, in uniform control flow
+float filterMoments(vec3 shadowCoord, int cascade, vec2 dx, vec2 dy) {
+	vec2 moments = textureGrad(shadowMap, vec3(shadowCoord.st, cascade), dx, dy).rg;
+	float warped = exp(EVSM_EXPONENT * (2.0 * shadowCoord.z - 1.0));
+	if (warped <= moments.x) {
+		return 1.0;
+	}
+	// smallest variance of about 1e-4 depth units once warped, against the acne of flat receivers
+	float minDeviation = 1e-4 * 2.0 * EVSM_EXPONENT * warped;
+	float variance = max(moments.y - moments.x * moments.x, minDeviation * minDeviation);
+	float d = warped - moments.x;
+	float pMax = variance / (variance + d * d);
+	return clamp((pMax - 0.2) / 0.8, 0.0, 1.0);
+}
+#else
+// fraction of the light reaching the fragment: box filter of 2 PCF_RADIUS - 1 texels per side, bilinearly weighted,
+// so it reads the comparisons of 2 PCF_RADIUS texels per side
+float filterPCF(vec3 shadowCoord, int cascade) {
+	if (PCF_RADIUS == 0) {
+		return texture(shadowMap, vec4(shadowCoord.st, cascade, shadowCoord.z));
+	}
+
+	vec2 mapSize = vec2(textureSize(shadowMap, 0).xy);
+	vec2 p = shadowCoord.st * mapSize - 0.5;
+	vec2 base = floor(p);
+	vec2 f = p - base;
+
+	float lit = 0.0;
+	for (int j = 0; j < PCF_RADIUS; j++) {
+		for (int i = 0; i < PCF_RADIUS; i++) {
+			// corner between the 2x2 texels starting at base - PCF_RADIUS + 1 + 2 (i, j)
+			vec2 corner = base + vec2(2 * i, 2 * j) + float(2 - PCF_RADIUS);
+			vec4 c = textureGather(shadowMap, vec3(corner / mapSize, cascade), shadowCoord.z);
+			// only the outer rows and columns of the kernel are partially covered
+			vec2 w0 = vec2(i == 0 ? 1.0 - f.x : 1.0, j == 0 ? 1.0 - f.y : 1.0);
+			vec2 w1 = vec2(i == PCF_RADIUS - 1 ? f.x : 1.0, j == PCF_RADIUS - 1 ? f.y : 1.0);
+			// gathered texels: (x0, y1), (x1, y1), (x1, y0), (x0, y0)
+			lit += c.x * w0.x * w1.y + c.y * w1.x * w1.y + c.z * w1.x * w0.y + c.w * w0.x * w0.y;
+		}
+	}
+	float width = float(2 * PCF_RADIUS - 1);
+	return lit / (width * width);
+}
+#endif
+
+// samples a layer of the shadow map to determine how much the fragment is in shadow
+float textureProj(vec4 shadowCoord, int cascade, vec2 dx, vec2 dy) {
 	float shadow = 1.0;
 	if (shadowCoord.z > -1.0 && shadowCoord.z < 1.0) {
-		float dist = texture(shadowMap, shadowCoord.st).r;
-		if (shadowCoord.w > 0.0 && dist < shadowCoord.z) {
-			shadow = ambient;
-		}
+#ifdef MOMENT_SHADOWS
+		shadow = mix(ambient, 1.0, filterMoments(shadowCoord.xyz, cascade, dx, dy));
+#else
+		shadow = mix(ambient, 1.0, filterPCF(shadowCoord.xyz, cascade));
+#endif
 	}
 	return shadow;
 }
 
 
+// fraction of the light of a spot light reaching the fragment: 2x2 bilinear comparisons (3x3 texels),
+// kept inside the tile of the light so the neighbouring tiles never bleed in
+float filterAtlas(vec4 tile, vec3 shadowCoord) {
+	vec2 texel = 1.0 / vec2(textureSize(shadowAtlas, 0));
+	vec2 tileMin = tile.xy + texel;
+	vec2 tileMax = tile.xy + tile.zw - texel;
+	vec2 uv = tile.xy + shadowCoord.st * tile.zw;
+	float lit = 0.0;
+	for (int j = 0; j < 2; j++) {
+		for (int i = 0; i < 2; i++) {
+			vec2 tap = clamp(uv + (vec2(i, j) - 0.5) * texel, tileMin, tileMax);
+			lit += textureLod(shadowAtlas, vec3(tap, shadowCoord.z), 0.0);
+		}
+	}
+	return lit * 0.25;
+}
+
+// diffuse light of the spot lights of the shadow atlas
+vec3 spotLighting(vec3 N) {
+	vec3 lighting = vec3(0.0);
+	for (int i = 0; i < ubo.shadowLightCount; i++) {
+		vec3 toLight = lights[i].position.xyz - inWorldPos;
+		float dist = length(toLight);
+		vec3 L = toLight / dist;
+		float cosAngle = dot(-L, lights[i].direction.xyz);
+		float cone = smoothstep(lights[i].direction.w, mix(lights[i].direction.w, 1.0, 0.25), cosAngle);
+		float falloff = clamp(1.0 - dist / lights[i].position.w, 0.0, 1.0);
+		float intensity = max(dot(N, L), 0.0) * cone * falloff * falloff;
+		if (intensity > 0.0 && lights[i].tile.z > 0.0) {
+			vec4 shadowCoord = biasMat * lights[i].viewProj * vec4(inWorldPos, 1.0);
+			shadowCoord /= shadowCoord.w;
+			if (shadowCoord.z < 1.0) {
+				intensity *= filterAtlas(lights[i].tile, shadowCoord.xyz);
+			}
+		}
+		lighting += lights[i].color.rgb * intensity;
+	}
+	return lighting;
+}
+
+
 void main() {	
-	float shadow = textureProj(inShadowCoord / inShadowCoord.w);
+	// the first cascade whose slice of the camera frustum contains the fragment
+	int cascade = 0;
+	for (int i = 0; i < ubo.cascadeCount - 1; i++) {
+		if (inViewDepth > ubo.cascadeSplits[i]) {
+			cascade = i + 1;
+		}
+	}
+	// or the cube face of the point light, from the major axis of the direction to the fragment (+x, -x, +y, -y, +z, -z)
+	if (ubo.cubeShadows != 0) {
+		vec3 dir = inWorldPos - ubo.lightPos.xyz;
+		vec3 absDir = abs(dir);
+		if (absDir.x >= absDir.y && absDir.x >= absDir.z) {
+			cascade = dir.x > 0.0 ? 0 : 1;
+		} else if (absDir.y >= absDir.z) {
+			cascade = dir.y > 0.0 ? 2 : 3;
+		} else {
+			cascade = dir.z > 0.0 ? 4 : 5;
+		}
+	}
+
+	vec4 shadowCoord = biasMat * ubo.lightSpace[cascade] * vec4(inWorldPos, 1.0);
+	shadowCoord /= shadowCoord.w;
+	// to the corner of the layer rendered
+	shadowCoord.st *= ubo.shadowScale;
+#ifndef MOMENT_SHADOWS
+	// the PCF kernel stays out of the texels left over from larger renders
+	if (ubo.shadowScale < 1.0) {
+		vec2 texel = 1.0 / vec2(textureSize(shadowMap, 0).xy);
+		shadowCoord.st = min(shadowCoord.st, vec2(ubo.shadowScale) - float(PCF_RADIUS + 1) * texel);
+	}
+#endif
+	vec2 dx = dFdx(shadowCoord.st);
+	vec2 dy = dFdy(shadowCoord.st);
+
+	float shadow = 1.0;
+	// beyond the last cascade nothing is shadowed
+	if (ubo.cascadeCount == 1 || inViewDepth <= ubo.cascadeSplits[ubo.cascadeCount - 1]) {
+		shadow = textureProj(shadowCoord, cascade, dx, dy);
+	}
 
 	vec3 N = normalize(inNormal);
 	vec3 L = normalize(inLightVec);
 	vec3 diffuse = max(dot(N, L), ambient) * inColor;
 
-	outFragColor = vec4(diffuse * shadow, 1.0);
+	outFragColor = vec4(diffuse * shadow + spotLighting(N) * inColor, 1.0);
 }
@@ -1,42 +1,79 @@
 #version 450
 
+// must match MAX_SHADOW_LAYERS in shadow_mapping.cpp
+#define MAX_LAYERS 6
+
+// per-frame data, bound with a dynamic offset in the uniform ring
 layout (binding = 0) uniform UBO {
 	mat4 projection;
 	mat4 view;
-	mat4 model;
-	mat4 lightSpace;
-	vec4 lightPos;
+	mat4 lightSpace[MAX_LAYERS];
+	vec4 cascadeSplits;
+	vec4 lightPos; // w = 0 for a directional light
 } ubo;
 
+// per-draw data
+layout (push_constant) uniform PushConstants {
+	mat4 model;
+} pc;
+
+#ifdef VERTEX_PULLING
+// the two streams of the geometry arena (see SceneVertexLayout): 3 floats per position,
+// and 3 words per attribute vertex (half float UV, unorm8 color, snorm16 octahedral normal)
+layout (std430, binding = 2) readonly buffer Positions { float positions[]; };
+layout (std430, binding = 3) readonly buffer Attributes { uint attributes[]; };
+
+vec3 inPos;
+vec2 inUV;
+vec3 inColor;
+vec2 inNormal;
+
+void fetchVertex() {
+  uint vertex = uint(gl_VertexIndex); // includes the vertexOffset of the draw
+  inPos = vec3(positions[3 * vertex], positions[3 * vertex + 1], positions[3 * vertex + 2]);
+  inUV = unpackHalf2x16(attributes[3 * vertex]);
+  inColor = unpackUnorm4x8(attributes[3 * vertex + 1]).rgb;
+  inNormal = unpackSnorm2x16(attributes[3 * vertex + 2]);
+}
+#else
 layout (location = 0) in vec3 inPos;
-layout (location = 1) in vec2 inUV;
-layout (location = 2) in vec3 inColor;
-layout (location = 3) in vec3 inNormal;
+layout (location = 1) in vec2 inUV;     // R16G16_SFLOAT
+layout (location = 2) in vec3 inColor;  // R8G8B8A8_UNORM
+layout (location = 3) in vec2 inNormal; // R16G16_SNORM, octahedral encoded
+#endif
 
 layout (location = 0) out vec3 outNormal;
 layout (location = 1) out vec3 outColor;
 layout (location = 2) out vec3 outViewVec;
 layout (location = 3) out vec3 outLightVec;
-layout (location = 4) out vec4 outShadowCoord;
-
-// matrix to convert coordinates from [-1, 1] to [0, 1]
-// we need this because the shadow map is in [0, 1] range
-// but the shadow coord is in [-1, 1] range
-const mat4 biasMat = mat4( 
-	0.5, 0.0, 0.0, 0.0,
-	0.0, 0.5, 0.0, 0.0,
-	0.0, 0.0, 1.0, 0.0,
-	0.5, 0.5, 0.0, 1.0
-);
+layout (location = 4) out vec3 outWorldPos;  // projected in the light space of its cascade in scene.frag
+layout (location = 5) out float outViewDepth; // selects the cascade
+
+// the depth prepass (depth.vert) writes the depth tested for EQUAL, both compute it with the same operations
+invariant gl_Position;
+
+// unit vector from its octahedral encoding (see vks::octEncode)
+vec3 octDecode(vec2 e) {
+  vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+  if (n.z < 0.0) {
+    n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+  }
+  return normalize(n);
+}
 
 void main() {
-  vec4 pos = ubo.model * vec4(inPos, 1.0);
+#ifdef VERTEX_PULLING
+  fetchVertex();
+#endif
+  vec4 pos = pc.model * vec4(inPos, 1.0);
 
   outColor = inColor;
-  outNormal = mat3(ubo.model) * inNormal;
+  outNormal = mat3(pc.model) * octDecode(inNormal);
   outViewVec = -pos.xyz;
-  outLightVec = normalize(ubo.lightPos.xyz - inPos);
-  outShadowCoord = (biasMat * ubo.lightSpace * ubo.model) * vec4(inPos, 1.0);
-  gl_Position = ubo.projection * ubo.view * ubo.model * vec4(inPos.xyz, 1.0);
+  outLightVec = normalize(ubo.lightPos.xyz - inPos * ubo.lightPos.w);
+  outWorldPos = pos.xyz;
+  vec4 viewPos = ubo.view * pos;
+  outViewDepth = -viewPos.z;
+  gl_Position = ubo.projection * viewPos;
 }
 
@@ -1,21 +1,42 @@
 #version 450
 
+// per-frame data, bound with a dynamic offset in the uniform ring
 layout(set = 0, binding = 0) uniform UniformBufferObject {
-  mat4 model;
   mat4 view;
   mat4 proj;
 } ubo;
 
+// per-draw data (vk::PushConstants)
+layout(push_constant) uniform PushConstants {
+  mat4 model;
+} pc;
+
+#ifdef VERTEX_PULLING
+// vk::VertexLayout: position as 3 floats, texture coordinates as 2 half floats (4 words per vertex)
+layout(std430, set = 0, binding = 2) readonly buffer Vertices { uint vertices[]; };
+
+vec3 inPosition;
+vec2 inTexCoord;
+
+void fetchVertex() {
+  uint vertex = 4 * uint(gl_VertexIndex); // includes the vertexOffset of the draw
+  inPosition = uintBitsToFloat(uvec3(vertices[vertex], vertices[vertex + 1], vertices[vertex + 2]));
+  inTexCoord = unpackHalf2x16(vertices[vertex + 3]);
+}
+#else
 layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inColor;
-layout(location = 2) in vec2 inTexCoord;
+layout(location = 1) in vec2 inTexCoord; // R16G16_SFLOAT, see vk::VertexLayout
+#endif
 
 layout(location = 0) out vec3 fragColor;
 layout(location = 1) out vec2 fragTexCoord;
 
 
 void main() {
-  gl_Position = ubo.proj * ubo.view * ubo.model * vec4(inPosition, 1.0);
-  fragColor = inColor;
+#ifdef VERTEX_PULLING
+  fetchVertex();
+#endif
+  gl_Position = ubo.proj * ubo.view * pc.model * vec4(inPosition, 1.0);
+  fragColor = vec3(1.0);
   fragTexCoord = inTexCoord;
 }
@@ -11,6 +11,17 @@
 #include "vk/command.hpp"
 #include "vk/framebufferattachment.hpp"
 
+#include <base/VulkanUniformRing.hpp>
+
+// layers of the shadow map (cascades, or the faces of a cube), must match MAX_LAYERS in scene.vert, scene.frag, offscreen.vert and debug.frag
+constexpr uint32_t MAX_SHADOW_LAYERS = 6;
+// cascades of the directional light (their splits are a vec4)
+constexpr uint32_t MAX_SHADOW_CASCADES = 4;
+// meshes with a per layer cull mask, must match MAX_CASTER_MESHES in offscreen.vert (the others are drawn in all layers)
+constexpr uint32_t MAX_SHADOW_CASTER_MESHES = 1024;
+// shadowed spot lights sharing the shadow atlas, must match MAX_LIGHTS in scene.frag and atlas.vert
+constexpr uint32_t MAX_SHADOW_LIGHTS = 32;
+
 class ShadowMapping {
   public:
     /************************ constructor and destructor ************************/
@@ -27,16 +38,38 @@ class ShadowMapping {
 
     bool paused = false;             // flag to pause animations (movement still allowed)
     bool displayShadowMap = false;   // display the shadow map (debug)
-    uint32_t shadowMapize = 2048;    // size of the shadow map buffer
+    uint32_t shadowMapize = 2048;    // size of each layer of the shadow map
     uint32_t gpu_id = 0;             // change gpu here
-    float zNear = 1.0f;              // near plane for the shadow map
-    float zFar = 96.0f;              // far plane for the shadow map
-    float lightFOV = 45.0f;          // field of view for the light source
+    float zNear = 1.0f;              // closest near plane of the point light
+    float zFar = 96.0f;              // farthest far plane of the point light
+    float lightFOV = 45.0f;          // widest field of view of the spot light
+    bool useCascades = false;        // directional light with cascades (-c)
+    bool allowCubeShadows = true;    // cube shadows when the scene leaves the spot cone
+    uint32_t cascadeCount = 3;       // number of cascades (2 to MAX_SHADOW_CASCADES)
+    float cascadeSplitLambda = 0.95f;// 0 for uniform splits, 1 for logarithmic splits
+    float shadowDistance = 96.0f;    // view depth covered by the shadows
     uint32_t width = 800;            // surface window width
     uint32_t height = 600;           // surface window height
     float timerSpeed = 0.20f;        // multiplier to control the speed of animations
     glm::vec3 lightPos = glm::vec3();// light position
     VkClearColorValue bgColor = {0.01f, 0.01f, 0.21f, 1.0f}; // background color
+    bool useSecondaryCommandBuffers = true; // record the passes in parallel
+    uint32_t drawChunks = 4;         // secondary command buffers per pass
+    bool useVertexPulling = false;   // fetch the vertices from storage buffers
+    uint32_t pcfRadius = 2;          // PCF kernel radius, in 2x2 gathers (0 for bilinear)
+    bool useMomentShadows = false;   // filtered EVSM moments instead of PCF
+    uint32_t momentBlurRadius = 2;   // blur radius of the moments, in texels
+    bool cacheShadowMap = true;      // redraw only what changed in the shadow map
+    uint32_t spotLightCount = 0;     // shadowed spot lights (up to MAX_SHADOW_LIGHTS, -s)
+    uint32_t shadowAtlasSize = 4096; // size of the shadow atlas of the spot lights
+    bool useDepthPrepass = false;    // depth-only prepass, then shading with an EQUAL depth test
+    bool autoDepthPrepass = true;    // switch the prepass on while it pays off
+    bool printStats = false;         // print the frame stats every few seconds (-p)
+    bool useDepthReduction = true;   // fit the shadows to the depths the camera sees
+    bool useFrameBudget = true;      // scale the resolutions down to hold targetFrameMs
+    float targetFrameMs = 16.6f;     // GPU time budget of a frame
+    float minShadowScale = 0.25f;    // smallest fraction of shadowMapize rendered
+    float minRenderScale = 0.5f;     // smallest scale of the scene resolution
 
     // depth bias used to avoid shadowing artifacts
     float depthBiasConstant = 1.25f; // constant factor (always applied)
@@ -44,16 +77,64 @@ class ShadowMapping {
     // float depthBiasConstant = 0.0f; // constant factor (always applied)
     // float depthBiasSlope = 0.0f;    // slope factor (applied depending on polygon's slope)
 
+    // GPU measures of the last frames (averaged), from queries around the scene pass
+    struct FrameStats {
+      bool depthPrepass = false;     // the depth prepass is on
+      float prepassMs = 0.0f;        // GPU time of the depth prepass
+      float shadingMs = 0.0f;        // GPU time of the scene pass
+      float overdraw = 0.0f;         // fragments shaded without the prepass per fragment with it
+      float breakEvenOverdraw = 0.0f;// overdraw above which the prepass pays off
+      float frameMs = 0.0f;          // GPU time of the whole frame
+      float shadowScale = 1.0f;      // fraction of each layer of the shadow map rendered (frame budget)
+      float renderScale = 1.0f;      // scene resolution over the window resolution (frame budget)
+    };
+    const FrameStats& getStats() const { return stats; }
+
 
     /************************ private state ************************/
   private:
     GLFWwindow* window;                 // window handle
     Camera camera;                      // camera handle
-    std::vector<vkglTF::Model> scenes;  // scenes
+    std::vector<vkglTF::Model> scenes;  // scenes, all loaded into the geometry arena
+    struct PrimitiveBounds {
+      glm::vec3 min, max;               // as drawn (node transforms and FlipY applied), before the pushed model matrix
+      glm::vec3 center;
+      float radius;
+      glm::mat4 world;                  // world matrix of the node the bounds were computed with
+    };
+    std::vector<PrimitiveBounds> primitiveBounds; // one per primitive of linearPrimitives of the first scene
+    vks::GeometryArena geometryArena;   // vertex and index buffers shared by all scenes, bound once per pass
+    uint32_t arenaVertexCapacity = 1 << 20; // vertices per chunk of the arena, chunks are added as the scenes need them
+    uint32_t arenaIndexCapacity = 1 << 22;  // indices per chunk, levels of detail included
+    vkglTF::DrawList sceneDrawList;     // draw list of the scene pass, sorted front-to-back every frame
+    vkglTF::DrawList shadowDrawList;    // draw list of the offscreen pass, sorted by state only, LODs picked from the light
+    float lodThreshold = 1.0f;          // largest screen space error of the levels of detail, in pixels
+    uint32_t shadowLodBias = 1;         // the shadow map uses coarser levels of detail than the scene
     bool swap_chain_ready = false;      // flag to indicate if the swap chain is ready to acquire frames
     uint32_t currentBuffer = 0;         // index of the current swap chain buffer
+    uint32_t currentFrame = 0;          // index of the current frame in flight
+    uint32_t debugCascade = 0;          // layer of the shadow map shown with displayShadowMap
     float timer = 0.0f;                 // frame rate independent timer, clamped from [0, 1]
 
+    // frustum of the point light, fitted every frame to the part of the scene seen by the camera
+    struct LightFrustum {
+      glm::vec3 direction = glm::vec3(0.0f, 1.0f, 0.0f); // axis of the spot light, towards the center of the scene
+      glm::vec2 center = glm::vec2(0.0f); // center of the spot frustum on the plane at distance 1 (off the axis)
+      float halfSize = 0.41421f;        // half width of the spot frustum on that plane, tan(fov / 2)
+      float zNear = 1.0f;
+      float zFar = 96.0f;
+    } lightFrustum;
+
+    // shadowed spot light, drawn in its own tile of the shadow atlas
+    struct SpotLight {
+      glm::vec3 position;
+      glm::vec3 direction;
+      glm::vec3 color;
+      float fov;                        // angle of the cone, in degrees
+      float range;                      // distance where the light fades out, far plane of its shadow
+    };
+    std::vector<SpotLight> spotLights;
+
     // constants
     struct {
       std::string sceneVert = "build/scene.vert.spv";
@@ -61,9 +142,28 @@ class ShadowMapping {
       std::string debugVert = "build/debug.vert.spv";
       std::string debugFrag = "build/debug.frag.spv";
       std::string offscVert = "build/offscreen.vert.spv";
+      std::string atlasVert = "build/atlas.vert.spv";
+      std::string depthVert = "build/depth.vert.spv";
+      std::string sceneVertPull = "build/scene_pull.vert.spv";    // VERTEX_PULLING variants
+      std::string offscVertPull = "build/offscreen_pull.vert.spv";
+      std::string atlasVertPull = "build/atlas_pull.vert.spv";
+      std::string depthVertPull = "build/depth_pull.vert.spv";
+      std::string sceneFragMoments = "build/scene_moments.frag.spv"; // MOMENT_SHADOWS variant
+      std::string offscFragMoments = "build/offscreen_moments.frag.spv";
+      std::string blurMomentsComp = "build/blur_moments.comp.spv";
+      std::string reduceDepthComp = "build/reduce_depth.comp.spv";
       std::string model = "models/samplescene.gltf";
     } paths;
 
+    // packed vertex of the scene: full precision positions, half float UVs, unorm8 colors and
+    // octahedral normals (decoded in scene.vert)
+    using SceneVertexLayout = vks::VertexLayout<
+      vks::VertexAttribute<vkglTF::VertexComponent::Position, vks::VertexEncoding::Float3>,
+      vks::VertexAttribute<vkglTF::VertexComponent::UV,       vks::VertexEncoding::Half2>,
+      vks::VertexAttribute<vkglTF::VertexComponent::Color,    vks::VertexEncoding::Unorm8x4>,
+      vks::VertexAttribute<vkglTF::VertexComponent::Normal,   vks::VertexEncoding::Oct16>
+    >;
+
     // input (WASD or right click to translate, left click to rotate)
     struct Input {
       struct {
@@ -85,76 +185,296 @@ class ShadowMapping {
     VkCommandPool commandPool;          // pointer to vulkanDevice->commandPool. A pool for submitting command buffers
     VkQueue queue;                      // graphics queue
     VulkanSwapChainGLFW swapChain;      // wrapper for swap chain
-    VkSemaphore semaphPresentComplete;  // semaphore for swap chain image presentation
-    VkSemaphore semaphRenderComplete;   // semaphore for command buffer submission and execution
-
-    std::vector<VkCommandBuffer> drawCmdBuffers; // command buffers (one per swap chain image)
-    std::vector<VkFence> waitFences;             // wait fences     (one per swap chain image)
     std::vector<VkShaderModule> shaderModules;   // shader modules  (one per shader)
 
-    // information about a queue submit operation
-    struct {
-      VkSubmitInfo info;
-      VkPipelineStageFlags stageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    } submit;
+    // state baked into the secondary command buffers of the offscreen pass
+    struct OffscreenPassInputs {
+      float depthBiasConstant;
+      float depthBiasSlope;
+      uint64_t drawOrder;     // signature of the draw list (levels of detail follow the light)
+      uint32_t uniformOffset; // dynamic offset of the uniform data in the ring
+      uint32_t lightsOffset;  // dynamic offset of the spot lights in their ring
+      glm::mat4 model;        // pushed model matrix
+      VkRect2D renderArea;    // scissor of the region rendered
+      uint32_t layers;        // layers rendered (render pass and pipeline)
+      bool operator!=(const OffscreenPassInputs& o) const {
+        return depthBiasConstant != o.depthBiasConstant || depthBiasSlope != o.depthBiasSlope || drawOrder != o.drawOrder || layers != o.layers ||
+               uniformOffset != o.uniformOffset || lightsOffset != o.lightsOffset || model != o.model ||
+               renderArea.offset.x != o.renderArea.offset.x || renderArea.offset.y != o.renderArea.offset.y ||
+               renderArea.extent.width != o.renderArea.extent.width || renderArea.extent.height != o.renderArea.extent.height;
+      }
+    };
+
+    // what the shadow map holds: the light and depth bias it was rendered with, and the state of each caster
+    struct ShadowCaster {
+      glm::mat4 transform;    // pushed model matrix
+      glm::mat4 world;        // world matrix of its node
+      PrimitiveBounds bounds; // bounds it was drawn with, the texels it covers in the shadow map
+      uint32_t lod;           // level of detail drawn
+    };
+    struct ShadowCache {
+      bool valid = false;     // the shadow map holds a complete render
+      uint32_t layers = 0;
+      uint32_t renderSize = 0;
+      glm::mat4 depthVP[MAX_SHADOW_LAYERS];
+      float depthBiasConstant;
+      float depthBiasSlope;
+      std::vector<ShadowCaster> casters; // one per primitive of linearPrimitives
+    } shadowCache;
+
+    // state baked into the secondary command buffers of the scene pass
+    struct ScenePassInputs {
+      uint32_t width, height;
+      bool displayShadowMap;
+      bool depthPrepass;      // the scene pass tests for EQUAL against the depth of the prepass
+      uint64_t drawOrder;     // signature of the draw list order
+      uint32_t uniformOffset; // dynamic offset of the uniform data in the ring
+      uint32_t lightsOffset;  // dynamic offset of the spot lights in their ring
+      glm::mat4 model;        // pushed model matrix
+      bool operator!=(const ScenePassInputs& o) const {
+        return width != o.width || height != o.height || displayShadowMap != o.displayShadowMap || depthPrepass != o.depthPrepass ||
+               drawOrder != o.drawOrder || uniformOffset != o.uniformOffset || lightsOffset != o.lightsOffset || model != o.model;
+      }
+    };
+
+    // resources of a frame in flight: the CPU records frame N+1 while the GPU still renders frame N
+    struct FrameResources {
+      VkCommandPool commandPool;                   // transient pool of the primary command buffer, reset every frame
+      VkCommandBuffer cmdBuffer;                   // primary command buffer, rerecorded every frame
+      VkFence fence;                               // signaled when the GPU has finished this frame
+      VkSemaphore presentComplete;                 // swap chain image acquired
+      VkSemaphore renderComplete;                  // command buffer executed, image ready to present
+      vk::ThreadCommandPools offscreenSecondaries; // cached secondary command buffers of the offscreen pass
+      vk::ThreadCommandPools sceneSecondaries;     // cached secondary command buffers of the scene pass
+      vk::ThreadCommandPools prepassSecondaries;   // cached secondary command buffers of the depth prepass
+      std::optional<OffscreenPassInputs> offscreenInputs; // inputs the offscreen secondaries were recorded with
+      std::optional<ScenePassInputs> sceneInputs;         // inputs the scene secondaries were recorded with
+      std::optional<ScenePassInputs> prepassInputs;       // inputs the prepass secondaries were recorded with
+      VkQueryPool timestampQueries = VK_NULL_HANDLE;  // timestamps of the frame and around the scene pass (FrameQuery)
+      VkQueryPool statisticsQueries = VK_NULL_HANDLE; // fragment shader invocations of the scene pass
+      bool queriesPending = false;                 // the queries were recorded, their results are read when the frame slot is reused
+      bool queriesPrepass = false;                 // the queries measured the scene with the depth prepass
+      uint32_t depthBoundsOffset;                  // offset of the bounds reduced from the scene depth in their ring
+      bool depthBoundsPending = false;             // the depth was reduced, the bounds are read when the frame slot is reused
+    };
+    std::array<FrameResources, MAX_FRAMES_IN_FLIGHT> frames;
+
+    // timestamps written at the start and end of a frame, and around the scene pass
+    enum FrameQuery { FrameBegin, PrepassBegin, SceneBegin, SceneEnd, FrameEnd, FrameQueryCount };
+    struct GpuQueries {
+      bool timestamps;        // the graphics queue writes timestamps
+      bool statistics;        // pipelineStatisticsQuery is enabled, fragment shader invocations are counted
+      float timestampPeriod;  // nanoseconds per timestamp tick
+      uint64_t timestampMask; // valid bits of the timestamps
+    } gpuQueries{};
+
+    // cost of the scene pass measured without [0] and with [1] the depth prepass, the mode not in use is probed now and then
+    struct DepthPrepassControl {
+      struct Sample {
+        bool valid = false;
+        float prepassMs = 0.0f;
+        float shadingMs = 0.0f;
+        float fragments = 0.0f;       // fragment shader invocations of the scene pass
+      } samples[2];
+      uint32_t probeInterval = 600;   // frames between two probes
+      uint32_t probeLength = 8;       // frames measured in the other mode (plus the frames in flight)
+      uint32_t countdown = 60;        // frames until the next probe
+      uint32_t probeFrames = 0;       // frames left in the current probe
+      bool choice = false;            // mode in use before the probe
+    } prepassControl;
+    FrameStats stats;
+    float statsTimer = 0.0f;          // seconds since the stats were printed
+
+    // frame budget controller (useFrameBudget): scales of the shadow map and scene resolutions, from the GPU frame time
+    struct FrameBudget {
+      float frameMs = 0.0f;           // GPU frame time, averaged over the last few frames
+      float shadowScale = 1.0f;       // multiple of 1/scaleSteps (or minShadowScale)
+      float renderScale = 1.0f;       // multiple of 1/scaleSteps (or minRenderScale)
+      float scaleSteps = 32.0f;
+      uint32_t cooldown = 0;          // frames until the last change of scale is measured (the frames in flight still used the previous ones)
+    } frameBudget;
 
     // render pass of main scene
     struct ScenePass {
       std::vector<VkFramebuffer> frameBuffers;    // frame buffers for the scene rendering (one per swap chain image)
       vk::FrameBufferAttachment depth;            // depth attachments
+      VkImageView depthSampled;                   // depth aspect alone, read by the depth reduction
+      bool upscale = false;                       // render to the color image, at the render scale, then blit it to the swap chain image
+      vk::FrameBufferAttachment color;            // scene color at the window resolution, rendered in its corner (upscale)
+      uint32_t renderWidth, renderHeight;         // region rendered: the window resolution at the render scale
       VkFormat depthFormat;
-      vks::Buffer uniformBuffer;                  // uniform buffer for the scene rendering
+      uint32_t uniformOffset;                     // offset of UniformDataScene in the ring for the current frame
       VkRenderPass renderPass;
+      VkRenderPass renderPassLoadDepth;           // keeps the depth of the prepass (compatible with renderPass)
+      VkRenderPass prepassRenderPass;             // depth only
+      VkFramebuffer prepassFrameBuffer;           // the depth attachment alone
+      bool prepass;                               // the depth prepass runs this frame
     } scenePass{};
 
     // offscreen pass for shadow map rendering
     struct OffscreenPass {
       uint32_t width, height;                     // fixed size equal to shadowMapize
+      uint32_t layers;                            // layers rendered this frame: cascades, cube faces or the spot light
+      uint32_t imageLayers;                       // layers of the images: one per cascade, or six when the point light may need a cube
+      uint32_t renderSize;                        // texels rendered in the corner of each layer (frame budget), at most width
+      bool cube;                                  // the point light renders the six faces of a cube
       VkFramebuffer frameBuffer;                  // only one because we render to the whole image
-      vk::FrameBufferAttachment depth;            // depth attachment (shadow map)
+      vk::FrameBufferAttachment depth;            // layered depth attachment (shadow map), all layers rendered at once with multiview
       VkFormat depthFormat = VK_FORMAT_D16_UNORM; // 16 bits is enough for the shadow map
-      VkSampler depthSampler;                     // we use this sampler in the fragment shader of the scene
-      vks::Buffer uniformBuffer;                  // uniform buffer for the shadow map rendering
+      VkSampler depthSampler;                     // raw depth, for the shadow map visualization
+      VkSampler shadowSampler;                    // hardware depth comparison, we use this sampler in the fragment shader of the scene
+      bool render;                                // false while the cached shadow map is still valid
+      VkRect2D renderArea;                        // region rendered this frame: the whole map, or the tiles around changed casters
+      VkRenderPass renderPassUpdate;              // keeps the contents outside of the render area (partial updates)
+
+      // moment shadow maps (useMomentShadows): moments of the warped depth, filtered instead of compared
+      vk::FrameBufferAttachment moments;          // layered moments with a mip chain, the view covers all levels (sampled by the scene)
+      VkImageView momentsTarget;                  // first level of the moments, rendered and blurred
+      vk::FrameBufferAttachment momentsBlur;      // intermediate image of the separable blur (first level only)
+      VkFormat momentsFormat = VK_FORMAT_R32G32_SFLOAT;
+      uint32_t momentsMipLevels;
+      float momentsExponent = 40.0f;              // EVSM warp exp(c (2 depth - 1)), exp(2c) must fit in a 32 bit float
+      VkSampler momentsSampler;                   // trilinear (and anisotropic) filtering of the moments
+      uint32_t uniformOffset;                     // offset of UniformDataOffscreen in the ring for the current frame
       VkRenderPass renderPass;
+
+      // the frames the point light fits in a spot frustum only render the first layer of a cube capable shadow map,
+      // with a single view (multiview render passes, and the framebuffers and pipelines using them, differ by their view mask)
+      VkRenderPass spotRenderPass;
+      VkRenderPass spotRenderPassUpdate;
+      VkFramebuffer spotFrameBuffer;
     } offscreenPass{};
 
+    // shadow atlas of the spot lights: a single depth image split in square tiles, one per light seen by the camera,
+    // all rendered in one pass (the tiles only differ by their viewport, scissor and casters)
+    struct ShadowAtlas {
+      uint32_t size;                              // width and height, shadowAtlasSize rounded down to a power of two
+      uint32_t minTileSize = 128;                 // tile of the lights covering only a few pixels of the screen
+      VkFramebuffer frameBuffer;
+      vk::FrameBufferAttachment depth;
+      VkFormat depthFormat = VK_FORMAT_D16_UNORM;
+      VkSampler sampler;                          // hardware depth comparison (scene.frag)
+      VkRenderPass renderPass;
+      struct Tile {
+        uint32_t light;                           // index of the light in the storage buffer (pushed to atlas.vert)
+        VkRect2D rect;                            // viewport and scissor
+        uint32_t firstItem;                       // casters in the frustum of the light, a range of drawList
+        uint32_t itemCount;
+      };
+      std::vector<Tile> tiles;                    // tiles packed this frame, largest first
+      vkglTF::DrawList drawList;                  // casters of all tiles, picked from the items of shadowDrawList
+      uint32_t lightsOffset;                      // offset of the spot lights in their ring for the current frame
+    } shadowAtlas{};
+
     // uniform buffer data for the offscreen shadow map rendering (offscreen.vert)
     struct UniformDataOffscreen {
-      glm::mat4 depthMVP;
+      glm::mat4 depthVP[MAX_SHADOW_LAYERS]; // view projection matrix of each layer from light's point of view (gl_ViewIndex)
+      glm::uvec4 layerMasks[MAX_SHADOW_CASTER_MESHES / 4]; // per mesh (gl_InstanceIndex): bit set for each layer whose frustum it touches
     } uniformDataOffscreen;
 
     // uniform buffer data for the scene rendering or shadow map visualization (scene.frag & debug.frag)
     struct UniformDataScene {
-      // variables for scene rendering (scene.frag)
+      // variables for scene rendering (scene.vert & scene.frag)
       glm::mat4 projection;    // projection matrix
       glm::mat4 view;          // view matrix
-      glm::mat4 model;         // model matrix
-      glm::mat4 lightSpace;    // MVP matrix from light's point of view
-      glm::vec4 lightPos;      // light position in view space
+      glm::mat4 lightSpace[MAX_SHADOW_LAYERS]; // view projection matrix of each layer from light's point of view
+      glm::vec4 cascadeSplits; // view depth where each cascade ends
+      glm::vec4 lightPos;      // light position, or direction towards the light (w = 0) with cascades
 
       // variables for shadow map visualization (debug.frag)
       float zNear;             // near plane for the shadow map
       float zFar;              //  far plane for the shadow map
+      int32_t cascadeCount;    // number of cascades, 1 for the point light (perspective, its depth is not linear)
+      int32_t debugCascade;    // layer shown
+      int32_t cubeShadows;     // the layers are the faces of a cube around the point light (perspective)
+
+      // spot lights of the shadow atlas (scene.frag)
+      int32_t shadowLightCount; // lights in the storage buffer
+
+      float shadowScale;       // fraction of the layers of the shadow map rendered, the shadow coordinates are scaled by it
     } uniformDataScene;
 
+    // storage buffer data of a spot light of the shadow atlas (atlas.vert & scene.frag)
+    struct ShadowLight {
+      glm::mat4 viewProj;      // view projection matrix from the light's point of view
+      glm::vec4 tile;          // offset (xy) and size (zw) of its tile in atlas coordinates, a size of 0 when unshadowed
+      glm::vec4 position;      // position, range in w
+      glm::vec4 direction;     // direction of the cone, cosine of its half angle in w
+      glm::vec4 color;
+    };
+    std::array<ShadowLight, MAX_SHADOW_LIGHTS> shadowLights;
+
+    // per-frame uniform data of both passes, sub-allocated at aligned offsets and bound with dynamic offsets
+    vks::UniformRing uniformRing;
+    // per-frame storage data of the spot lights, bound with a dynamic offset as well
+    vks::UniformRing lightRing;
+
+    // per-draw data, pushed in the command buffers of both passes (scene.vert & offscreen.vert)
+    struct PushConstants {
+      glm::mat4 model;         // model matrix
+      uint32_t shadowLight;    // spot light of the atlas tile drawn (atlas.vert)
+    } pushConstants;
+
     // pipelines for each render
     struct Pipelines {
       VkPipeline offscreen;    // pipeline for the offscreen rendering (create the shadow map)
+      VkPipeline offscreenSpot;// same, first layer alone (point light in a spot frustum, cube capable shadow map)
+      VkPipeline shadowAtlas;  // pipeline for the tiles of the shadow atlas
       VkPipeline sceneShadow;  // pipeline for the scene rendering (uses the shadow map)
+      VkPipeline sceneShadowEqual; // same, after the depth prepass: EQUAL depth test, no depth writes
+      VkPipeline depthPrepass; // pipeline for the depth prepass (vertex shader only)
       VkPipeline debug;        // pipeline for the shadow map visualization (debug)
-      VkPipelineLayout layout; // common uniform layout for all pipelines
+      VkPipelineLayout layout; // common uniform layout and push constant range for all pipelines
       VkPipelineCache cache;   // common cache for the pipelines
     } pipelines;
 
-    // descriptor sets for each render
+    // descriptor sets for each render (shared by all frames, the uniform data of a frame is selected by its dynamic offset)
     struct Descriptors {
-      VkDescriptorSet offscreen;    // descriptor set for the offscreen rendering
-      VkDescriptorSet scene;        // descriptor set for the scene rendering
-      VkDescriptorSet debug;        // descriptor set for the shadow map visualization
+      VkDescriptorSet offscreen; // descriptor set for the offscreen rendering
+      VkDescriptorSet scene;     // descriptor set for the scene rendering
+      VkDescriptorSet debug;     // descriptor set for the shadow map visualization
       VkDescriptorSetLayout layout; // common layout for all descriptor sets
       VkDescriptorPool pool;        // common pool for submitting descriptor sets (uniform buffers)
     } descriptors;
 
+    // separable blur of the moments (useMomentShadows), one compute dispatch per direction
+    struct MomentBlur {
+      VkDescriptorSetLayout descriptorLayout;
+      VkDescriptorPool pool;
+      VkDescriptorSet horizontal;  // moments to the blur image
+      VkDescriptorSet vertical;    // blur image back to the moments
+      VkPipelineLayout layout;     // direction of the pass as a push constant
+      VkPipeline pipeline;
+    } momentBlur{};
+
+    // reduction of the scene depth (useDepthReduction) in compute, after the scene pass: bounds of the visible samples
+    struct DepthBounds {
+      uint32_t minValues[4];       // view depth, world x, y, z, as order preserving integers (see reduce_depth.comp)
+      uint32_t maxValues[4];
+    };
+    struct DepthReductionConstants {
+      glm::mat4 invViewProj;       // NDC to world space
+      glm::vec2 depthParams;       // projection[2][2] and [3][2]: view depth of a depth buffer value
+      glm::ivec2 renderSize;       // region of the depth rendered (render scale)
+    };
+    struct DepthReduction {
+      VkDescriptorSetLayout descriptorLayout;
+      VkDescriptorPool pool;
+      VkDescriptorSet descriptorSet;
+      VkPipelineLayout layout;     // DepthReductionConstants as push constants
+      VkPipeline pipeline;
+      VkSampler sampler;           // texelFetch only
+      vks::UniformRing ring;       // per-frame bounds, reset by the CPU, written by the GPU and read back a few frames later
+      uint32_t offset;             // offset of the bounds in the ring for the current frame
+    } depthReduction{};
+
+    // bounds of the samples seen by the camera, from the last depth reduction read back
+    struct VisibleBounds {
+      bool valid = false;          // the camera saw some of the scene
+      float minDepth, maxDepth;    // view depth
+      glm::vec3 min, max;          // world space
+    } visibleBounds;
+
 
 
 
@@ -167,19 +487,33 @@ class ShadowMapping {
       vk::getPhysicalDevice(instance, gpu_id, physicalDevice);
       createDevice(); // init vulkanDevice, device and commandPool
 
+      // the shadows of the point light depend on the extent of the scene
+      vkGetDeviceQueue(device, vulkanDevice->queueFamilyIndices.graphics, 0, &queue);
+      loadModel();
+
       // offscreen pass setup (without presentation)
       setupOffscreenDepthAttachment();
+      if (useMomentShadows) {
+        setupOffscreenMomentsAttachment();
+      }
       setupOffscreenRenderPass();
       setupOffscreenFrameBuffer();
+      if (offscreenPass.imageLayers == 6) {
+        initOffscreenLayouts();
+      }
 
-      // presentation setup (graphics queue, load model, swap chain, surface, sync objects)
-      vkGetDeviceQueue(device, vulkanDevice->queueFamilyIndices.graphics, 0, &queue);
-      loadModel();
+      // shadow atlas of the spot lights
+      setupSpotLights();
+      setupShadowAtlas();
+
+      // presentation setup (swap chain, surface, sync objects)
       createSwapChain(); // also inits surface
-      createSemaphores();
-      createFences();
+      createFrameResources();
 
       // scene pass setup
+      if (scenePass.upscale) {
+        setupSceneColorAttachment();
+      }
       setupSceneDepthAttachment();
       setupSceneRenderPass();
       setupSceneFrameBuffers();
@@ -188,7 +522,13 @@ class ShadowMapping {
       setupUniformBuffers();
       setupDescriptorSets();
       setupPipelines();
-      setupCommandBuffers();
+      if (useMomentShadows) {
+        setupMomentBlur();
+      }
+      if (useDepthReduction) {
+        setupDepthReduction();
+      }
+      updateRenderScales();
 
       swap_chain_ready = true;
     }
@@ -214,6 +554,13 @@ class ShadowMapping {
         if (timer > 1.0)
           timer -= 1.0f;
       }
+
+      // print the GPU stats every few seconds
+      statsTimer += frameDuration;
+      if (printStats && statsTimer > 2.0f) {
+        statsTimer = 0.0f;
+        printFrameStats();
+      }
     }
 
 
@@ -230,8 +577,23 @@ class ShadowMapping {
         keys[key] = false;
         if (key == GLFW_KEY_SPACE) {
           me->paused = !me->paused;
+        } else if (key == GLFW_KEY_M) {
+          me->displayShadowMap = !me->displayShadowMap;
+        } else if (key == GLFW_KEY_C) {
+          me->debugCascade = (me->debugCascade + 1) % me->offscreenPass.layers;
+        } else if (key == GLFW_KEY_P) {
+          // manual control of the depth prepass
+          me->autoDepthPrepass = false;
+          me->useDepthPrepass = !me->useDepthPrepass;
         }
       }
+      // arrows tweak the depth bias (up/down: constant factor, right/left: slope factor)
+      if (action != GLFW_RELEASE) {
+        if (key == GLFW_KEY_UP)    me->depthBiasConstant += 0.25f;
+        if (key == GLFW_KEY_DOWN)  me->depthBiasConstant = std::max(0.0f, me->depthBiasConstant - 0.25f);
+        if (key == GLFW_KEY_RIGHT) me->depthBiasSlope += 0.25f;
+        if (key == GLFW_KEY_LEFT)  me->depthBiasSlope = std::max(0.0f, me->depthBiasSlope - 0.25f);
+      }
       me->camera.keys.up = keys[GLFW_KEY_W];
       me->camera.keys.down = keys[GLFW_KEY_S];
       me->camera.keys.left = keys[GLFW_KEY_A];
@@ -275,16 +637,80 @@ class ShadowMapping {
     void createDevice() {
       VkPhysicalDeviceFeatures enabledFeatures{};
       std::vector<const char*> enabledDeviceExtensions = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
+      // multiview renders all layers of the shadow map in a single pass (core and required since Vulkan 1.1)
+      VkPhysicalDeviceMultiviewFeatures multiviewFeatures{};
+      multiviewFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MULTIVIEW_FEATURES;
+      multiviewFeatures.multiview = VK_TRUE;
       vulkanDevice = new vks::VulkanDevice(physicalDevice);
-      VK_CHECK_RESULT(vulkanDevice->createLogicalDevice(enabledFeatures, enabledDeviceExtensions, nullptr));
+      if (useMomentShadows) {
+        // the moments are rendered, blurred through storage images, mipmapped with blits and filtered
+        const VkFormatFeatureFlags momentsFeatures = VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT | VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT |
+          VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT | VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT;
+        VkFormatProperties formatProperties;
+        vkGetPhysicalDeviceFormatProperties(physicalDevice, offscreenPass.momentsFormat, &formatProperties);
+        if ((formatProperties.optimalTilingFeatures & momentsFeatures) != momentsFeatures || !vulkanDevice->features.shaderStorageImageExtendedFormats) {
+          std::cout << "The device cannot blur and filter R32G32 moments, moment shadow maps disabled" << std::endl;
+          useMomentShadows = false;
+        } else {
+          enabledFeatures.shaderStorageImageExtendedFormats = VK_TRUE;
+          enabledFeatures.samplerAnisotropy = vulkanDevice->features.samplerAnisotropy;
+        }
+      }
+      // the fragment shader invocations of the scene pass measure its overdraw (depth prepass),
+      // its secondary command buffers are executed while the query is active
+      if (vulkanDevice->features.pipelineStatisticsQuery && (vulkanDevice->features.inheritedQueries || !useSecondaryCommandBuffers)) {
+        enabledFeatures.pipelineStatisticsQuery = VK_TRUE;
+        enabledFeatures.inheritedQueries = vulkanDevice->features.inheritedQueries;
+      }
+      VK_CHECK_RESULT(vulkanDevice->createLogicalDevice(enabledFeatures, enabledDeviceExtensions, &multiviewFeatures));
       device = vulkanDevice->logicalDevice;
       commandPool = vulkanDevice->commandPool;
+
+      const uint32_t timestampBits = vulkanDevice->queueFamilyProperties[vulkanDevice->queueFamilyIndices.graphics].timestampValidBits;
+      gpuQueries.timestamps = timestampBits > 0;
+      gpuQueries.statistics = gpuQueries.timestamps && enabledFeatures.pipelineStatisticsQuery;
+      gpuQueries.timestampPeriod = vulkanDevice->properties.limits.timestampPeriod;
+      gpuQueries.timestampMask = timestampBits >= 64 ? ~0ull : (1ull << timestampBits) - 1;
+      if (!gpuQueries.statistics) {
+        std::cout << "The device cannot count fragment shader invocations, the depth prepass is not switched automatically" << std::endl;
+      }
     }
 
     void loadModel() {
-      const uint32_t glTFLoadingFlags = vkglTF::FileLoadingFlags::PreTransformVertices | vkglTF::FileLoadingFlags::PreMultiplyVertexColors | vkglTF::FileLoadingFlags::FlipY;
+      const uint32_t glTFLoadingFlags = vkglTF::FileLoadingFlags::PreTransformVertices | vkglTF::FileLoadingFlags::PreMultiplyVertexColors | vkglTF::FileLoadingFlags::FlipY |
+                                        vkglTF::FileLoadingFlags::OptimizeMeshes | vkglTF::FileLoadingFlags::GenerateLODs;
+      // only the components read by the shaders are kept, quantized: 24 bytes per vertex instead of 96
+      vkglTF::vertexFormat = SceneVertexLayout::format();
+      static_assert(SceneVertexLayout::offset<vkglTF::VertexComponent::UV>() == 12 && SceneVertexLayout::offset<vkglTF::VertexComponent::Color>() == 16 &&
+                    SceneVertexLayout::offset<vkglTF::VertexComponent::Normal>() == 20 && SceneVertexLayout::stride == 24,
+                    "scene_pull.vert expects 12 bytes of positions, then a UV, color and normal word in the attribute stream");
+      // 16 bit indices: the scene primitives have less than 65536 vertices each
+      // the streams are also storage buffers, read by the vertex shaders with vertex pulling
+      geometryArena.create(device, physicalDevice,
+        {vkglTF::Vertex::streamFormat(vkglTF::VertexStream::PositionStream).stride, vkglTF::Vertex::streamFormat(vkglTF::VertexStream::AttributeStream).stride},
+        arenaVertexCapacity, arenaIndexCapacity, VK_INDEX_TYPE_UINT16, vkglTF::memoryPropertyFlags | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+      vkglTF::geometryArena = &geometryArena;
       scenes.resize(1);
       scenes[0].loadFromFile(paths.model, vulkanDevice, queue, glTFLoadingFlags);
+      // bounds of the primitives as drawn, for the culling and fitting of the shadows
+      primitiveBounds.resize(scenes[0].linearPrimitives.size());
+      for (uint32_t i = 0; i < primitiveBounds.size(); i++) {
+        updatePrimitiveBounds(i);
+      }
+      // the pulling shaders read the streams of a single chunk (see setupDescriptorSets)
+      if (useVertexPulling && geometryArena.chunkCount() > 1) {
+        std::cout << "The scene spans " << geometryArena.chunkCount() << " geometry chunks, vertex pulling disabled" << std::endl;
+        useVertexPulling = false;
+      }
+    }
+
+    // bounds of a primitive at the current world matrix of its node
+    void updatePrimitiveBounds(uint32_t primitiveIndex) {
+      PrimitiveBounds& bounds = primitiveBounds[primitiveIndex];
+      bounds.world = scenes[0].sceneGraph.worldMatrices[scenes[0].linearPrimitiveNodes[primitiveIndex]->flatIndex];
+      scenes[0].getPrimitiveBounds(primitiveIndex, bounds.min, bounds.max);
+      bounds.center = (bounds.min + bounds.max) * 0.5f;
+      bounds.radius = glm::distance(bounds.min, bounds.max) * 0.5f;
     }
 
     // Swap chain and surface
@@ -292,39 +718,89 @@ class ShadowMapping {
       swapChain.setContext(instance, physicalDevice, device);
       swapChain.initSurface(window);
       swapChain.create(&width, &height);
+
+      // the frame budget lowers the scene resolution by rendering to a color image, blitted to the swap chain images
+      if (useFrameBudget) {
+        VkFormatProperties formatProperties;
+        vkGetPhysicalDeviceFormatProperties(physicalDevice, swapChain.colorFormat, &formatProperties);
+        const VkFormatFeatureFlags blitFeatures =
+          VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+        scenePass.upscale = (formatProperties.optimalTilingFeatures & blitFeatures) == blitFeatures &&
+                            (swapChain.imageUsage & VK_IMAGE_USAGE_TRANSFER_DST_BIT);
+        if (!scenePass.upscale) {
+          std::cout << "The swap chain images cannot be blitted to, the scene is always rendered at full resolution" << std::endl;
+        }
+      }
     }
 
-    // Semaphores (they stay the same during application time)
-    void createSemaphores() {
+    // Per-frame command pools, command buffers, sync objects and cached secondary command buffers
+    // (they stay the same during application time, also across swap chain recreations)
+    void createFrameResources() {
+      const uint32_t threadCount = vk::getRecordingThreadCount();
       VkSemaphoreCreateInfo semaphoreCreateInfo = vks::initializers::semaphoreCreateInfo();
-      VK_CHECK_RESULT(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &semaphPresentComplete));
-      VK_CHECK_RESULT(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &semaphRenderComplete));
-      submit.info = vks::initializers::submitInfo();
-      submit.info.pWaitDstStageMask = &submit.stageMask;
-      submit.info.waitSemaphoreCount = 1;
-      submit.info.pWaitSemaphores = &semaphPresentComplete;
-      submit.info.signalSemaphoreCount = 1;
-      submit.info.pSignalSemaphores = &semaphRenderComplete;
-      submit.info.commandBufferCount = 1;
-    }
-
-    // Wait fences (one for each command buffer)
-    void createFences() {
       VkFenceCreateInfo fenceCreateInfo = vks::initializers::fenceCreateInfo(VK_FENCE_CREATE_SIGNALED_BIT);
-      waitFences.resize(swapChain.imageCount);
-      for (auto& fence : waitFences) {
-        VK_CHECK_RESULT(vkCreateFence(device, &fenceCreateInfo, nullptr, &fence));
+      for (auto& frame : frames) {
+        vk::createCommandPool(device, vulkanDevice->queueFamilyIndices.graphics, frame.commandPool, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+        VkCommandBufferAllocateInfo cmdBufAllocateInfo = vks::initializers::commandBufferAllocateInfo(frame.commandPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1);
+        VK_CHECK_RESULT(vkAllocateCommandBuffers(device, &cmdBufAllocateInfo, &frame.cmdBuffer));
+        VK_CHECK_RESULT(vkCreateFence(device, &fenceCreateInfo, nullptr, &frame.fence));
+        VK_CHECK_RESULT(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &frame.presentComplete));
+        VK_CHECK_RESULT(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &frame.renderComplete));
+        vk::createThreadCommandPools(device, vulkanDevice->queueFamilyIndices.graphics, threadCount, drawChunks, frame.offscreenSecondaries);
+        vk::createThreadCommandPools(device, vulkanDevice->queueFamilyIndices.graphics, threadCount, drawChunks, frame.sceneSecondaries);
+        vk::createThreadCommandPools(device, vulkanDevice->queueFamilyIndices.graphics, threadCount, drawChunks, frame.prepassSecondaries);
+
+        // GPU time and fragments of the scene pass, read back when this frame slot is used again
+        VkQueryPoolCreateInfo queryPoolCI{};
+        queryPoolCI.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        if (gpuQueries.timestamps) {
+          queryPoolCI.queryType = VK_QUERY_TYPE_TIMESTAMP;
+          queryPoolCI.queryCount = FrameQueryCount;
+          VK_CHECK_RESULT(vkCreateQueryPool(device, &queryPoolCI, nullptr, &frame.timestampQueries));
+        }
+        if (gpuQueries.statistics) {
+          queryPoolCI.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+          queryPoolCI.queryCount = 1;
+          queryPoolCI.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+          VK_CHECK_RESULT(vkCreateQueryPool(device, &queryPoolCI, nullptr, &frame.statisticsQueries));
+        }
       }
     }
 
+    // Color target of the scene when it is upscaled: sized for the window, the render scale only uses its corner
+    void setupSceneColorAttachment() {
+      VkImageCreateInfo imageCI = vks::initializers::imageCreateInfo(swapChain.colorFormat, {width, height, 1});
+      imageCI.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+      VK_CHECK_RESULT(vkCreateImage(device, &imageCI, nullptr, &scenePass.color.image));
+      VkMemoryRequirements memReqs{};
+      vkGetImageMemoryRequirements(device, scenePass.color.image, &memReqs);
+
+      VkMemoryAllocateInfo memAllloc{};
+      memAllloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+      memAllloc.allocationSize = memReqs.size;
+      memAllloc.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+      VK_CHECK_RESULT(vkAllocateMemory(device, &memAllloc, nullptr, &scenePass.color.mem));
+      VK_CHECK_RESULT(vkBindImageMemory(device, scenePass.color.image, scenePass.color.mem, 0));
+
+      VkImageViewCreateInfo imageViewCI = vks::initializers::imageViewCreateInfo(scenePass.color.image, swapChain.colorFormat);
+      VK_CHECK_RESULT(vkCreateImageView(device, &imageViewCI, nullptr, &scenePass.color.view));
+    }
+
     void setupSceneDepthAttachment() {
       // init depth format
       if (!scenePass.depthFormat) {
         vks::tools::getSupportedDepthFormat(physicalDevice, &scenePass.depthFormat);
+        VkFormatProperties formatProperties;
+        vkGetPhysicalDeviceFormatProperties(physicalDevice, scenePass.depthFormat, &formatProperties);
+        if (useDepthReduction && !(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT)) {
+          std::cout << "The scene depth format cannot be sampled, depth reduction disabled" << std::endl;
+          useDepthReduction = false;
+        }
       }
 
       VkImageCreateInfo imageCI = vks::initializers::imageCreateInfo(scenePass.depthFormat, {width, height, 1});
-      imageCI.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+      // the depth reduction reads it after the scene pass
+      imageCI.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | (useDepthReduction ? VK_IMAGE_USAGE_SAMPLED_BIT : 0);
       VK_CHECK_RESULT(vkCreateImage(device, &imageCI, nullptr, &scenePass.depth.image));
       VkMemoryRequirements memReqs{};
       vkGetImageMemoryRequirements(device, scenePass.depth.image, &memReqs);
@@ -342,6 +818,12 @@ class ShadowMapping {
         imageViewCI.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
       }
       VK_CHECK_RESULT(vkCreateImageView(device, &imageViewCI, nullptr, &scenePass.depth.view));
+
+      // a sampled view has a single aspect
+      if (useDepthReduction) {
+        imageViewCI.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+        VK_CHECK_RESULT(vkCreateImageView(device, &imageViewCI, nullptr, &scenePass.depthSampled));
+      }
     }
 
     void setupSceneRenderPass() {
@@ -354,7 +836,8 @@ class ShadowMapping {
       attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
       attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
       attachments[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-      attachments[0].finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+      // the color image is blitted to the swap chain image after the pass
+      attachments[0].finalLayout = scenePass.upscale ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
       VkAttachmentReference colorReference = {};
       colorReference.attachment = 0;
       colorReference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
@@ -386,17 +869,19 @@ class ShadowMapping {
       // Subpass dependencies for layout transitions
       std::array<VkSubpassDependency, 2> dependencies;
 
+      // the depth is overwritten once the depth reduction of the previous frame is done reading it
       dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
       dependencies[0].dstSubpass = 0;
-      dependencies[0].srcStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+      dependencies[0].srcStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
       dependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
       dependencies[0].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
       dependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT;
       dependencies[0].dependencyFlags = 0;
 
+      // the color image is overwritten once the blit of the previous frame is done reading it
       dependencies[1].srcSubpass = VK_SUBPASS_EXTERNAL;
       dependencies[1].dstSubpass = 0;
-      dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+      dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | (scenePass.upscale ? VK_PIPELINE_STAGE_TRANSFER_BIT : 0);
       dependencies[1].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
       dependencies[1].srcAccessMask = 0;
       dependencies[1].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_READ_BIT;
@@ -410,6 +895,33 @@ class ShadowMapping {
       renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());
       renderPassInfo.pDependencies = dependencies.data();
       VK_CHECK_RESULT(vkCreateRenderPass(device, &renderPassInfo, nullptr, &scenePass.renderPass));
+
+      // Same pass after the depth prepass: its depth is loaded instead of cleared
+      attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+      attachments[1].initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+      VK_CHECK_RESULT(vkCreateRenderPass(device, &renderPassInfo, nullptr, &scenePass.renderPassLoadDepth));
+
+      // Depth prepass: the depth attachment alone, cleared and stored for the scene pass
+      attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+      attachments[1].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      VkAttachmentReference prepassDepthReference = {0, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
+      VkSubpassDescription prepassSubpass = {};
+      prepassSubpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+      prepassSubpass.pDepthStencilAttachment = &prepassDepthReference;
+
+      // the depth written by the prepass is tested by the scene pass
+      dependencies[1].srcSubpass = 0;
+      dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+      dependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+      dependencies[1].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+      dependencies[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+      dependencies[1].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT;
+      dependencies[1].dependencyFlags = 0;
+
+      renderPassInfo.attachmentCount = 1;
+      renderPassInfo.pAttachments = &attachments[1];
+      renderPassInfo.pSubpasses = &prepassSubpass;
+      VK_CHECK_RESULT(vkCreateRenderPass(device, &renderPassInfo, nullptr, &scenePass.prepassRenderPass));
     }
 
     void setupSceneFrameBuffers() {
@@ -422,19 +934,30 @@ class ShadowMapping {
       fbufCreateInfo.attachmentCount = 2;
       fbufCreateInfo.pAttachments = attachments;
 
-      // Create frame buffers for every swap chain image
+      // Create frame buffers for every swap chain image (all on the color image when it is upscaled)
       scenePass.frameBuffers.resize(swapChain.imageCount);
       for (uint32_t i = 0; i < scenePass.frameBuffers.size(); i++) {
-        attachments[0] = swapChain.buffers[i].view;
+        attachments[0] = scenePass.upscale ? scenePass.color.view : swapChain.buffers[i].view;
         VK_CHECK_RESULT(vkCreateFramebuffer(device, &fbufCreateInfo, nullptr, &scenePass.frameBuffers[i]));
       }
+
+      // the depth prepass only renders to the depth attachment
+      VkFramebufferCreateInfo prepassCreateInfo = vks::initializers::framebufferCreateInfo(scenePass.prepassRenderPass, width, height);
+      prepassCreateInfo.attachmentCount = 1;
+      prepassCreateInfo.pAttachments = &scenePass.depth.view;
+      VK_CHECK_RESULT(vkCreateFramebuffer(device, &prepassCreateInfo, nullptr, &scenePass.prepassFrameBuffer));
     }
 
     void setupOffscreenDepthAttachment() {
       offscreenPass.width = offscreenPass.height = shadowMapize;
+      // the point light picks between the cube and a spot frustum every frame (fitLightFrustum)
+      offscreenPass.cube = !useCascades && pointLightMayNeedCube();
+      offscreenPass.imageLayers = useCascades ? std::clamp(cascadeCount, 2u, MAX_SHADOW_CASCADES) : (offscreenPass.cube ? 6 : 1);
+      offscreenPass.layers = offscreenPass.imageLayers;
 
-      // depth attachment for shadow mapping
+      // depth attachment for shadow mapping, one layer per cascade
       VkImageCreateInfo imageCI = vks::initializers::imageCreateInfo(offscreenPass.depthFormat, {offscreenPass.width, offscreenPass.height, 1});
+      imageCI.arrayLayers = offscreenPass.imageLayers;
       // we will sample directly from the depth attachment
       imageCI.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
       VK_CHECK_RESULT(vkCreateImage(device, &imageCI, nullptr, &offscreenPass.depth.image));
@@ -447,11 +970,13 @@ class ShadowMapping {
       VK_CHECK_RESULT(vkAllocateMemory(device, &memAlloc, nullptr, &offscreenPass.depth.mem));
       VK_CHECK_RESULT(vkBindImageMemory(device, offscreenPass.depth.image, offscreenPass.depth.mem, 0));
 
+      // the same array view is the multiview attachment and the sampled image
       VkImageViewCreateInfo depthStencilView = vks::initializers::imageViewCreateInfo(offscreenPass.depth.image, offscreenPass.depthFormat);
+      depthStencilView.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+      depthStencilView.subresourceRange.layerCount = offscreenPass.imageLayers;
       VK_CHECK_RESULT(vkCreateImageView(device, &depthStencilView, nullptr, &offscreenPass.depth.view));
 
-      // Create sampler to sample from to depth attachment
-      // Used to sample in the fragment shader for shadowed rendering
+      // Create samplers to sample from to depth attachment
       VkFilter shadowmap_filter = vks::tools::formatIsFilterable(physicalDevice, offscreenPass.depthFormat, VK_IMAGE_TILING_OPTIMAL) ? VK_FILTER_LINEAR : VK_FILTER_NEAREST;
       VkSamplerCreateInfo sampler = vks::initializers::samplerCreateInfo();
       sampler.magFilter = shadowmap_filter;
@@ -466,6 +991,66 @@ class ShadowMapping {
       sampler.maxLod = 1.0f;
       sampler.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
       VK_CHECK_RESULT(vkCreateSampler(device, &sampler, nullptr, &offscreenPass.depthSampler));
+
+      // Used in the fragment shader for shadowed rendering: the texels are compared with the depth of the fragment
+      // (passes when it is closer to the light or at the same depth), textureGather returns four comparisons at once
+      sampler.compareEnable = VK_TRUE;
+      sampler.compareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+      VK_CHECK_RESULT(vkCreateSampler(device, &sampler, nullptr, &offscreenPass.shadowSampler));
+    }
+
+    // Setup the moments of the moment shadow maps: a layered color target with a mip chain, and the intermediate image of its blur
+    void setupOffscreenMomentsAttachment() {
+      offscreenPass.momentsMipLevels = static_cast<uint32_t>(std::floor(std::log2(offscreenPass.width))) + 1;
+
+      auto createImage = [&](vk::FrameBufferAttachment& attachment, uint32_t mipLevels, VkImageUsageFlags usage) {
+        VkImageCreateInfo imageCI = vks::initializers::imageCreateInfo(offscreenPass.momentsFormat, {offscreenPass.width, offscreenPass.height, 1});
+        imageCI.mipLevels = mipLevels;
+        imageCI.arrayLayers = offscreenPass.imageLayers;
+        imageCI.usage = usage;
+        VK_CHECK_RESULT(vkCreateImage(device, &imageCI, nullptr, &attachment.image));
+
+        VkMemoryAllocateInfo memAlloc = vks::initializers::memoryAllocateInfo();
+        VkMemoryRequirements memReqs;
+        vkGetImageMemoryRequirements(device, attachment.image, &memReqs);
+        memAlloc.allocationSize = memReqs.size;
+        memAlloc.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        VK_CHECK_RESULT(vkAllocateMemory(device, &memAlloc, nullptr, &attachment.mem));
+        VK_CHECK_RESULT(vkBindImageMemory(device, attachment.image, attachment.mem, 0));
+
+        VkImageViewCreateInfo viewCI = vks::initializers::imageViewCreateInfo(attachment.image, offscreenPass.momentsFormat);
+        viewCI.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+        viewCI.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        viewCI.subresourceRange.levelCount = mipLevels;
+        viewCI.subresourceRange.layerCount = offscreenPass.imageLayers;
+        VK_CHECK_RESULT(vkCreateImageView(device, &viewCI, nullptr, &attachment.view));
+      };
+
+      // the first level is rendered, read and written by the blur, and the source of the mip chain blits
+      createImage(offscreenPass.moments, offscreenPass.momentsMipLevels,
+        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
+        VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT);
+      createImage(offscreenPass.momentsBlur, 1, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
+
+      VkImageViewCreateInfo targetCI = vks::initializers::imageViewCreateInfo(offscreenPass.moments.image, offscreenPass.momentsFormat);
+      targetCI.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+      targetCI.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      targetCI.subresourceRange.layerCount = offscreenPass.imageLayers;
+      VK_CHECK_RESULT(vkCreateImageView(device, &targetCI, nullptr, &offscreenPass.momentsTarget));
+
+      // moments are averaged like any texture: trilinear, and anisotropic if the device supports it
+      VkSamplerCreateInfo sampler = vks::initializers::samplerCreateInfo();
+      sampler.magFilter = VK_FILTER_LINEAR;
+      sampler.minFilter = VK_FILTER_LINEAR;
+      sampler.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+      sampler.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+      sampler.addressModeV = sampler.addressModeU;
+      sampler.addressModeW = sampler.addressModeU;
+      sampler.anisotropyEnable = vulkanDevice->enabledFeatures.samplerAnisotropy;
+      sampler.maxAnisotropy = sampler.anisotropyEnable ? std::min(8.0f, vulkanDevice->properties.limits.maxSamplerAnisotropy) : 1.0f;
+      sampler.minLod = 0.0f;
+      sampler.maxLod = static_cast<float>(offscreenPass.momentsMipLevels);
+      VK_CHECK_RESULT(vkCreateSampler(device, &sampler, nullptr, &offscreenPass.momentsSampler));
     }
 
     // Setup the offscreen framebuffer for rendering the scene from light's point-of-view to generate the shadow map
@@ -485,9 +1070,20 @@ class ShadowMapping {
       depthReference.attachment = 0;
       depthReference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;      // Attachment will be used as depth/stencil during render pass
 
+      // Moment shadow maps also write the moments (first level), left in the general layout for the blur
+      std::vector<VkAttachmentDescription> attachmentDescriptions = {attachmentDescription};
+      VkAttachmentReference momentsReference = {1, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+      if (useMomentShadows) {
+        VkAttachmentDescription momentsDescription = attachmentDescription;
+        momentsDescription.format = offscreenPass.momentsFormat;
+        momentsDescription.finalLayout = VK_IMAGE_LAYOUT_GENERAL;
+        attachmentDescriptions.push_back(momentsDescription);
+      }
+
       VkSubpassDescription subpass = {};
       subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-      subpass.colorAttachmentCount = 0;                  // no color attachments (framebuffer)
+      subpass.colorAttachmentCount = useMomentShadows ? 1 : 0; // no color attachments (framebuffer) for depth comparisons
+      subpass.pColorAttachments = &momentsReference;
       subpass.pDepthStencilAttachment = &depthReference; // reference to our depth attachment
 
       // Subpass dependencies for layout transitions
@@ -498,7 +1094,7 @@ class ShadowMapping {
       dependencies[0].srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
       dependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
       dependencies[0].srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
-      dependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+      dependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
       dependencies[0].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
 
       dependencies[1].srcSubpass = 0;
@@ -509,49 +1105,226 @@ class ShadowMapping {
       dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
       dependencies[1].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
 
+      if (useMomentShadows) {
+        dependencies[0].dstStageMask |= VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        dependencies[0].dstAccessMask |= VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        // the blur reads the moments of the neighbouring texels in compute
+        dependencies[1].srcStageMask |= VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        dependencies[1].dstStageMask |= VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        dependencies[1].srcAccessMask |= VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        dependencies[1].dependencyFlags = 0;
+      }
+
+      // one view per layer: each draw is broadcast to all cascades, offscreen.vert picks the matrix with gl_ViewIndex
+      uint32_t viewMask = (1u << offscreenPass.imageLayers) - 1;
+      VkRenderPassMultiviewCreateInfo multiviewCI{};
+      multiviewCI.sType = VK_STRUCTURE_TYPE_RENDER_PASS_MULTIVIEW_CREATE_INFO;
+      multiviewCI.subpassCount = 1;
+      multiviewCI.pViewMasks = &viewMask;
+      multiviewCI.correlationMaskCount = 1;
+      multiviewCI.pCorrelationMasks = &viewMask;
+
       VkRenderPassCreateInfo renderPassCreateInfo = vks::initializers::renderPassCreateInfo();
-      renderPassCreateInfo.attachmentCount = 1;
-      renderPassCreateInfo.pAttachments = &attachmentDescription;
+      renderPassCreateInfo.pNext = &multiviewCI;
+      renderPassCreateInfo.attachmentCount = static_cast<uint32_t>(attachmentDescriptions.size());
+      renderPassCreateInfo.pAttachments = attachmentDescriptions.data();
       renderPassCreateInfo.subpassCount = 1;
       renderPassCreateInfo.pSubpasses = &subpass;
       renderPassCreateInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());
       renderPassCreateInfo.pDependencies = dependencies.data();
       VK_CHECK_RESULT(vkCreateRenderPass(device, &renderPassCreateInfo, nullptr, &offscreenPass.renderPass));
+
+      // Compatible render pass for partial updates of the cached shadow map: the clear is restricted to the
+      // render area, and starting from the previous layout keeps the texels outside of it
+      attachmentDescriptions[0].initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+      if (useMomentShadows) {
+        attachmentDescriptions[1].initialLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+      }
+      VK_CHECK_RESULT(vkCreateRenderPass(device, &renderPassCreateInfo, nullptr, &offscreenPass.renderPassUpdate));
+
+      // Single view variants of both for the spot frames of the point light (only their view is transitioned, the
+      // other layers stay in the layouts set by initOffscreenLayouts)
+      if (offscreenPass.imageLayers == 6) {
+        viewMask = 1;
+        VK_CHECK_RESULT(vkCreateRenderPass(device, &renderPassCreateInfo, nullptr, &offscreenPass.spotRenderPassUpdate));
+        attachmentDescriptions[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        if (useMomentShadows) {
+          attachmentDescriptions[1].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        }
+        VK_CHECK_RESULT(vkCreateRenderPass(device, &renderPassCreateInfo, nullptr, &offscreenPass.spotRenderPass));
+      }
+    }
+
+    // Leave all layers of a cube capable shadow map in the layouts the scene samples them in, so the layers a spot
+    // frame does not render are always valid for the descriptors covering all of them
+    void initOffscreenLayouts() {
+      VkCommandBuffer cmdBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+      VkImageSubresourceRange depthRange = {VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, offscreenPass.imageLayers};
+      vks::tools::setImageLayout(cmdBuffer, offscreenPass.depth.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+        depthRange, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+      if (useMomentShadows) {
+        VkImageSubresourceRange momentsRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, offscreenPass.momentsMipLevels, 0, offscreenPass.imageLayers};
+        vks::tools::setImageLayout(cmdBuffer, offscreenPass.moments.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+          momentsRange, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+        VkImageSubresourceRange blurRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, offscreenPass.imageLayers};
+        vks::tools::setImageLayout(cmdBuffer, offscreenPass.momentsBlur.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
+          blurRange, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+      }
+      vulkanDevice->flushCommandBuffer(cmdBuffer, queue);
     }
 
     void setupOffscreenFrameBuffer() {
+      VkImageView attachments[2] = {offscreenPass.depth.view, offscreenPass.momentsTarget};
       VkFramebufferCreateInfo fbufCreateInfo = vks::initializers::framebufferCreateInfo(offscreenPass.renderPass, offscreenPass.width, offscreenPass.height);
-      fbufCreateInfo.attachmentCount = 1;
-      fbufCreateInfo.pAttachments = &offscreenPass.depth.view;
+      fbufCreateInfo.attachmentCount = useMomentShadows ? 2 : 1;
+      fbufCreateInfo.pAttachments = attachments;
       VK_CHECK_RESULT(vkCreateFramebuffer(device, &fbufCreateInfo, nullptr, &offscreenPass.frameBuffer));
+      // same views, the spot render pass only renders their first layer
+      if (offscreenPass.imageLayers == 6) {
+        fbufCreateInfo.renderPass = offscreenPass.spotRenderPass;
+        VK_CHECK_RESULT(vkCreateFramebuffer(device, &fbufCreateInfo, nullptr, &offscreenPass.spotFrameBuffer));
+      }
+    }
+
+    // Spot lights on a ring above the scene, all aimed at its center
+    void setupSpotLights() {
+      const glm::vec3 center = scenes[0].dimensions.center;
+      const float radius = scenes[0].dimensions.radius;
+      const glm::vec3 colors[4] = {{1.0f, 0.6f, 0.3f}, {0.3f, 0.6f, 1.0f}, {0.5f, 1.0f, 0.4f}, {1.0f, 0.4f, 0.8f}};
+      spotLights.resize(std::min(spotLightCount, MAX_SHADOW_LIGHTS));
+      for (uint32_t i = 0; i < spotLights.size(); i++) {
+        const float angle = glm::two_pi<float>() * i / spotLights.size();
+        SpotLight& light = spotLights[i];
+        // the scene is flipped (FlipY): up is -y
+        light.position = center + glm::vec3(std::cos(angle) * radius * 0.6f, -radius * 0.4f, std::sin(angle) * radius * 0.6f);
+        light.direction = glm::normalize(center - light.position);
+        light.color = colors[i % 4] * 0.6f;
+        light.fov = 50.0f;
+        light.range = radius * 1.5f;
+      }
+    }
+
+    // Setup the shadow atlas: one depth image shared by the spot lights, its tiles are packed every frame (see updateShadowAtlas)
+    void setupShadowAtlas() {
+      // tiles are powers of two, so the atlas is one as well
+      shadowAtlas.size = 1;
+      while (shadowAtlas.size * 2 <= std::max(shadowAtlasSize, shadowAtlas.minTileSize)) {
+        shadowAtlas.size *= 2;
+      }
+
+      VkImageCreateInfo imageCI = vks::initializers::imageCreateInfo(shadowAtlas.depthFormat, {shadowAtlas.size, shadowAtlas.size, 1});
+      imageCI.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+      VK_CHECK_RESULT(vkCreateImage(device, &imageCI, nullptr, &shadowAtlas.depth.image));
+
+      VkMemoryAllocateInfo memAlloc = vks::initializers::memoryAllocateInfo();
+      VkMemoryRequirements memReqs;
+      vkGetImageMemoryRequirements(device, shadowAtlas.depth.image, &memReqs);
+      memAlloc.allocationSize = memReqs.size;
+      memAlloc.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+      VK_CHECK_RESULT(vkAllocateMemory(device, &memAlloc, nullptr, &shadowAtlas.depth.mem));
+      VK_CHECK_RESULT(vkBindImageMemory(device, shadowAtlas.depth.image, shadowAtlas.depth.mem, 0));
+
+      VkImageViewCreateInfo depthStencilView = vks::initializers::imageViewCreateInfo(shadowAtlas.depth.image, shadowAtlas.depthFormat);
+      VK_CHECK_RESULT(vkCreateImageView(device, &depthStencilView, nullptr, &shadowAtlas.depth.view));
+
+      // comparisons of the depth, clamped to its tile by scene.frag
+      VkFilter filter = vks::tools::formatIsFilterable(physicalDevice, shadowAtlas.depthFormat, VK_IMAGE_TILING_OPTIMAL) ? VK_FILTER_LINEAR : VK_FILTER_NEAREST;
+      VkSamplerCreateInfo sampler = vks::initializers::samplerCreateInfo();
+      sampler.magFilter = filter;
+      sampler.minFilter = filter;
+      sampler.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+      sampler.addressModeV = sampler.addressModeU;
+      sampler.addressModeW = sampler.addressModeU;
+      sampler.maxAnisotropy = 1.0f;
+      sampler.maxLod = 1.0f;
+      sampler.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
+      sampler.compareEnable = VK_TRUE;
+      sampler.compareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+      VK_CHECK_RESULT(vkCreateSampler(device, &sampler, nullptr, &shadowAtlas.sampler));
+
+      // depth only render pass, cleared as a whole every frame (the tiles move)
+      VkAttachmentDescription attachmentDescription{};
+      attachmentDescription.format = shadowAtlas.depthFormat;
+      attachmentDescription.samples = VK_SAMPLE_COUNT_1_BIT;
+      attachmentDescription.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+      attachmentDescription.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+      attachmentDescription.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+      attachmentDescription.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+      attachmentDescription.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      attachmentDescription.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+
+      VkAttachmentReference depthReference = {0, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
+      VkSubpassDescription subpass = {};
+      subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+      subpass.pDepthStencilAttachment = &depthReference;
+
+      std::array<VkSubpassDependency, 2> dependencies;
+      dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+      dependencies[0].dstSubpass = 0;
+      dependencies[0].srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+      dependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+      dependencies[0].srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+      dependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+      dependencies[0].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+
+      dependencies[1].srcSubpass = 0;
+      dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+      dependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+      dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+      dependencies[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+      dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+      dependencies[1].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+
+      VkRenderPassCreateInfo renderPassCreateInfo = vks::initializers::renderPassCreateInfo();
+      renderPassCreateInfo.attachmentCount = 1;
+      renderPassCreateInfo.pAttachments = &attachmentDescription;
+      renderPassCreateInfo.subpassCount = 1;
+      renderPassCreateInfo.pSubpasses = &subpass;
+      renderPassCreateInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());
+      renderPassCreateInfo.pDependencies = dependencies.data();
+      VK_CHECK_RESULT(vkCreateRenderPass(device, &renderPassCreateInfo, nullptr, &shadowAtlas.renderPass));
+
+      VkFramebufferCreateInfo fbufCreateInfo = vks::initializers::framebufferCreateInfo(shadowAtlas.renderPass, shadowAtlas.size, shadowAtlas.size);
+      fbufCreateInfo.attachmentCount = 1;
+      fbufCreateInfo.pAttachments = &shadowAtlas.depth.view;
+      VK_CHECK_RESULT(vkCreateFramebuffer(device, &fbufCreateInfo, nullptr, &shadowAtlas.frameBuffer));
     }
 
     void setupUniformBuffers() {
-      // uniform buffer block for offscreen vertex shader
-      VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &offscreenPass.uniformBuffer, sizeof(UniformDataOffscreen)));
-      // uniform buffer block for scene vertex shader
-      VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &scenePass.uniformBuffer, sizeof(UniformDataScene)));
-      // map the memory and update
-      VK_CHECK_RESULT(offscreenPass.uniformBuffer.map());
-      VK_CHECK_RESULT(scenePass.uniformBuffer.map());
+      // one region of the ring per frame in flight, so we never write data the GPU is still reading
+      // each region holds the scene and the offscreen uniform blocks
+      uniformRing.create(device, physicalDevice, sizeof(UniformDataScene) + sizeof(UniformDataOffscreen), MAX_FRAMES_IN_FLIGHT, 2);
+      lightRing.create(device, physicalDevice, sizeof(shadowLights), MAX_FRAMES_IN_FLIGHT, 1, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+      pushConstants.model = glm::mat4(1.0f);
+      pushConstants.shadowLight = 0;
       updateScene();
     }
 
     void setupDescriptorSets() {
       // Pool
       std::vector<VkDescriptorPoolSize> poolSizes = {
-        vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 3),
-        vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 3)
+        vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 3),
+        vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 4),
+        vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3),
+        vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 2)
       };
       VkDescriptorPoolCreateInfo descriptorPoolInfo = vks::initializers::descriptorPoolCreateInfo(poolSizes, 3);
       VK_CHECK_RESULT(vkCreateDescriptorPool(device, &descriptorPoolInfo, nullptr, &descriptors.pool));
 
       // Common layout
       std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings = {
-        // Binding 0 : Vertex shader uniform buffer
-        vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0),
+        // Binding 0 : Vertex shader uniform buffer (dynamic offset in the uniform ring)
+        vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0),
         // Binding 1 : Fragment shader image sampler (shadow map)
-        vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 1)
+        vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 1),
+        // Binding 2 : Vertex shader position stream (vertex pulling)
+        vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 2),
+        // Binding 3 : Vertex shader attribute stream (vertex pulling)
+        vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 3),
+        // Binding 4 : Spot lights of the shadow atlas (dynamic offset in the light ring)
+        vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 4),
+        // Binding 5 : Fragment shader image sampler (shadow atlas)
+        vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 5)
       };
       VkDescriptorSetLayoutCreateInfo descriptorLayout = vks::initializers::descriptorSetLayoutCreateInfo(setLayoutBindings);
       VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &descriptorLayout, nullptr, &descriptors.layout));
@@ -559,28 +1332,57 @@ class ShadowMapping {
       // Sets
       std::vector<VkWriteDescriptorSet> writeDescriptorSets;
 
-      // Image descriptor for the shadow map attachment
+      // Image descriptors for the shadow map attachment (raw depth for the visualization, comparisons for the scene)
       VkDescriptorImageInfo shadowMapDescriptor = vks::initializers::descriptorImageInfo(
           offscreenPass.depthSampler,
           offscreenPass.depth.view,
           VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL);
+      VkDescriptorImageInfo shadowCompareDescriptor = vks::initializers::descriptorImageInfo(
+          offscreenPass.shadowSampler,
+          offscreenPass.depth.view,
+          VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL);
+      // or the filtered moments, with all their levels
+      if (useMomentShadows) {
+        shadowCompareDescriptor = vks::initializers::descriptorImageInfo(
+          offscreenPass.momentsSampler,
+          offscreenPass.moments.view,
+          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+      }
+
+      // Uniform blocks of the ring (the offsets are given when binding the sets)
+      VkDescriptorBufferInfo sceneUniformDescriptor = uniformRing.descriptor(sizeof(UniformDataScene));
+      VkDescriptorBufferInfo offscreenUniformDescriptor = uniformRing.descriptor(sizeof(UniformDataOffscreen));
+      VkDescriptorBufferInfo lightsDescriptor = lightRing.descriptor(sizeof(shadowLights));
+      VkDescriptorImageInfo shadowAtlasDescriptor = vks::initializers::descriptorImageInfo(
+          shadowAtlas.sampler,
+          shadowAtlas.depth.view,
+          VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL);
+
+      // Vertex streams of the first arena chunk (read with vertex pulling, which needs the scene to fit in it)
+      VkDescriptorBufferInfo positionsDescriptor = {geometryArena.vertexBuffer(vkglTF::VertexStream::PositionStream), 0, VK_WHOLE_SIZE};
+      VkDescriptorBufferInfo attributesDescriptor = {geometryArena.vertexBuffer(vkglTF::VertexStream::AttributeStream), 0, VK_WHOLE_SIZE};
 
-      // Debug display
       VkDescriptorSetAllocateInfo allocInfo = vks::initializers::descriptorSetAllocateInfo(descriptors.pool, &descriptors.layout, 1);
+
+      // Debug display
       VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &descriptors.debug));
       writeDescriptorSets = {
         // Binding 0 : Parameters uniform buffer
-        vks::initializers::writeDescriptorSet(descriptors.debug, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 0, &scenePass.uniformBuffer.descriptor),
+        vks::initializers::writeDescriptorSet(descriptors.debug, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 0, &sceneUniformDescriptor),
         // Binding 1 : Fragment shader texture sampler
         vks::initializers::writeDescriptorSet(descriptors.debug, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, &shadowMapDescriptor)
       };
       vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
 
-      // Offscreen shadow map generation
+      // Offscreen shadow map generation (and tiles of the shadow atlas)
       VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &descriptors.offscreen));
       writeDescriptorSets = {
         // Binding 0 : Vertex shader uniform buffer
-        vks::initializers::writeDescriptorSet(descriptors.offscreen, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 0, &offscreenPass.uniformBuffer.descriptor),
+        vks::initializers::writeDescriptorSet(descriptors.offscreen, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 0, &offscreenUniformDescriptor),
+        // Binding 2 : Vertex shader position stream
+        vks::initializers::writeDescriptorSet(descriptors.offscreen, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2, &positionsDescriptor),
+        // Binding 4 : Spot lights (matrices of the atlas tiles)
+        vks::initializers::writeDescriptorSet(descriptors.offscreen, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 4, &lightsDescriptor),
       };
       vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
 
@@ -588,9 +1390,16 @@ class ShadowMapping {
       VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &descriptors.scene));
       writeDescriptorSets = {
         // Binding 0 : Vertex shader uniform buffer
-        vks::initializers::writeDescriptorSet(descriptors.scene, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 0, &scenePass.uniformBuffer.descriptor),
+        vks::initializers::writeDescriptorSet(descriptors.scene, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 0, &sceneUniformDescriptor),
         // Binding 1 : Fragment shader shadow sampler
-        vks::initializers::writeDescriptorSet(descriptors.scene, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, &shadowMapDescriptor)
+        vks::initializers::writeDescriptorSet(descriptors.scene, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, &shadowCompareDescriptor),
+        // Binding 2 and 3 : Vertex shader position and attribute streams
+        vks::initializers::writeDescriptorSet(descriptors.scene, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2, &positionsDescriptor),
+        vks::initializers::writeDescriptorSet(descriptors.scene, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3, &attributesDescriptor),
+        // Binding 4 : Spot lights (matrices and tiles)
+        vks::initializers::writeDescriptorSet(descriptors.scene, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 4, &lightsDescriptor),
+        // Binding 5 : Fragment shader shadow atlas sampler
+        vks::initializers::writeDescriptorSet(descriptors.scene, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 5, &shadowAtlasDescriptor)
       };
       vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
     }
@@ -600,8 +1409,11 @@ class ShadowMapping {
       VkPipelineCacheCreateInfo pipelineCacheCreateInfo = vks::initializers::pipelineCacheCreateInfo();
       VK_CHECK_RESULT(vkCreatePipelineCache(device, &pipelineCacheCreateInfo, nullptr, &pipelines.cache));
 
-      // Layout
+      // Layout (the model matrix is a push constant)
+      VkPushConstantRange pushConstantRange = vks::initializers::pushConstantRange(VK_SHADER_STAGE_VERTEX_BIT, sizeof(PushConstants), 0);
       VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = vks::initializers::pipelineLayoutCreateInfo(&descriptors.layout, 1);
+      pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+      pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
       VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCreateInfo, nullptr, &pipelines.layout));
 
       // Pipelines
@@ -636,106 +1448,666 @@ class ShadowMapping {
       VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelines.cache, 1, &pipelineCI, nullptr, &pipelines.debug));
 
       // Scene rendering with shadows applied
+      // (with vertex pulling, the shaders decode the streams themselves and the pipelines have no vertex input)
       rasterizationStateCI.cullMode = VK_CULL_MODE_BACK_BIT;
-      shaderStages[0] = loadShader(paths.sceneVert, VK_SHADER_STAGE_VERTEX_BIT);
-      shaderStages[1] = loadShader(paths.sceneFrag, VK_SHADER_STAGE_FRAGMENT_BIT);
-      pipelineCI.pVertexInputState = vkglTF::Vertex::getPipelineVertexInputState({vkglTF::VertexComponent::Position, vkglTF::VertexComponent::UV, vkglTF::VertexComponent::Color, vkglTF::VertexComponent::Normal});
+      shaderStages[0] = loadShader(useVertexPulling ? paths.sceneVertPull : paths.sceneVert, VK_SHADER_STAGE_VERTEX_BIT);
+      shaderStages[1] = loadShader(useMomentShadows ? paths.sceneFragMoments : paths.sceneFrag, VK_SHADER_STAGE_FRAGMENT_BIT);
+      // the PCF kernel size is a specialization constant, so its loops are unrolled, and so is the warp of the moments
+      struct {
+        int32_t pcfRadius;
+        float momentsExponent;
+      } sceneConstants = {static_cast<int32_t>(pcfRadius), offscreenPass.momentsExponent};
+      std::array<VkSpecializationMapEntry, 2> sceneMapEntries = {
+        vks::initializers::specializationMapEntry(0, offsetof(decltype(sceneConstants), pcfRadius), sizeof(int32_t)),
+        vks::initializers::specializationMapEntry(1, offsetof(decltype(sceneConstants), momentsExponent), sizeof(float))
+      };
+      VkSpecializationInfo sceneSpecializationInfo = vks::initializers::specializationInfo(
+        static_cast<uint32_t>(sceneMapEntries.size()), sceneMapEntries.data(), sizeof(sceneConstants), &sceneConstants);
+      shaderStages[1].pSpecializationInfo = &sceneSpecializationInfo;
+      pipelineCI.pVertexInputState = useVertexPulling ? &emptyInputState :
+        vkglTF::Vertex::getPipelineVertexInputState({vkglTF::VertexComponent::Position, vkglTF::VertexComponent::UV,
+                                                     vkglTF::VertexComponent::Color, vkglTF::VertexComponent::Normal});
       VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelines.cache, 1, &pipelineCI, nullptr, &pipelines.sceneShadow));
 
-      // Offscreen pipeline (vertex shader only)
-      shaderStages[0] = loadShader(paths.offscVert, VK_SHADER_STAGE_VERTEX_BIT);
+      // Same scene rendering after the depth prepass: only the visible surfaces pass the EQUAL test, their depth is already written
+      depthStencilStateCI.depthWriteEnable = VK_FALSE;
+      depthStencilStateCI.depthCompareOp = VK_COMPARE_OP_EQUAL;
+      VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelines.cache, 1, &pipelineCI, nullptr, &pipelines.sceneShadowEqual));
+      depthStencilStateCI.depthWriteEnable = VK_TRUE;
+      depthStencilStateCI.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+
+      // Depth prepass (vertex shader only, reads the position stream alone)
+      shaderStages[0] = loadShader(useVertexPulling ? paths.depthVertPull : paths.depthVert, VK_SHADER_STAGE_VERTEX_BIT);
       pipelineCI.stageCount = 1;
+      pipelineCI.pVertexInputState = useVertexPulling ? &emptyInputState :
+        vkglTF::Vertex::getPipelineVertexInputState({vkglTF::VertexComponent::Position});
+      pipelineCI.renderPass = scenePass.prepassRenderPass;
+      colorBlendStateCI.attachmentCount = 0;
+      VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelines.cache, 1, &pipelineCI, nullptr, &pipelines.depthPrepass));
+
+      // Offscreen pipeline (vertex shader only, reads the position stream alone)
+      // moment shadow maps add a fragment shader writing the moments of the depth
+      shaderStages[0] = loadShader(useVertexPulling ? paths.offscVertPull : paths.offscVert, VK_SHADER_STAGE_VERTEX_BIT);
+      pipelineCI.stageCount = 1;
+      VkSpecializationMapEntry momentsMapEntry = vks::initializers::specializationMapEntry(0, 0, sizeof(float));
+      VkSpecializationInfo momentsSpecializationInfo = vks::initializers::specializationInfo(1, &momentsMapEntry, sizeof(float), &offscreenPass.momentsExponent);
+      if (useMomentShadows) {
+        shaderStages[1] = loadShader(paths.offscFragMoments, VK_SHADER_STAGE_FRAGMENT_BIT);
+        shaderStages[1].pSpecializationInfo = &momentsSpecializationInfo;
+        pipelineCI.stageCount = 2;
+      }
+      pipelineCI.pVertexInputState = useVertexPulling ? &emptyInputState :
+        vkglTF::Vertex::getPipelineVertexInputState({vkglTF::VertexComponent::Position});
       pipelineCI.renderPass = offscreenPass.renderPass;
-      colorBlendStateCI.attachmentCount = 0;                      // no color attachments used
+      colorBlendStateCI.attachmentCount = useMomentShadows ? 1 : 0; // no color attachments used, except for the moments
       rasterizationStateCI.cullMode = VK_CULL_MODE_NONE;          // disable culling, all faces contribute to shadows
       rasterizationStateCI.depthBiasEnable = VK_TRUE;             // enable depth bias
       dynamicStateEnables.push_back(VK_DYNAMIC_STATE_DEPTH_BIAS); // enable changing depth bias at runtime
       dynamicStateCI = vks::initializers::pipelineDynamicStateCreateInfo(dynamicStateEnables);
       depthStencilStateCI.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
       VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelines.cache, 1, &pipelineCI, nullptr, &pipelines.offscreen));
+      if (offscreenPass.imageLayers == 6) {
+        pipelineCI.renderPass = offscreenPass.spotRenderPass;
+        VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelines.cache, 1, &pipelineCI, nullptr, &pipelines.offscreenSpot));
+      }
+
+      // Shadow atlas pipeline: same state, depth only, the matrix of each tile is read from the spot lights
+      shaderStages[0] = loadShader(useVertexPulling ? paths.atlasVertPull : paths.atlasVert, VK_SHADER_STAGE_VERTEX_BIT);
+      pipelineCI.stageCount = 1;
+      pipelineCI.renderPass = shadowAtlas.renderPass;
+      colorBlendStateCI.attachmentCount = 0;
+      VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelines.cache, 1, &pipelineCI, nullptr, &pipelines.shadowAtlas));
+    }
+
+    // Compute pipeline and descriptor sets of the separable blur of the moments
+    void setupMomentBlur() {
+      std::vector<VkDescriptorPoolSize> poolSizes = {
+        vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2),
+        vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 2)
+      };
+      VkDescriptorPoolCreateInfo descriptorPoolInfo = vks::initializers::descriptorPoolCreateInfo(poolSizes, 2);
+      VK_CHECK_RESULT(vkCreateDescriptorPool(device, &descriptorPoolInfo, nullptr, &momentBlur.pool));
+
+      std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings = {
+        // Binding 0 : source moments (texelFetch)
+        vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 0),
+        // Binding 1 : blurred moments
+        vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 1)
+      };
+      VkDescriptorSetLayoutCreateInfo descriptorLayout = vks::initializers::descriptorSetLayoutCreateInfo(setLayoutBindings);
+      VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &descriptorLayout, nullptr, &momentBlur.descriptorLayout));
+
+      // both images stay in the general layout during the blur
+      VkDescriptorImageInfo momentsDescriptor =
+        vks::initializers::descriptorImageInfo(offscreenPass.momentsSampler, offscreenPass.momentsTarget, VK_IMAGE_LAYOUT_GENERAL);
+      VkDescriptorImageInfo blurDescriptor =
+        vks::initializers::descriptorImageInfo(offscreenPass.momentsSampler, offscreenPass.momentsBlur.view, VK_IMAGE_LAYOUT_GENERAL);
+      VkDescriptorSetAllocateInfo allocInfo = vks::initializers::descriptorSetAllocateInfo(momentBlur.pool, &momentBlur.descriptorLayout, 1);
+      VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &momentBlur.horizontal));
+      VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &momentBlur.vertical));
+      std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
+        vks::initializers::writeDescriptorSet(momentBlur.horizontal, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 0, &momentsDescriptor),
+        vks::initializers::writeDescriptorSet(momentBlur.horizontal, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, &blurDescriptor),
+        vks::initializers::writeDescriptorSet(momentBlur.vertical, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 0, &blurDescriptor),
+        vks::initializers::writeDescriptorSet(momentBlur.vertical, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, &momentsDescriptor)
+      };
+      vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+
+      // the direction of the pass is pushed
+      VkPushConstantRange pushConstantRange = vks::initializers::pushConstantRange(VK_SHADER_STAGE_COMPUTE_BIT, 2 * sizeof(int32_t), 0);
+      VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = vks::initializers::pipelineLayoutCreateInfo(&momentBlur.descriptorLayout, 1);
+      pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+      pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+      VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCreateInfo, nullptr, &momentBlur.layout));
+
+      int32_t blurRadius = static_cast<int32_t>(momentBlurRadius);
+      VkSpecializationMapEntry blurMapEntry = vks::initializers::specializationMapEntry(0, 0, sizeof(int32_t));
+      VkSpecializationInfo blurSpecializationInfo = vks::initializers::specializationInfo(1, &blurMapEntry, sizeof(int32_t), &blurRadius);
+      VkComputePipelineCreateInfo pipelineCI = vks::initializers::computePipelineCreateInfo(momentBlur.layout);
+      pipelineCI.stage = loadShader(paths.blurMomentsComp, VK_SHADER_STAGE_COMPUTE_BIT);
+      pipelineCI.stage.pSpecializationInfo = &blurSpecializationInfo;
+      VK_CHECK_RESULT(vkCreateComputePipelines(device, pipelines.cache, 1, &pipelineCI, nullptr, &momentBlur.pipeline));
+    }
+
+    // Compute pipeline and descriptor set of the reduction of the scene depth, and the ring of its per-frame bounds
+    void setupDepthReduction() {
+      depthReduction.ring.create(device, physicalDevice, sizeof(DepthBounds), MAX_FRAMES_IN_FLIGHT, 1, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+
+      VkSamplerCreateInfo samplerCI = vks::initializers::samplerCreateInfo();
+      samplerCI.magFilter = VK_FILTER_NEAREST;
+      samplerCI.minFilter = VK_FILTER_NEAREST;
+      samplerCI.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+      samplerCI.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+      samplerCI.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+      samplerCI.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+      samplerCI.maxLod = 1.0f;
+      VK_CHECK_RESULT(vkCreateSampler(device, &samplerCI, nullptr, &depthReduction.sampler));
+
+      std::vector<VkDescriptorPoolSize> poolSizes = {
+        vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1),
+        vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 1)
+      };
+      VkDescriptorPoolCreateInfo descriptorPoolInfo = vks::initializers::descriptorPoolCreateInfo(poolSizes, 1);
+      VK_CHECK_RESULT(vkCreateDescriptorPool(device, &descriptorPoolInfo, nullptr, &depthReduction.pool));
+
+      std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings = {
+        // Binding 0 : scene depth (texelFetch)
+        vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 0),
+        // Binding 1 : bounds of the frame (dynamic offset in the ring)
+        vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT, 1)
+      };
+      VkDescriptorSetLayoutCreateInfo descriptorLayout = vks::initializers::descriptorSetLayoutCreateInfo(setLayoutBindings);
+      VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &descriptorLayout, nullptr, &depthReduction.descriptorLayout));
+
+      VkDescriptorSetAllocateInfo allocInfo = vks::initializers::descriptorSetAllocateInfo(depthReduction.pool, &depthReduction.descriptorLayout, 1);
+      VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &depthReduction.descriptorSet));
+      VkDescriptorBufferInfo boundsDescriptor = depthReduction.ring.descriptor(sizeof(DepthBounds));
+      VkWriteDescriptorSet writeDescriptorSet =
+        vks::initializers::writeDescriptorSet(depthReduction.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 1, &boundsDescriptor);
+      vkUpdateDescriptorSets(device, 1, &writeDescriptorSet, 0, nullptr);
+      updateDepthReductionDescriptor();
+
+      // inverse view projection, depth parameters and render size are pushed
+      VkPushConstantRange pushConstantRange = vks::initializers::pushConstantRange(VK_SHADER_STAGE_COMPUTE_BIT, sizeof(DepthReductionConstants), 0);
+      VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = vks::initializers::pipelineLayoutCreateInfo(&depthReduction.descriptorLayout, 1);
+      pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+      pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+      VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCreateInfo, nullptr, &depthReduction.layout));
+
+      VkComputePipelineCreateInfo pipelineCI = vks::initializers::computePipelineCreateInfo(depthReduction.layout);
+      pipelineCI.stage = loadShader(paths.reduceDepthComp, VK_SHADER_STAGE_COMPUTE_BIT);
+      VK_CHECK_RESULT(vkCreateComputePipelines(device, pipelines.cache, 1, &pipelineCI, nullptr, &depthReduction.pipeline));
+    }
+
+    // the scene depth is recreated with the swap chain
+    void updateDepthReductionDescriptor() {
+      VkDescriptorImageInfo depthDescriptor =
+        vks::initializers::descriptorImageInfo(depthReduction.sampler, scenePass.depthSampled, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL);
+      VkWriteDescriptorSet writeDescriptorSet =
+        vks::initializers::writeDescriptorSet(depthReduction.descriptorSet, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 0, &depthDescriptor);
+      vkUpdateDescriptorSets(device, 1, &writeDescriptorSet, 0, nullptr);
     }
 
-    void setupCommandBuffers() {
-      // create command buffers (one command buffer for each swap chain image)
-      drawCmdBuffers.resize(swapChain.imageCount);
-      VkCommandBufferAllocateInfo cmdBufAllocateInfo = vks::initializers::commandBufferAllocateInfo(
-            commandPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, static_cast<uint32_t>(drawCmdBuffers.size()));
-      VK_CHECK_RESULT(vkAllocateCommandBuffers(device, &cmdBufAllocateInfo, drawCmdBuffers.data()));
+    // Record the primary command buffer of a frame. With secondary command buffers, each pass is
+    // split in chunks recorded in parallel, and the chunks are only rerecorded when the inputs they
+    // depend on changed since the last time this frame slot was used: otherwise they are replayed
+    void recordFrame(uint32_t frameIndex, uint32_t imageIndex) {
+      FrameResources& frame = frames[frameIndex];
+      updateShadowCache();
+
+      // the fence of this frame was waited for, so nothing allocated from its pool is in use anymore
+      VK_CHECK_RESULT(vkResetCommandPool(device, frame.commandPool, 0));
 
-      // setup command buffers
       VkCommandBufferBeginInfo cmdBufInfo = vks::initializers::commandBufferBeginInfo();
-      for (size_t i = 0; i < drawCmdBuffers.size(); ++i) {
-        VK_CHECK_RESULT(vkBeginCommandBuffer(drawCmdBuffers[i], &cmdBufInfo));
-        {
-          // First pass: Generate shadow map by rendering the scene from light's POV
-          {
-            VkClearValue clearValues[1];
-            clearValues[0].depthStencil = { 1.0f, 0 };
-
-            VkRenderPassBeginInfo renderPassBeginInfo = vks::initializers::renderPassBeginInfo();
-            renderPassBeginInfo.renderPass = offscreenPass.renderPass;
-            renderPassBeginInfo.framebuffer = offscreenPass.frameBuffer;
-            renderPassBeginInfo.renderArea.extent.width = offscreenPass.width;
-            renderPassBeginInfo.renderArea.extent.height = offscreenPass.height;
-            renderPassBeginInfo.clearValueCount = 1;
-            renderPassBeginInfo.pClearValues = clearValues;
-
-            vkCmdBeginRenderPass(drawCmdBuffers[i], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
-            {
-              VkViewport viewport = vks::initializers::viewport((float)offscreenPass.width, (float)offscreenPass.height, 0.0f, 1.0f);
-              vkCmdSetViewport(drawCmdBuffers[i], 0, 1, &viewport);
-
-              VkRect2D scissor = vks::initializers::rect2D(offscreenPass.width, offscreenPass.height, 0, 0);
-              vkCmdSetScissor(drawCmdBuffers[i], 0, 1, &scissor);
-
-              // Set depth bias (aka "Polygon offset") to avoid shadow mapping artifacts
-              vkCmdSetDepthBias(drawCmdBuffers[i], depthBiasConstant, 0.0f, depthBiasSlope);
-
-              vkCmdBindPipeline(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.offscreen);
-              vkCmdBindDescriptorSets(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.layout, 0, 1, &descriptors.offscreen, 0, nullptr);
-              scenes[0].draw(drawCmdBuffers[i]);
-            }
-            vkCmdEndRenderPass(drawCmdBuffers[i]);
-          } // end of first pass
-
-          // Second pass: Scene rendering with applied shadow map
-          {
-            VkClearValue clearValues[2];
-            clearValues[0].color = bgColor;
-            clearValues[1].depthStencil = { 1.0f, 0 };
-
-            VkRenderPassBeginInfo renderPassBeginInfo = vks::initializers::renderPassBeginInfo();
-            renderPassBeginInfo.renderPass = scenePass.renderPass;
-            renderPassBeginInfo.framebuffer = scenePass.frameBuffers[i];
-            renderPassBeginInfo.renderArea.extent.width = width;
-            renderPassBeginInfo.renderArea.extent.height = height;
-            renderPassBeginInfo.clearValueCount = 2;
-            renderPassBeginInfo.pClearValues = clearValues;
-
-            vkCmdBeginRenderPass(drawCmdBuffers[i], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
-            {
-              VkViewport viewport = vks::initializers::viewport((float)width, (float)height, 0.0f, 1.0f);
-              vkCmdSetViewport(drawCmdBuffers[i], 0, 1, &viewport);
-
-              VkRect2D scissor = vks::initializers::rect2D(width, height, 0, 0);
-              vkCmdSetScissor(drawCmdBuffers[i], 0, 1, &scissor);
-
-              // Visualize shadow map
-              if (displayShadowMap) {
-                vkCmdBindDescriptorSets(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.layout, 0, 1, &descriptors.debug, 0, nullptr);
-                vkCmdBindPipeline(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.debug);
-                vkCmdDraw(drawCmdBuffers[i], 3, 1, 0, 0);
-              } else {
-                // Render the shadows scene
-                vkCmdBindDescriptorSets(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.layout, 0, 1, &descriptors.scene, 0, nullptr);
-                vkCmdBindPipeline(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.sceneShadow);
-                scenes[0].draw(drawCmdBuffers[i]);
-              }
-            }
-          } // end of second pass
-          vkCmdEndRenderPass(drawCmdBuffers[i]);
-        } // end of command buffer
-        VK_CHECK_RESULT(vkEndCommandBuffer(drawCmdBuffers[i]));
+      cmdBufInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+      VK_CHECK_RESULT(vkBeginCommandBuffer(frame.cmdBuffer, &cmdBufInfo));
+
+      // the prepass is skipped while the shadow map is displayed (a single fullscreen triangle), and so are the queries
+      scenePass.prepass = useDepthPrepass && !displayShadowMap;
+      frame.queriesPending = gpuQueries.timestamps && !displayShadowMap;
+      frame.queriesPrepass = scenePass.prepass;
+      if (frame.queriesPending) {
+        vkCmdResetQueryPool(frame.cmdBuffer, frame.timestampQueries, 0, FrameQueryCount);
+        if (gpuQueries.statistics) {
+          vkCmdResetQueryPool(frame.cmdBuffer, frame.statisticsQueries, 0, 1);
+        }
+      }
+      recordFrameQuery(frame.cmdBuffer, frame, FrameBegin);
+
+      if (!useSecondaryCommandBuffers) {
+        const uint32_t primitiveCount = static_cast<uint32_t>(scenes[0].linearPrimitives.size());
+
+        // First pass: Generate shadow map by rendering the scene from light's POV
+        if (offscreenPass.render) {
+          beginOffscreenPass(frame.cmdBuffer, VK_SUBPASS_CONTENTS_INLINE);
+          recordOffscreenCommands(frame.cmdBuffer, 0, primitiveCount);
+          vkCmdEndRenderPass(frame.cmdBuffer);
+          if (useMomentShadows) {
+            recordMomentFiltering(frame.cmdBuffer);
+          }
+        }
+        recordShadowAtlas(frame.cmdBuffer);
+
+        // Depth prepass: depth of the visible surfaces, so the scene pass shades each pixel once
+        recordFrameQuery(frame.cmdBuffer, frame, PrepassBegin);
+        if (scenePass.prepass) {
+          beginPrepass(frame.cmdBuffer, VK_SUBPASS_CONTENTS_INLINE);
+          recordPrepassCommands(frame.cmdBuffer, 0, primitiveCount);
+          vkCmdEndRenderPass(frame.cmdBuffer);
+        }
+
+        // Second pass: Scene rendering with applied shadow map
+        recordFrameQuery(frame.cmdBuffer, frame, SceneBegin);
+        beginScenePass(frame.cmdBuffer, imageIndex, VK_SUBPASS_CONTENTS_INLINE);
+        recordSceneCommands(frame.cmdBuffer, 0, primitiveCount);
+        vkCmdEndRenderPass(frame.cmdBuffer);
+        recordFrameQuery(frame.cmdBuffer, frame, SceneEnd);
+        recordDepthReduction(frame.cmdBuffer, frame);
+        recordUpscale(frame.cmdBuffer, imageIndex);
+        recordFrameQuery(frame.cmdBuffer, frame, FrameEnd);
+
+        VK_CHECK_RESULT(vkEndCommandBuffer(frame.cmdBuffer));
+        return;
+      }
+
+      // rerecord the passes whose inputs changed
+      OffscreenPassInputs offscreenInputs = {depthBiasConstant, depthBiasSlope, shadowDrawList.signature, offscreenPass.uniformOffset,
+                                             shadowAtlas.lightsOffset, pushConstants.model, offscreenPass.renderArea, offscreenPass.layers};
+      if (offscreenPass.render && frame.offscreenInputs != offscreenInputs) {
+        const bool spot = offscreenPass.layers < offscreenPass.imageLayers;
+        const VkRenderPass renderPass = spot ? offscreenPass.spotRenderPass : offscreenPass.renderPass;
+        recordPassChunks(frame.offscreenSecondaries, renderPass, [&](VkCommandBuffer cmdBuffer, uint32_t first, uint32_t count) {
+          recordOffscreenCommands(cmdBuffer, first, count);
+        });
+        frame.offscreenInputs = offscreenInputs;
+      }
+      ScenePassInputs sceneInputs = {scenePass.renderWidth, scenePass.renderHeight, displayShadowMap, scenePass.prepass, sceneDrawList.signature,
+                                     scenePass.uniformOffset, shadowAtlas.lightsOffset, pushConstants.model};
+      if (scenePass.prepass && frame.prepassInputs != sceneInputs) {
+        recordPassChunks(frame.prepassSecondaries, scenePass.prepassRenderPass, [&](VkCommandBuffer cmdBuffer, uint32_t first, uint32_t count) {
+          recordPrepassCommands(cmdBuffer, first, count);
+        });
+        frame.prepassInputs = sceneInputs;
+      }
+      // the scene secondaries are executed by both variants of the scene pass (they are compatible)
+      if (frame.sceneInputs != sceneInputs) {
+        recordPassChunks(frame.sceneSecondaries, scenePass.renderPass, [&](VkCommandBuffer cmdBuffer, uint32_t first, uint32_t count) {
+          recordSceneCommands(cmdBuffer, first, count);
+        });
+        frame.sceneInputs = sceneInputs;
+      }
+
+      // primary command buffer only begins the passes and executes the secondary ones
+      std::vector<VkCommandBuffer> secondaries(drawChunks);
+
+      // First pass: Generate shadow map by rendering the scene from light's POV
+      if (offscreenPass.render) {
+        beginOffscreenPass(frame.cmdBuffer, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        for (uint32_t c = 0; c < drawChunks; c++) {
+          secondaries[c] = frame.offscreenSecondaries.buffer(c);
+        }
+        vkCmdExecuteCommands(frame.cmdBuffer, drawChunks, secondaries.data());
+        vkCmdEndRenderPass(frame.cmdBuffer);
+        if (useMomentShadows) {
+          recordMomentFiltering(frame.cmdBuffer);
+        }
+      }
+      // the tiles of the atlas are few draws each, recorded inline
+      recordShadowAtlas(frame.cmdBuffer);
+
+      // Depth prepass: depth of the visible surfaces, so the scene pass shades each pixel once
+      recordFrameQuery(frame.cmdBuffer, frame, PrepassBegin);
+      if (scenePass.prepass) {
+        beginPrepass(frame.cmdBuffer, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        for (uint32_t c = 0; c < drawChunks; c++) {
+          secondaries[c] = frame.prepassSecondaries.buffer(c);
+        }
+        vkCmdExecuteCommands(frame.cmdBuffer, drawChunks, secondaries.data());
+        vkCmdEndRenderPass(frame.cmdBuffer);
+      }
+
+      // Second pass: Scene rendering with applied shadow map
+      recordFrameQuery(frame.cmdBuffer, frame, SceneBegin);
+      beginScenePass(frame.cmdBuffer, imageIndex, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+      for (uint32_t c = 0; c < drawChunks; c++) {
+        secondaries[c] = frame.sceneSecondaries.buffer(c);
+      }
+      vkCmdExecuteCommands(frame.cmdBuffer, drawChunks, secondaries.data());
+      vkCmdEndRenderPass(frame.cmdBuffer);
+      recordFrameQuery(frame.cmdBuffer, frame, SceneEnd);
+      // bounds of the visible samples, for the shadow frustums of a next frame
+      recordDepthReduction(frame.cmdBuffer, frame);
+      // scene at the render scale to the swap chain image
+      recordUpscale(frame.cmdBuffer, imageIndex);
+      recordFrameQuery(frame.cmdBuffer, frame, FrameEnd);
+
+      VK_CHECK_RESULT(vkEndCommandBuffer(frame.cmdBuffer));
+    }
+
+    // (Re)record the chunks of a pass in parallel, one secondary command buffer per chunk of primitives
+    template <typename RecordFunc>
+    void recordPassChunks(vk::ThreadCommandPools& secondaries, VkRenderPass renderPass, RecordFunc record) {
+      for (auto& pool : secondaries.pools) {
+        VK_CHECK_RESULT(vkResetCommandPool(device, pool, 0));
+      }
+
+      const uint32_t primitiveCount = static_cast<uint32_t>(scenes[0].linearPrimitives.size());
+      vk::recordParallel(drawChunks, secondaries.threadCount(), [&](uint32_t chunk, uint32_t thread) {
+        uint32_t firstPrimitive = primitiveCount * chunk / drawChunks;
+        uint32_t chunkPrimitives = primitiveCount * (chunk + 1) / drawChunks - firstPrimitive;
+
+        // no framebuffer in the inheritance info: the same secondaries are used with every swap chain image
+        VkCommandBuffer cmdBuffer = secondaries.buffer(chunk);
+        // the scene secondaries run while the fragment shader invocations are counted
+        vk::beginSecondaryCommandBuffer(cmdBuffer, renderPass, 0, VK_NULL_HANDLE,
+          gpuQueries.statistics ? VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT : 0);
+        record(cmdBuffer, firstPrimitive, chunkPrimitives);
+        VK_CHECK_RESULT(vkEndCommandBuffer(cmdBuffer));
+      });
+    }
+
+    // Blur the moments rendered by the offscreen pass (separable gaussian, in compute) and build their mip chain,
+    // leaving all their levels ready for the scene pass
+    void recordMomentFiltering(VkCommandBuffer cmdBuffer) {
+      const uint32_t layers = offscreenPass.layers;
+
+      // the blur image is overwritten: its previous contents are discarded once the last blur is done with them
+      VkImageMemoryBarrier blurBarrier = vks::initializers::imageMemoryBarrier();
+      blurBarrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+      blurBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      blurBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+      blurBarrier.image = offscreenPass.momentsBlur.image;
+      blurBarrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, layers};
+      vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &blurBarrier);
+
+      // horizontal pass into the blur image, then vertical pass back into the first level of the moments
+      const VkDescriptorSet sets[2] = {momentBlur.horizontal, momentBlur.vertical};
+      const int32_t directions[2][2] = {{1, 0}, {0, 1}};
+      vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, momentBlur.pipeline);
+      for (uint32_t pass = 0; pass < 2; pass++) {
+        if (pass > 0) {
+          VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+          memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+          memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+          vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+        }
+        vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, momentBlur.layout, 0, 1, &sets[pass], 0, nullptr);
+        vkCmdPushConstants(cmdBuffer, momentBlur.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(directions[pass]), directions[pass]);
+        vkCmdDispatch(cmdBuffer, (offscreenPass.width + 15) / 16, (offscreenPass.height + 15) / 16, layers);
+      }
+
+      // mip chain: each level is blitted from the previous one, for all layers at once
+      VkImageMemoryBarrier levelBarriers[2] = {vks::initializers::imageMemoryBarrier(), vks::initializers::imageMemoryBarrier()};
+      levelBarriers[0].srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+      levelBarriers[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+      levelBarriers[0].oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+      levelBarriers[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+      levelBarriers[0].image = offscreenPass.moments.image;
+      levelBarriers[0].subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, layers};
+      levelBarriers[1].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      levelBarriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      levelBarriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+      levelBarriers[1].image = offscreenPass.moments.image;
+      levelBarriers[1].subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 1, offscreenPass.momentsMipLevels - 1, 0, layers};
+      vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr,
+        offscreenPass.momentsMipLevels > 1 ? 2 : 1, levelBarriers);
+
+      for (uint32_t level = 1; level < offscreenPass.momentsMipLevels; level++) {
+        VkImageBlit blit{};
+        blit.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 0, layers};
+        blit.srcOffsets[1] = {std::max(int32_t(offscreenPass.width >> (level - 1)), 1), std::max(int32_t(offscreenPass.height >> (level - 1)), 1), 1};
+        blit.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, level, 0, layers};
+        blit.dstOffsets[1] = {std::max(int32_t(offscreenPass.width >> level), 1), std::max(int32_t(offscreenPass.height >> level), 1), 1};
+        vkCmdBlitImage(cmdBuffer, offscreenPass.moments.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+          offscreenPass.moments.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
+
+        // this level is the source of the next one
+        VkImageMemoryBarrier levelBarrier = vks::initializers::imageMemoryBarrier();
+        levelBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        levelBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        levelBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        levelBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        levelBarrier.image = offscreenPass.moments.image;
+        levelBarrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, level, 1, 0, layers};
+        vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &levelBarrier);
+      }
+
+      // all levels are read by the scene pass
+      VkImageMemoryBarrier readBarrier = vks::initializers::imageMemoryBarrier();
+      readBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      readBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+      readBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+      readBarrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+      readBarrier.image = offscreenPass.moments.image;
+      readBarrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, offscreenPass.momentsMipLevels, 0, layers};
+      vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &readBarrier);
+    }
+
+    void beginOffscreenPass(VkCommandBuffer cmdBuffer, VkSubpassContents contents) {
+      // the moments are cleared to the ones of the far plane
+      const float farMoment = std::exp(offscreenPass.momentsExponent);
+      VkClearValue clearValues[2];
+      clearValues[0].depthStencil = { 1.0f, 0 };
+      clearValues[1].color = { { farMoment, farMoment * farMoment, 0.0f, 0.0f } };
+
+      // the whole map is cleared from an undefined layout, a partial update only clears and redraws its render area
+      const bool fullArea = offscreenPass.renderArea.extent.width == offscreenPass.renderSize && offscreenPass.renderArea.extent.height == offscreenPass.renderSize;
+      VkRenderPassBeginInfo renderPassBeginInfo = vks::initializers::renderPassBeginInfo();
+      // a spot frame of the point light renders the first layer alone
+      const bool spot = offscreenPass.layers < offscreenPass.imageLayers;
+      if (spot) {
+        renderPassBeginInfo.renderPass = fullArea ? offscreenPass.spotRenderPass : offscreenPass.spotRenderPassUpdate;
+        renderPassBeginInfo.framebuffer = offscreenPass.spotFrameBuffer;
+      } else {
+        renderPassBeginInfo.renderPass = fullArea ? offscreenPass.renderPass : offscreenPass.renderPassUpdate;
+        renderPassBeginInfo.framebuffer = offscreenPass.frameBuffer;
+      }
+      renderPassBeginInfo.renderArea = offscreenPass.renderArea;
+      renderPassBeginInfo.clearValueCount = useMomentShadows ? 2 : 1;
+      renderPassBeginInfo.pClearValues = clearValues;
+      vkCmdBeginRenderPass(cmdBuffer, &renderPassBeginInfo, contents);
+    }
+
+    // Render the tiles of the shadow atlas in a single pass: each tile has its own viewport, scissor and casters
+    // (the pass also runs without tiles, so the atlas is always in the layout sampled by the scene)
+    void recordShadowAtlas(VkCommandBuffer cmdBuffer) {
+      VkClearValue clearValue;
+      clearValue.depthStencil = { 1.0f, 0 };
+      VkRenderPassBeginInfo renderPassBeginInfo = vks::initializers::renderPassBeginInfo();
+      renderPassBeginInfo.renderPass = shadowAtlas.renderPass;
+      renderPassBeginInfo.framebuffer = shadowAtlas.frameBuffer;
+      renderPassBeginInfo.renderArea.extent.width = shadowAtlas.size;
+      renderPassBeginInfo.renderArea.extent.height = shadowAtlas.size;
+      renderPassBeginInfo.clearValueCount = 1;
+      renderPassBeginInfo.pClearValues = &clearValue;
+      vkCmdBeginRenderPass(cmdBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+      if (!shadowAtlas.tiles.empty()) {
+        vkCmdSetDepthBias(cmdBuffer, depthBiasConstant, 0.0f, depthBiasSlope);
+        vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.shadowAtlas);
+        const uint32_t dynamicOffsets[2] = {offscreenPass.uniformOffset, shadowAtlas.lightsOffset};
+        vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.layout, 0, 1, &descriptors.offscreen, 2, dynamicOffsets);
+        for (const ShadowAtlas::Tile& tile : shadowAtlas.tiles) {
+          VkViewport viewport = vks::initializers::viewport((float)tile.rect.extent.width, (float)tile.rect.extent.height, 0.0f, 1.0f);
+          viewport.x = (float)tile.rect.offset.x;
+          viewport.y = (float)tile.rect.offset.y;
+          vkCmdSetViewport(cmdBuffer, 0, 1, &viewport);
+          vkCmdSetScissor(cmdBuffer, 0, 1, &tile.rect);
+
+          PushConstants tileConstants = pushConstants;
+          tileConstants.shadowLight = tile.light;
+          vkCmdPushConstants(cmdBuffer, pipelines.layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstants), &tileConstants);
+          scenes[0].drawList(cmdBuffer, shadowAtlas.drawList, tile.firstItem, tile.itemCount,
+            useVertexPulling ? vkglTF::RenderFlags::PullVertices : vkglTF::RenderFlags::PositionsOnly);
+        }
+      }
+      vkCmdEndRenderPass(cmdBuffer);
+    }
+
+    // Reduce the scene depth to the bounds of the visible samples, in the region of this frame in the ring
+    // (read back when this frame slot is used again). Nothing is reduced while the shadow map is displayed
+    void recordDepthReduction(VkCommandBuffer cmdBuffer, FrameResources& frame) {
+      frame.depthBoundsPending = useDepthReduction && !displayShadowMap;
+      if (!frame.depthBoundsPending) {
+        return;
+      }
+      frame.depthBoundsOffset = depthReduction.offset;
+
+      // the depth written by the prepass or the scene pass is sampled
+      VkImageMemoryBarrier depthBarrier = vks::initializers::imageMemoryBarrier();
+      depthBarrier.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+      depthBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+      depthBarrier.oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+      depthBarrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+      depthBarrier.image = scenePass.depth.image;
+      depthBarrier.subresourceRange = {VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1};
+      if (scenePass.depthFormat >= VK_FORMAT_D16_UNORM_S8_UINT) {
+        depthBarrier.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
+      }
+      vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &depthBarrier);
+
+      // each invocation reduces 2x2 texels of the region rendered
+      DepthReductionConstants constants;
+      constants.invViewProj = glm::inverse(uniformDataScene.projection * uniformDataScene.view);
+      constants.depthParams = glm::vec2(uniformDataScene.projection[2][2], uniformDataScene.projection[3][2]);
+      constants.renderSize = glm::ivec2(scenePass.renderWidth, scenePass.renderHeight);
+      vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, depthReduction.pipeline);
+      vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, depthReduction.layout, 0, 1, &depthReduction.descriptorSet, 1, &depthReduction.offset);
+      vkCmdPushConstants(cmdBuffer, depthReduction.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+      vkCmdDispatch(cmdBuffer, (scenePass.renderWidth + 31) / 32, (scenePass.renderHeight + 31) / 32, 1);
+
+      // the bounds are read by the CPU once the fence of this frame is signaled
+      VkMemoryBarrier hostBarrier = vks::initializers::memoryBarrier();
+      hostBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+      hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+      vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &hostBarrier, 0, nullptr, 0, nullptr);
+    }
+
+    // Timestamps at the start and end of the frame, before the prepass, before and after the scene pass, and the
+    // fragment shader invocations of the scene pass (outside of the render passes)
+    void recordFrameQuery(VkCommandBuffer cmdBuffer, const FrameResources& frame, FrameQuery query) {
+      if (!frame.queriesPending) {
+        return;
+      }
+      if (query == SceneEnd && gpuQueries.statistics) {
+        vkCmdEndQuery(cmdBuffer, frame.statisticsQueries, 0);
+      }
+      const VkPipelineStageFlagBits stage = query == FrameBegin ? VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT : VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+      vkCmdWriteTimestamp(cmdBuffer, stage, frame.timestampQueries, query);
+      if (query == SceneBegin && gpuQueries.statistics) {
+        vkCmdBeginQuery(cmdBuffer, frame.statisticsQueries, 0, 0);
+      }
+    }
+
+    void beginPrepass(VkCommandBuffer cmdBuffer, VkSubpassContents contents) {
+      VkClearValue clearValue;
+      clearValue.depthStencil = { 1.0f, 0 };
+
+      VkRenderPassBeginInfo renderPassBeginInfo = vks::initializers::renderPassBeginInfo();
+      renderPassBeginInfo.renderPass = scenePass.prepassRenderPass;
+      renderPassBeginInfo.framebuffer = scenePass.prepassFrameBuffer;
+      renderPassBeginInfo.renderArea.extent.width = scenePass.renderWidth;
+      renderPassBeginInfo.renderArea.extent.height = scenePass.renderHeight;
+      renderPassBeginInfo.clearValueCount = 1;
+      renderPassBeginInfo.pClearValues = &clearValue;
+      vkCmdBeginRenderPass(cmdBuffer, &renderPassBeginInfo, contents);
+    }
+
+    void beginScenePass(VkCommandBuffer cmdBuffer, size_t imageIndex, VkSubpassContents contents) {
+      VkClearValue clearValues[2];
+      clearValues[0].color = bgColor;
+      clearValues[1].depthStencil = { 1.0f, 0 };
+
+      // after the prepass, the depth attachment is loaded (its clear value is ignored)
+      VkRenderPassBeginInfo renderPassBeginInfo = vks::initializers::renderPassBeginInfo();
+      renderPassBeginInfo.renderPass = scenePass.prepass ? scenePass.renderPassLoadDepth : scenePass.renderPass;
+      renderPassBeginInfo.framebuffer = scenePass.frameBuffers[imageIndex];
+      renderPassBeginInfo.renderArea.extent.width = scenePass.renderWidth;
+      renderPassBeginInfo.renderArea.extent.height = scenePass.renderHeight;
+      renderPassBeginInfo.clearValueCount = 2;
+      renderPassBeginInfo.pClearValues = clearValues;
+      vkCmdBeginRenderPass(cmdBuffer, &renderPassBeginInfo, contents);
+    }
+
+    // Blit the region rendered in the color image to the whole swap chain image, and leave it ready to present
+    void recordUpscale(VkCommandBuffer cmdBuffer, uint32_t imageIndex) {
+      if (!scenePass.upscale) {
+        return;
+      }
+      // the color written by the scene pass is read, the swap chain image is overwritten
+      VkImageMemoryBarrier barriers[2] = {vks::initializers::imageMemoryBarrier(), vks::initializers::imageMemoryBarrier()};
+      barriers[0].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+      barriers[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+      barriers[0].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+      barriers[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+      barriers[0].image = scenePass.color.image;
+      barriers[0].subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+      barriers[1].srcAccessMask = 0;
+      barriers[1].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      barriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      barriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+      barriers[1].image = swapChain.images[imageIndex];
+      barriers[1].subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+      vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barriers[0]);
+      // the transition of the swap chain image waits for the acquire semaphore, waited on at the transfer stage
+      vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barriers[1]);
+
+      VkImageBlit blit{};
+      blit.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+      blit.srcOffsets[1] = {static_cast<int32_t>(scenePass.renderWidth), static_cast<int32_t>(scenePass.renderHeight), 1};
+      blit.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+      blit.dstOffsets[1] = {static_cast<int32_t>(width), static_cast<int32_t>(height), 1};
+      vkCmdBlitImage(cmdBuffer, scenePass.color.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        swapChain.images[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
+
+      // presentation waits on the semaphore signaled at the end of the submission
+      barriers[1].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      barriers[1].dstAccessMask = 0;
+      barriers[1].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+      barriers[1].newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+      vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barriers[1]);
+    }
+
+    // Commands of the offscreen pass for a range of primitives (inline or in a secondary command buffer)
+    void recordOffscreenCommands(VkCommandBuffer cmdBuffer, uint32_t firstPrimitive, uint32_t primitiveCount) {
+      // the layers are rendered in their corner of renderSize texels (frame budget)
+      VkViewport viewport = vks::initializers::viewport((float)offscreenPass.renderSize, (float)offscreenPass.renderSize, 0.0f, 1.0f);
+      vkCmdSetViewport(cmdBuffer, 0, 1, &viewport);
+
+      vkCmdSetScissor(cmdBuffer, 0, 1, &offscreenPass.renderArea);
+
+      // Set depth bias (aka "Polygon offset") to avoid shadow mapping artifacts
+      vkCmdSetDepthBias(cmdBuffer, depthBiasConstant, 0.0f, depthBiasSlope);
+
+      vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, offscreenPass.layers < offscreenPass.imageLayers ? pipelines.offscreenSpot : pipelines.offscreen);
+      const uint32_t dynamicOffsets[2] = {offscreenPass.uniformOffset, shadowAtlas.lightsOffset};
+      vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.layout, 0, 1, &descriptors.offscreen, 2, dynamicOffsets);
+      vkCmdPushConstants(cmdBuffer, pipelines.layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstants), &pushConstants);
+      // depth only: bind the position stream alone (or only the indices, the shader pulls the positions)
+      scenes[0].drawList(cmdBuffer, shadowDrawList, firstPrimitive, primitiveCount,
+        useVertexPulling ? vkglTF::RenderFlags::PullVertices : vkglTF::RenderFlags::PositionsOnly);
+    }
+
+    // Commands of the depth prepass for a range of primitives (inline or in a secondary command buffer)
+    void recordPrepassCommands(VkCommandBuffer cmdBuffer, uint32_t firstPrimitive, uint32_t primitiveCount) {
+      VkViewport viewport = vks::initializers::viewport((float)scenePass.renderWidth, (float)scenePass.renderHeight, 0.0f, 1.0f);
+      vkCmdSetViewport(cmdBuffer, 0, 1, &viewport);
+
+      VkRect2D scissor = vks::initializers::rect2D(scenePass.renderWidth, scenePass.renderHeight, 0, 0);
+      vkCmdSetScissor(cmdBuffer, 0, 1, &scissor);
+
+      vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.depthPrepass);
+      const uint32_t dynamicOffsets[2] = {scenePass.uniformOffset, shadowAtlas.lightsOffset};
+      vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.layout, 0, 1, &descriptors.scene, 2, dynamicOffsets);
+      vkCmdPushConstants(cmdBuffer, pipelines.layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstants), &pushConstants);
+      // same draws as the scene pass (same levels of detail, front-to-back), with the position stream alone
+      scenes[0].drawList(cmdBuffer, sceneDrawList, firstPrimitive, primitiveCount,
+        useVertexPulling ? vkglTF::RenderFlags::PullVertices : vkglTF::RenderFlags::PositionsOnly);
+    }
+
+    // Commands of the scene pass for a range of primitives (inline or in a secondary command buffer)
+    void recordSceneCommands(VkCommandBuffer cmdBuffer, uint32_t firstPrimitive, uint32_t primitiveCount) {
+      VkViewport viewport = vks::initializers::viewport((float)scenePass.renderWidth, (float)scenePass.renderHeight, 0.0f, 1.0f);
+      vkCmdSetViewport(cmdBuffer, 0, 1, &viewport);
+
+      VkRect2D scissor = vks::initializers::rect2D(scenePass.renderWidth, scenePass.renderHeight, 0, 0);
+      vkCmdSetScissor(cmdBuffer, 0, 1, &scissor);
+
+      const uint32_t dynamicOffsets[2] = {scenePass.uniformOffset, shadowAtlas.lightsOffset};
+
+      // Visualize shadow map (a single fullscreen triangle, drawn by the first chunk only)
+      if (displayShadowMap) {
+        if (firstPrimitive == 0) {
+          vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.layout, 0, 1, &descriptors.debug, 2, dynamicOffsets);
+          vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.debug);
+          vkCmdDraw(cmdBuffer, 3, 1, 0, 0);
+        }
+      } else {
+        // Render the shadows scene
+        vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.layout, 0, 1, &descriptors.scene, 2, dynamicOffsets);
+        vkCmdPushConstants(cmdBuffer, pipelines.layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstants), &pushConstants);
+        vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, scenePass.prepass ? pipelines.sceneShadowEqual : pipelines.sceneShadow);
+        scenes[0].drawList(cmdBuffer, sceneDrawList, firstPrimitive, primitiveCount, useVertexPulling ? vkglTF::RenderFlags::PullVertices : 0);
       }
     }
 
@@ -751,33 +2123,763 @@ class ShadowMapping {
     /************************ main looping ************************/
 
 
+    // position of the light on its orbit around the scene at a time of the animation (in [0, 1])
+    static glm::vec3 lightOrbit(float time) {
+      auto sintheta = sin(glm::radians(time * 360.0f));
+      return glm::vec3(cos(glm::radians(time * 360.0f)) * 40.0f, -50.0f + sintheta * 20.0f, 25.0f + sintheta * 5.0f);
+    }
+
+    // The spot frustum of the point light (looking at the origin) holds the bounding sphere of the scene in its cone
+    // and depth range from this position
+    bool spotCoversScene(const glm::vec3& position) {
+      const glm::vec3 toScene = scenes[0].dimensions.center - position;
+      const float sceneRadius = scenes[0].dimensions.radius;
+      const float distance = glm::length(toScene);
+      if (distance - sceneRadius < zNear || distance + sceneRadius > zFar) {
+        return false;
+      }
+      const float axisAngle = std::acos(glm::clamp(glm::dot(toScene / distance, glm::normalize(-position)), -1.0f, 1.0f));
+      return axisAngle + std::asin(sceneRadius / distance) <= glm::radians(lightFOV) * 0.5f;
+    }
+
+    // The point light can do with a single spot frustum if it covers the scene along the whole orbit, otherwise the
+    // shadow map gets the six layers of a cube, rendered on the frames its receivers leave the cone of a spot frustum
+    // (see fitLightFrustum)
+    bool pointLightMayNeedCube() {
+      if (!allowCubeShadows) {
+        return false;
+      }
+      for (uint32_t i = 0; i < 64; i++) {
+        if (!spotCoversScene(lightOrbit(i / 64.0f))) {
+          return true;
+        }
+      }
+      return false;
+    }
+
     // update position of objects in the scene
     void updateScene() {
       // animate the light source
       if (!paused) {
-        auto sintheta = sin(glm::radians(timer * 360.0f));
-        lightPos.x = cos(glm::radians(timer * 360.0f)) * 40.0f;
-        lightPos.y = -50.0f + sintheta * 20.0f;
-        lightPos.z = 25.0f + sintheta * 5.0f;
+        lightPos = lightOrbit(timer);
+      }
+
+      // the bounds follow the nodes that moved since they were computed
+      const vkglTF::SceneGraph& sceneGraph = scenes[0].sceneGraph;
+      for (uint32_t i = 0; i < primitiveBounds.size(); i++) {
+        const uint32_t slot = scenes[0].linearPrimitiveNodes[i]->flatIndex;
+        if (sceneGraph.worldChanged[slot] && sceneGraph.worldMatrices[slot] != primitiveBounds[i].world) {
+          updatePrimitiveBounds(i);
+        }
       }
 
       // scene uniform buffer
       uniformDataScene.projection = camera.matrices.perspective;
       uniformDataScene.view = camera.matrices.view;
-      uniformDataScene.model = glm::mat4(1.0f);
-      uniformDataScene.lightPos = glm::vec4(lightPos, 1.0f);
-      uniformDataScene.lightSpace = uniformDataOffscreen.depthMVP;
-      uniformDataScene.zNear = zNear;
-      uniformDataScene.zFar = zFar;
-      memcpy(scenePass.uniformBuffer.mapped, &uniformDataScene, sizeof(uniformDataScene));
+      uniformDataScene.lightPos = useCascades ? glm::vec4(glm::normalize(lightPos), 0.0f) : glm::vec4(lightPos, 1.0f);
+      if (!useCascades) {
+        fitLightFrustum();
+      }
+      uniformDataScene.zNear = lightFrustum.zNear;
+      uniformDataScene.zFar = lightFrustum.zFar;
+      uniformDataScene.cascadeCount = static_cast<int32_t>(useCascades ? offscreenPass.layers : 1);
+      uniformDataScene.debugCascade = static_cast<int32_t>(debugCascade % offscreenPass.layers);
+      uniformDataScene.cubeShadows = offscreenPass.cube ? 1 : 0;
+      uniformDataScene.shadowScale = static_cast<float>(offscreenPass.renderSize) / offscreenPass.width;
+
+      // sort the scene front-to-back for early depth rejection, and pick the levels of detail
+      // (the scene pass is only rerecorded when the order or a level actually changes)
+      vkglTF::LODSelection sceneLods;
+      sceneLods.viewPosition = glm::vec3(glm::inverse(camera.matrices.view)[3]);
+      sceneLods.projectionScale = std::abs(camera.matrices.perspective[1][1]) * scenePass.renderHeight * 0.5f;
+      sceneLods.threshold = lodThreshold;
+      scenes[0].buildDrawList(sceneDrawList, &camera.matrices.view, &sceneLods);
+
+      // the shadow map is rendered without materials, its order does not depend on the camera
+      // the texel density of the cascades follows the one of the camera, so their levels of detail do too
+      vkglTF::LODSelection shadowLods = sceneLods;
+      if (!useCascades) {
+        shadowLods.viewPosition = lightPos;
+        shadowLods.projectionScale = offscreenPass.renderSize * 0.5f / (offscreenPass.cube ? 1.0f : lightFrustum.halfSize);
+      }
+      shadowLods.bias = shadowLodBias;
+      scenes[0].buildDrawList(shadowDrawList, nullptr, &shadowLods);
 
       // offscren uniform buffer
-      // Matrix from light's point of view
-      glm::mat4 depthProjectionMatrix = glm::perspective(glm::radians(lightFOV), 1.0f, zNear, zFar);
-      glm::mat4 depthViewMatrix = glm::lookAt(lightPos, glm::vec3(0.0f), glm::vec3(0, 1, 0));
-      glm::mat4 depthModelMatrix = glm::mat4(1.0f);
-      uniformDataOffscreen.depthMVP = depthProjectionMatrix * depthViewMatrix * depthModelMatrix;
-      memcpy(offscreenPass.uniformBuffer.mapped, &uniformDataOffscreen, sizeof(uniformDataOffscreen));
+      // Matrices from light's point of view
+      if (useCascades) {
+        updateCascades();
+      } else if (offscreenPass.cube) {
+        // one 90 degree frustum per face, widened so the PCF kernel at the edges of a face stays in it
+        // (scene.frag picks the face from the major axis of the direction to the fragment)
+        const float guard = static_cast<float>(pcfRadius + 1) * 2.0f / offscreenPass.renderSize;
+        const glm::mat4 faceProjection = glm::perspective(2.0f * std::atan(1.0f + guard), 1.0f, lightFrustum.zNear, lightFrustum.zFar);
+        const glm::vec3 faceDirections[6] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+        for (uint32_t face = 0; face < 6; face++) {
+          const glm::vec3 up = faceDirections[face].y != 0.0f ? glm::vec3(0, 0, 1) : glm::vec3(0, 1, 0);
+          uniformDataOffscreen.depthVP[face] = faceProjection * glm::lookAt(lightPos, lightPos + faceDirections[face], up);
+        }
+      } else {
+        const glm::vec3 up = std::abs(lightFrustum.direction.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+        const glm::vec2 frustumMin = (lightFrustum.center - lightFrustum.halfSize) * lightFrustum.zNear;
+        const glm::vec2 frustumMax = (lightFrustum.center + lightFrustum.halfSize) * lightFrustum.zNear;
+        glm::mat4 depthProjectionMatrix = glm::frustum(frustumMin.x, frustumMax.x, frustumMin.y, frustumMax.y, lightFrustum.zNear, lightFrustum.zFar);
+        glm::mat4 depthViewMatrix = glm::lookAt(lightPos, lightPos + lightFrustum.direction, up);
+        uniformDataOffscreen.depthVP[0] = depthProjectionMatrix * depthViewMatrix;
+      }
+      for (uint32_t i = 0; i < offscreenPass.layers; i++) {
+        uniformDataScene.lightSpace[i] = uniformDataOffscreen.depthVP[i];
+      }
+      updateLayerMasks();
+      updateShadowAtlas();
+    }
+
+    // Fit the frustum of the point light to the shadows that can be seen: the receivers are the bounds of the scene
+    // clipped to the camera frustum (up to shadowDistance), the casters are the whole scene between them and the light.
+    // The spot frustum covers the receivers only, and the depth range of both the spot light and the cube faces spans
+    // the casters in front of the receivers, so the texels (and depth precision) land on geometry on screen.
+    // Like the cascades, the fit is snapped: the spot frustum keeps its axis and is sheared by whole texels, its size
+    // and depth range are rounded outwards, so the shadow edges do not swim as the camera moves
+    void fitLightFrustum() {
+      const LightFrustum previous = lightFrustum;
+      const bool previousCube = offscreenPass.cube;
+
+      // bounds of the scene as drawn
+      glm::vec3 sceneMin(FLT_MAX), sceneMax(-FLT_MAX);
+      const vkglTF::Model::Dimensions& dimensions = scenes[0].dimensions;
+      for (uint32_t c = 0; c < 8; c++) {
+        const glm::vec3 corner((c & 1) ? dimensions.max.x : dimensions.min.x, (c & 2) ? dimensions.max.y : dimensions.min.y,
+                               (c & 4) ? dimensions.max.z : dimensions.min.z);
+        const glm::vec3 position = glm::vec3(pushConstants.model * glm::vec4(corner, 1.0f));
+        sceneMin = glm::min(sceneMin, position);
+        sceneMax = glm::max(sceneMax, position);
+      }
+
+      // bounds of the camera frustum, cut at the shadow distance (view depth is linear along its edges)
+      const float cameraNear = camera.getNearClip();
+      const float cameraFar = camera.getFarClip();
+      const float cut = (std::min(cameraFar, shadowDistance) - cameraNear) / (cameraFar - cameraNear);
+      const glm::mat4 invViewProj = glm::inverse(camera.matrices.perspective * camera.matrices.view);
+      glm::vec3 cameraMin(FLT_MAX), cameraMax(-FLT_MAX);
+      for (uint32_t c = 0; c < 4; c++) {
+        const glm::vec4 nearCorner = invViewProj * glm::vec4((c & 1) ? 1.0f : -1.0f, (c & 2) ? 1.0f : -1.0f, 0.0f, 1.0f);
+        const glm::vec4 farCorner = invViewProj * glm::vec4((c & 1) ? 1.0f : -1.0f, (c & 2) ? 1.0f : -1.0f, 1.0f, 1.0f);
+        const glm::vec3 nearPosition = glm::vec3(nearCorner) / nearCorner.w;
+        const glm::vec3 cutPosition = nearPosition + (glm::vec3(farCorner) / farCorner.w - nearPosition) * cut;
+        cameraMin = glm::min(cameraMin, glm::min(nearPosition, cutPosition));
+        cameraMax = glm::max(cameraMax, glm::max(nearPosition, cutPosition));
+      }
+
+      // receivers: both bounds intersected, and the bounds of the samples the camera actually saw with the depth reduction
+      // (the whole scene when the camera sees none of it)
+      glm::vec3 receiverMin = glm::max(sceneMin, cameraMin);
+      glm::vec3 receiverMax = glm::min(sceneMax, cameraMax);
+      if (useDepthReduction && visibleBounds.valid) {
+        receiverMin = glm::max(receiverMin, visibleBounds.min);
+        receiverMax = glm::min(receiverMax, visibleBounds.max);
+      }
+      if (glm::any(glm::greaterThan(receiverMin, receiverMax))) {
+        receiverMin = sceneMin;
+        receiverMax = sceneMax;
+      }
+
+      // the axis of the spot light only follows the light (towards the center of the scene), the receivers are
+      // covered by a frustum sheared off that axis: a square window on the plane at distance 1
+      const glm::vec3 toScene = (sceneMin + sceneMax) * 0.5f - lightPos;
+      lightFrustum.direction = glm::length(toScene) > 0.0f ? glm::normalize(toScene) : glm::vec3(0.0f, 1.0f, 0.0f);
+      const glm::vec3 up = std::abs(lightFrustum.direction.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+      const glm::mat4 lightView = glm::lookAt(lightPos, lightPos + lightFrustum.direction, up);
+      glm::vec2 windowMin(FLT_MAX), windowMax(-FLT_MAX);
+      bool behind = false;
+      float receiverFar = 0.0f;
+      float receiverDistance = 0.0f; // farthest corner from the light, the depth range of the cube faces
+      for (uint32_t c = 0; c < 8; c++) {
+        const glm::vec3 corner((c & 1) ? receiverMax.x : receiverMin.x, (c & 2) ? receiverMax.y : receiverMin.y,
+                               (c & 4) ? receiverMax.z : receiverMin.z);
+        const glm::vec3 view = glm::vec3(lightView * glm::vec4(corner, 1.0f));
+        const float depth = -view.z;
+        behind |= depth <= 0.0f;
+        if (depth > 0.0f) {
+          windowMin = glm::min(windowMin, glm::vec2(view) / depth);
+          windowMax = glm::max(windowMax, glm::vec2(view) / depth);
+        }
+        receiverFar = std::max(receiverFar, depth);
+        receiverDistance = std::max(receiverDistance, glm::length(corner - lightPos));
+      }
+      const glm::vec2 windowSize = windowMax - windowMin;
+      const float halfSize = behind ? FLT_MAX : std::max(windowSize.x, windowSize.y) * 0.5f;
+      const float maxHalfSize = std::tan(glm::radians(lightFOV) * 0.5f);
+
+      // a cube capable shadow map renders the six faces only while the receivers do not fit in the widest spot frustum
+      if (offscreenPass.imageLayers == 6) {
+        offscreenPass.cube = halfSize > maxHalfSize;
+        offscreenPass.layers = offscreenPass.cube ? 6 : 1;
+      }
+
+      // the size is rounded up to 1/16 octave (with a texel of margin for the snapping), then the center is snapped
+      // to whole texels of that size
+      const float minHalfSize = std::tan(glm::radians(0.5f));
+      const float margin = 1.0f + 2.0f / offscreenPass.renderSize;
+      const float fitHalfSize = glm::clamp(halfSize * margin, minHalfSize, maxHalfSize);
+      lightFrustum.halfSize = std::min(std::exp2(std::ceil(std::log2(fitHalfSize) * 16.0f) / 16.0f), maxHalfSize);
+      const float texel = 2.0f * lightFrustum.halfSize / offscreenPass.renderSize;
+      lightFrustum.center = behind ? glm::vec2(0.0f) : glm::round((windowMin + windowMax) * 0.5f / texel) * texel;
+
+      // the casters start at the closest point of the scene bounds (along the axis for the spot light, in any direction for the cube)
+      float casterNear = FLT_MAX;
+      for (uint32_t c = 0; c < 8; c++) {
+        const glm::vec3 corner((c & 1) ? sceneMax.x : sceneMin.x, (c & 2) ? sceneMax.y : sceneMin.y, (c & 4) ? sceneMax.z : sceneMin.z);
+        casterNear = std::min(casterNear, -glm::vec3(lightView * glm::vec4(corner, 1.0f)).z);
+      }
+      if (offscreenPass.cube) {
+        casterNear = glm::distance(lightPos, glm::clamp(lightPos, sceneMin, sceneMax));
+        receiverFar = receiverDistance;
+      }
+      // rounded outwards with a small margin, so the bounds are not clipped by the planes themselves
+      lightFrustum.zFar = glm::clamp(std::ceil(receiverFar * 1.01f * 4.0f) / 4.0f, zNear * 2.0f, zFar);
+      lightFrustum.zNear = glm::clamp(std::floor(casterNear * 0.99f * 4.0f) / 4.0f, zNear, lightFrustum.zFar * 0.5f);
+
+      // the previous fit is kept while it still covers the receivers and casters and is not much larger than needed,
+      // so the cached shadow map (updateShadowCache) survives the camera moving while the light does not
+      bool keep = offscreenPass.cube == previousCube && lightFrustum.direction == previous.direction &&
+                  lightFrustum.zNear >= previous.zNear && lightFrustum.zFar <= previous.zFar && lightFrustum.zFar > previous.zFar * 0.75f;
+      if (keep && !offscreenPass.cube) {
+        keep = !behind && glm::all(glm::greaterThanEqual(windowMin, previous.center - previous.halfSize)) &&
+               glm::all(glm::lessThanEqual(windowMax, previous.center + previous.halfSize)) && fitHalfSize > previous.halfSize * 0.75f;
+      }
+      if (keep) {
+        lightFrustum = previous;
+      }
+    }
+
+    // planes of the frustum of a view projection matrix (depth in [0, 1]), pointing inwards
+    static void frustumPlanes(const glm::mat4& viewProj, glm::vec4 planes[6]) {
+      const glm::mat4 m = glm::transpose(viewProj);
+      planes[0] = m[3] + m[0];
+      planes[1] = m[3] - m[0];
+      planes[2] = m[3] + m[1];
+      planes[3] = m[3] - m[1];
+      planes[4] = m[2];
+      planes[5] = m[3] - m[2];
+    }
+
+    static bool sphereInFrustum(const glm::vec4 planes[6], const glm::vec4& center, float radius) {
+      for (uint32_t p = 0; p < 6; p++) {
+        if (glm::dot(planes[p], center) < -radius * glm::length(glm::vec3(planes[p]))) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Cull the casters per layer: a mesh is only rasterized in the layers (cascades or cube faces) whose frustum its
+    // bounding spheres touch, offscreen.vert moves it out of the others. All layers are still drawn in a single pass
+    void updateLayerMasks() {
+      glm::vec4 planes[MAX_SHADOW_LAYERS][6];
+      for (uint32_t layer = 0; layer < offscreenPass.layers; layer++) {
+        frustumPlanes(uniformDataOffscreen.depthVP[layer], planes[layer]);
+      }
+
+      uint32_t* masks = &uniformDataOffscreen.layerMasks[0][0];
+      std::fill(masks, masks + MAX_SHADOW_CASTER_MESHES, 0u);
+      const float scale = std::max({glm::length(glm::vec3(pushConstants.model[0])), glm::length(glm::vec3(pushConstants.model[1])),
+                                    glm::length(glm::vec3(pushConstants.model[2]))});
+      for (size_t i = 0; i < scenes[0].linearPrimitives.size(); i++) {
+        const uint32_t mesh = scenes[0].linearPrimitiveNodes[i]->mesh->transformIndex;
+        if (mesh >= MAX_SHADOW_CASTER_MESHES) {
+          continue;
+        }
+        const glm::vec4 center = pushConstants.model * glm::vec4(primitiveBounds[i].center, 1.0f);
+        const float radius = primitiveBounds[i].radius * scale;
+        for (uint32_t layer = 0; layer < offscreenPass.layers; layer++) {
+          if (sphereInFrustum(planes[layer], center, radius)) {
+            masks[mesh] |= 1u << layer;
+          }
+        }
+      }
+    }
+
+    // Pack the shadow atlas: every spot light seen by the camera gets a square tile sized by its coverage of the screen,
+    // and only the casters in its frustum are drawn in it, so the cost of the shadows follows the pixels they cover
+    // rather than the number of lights. The tiles move every frame, the atlas is redrawn as a whole
+    void updateShadowAtlas() {
+      glm::vec4 cameraPlanes[6];
+      frustumPlanes(camera.matrices.perspective * camera.matrices.view, cameraPlanes);
+      const glm::vec3 cameraPosition = glm::vec3(glm::inverse(camera.matrices.view)[3]);
+      const float projectionScale = std::abs(camera.matrices.perspective[1][1]) * height * 0.5f;
+
+      // bounding sphere of the cone of each light, and its diameter on screen (the whole screen from inside of it)
+      struct Request {
+        uint32_t light;
+        float coverage;
+        uint32_t size;
+      };
+      std::vector<Request> requests;
+      std::vector<glm::vec4> bounds(spotLights.size());
+      for (uint32_t i = 0; i < spotLights.size(); i++) {
+        const SpotLight& light = spotLights[i];
+        const float halfAngle = glm::radians(light.fov) * 0.5f;
+        const float radius = halfAngle > glm::quarter_pi<float>() ? light.range * std::tan(halfAngle) :
+                                                                    light.range / (2.0f * std::cos(halfAngle) * std::cos(halfAngle));
+        const float axisDistance = halfAngle > glm::quarter_pi<float>() ? light.range : radius;
+        bounds[i] = glm::vec4(light.position + light.direction * axisDistance, 1.0f);
+        if (!sphereInFrustum(cameraPlanes, bounds[i], radius)) {
+          continue;
+        }
+        const float distance = glm::length(glm::vec3(bounds[i]) - cameraPosition);
+        const float coverage = distance > radius ? 2.0f * radius * projectionScale / distance : static_cast<float>(std::max(width, height));
+        uint32_t size = shadowAtlas.minTileSize;
+        while (size < shadowAtlas.size / 2 && size < coverage) {
+          size *= 2;
+        }
+        requests.push_back({i, coverage, size});
+      }
+
+      // while the tiles do not fit, the largest ones are halved, then the least important lights lose their shadows
+      std::sort(requests.begin(), requests.end(), [](const Request& a, const Request& b) { return a.coverage > b.coverage; });
+      auto tileArea = [&]() {
+        uint64_t area = 0;
+        for (const Request& request : requests) {
+          area += static_cast<uint64_t>(request.size) * request.size;
+        }
+        return area;
+      };
+      const uint64_t atlasArea = static_cast<uint64_t>(shadowAtlas.size) * shadowAtlas.size;
+      while (tileArea() > atlasArea && requests.front().size > shadowAtlas.minTileSize) {
+        const uint32_t largest = requests.front().size;
+        for (Request& request : requests) {
+          if (request.size == largest) {
+            request.size /= 2;
+          }
+        }
+      }
+      uint32_t shadowedCount = static_cast<uint32_t>(requests.size());
+      for (uint64_t area = tileArea(); area > atlasArea; area -= static_cast<uint64_t>(shadowAtlas.minTileSize) * shadowAtlas.minTileSize) {
+        shadowedCount--;
+      }
+
+      // the tiles are laid along a Morton curve, largest first: each one starts at a multiple of its own area,
+      // so it covers an aligned square of the atlas and the tiles neither overlap nor leave gaps
+      shadowAtlas.tiles.clear();
+      shadowAtlas.drawList.items.clear();
+      uint64_t cursor = 0;
+      // the bounding spheres of the casters are scaled like the pushed model matrix, the same for every tile
+      const float scale = std::max({glm::length(glm::vec3(pushConstants.model[0])), glm::length(glm::vec3(pushConstants.model[1])),
+                                    glm::length(glm::vec3(pushConstants.model[2]))});
+      for (uint32_t i = 0; i < requests.size(); i++) {
+        const SpotLight& light = spotLights[requests[i].light];
+        const glm::vec3 up = std::abs(light.direction.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+        const glm::mat4 viewProj = glm::perspective(glm::radians(light.fov), 1.0f, zNear, light.range) *
+                                   glm::lookAt(light.position, light.position + light.direction, up);
+
+        ShadowLight& shadowLight = shadowLights[i];
+        shadowLight.viewProj = viewProj;
+        shadowLight.tile = glm::vec4(0.0f);
+        shadowLight.position = glm::vec4(light.position, light.range);
+        shadowLight.direction = glm::vec4(light.direction, std::cos(glm::radians(light.fov) * 0.5f));
+        shadowLight.color = glm::vec4(light.color, 1.0f);
+        if (i >= shadowedCount) {
+          continue;
+        }
+
+        const uint32_t size = requests[i].size;
+        glm::uvec2 offset(0);
+        for (uint32_t bit = 0; bit < 32; bit++) {
+          offset.x |= static_cast<uint32_t>((cursor >> (2 * bit)) & 1) << bit;
+          offset.y |= static_cast<uint32_t>((cursor >> (2 * bit + 1)) & 1) << bit;
+        }
+        cursor += static_cast<uint64_t>(size) * size;
+        shadowLight.tile = glm::vec4(glm::vec2(offset), glm::vec2(size)) / static_cast<float>(shadowAtlas.size);
+
+        // casters of the tile, in the order of the shadow draw list (sorted by state)
+        glm::vec4 lightPlanes[6];
+        frustumPlanes(viewProj, lightPlanes);
+        ShadowAtlas::Tile tile;
+        tile.light = i;
+        tile.rect = vks::initializers::rect2D(size, size, offset.x, offset.y);
+        tile.firstItem = static_cast<uint32_t>(shadowAtlas.drawList.items.size());
+        for (const vkglTF::DrawList::Item& item : shadowDrawList.items) {
+          const PrimitiveBounds& bounds = primitiveBounds[item.primitiveIndex];
+          if (sphereInFrustum(lightPlanes, pushConstants.model * glm::vec4(bounds.center, 1.0f), bounds.radius * scale)) {
+            shadowAtlas.drawList.items.push_back(item);
+          }
+        }
+        tile.itemCount = static_cast<uint32_t>(shadowAtlas.drawList.items.size()) - tile.firstItem;
+        shadowAtlas.tiles.push_back(tile);
+      }
+      uniformDataScene.shadowLightCount = static_cast<int32_t>(requests.size());
+    }
+
+    // Directional light (towards the origin) with one orthographic cascade per slice of the camera frustum
+    // The slices follow the practical split scheme, and each cascade is fitted to the bounding sphere of its slice
+    // and snapped to whole texels, so the shadow edges do not shimmer when the camera moves or rotates
+    // With the depth reduction, the slices only split the depth range actually visible and each cascade is cut to the
+    // bounds of the visible samples across the light (sample distribution shadow maps)
+    void updateCascades() {
+      const float cameraNear = camera.getNearClip();
+      const float cameraFar = camera.getFarClip();
+      float nearClip = cameraNear;
+      float farClip = std::min(cameraFar, shadowDistance);
+      const bool sampleDistribution = useDepthReduction && visibleBounds.valid;
+      if (sampleDistribution) {
+        // rounded outwards with a margin: the bounds are a few frames old, and beyond the last cascade nothing is shadowed
+        farClip = std::clamp(std::ceil(visibleBounds.maxDepth * 1.05f * 4.0f) / 4.0f, cameraNear * 2.0f, farClip);
+        nearClip = std::clamp(std::floor(visibleBounds.minDepth * 0.95f * 4.0f) / 4.0f, cameraNear, farClip * 0.5f);
+      }
+
+      // corners of the camera frustum in world space, near plane first
+      const glm::mat4 invViewProj = glm::inverse(camera.matrices.perspective * camera.matrices.view);
+      glm::vec3 frustumCorners[8];
+      for (uint32_t c = 0; c < 8; c++) {
+        glm::vec4 corner = invViewProj * glm::vec4((c & 1) ? 1.0f : -1.0f, (c & 2) ? 1.0f : -1.0f, (c & 4) ? 1.0f : 0.0f, 1.0f);
+        frustumCorners[c] = glm::vec3(corner) / corner.w;
+      }
+
+      const glm::vec3 lightDir = glm::normalize(-lightPos);
+      const glm::vec3 up = std::abs(lightDir.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+      const glm::vec3 sceneCenter = scenes[0].dimensions.center;
+      const float sceneRadius = scenes[0].dimensions.radius;
+
+      float sliceNear = nearClip;
+      for (uint32_t i = 0; i < offscreenPass.layers; i++) {
+        // blend of the logarithmic and uniform split schemes
+        const float p = static_cast<float>(i + 1) / offscreenPass.layers;
+        const float logSplit = nearClip * std::pow(farClip / nearClip, p);
+        const float uniformSplit = nearClip + (farClip - nearClip) * p;
+        const float sliceFar = cascadeSplitLambda * (logSplit - uniformSplit) + uniformSplit;
+
+        // corners of the slice, along the edges of the frustum (view depth is linear along them)
+        glm::vec3 center(0.0f);
+        glm::vec3 sliceCorners[8];
+        for (uint32_t c = 0; c < 4; c++) {
+          const glm::vec3 edge = frustumCorners[c + 4] - frustumCorners[c];
+          sliceCorners[c] = frustumCorners[c] + edge * ((sliceNear - cameraNear) / (cameraFar - cameraNear));
+          sliceCorners[c + 4] = frustumCorners[c] + edge * ((sliceFar - cameraNear) / (cameraFar - cameraNear));
+          center += sliceCorners[c] + sliceCorners[c + 4];
+        }
+        center /= 8.0f;
+
+        // a bounding sphere does not change size when the camera rotates (rounded up to avoid float noise)
+        float radius = 0.0f;
+        for (const glm::vec3& corner : sliceCorners) {
+          radius = std::max(radius, glm::length(corner - center));
+        }
+        radius = std::ceil(radius * 16.0f) / 16.0f;
+
+        // the depth range covers the whole scene along the light, so casters outside the slice still cast shadows in it
+        const float depthExtent = glm::length(center - sceneCenter) + sceneRadius;
+        const glm::mat4 lightView = glm::lookAt(center - lightDir * depthExtent, center, up);
+        glm::vec2 extentMin(-radius), extentMax(radius);
+        if (sampleDistribution) {
+          glm::vec2 visibleMin(FLT_MAX), visibleMax(-FLT_MAX);
+          for (uint32_t c = 0; c < 8; c++) {
+            const glm::vec3 corner((c & 1) ? visibleBounds.max.x : visibleBounds.min.x, (c & 2) ? visibleBounds.max.y : visibleBounds.min.y,
+                                   (c & 4) ? visibleBounds.max.z : visibleBounds.min.z);
+            const glm::vec2 position = glm::vec2(lightView * glm::vec4(corner, 1.0f));
+            visibleMin = glm::min(visibleMin, position);
+            visibleMax = glm::max(visibleMax, position);
+          }
+          // rounded outwards, the cascade keeps its sphere when the visible samples do not overlap it
+          visibleMin = glm::floor(visibleMin * 4.0f) / 4.0f;
+          visibleMax = glm::ceil(visibleMax * 4.0f) / 4.0f;
+          if (glm::all(glm::lessThan(glm::max(extentMin, visibleMin), glm::min(extentMax, visibleMax)))) {
+            extentMin = glm::max(extentMin, visibleMin);
+            extentMax = glm::min(extentMax, visibleMax);
+          }
+        }
+        glm::mat4 lightProjection = glm::ortho(extentMin.x, extentMax.x, extentMin.y, extentMax.y, 0.0f, 2.0f * depthExtent);
+
+        // move the cascade by less than a texel so the world origin falls on a texel corner
+        const glm::vec4 origin = lightProjection * lightView * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f) * (offscreenPass.renderSize * 0.5f);
+        const glm::vec4 offset = (glm::round(origin) - origin) * (2.0f / offscreenPass.renderSize);
+        lightProjection[3][0] += offset.x;
+        lightProjection[3][1] += offset.y;
+
+        uniformDataOffscreen.depthVP[i] = lightProjection * lightView;
+        uniformDataScene.cascadeSplits[i] = sliceFar;
+        sliceNear = sliceFar;
+      }
+    }
+
+    // Decide what the offscreen pass renders this frame (offscreenPass.render and renderArea): the whole shadow map
+    // when the light or the depth bias changed, the tiles around the casters that moved or changed level of detail
+    // otherwise, and nothing at all when no caster changed (the cached shadow map is still valid)
+    void updateShadowCache() {
+      const uint32_t primitiveCount = static_cast<uint32_t>(scenes[0].linearPrimitives.size());
+      bool lightChanged = !cacheShadowMap || !shadowCache.valid || shadowCache.layers != offscreenPass.layers ||
+                          shadowCache.renderSize != offscreenPass.renderSize ||
+                          shadowCache.depthBiasConstant != depthBiasConstant || shadowCache.depthBiasSlope != depthBiasSlope ||
+                          shadowCache.casters.size() != primitiveCount;
+      for (uint32_t i = 0; i < offscreenPass.layers && !lightChanged; i++) {
+        lightChanged = shadowCache.depthVP[i] != uniformDataOffscreen.depthVP[i];
+      }
+
+      // texels covered by the changed casters, before and after their change
+      glm::vec2 dirtyMin(FLT_MAX);
+      glm::vec2 dirtyMax(-FLT_MAX);
+      bool dirty = lightChanged;
+      shadowCache.casters.resize(primitiveCount);
+      // a caster changed when its pushed model matrix, the world matrix of its node or its level of detail did
+      for (const vkglTF::DrawList::Item& item : shadowDrawList.items) {
+        ShadowCaster& caster = shadowCache.casters[item.primitiveIndex];
+        const PrimitiveBounds& bounds = primitiveBounds[item.primitiveIndex];
+        if (!lightChanged) {
+          if (caster.transform == pushConstants.model && caster.world == bounds.world && caster.lod == item.lod) {
+            continue;
+          }
+          // the texels it covered, and the ones it covers now
+          expandShadowRect(caster.bounds, caster.transform, dirtyMin, dirtyMax);
+          expandShadowRect(bounds, pushConstants.model, dirtyMin, dirtyMax);
+          dirty = true;
+        }
+        caster.transform = pushConstants.model;
+        caster.world = bounds.world;
+        caster.bounds = bounds;
+        caster.lod = item.lod;
+      }
+
+      offscreenPass.render = dirty;
+      offscreenPass.renderArea = vks::initializers::rect2D(offscreenPass.renderSize, offscreenPass.renderSize, 0, 0);
+      if (dirty && !lightChanged) {
+        // a margin for the PCF kernel of the shadow map, rounded out to whole tiles
+        const float tileSize = 64.0f;
+        const float margin = static_cast<float>(pcfRadius + 1);
+        const glm::vec2 mapSize(offscreenPass.renderSize);
+        const glm::vec2 tileMin = glm::clamp(glm::floor((dirtyMin - margin) / tileSize) * tileSize, glm::vec2(0.0f), mapSize);
+        const glm::vec2 tileMax = glm::clamp(glm::ceil((dirtyMax + margin) / tileSize) * tileSize, glm::vec2(0.0f), mapSize);
+        const glm::vec2 size = tileMax - tileMin;
+        if (size.x <= 0.0f || size.y <= 0.0f) {
+          // the changed casters are outside of the shadow map
+          offscreenPass.render = false;
+        } else if (!useMomentShadows && size.x * size.y < 0.5f * mapSize.x * mapSize.y) {
+          // past half of the map, clearing from an undefined layout costs less than preserving the rest
+          // (moment shadow maps are blurred and mipmapped as a whole, they are always fully redrawn)
+          offscreenPass.renderArea = vks::initializers::rect2D(static_cast<int32_t>(size.x), static_cast<int32_t>(size.y),
+                                                               static_cast<int32_t>(tileMin.x), static_cast<int32_t>(tileMin.y));
+        }
+      }
+
+      if (lightChanged) {
+        shadowCache.valid = true;
+        shadowCache.layers = offscreenPass.layers;
+        shadowCache.renderSize = offscreenPass.renderSize;
+        std::copy(std::begin(uniformDataOffscreen.depthVP), std::end(uniformDataOffscreen.depthVP), std::begin(shadowCache.depthVP));
+        shadowCache.depthBiasConstant = depthBiasConstant;
+        shadowCache.depthBiasSlope = depthBiasSlope;
+      }
+    }
+
+    // Grow a rectangle of shadow map texels by the bounds of a primitive, projected in every layer
+    // (all layers share the render area of the multiview pass)
+    void expandShadowRect(const PrimitiveBounds& bounds, const glm::mat4& transform, glm::vec2& rectMin, glm::vec2& rectMax) {
+      const glm::vec2 mapSize(offscreenPass.renderSize);
+      for (uint32_t layer = 0; layer < offscreenPass.layers; layer++) {
+        const glm::mat4 mvp = uniformDataOffscreen.depthVP[layer] * transform;
+        for (uint32_t c = 0; c < 8; c++) {
+          const glm::vec3 corner((c & 1) ? bounds.max.x : bounds.min.x,
+                                 (c & 2) ? bounds.max.y : bounds.min.y,
+                                 (c & 4) ? bounds.max.z : bounds.min.z);
+          const glm::vec4 clip = mvp * glm::vec4(corner, 1.0f);
+          if (clip.w <= 0.0f) {
+            // behind the spot light: the projection of the bounds is unbounded
+            rectMin = glm::vec2(0.0f);
+            rectMax = mapSize;
+            return;
+          }
+          const glm::vec2 texel = (glm::vec2(clip) / clip.w * 0.5f + 0.5f) * mapSize;
+          rectMin = glm::min(rectMin, texel);
+          rectMax = glm::max(rectMax, texel);
+        }
+      }
+    }
+
+    // copy the uniform data to the region of a frame in the ring (only once the GPU is done with that frame)
+    // the blocks are pushed in the same order every frame, so a frame slot always gets the same offsets
+    void updateUniformBuffers(uint32_t frameIndex) {
+      uniformRing.beginFrame(frameIndex);
+      scenePass.uniformOffset = uniformRing.push(uniformDataScene);
+      offscreenPass.uniformOffset = uniformRing.push(uniformDataOffscreen);
+      lightRing.beginFrame(frameIndex);
+      shadowAtlas.lightsOffset = lightRing.push(shadowLights.data(), sizeof(shadowLights));
+      if (useDepthReduction) {
+        // empty bounds, grown by the depth reduction
+        DepthBounds emptyBounds;
+        std::fill(std::begin(emptyBounds.minValues), std::end(emptyBounds.minValues), ~0u);
+        std::fill(std::begin(emptyBounds.maxValues), std::end(emptyBounds.maxValues), 0u);
+        depthReduction.ring.beginFrame(frameIndex);
+        depthReduction.offset = depthReduction.ring.push(emptyBounds);
+      }
+    }
+
+    // Read the bounds reduced from the depth of the last frame rendered with these resources
+    void readDepthBounds(FrameResources& frame) {
+      if (!frame.depthBoundsPending) {
+        return;
+      }
+      frame.depthBoundsPending = false;
+      const DepthBounds* bounds = static_cast<const DepthBounds*>(depthReduction.ring.mappedBlock(frame.depthBoundsOffset));
+      // no sample at all: the camera only sees the background
+      visibleBounds.valid = bounds->minValues[0] <= bounds->maxValues[0];
+      if (!visibleBounds.valid) {
+        return;
+      }
+      // inverse of orderedBits in reduce_depth.comp
+      auto decode = [](uint32_t bits) {
+        bits = (bits & 0x80000000u) ? bits & 0x7fffffffu : ~bits;
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+      };
+      visibleBounds.minDepth = decode(bounds->minValues[0]);
+      visibleBounds.maxDepth = decode(bounds->maxValues[0]);
+      visibleBounds.min = glm::vec3(decode(bounds->minValues[1]), decode(bounds->minValues[2]), decode(bounds->minValues[3]));
+      visibleBounds.max = glm::vec3(decode(bounds->maxValues[1]), decode(bounds->maxValues[2]), decode(bounds->maxValues[3]));
+    }
+
+    // Average the GPU time of the last frame rendered with these resources for the frame budget, and the queries of its
+    // scene pass in the sample of its mode (with or without the depth prepass), then model the scene pass as a fixed cost
+    // plus a cost per fragment shaded: both samples give the cost of a fragment, and the prepass pays for itself when the
+    // fragments it saves cost more than it does
+    void readFrameQueries(FrameResources& frame) {
+      if (!frame.queriesPending) {
+        return;
+      }
+      frame.queriesPending = false;
+      uint64_t timestamps[FrameQueryCount];
+      if (vkGetQueryPoolResults(device, frame.timestampQueries, 0, FrameQueryCount, sizeof(timestamps), timestamps, sizeof(uint64_t),
+                                VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+        return;
+      }
+      uint64_t fragments = 0;
+      if (gpuQueries.statistics &&
+          vkGetQueryPoolResults(device, frame.statisticsQueries, 0, 1, sizeof(fragments), &fragments, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+        return;
+      }
+
+      // exponential moving average, the first measure of a mode is taken as is
+      const float msPerTick = gpuQueries.timestampPeriod * 1e-6f;
+      // the frame time reacts faster: until a change of scale is measured, the last frame is taken as is
+      const float frameMs = ((timestamps[FrameEnd] - timestamps[FrameBegin]) & gpuQueries.timestampMask) * msPerTick;
+      frameBudget.frameMs += (frameBudget.frameMs > 0.0f && frameBudget.cooldown == 0 ? 0.3f : 1.0f) * (frameMs - frameBudget.frameMs);
+      stats.frameMs = frameBudget.frameMs;
+      auto& sample = prepassControl.samples[frame.queriesPrepass ? 1 : 0];
+      const float weight = sample.valid ? 0.1f : 1.0f;
+      sample.prepassMs += weight * (((timestamps[SceneBegin] - timestamps[PrepassBegin]) & gpuQueries.timestampMask) * msPerTick - sample.prepassMs);
+      sample.shadingMs += weight * (((timestamps[SceneEnd] - timestamps[SceneBegin]) & gpuQueries.timestampMask) * msPerTick - sample.shadingMs);
+      sample.fragments += weight * (static_cast<float>(fragments) - sample.fragments);
+      sample.valid = true;
+
+      stats.depthPrepass = frame.queriesPrepass;
+      stats.prepassMs = sample.prepassMs;
+      stats.shadingMs = sample.shadingMs;
+      const auto& off = prepassControl.samples[0];
+      const auto& on = prepassControl.samples[1];
+      if (gpuQueries.statistics && off.valid && on.valid && on.fragments > 0.0f) {
+        // with the prepass, each covered pixel is shaded once
+        stats.overdraw = off.fragments / on.fragments;
+        const float fragmentMs = off.fragments > on.fragments ? (off.shadingMs - on.shadingMs) / (off.fragments - on.fragments) : 0.0f;
+        stats.breakEvenOverdraw = fragmentMs > 0.0f ? 1.0f + on.prepassMs / (fragmentMs * on.fragments) : std::numeric_limits<float>::infinity();
+      }
+    }
+
+    // Switch the depth prepass (autoDepthPrepass): the mode not in use is measured for a few frames every probeInterval
+    // frames, then the prepass is kept on while the overdraw is above its break-even point
+    void updateDepthPrepass() {
+      auto& control = prepassControl;
+      if (!autoDepthPrepass || !gpuQueries.statistics || displayShadowMap) {
+        return;
+      }
+      if (control.probeFrames > 0) {
+        if (--control.probeFrames == 0) {
+          useDepthPrepass = stats.breakEvenOverdraw > 0.0f ? stats.overdraw > stats.breakEvenOverdraw : control.choice;
+        }
+      } else if (--control.countdown == 0) {
+        // the measures of the probe are read back once its frames in flight are done
+        control.countdown = control.probeInterval;
+        control.probeFrames = control.probeLength + MAX_FRAMES_IN_FLIGHT;
+        control.choice = useDepthPrepass;
+        useDepthPrepass = !useDepthPrepass;
+      }
+    }
+
+    // Hold targetFrameMs (useFrameBudget): over budget, the resolution of the shadow map rendered is lowered first, then
+    // the scene render scale; under budget, the scene resolution is restored first. The GPU time is taken to follow the
+    // pixels rendered, so a step aims at the target with the square root of the budget over the frame time
+    void updateFrameBudget() {
+      auto& budget = frameBudget;
+      if (!useFrameBudget || !gpuQueries.timestamps || displayShadowMap || budget.frameMs <= 0.0f) {
+        return;
+      }
+      if (budget.cooldown > 0) {
+        budget.cooldown--;
+        return;
+      }
+
+      // scales stay on a grid, rounded towards the direction of the step
+      auto stepScale = [&](float scale, float factor, float minScale) {
+        const float scaled = scale * factor * budget.scaleSteps;
+        return std::clamp((factor < 1.0f ? std::floor(scaled) : std::ceil(scaled)) / budget.scaleSteps, minScale, 1.0f);
+      };
+      // moment shadow maps are blurred and mipmapped as a whole, and without upscaling the scene fills the swap chain image
+      const float minShadow = useMomentShadows ? 1.0f : minShadowScale;
+      const float minRender = scenePass.upscale ? minRenderScale : 1.0f;
+      const float ratio = budget.frameMs / targetFrameMs;
+      const float step = std::sqrt(1.0f / ratio);
+      float shadowScale = budget.shadowScale;
+      float renderScale = budget.renderScale;
+      if (ratio > 1.05f) {
+        // a single scale changes per step, by at most a fifth down
+        const float factor = std::max(step, 0.8f);
+        if (shadowScale > minShadow) {
+          shadowScale = stepScale(shadowScale, factor, minShadow);
+        } else {
+          renderScale = stepScale(renderScale, factor, minRender);
+        }
+      } else if (ratio < 0.85f) {
+        // and a tenth up, so it creeps back to the budget rather than overshooting it
+        const float factor = std::min(step, 1.1f);
+        if (renderScale < 1.0f) {
+          renderScale = stepScale(renderScale, factor, minRender);
+        } else {
+          shadowScale = stepScale(shadowScale, factor, minShadow);
+        }
+      }
+      if (shadowScale == budget.shadowScale && renderScale == budget.renderScale) {
+        return;
+      }
+
+      // the frames in flight were recorded with the previous scales
+      budget.shadowScale = shadowScale;
+      budget.renderScale = renderScale;
+      budget.cooldown = MAX_FRAMES_IN_FLIGHT + 1;
+      updateRenderScales();
+    }
+
+    // Extents rendered at the scales of the frame budget: the corner of the layers of the shadow map, and the region of
+    // the color image upscaled to the window (the passes are rerecorded with them on the next frames)
+    void updateRenderScales() {
+      offscreenPass.renderSize = std::max(static_cast<uint32_t>(std::lround(frameBudget.shadowScale * offscreenPass.width)), 1u);
+      const float renderScale = scenePass.upscale ? frameBudget.renderScale : 1.0f;
+      scenePass.renderWidth = std::max(static_cast<uint32_t>(std::lround(renderScale * width)), 1u);
+      scenePass.renderHeight = std::max(static_cast<uint32_t>(std::lround(renderScale * height)), 1u);
+      stats.shadowScale = static_cast<float>(offscreenPass.renderSize) / offscreenPass.width;
+      stats.renderScale = renderScale;
+    }
+
+    // benchmark output: GPU times of the frame and of the scene pass, the scales of the frame budget, the overdraw of the
+    // scene pass and the overdraw where the depth prepass breaks even
+    void printFrameStats() {
+      if (!gpuQueries.timestamps || displayShadowMap) {
+        return;
+      }
+      std::cout << std::fixed << std::setprecision(3) << "frame " << stats.frameMs << " ms, render scale " << stats.renderScale
+                << ", shadow scale " << stats.shadowScale << std::endl;
+      std::cout << "scene pass: depth prepass " << (stats.depthPrepass ? "on" : "off")
+                << ", prepass " << stats.prepassMs << " ms, shading " << stats.shadingMs << " ms";
+      if (stats.breakEvenOverdraw > 0.0f) {
+        std::cout << std::setprecision(2) << ", overdraw " << stats.overdraw << ", break-even overdraw " << stats.breakEvenOverdraw;
+      }
+      std::cout << std::defaultfloat << std::endl;
     }
 
     // render frame
@@ -785,33 +2887,59 @@ class ShadowMapping {
       if (!swap_chain_ready)
         return;
 
-      // wait for the last frame to be finished (the fence is signaled by the present queue)
-      vkWaitForFences(device, 1, &waitFences[currentBuffer], VK_TRUE, UINT64_MAX);
+      FrameResources& frame = frames[currentFrame];
+
+      // wait for the GPU to finish the last frame that used these resources
+      // (with MAX_FRAMES_IN_FLIGHT frames, this is not the previous frame, so the CPU does not stall)
+      vkWaitForFences(device, 1, &frame.fence, VK_TRUE, UINT64_MAX);
+
+      // the queries of that frame are available: update the stats, and the mode of the depth prepass
+      readFrameQueries(frame);
+      updateDepthPrepass();
+      updateFrameBudget();
+      // and so are the bounds reduced from its depth, used by the shadow frustums of the next frame
+      readDepthBounds(frame);
 
       // prepare frame
-      VkResult result = swapChain.acquireNextImage(semaphPresentComplete, &currentBuffer);
+      VkResult result = swapChain.acquireNextImage(frame.presentComplete, &currentBuffer);
       if (result == VK_ERROR_OUT_OF_DATE_KHR) {
         // recreate the swapchain if it's no longer compatible with the surface (OUT_OF_DATE)
         recreateSwapChain();
+        return;
       } else if (result != VK_SUBOPTIMAL_KHR) {
         VK_CHECK_RESULT(result);
       }
 
-      // now that we have the image, we can reset the fence to block the next frame
-      vkResetFences(device, 1, &waitFences[currentBuffer]);
+      // now that we have the image, we can reset the fence to block the next use of this frame
+      vkResetFences(device, 1, &frame.fence);
 
-      // submit frame to queue
-      submit.info.pCommandBuffers = &drawCmdBuffers[currentBuffer];
-      VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submit.info, waitFences[currentBuffer]));
+      // update uniform buffers and record the command buffer of this frame
+      updateUniformBuffers(currentFrame);
+      recordFrame(currentFrame, currentBuffer);
 
-      // present frame and wait until the queue is idle
-      result = swapChain.queuePresent(queue, currentBuffer, semaphRenderComplete);
+      // submit frame to queue
+      // the swap chain image is first written by the scene pass, or by the upscale blit
+      VkPipelineStageFlags stageMask = scenePass.upscale ? VK_PIPELINE_STAGE_TRANSFER_BIT : VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+      VkSubmitInfo submitInfo = vks::initializers::submitInfo();
+      submitInfo.pWaitDstStageMask = &stageMask;
+      submitInfo.waitSemaphoreCount = 1;
+      submitInfo.pWaitSemaphores = &frame.presentComplete;
+      submitInfo.signalSemaphoreCount = 1;
+      submitInfo.pSignalSemaphores = &frame.renderComplete;
+      submitInfo.commandBufferCount = 1;
+      submitInfo.pCommandBuffers = &frame.cmdBuffer;
+      VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submitInfo, frame.fence));
+
+      // present frame
+      result = swapChain.queuePresent(queue, currentBuffer, frame.renderComplete);
       if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
         recreateSwapChain();
       } else {
         VK_CHECK_RESULT(result);
       }
-      VK_CHECK_RESULT(vkQueueWaitIdle(queue));
+
+      // advance to the next frame
+      currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
     }
 
     // called by renderFrame() on windows resize
@@ -837,26 +2965,29 @@ class ShadowMapping {
       swapChain.create(&width, &height);
 
       // recreate frame buffers attachments
+      if (scenePass.upscale) {
+        scenePass.color.destroy(device);
+        setupSceneColorAttachment();
+      }
+      if (useDepthReduction) {
+        vkDestroyImageView(device, scenePass.depthSampled, nullptr);
+      }
       scenePass.depth.destroy(device);
       setupSceneDepthAttachment();
+      if (useDepthReduction) {
+        updateDepthReductionDescriptor();
+      }
 
       // recreate frame buffers
       for (uint32_t i = 0; i < scenePass.frameBuffers.size(); i++) {
         vkDestroyFramebuffer(device, scenePass.frameBuffers[i], nullptr);
       }
+      vkDestroyFramebuffer(device, scenePass.prepassFrameBuffer, nullptr);
       setupSceneFrameBuffers();
 
-      // recreate command buffers (they store references to the old frame buffers)
-      vkFreeCommandBuffers(device, commandPool, static_cast<uint32_t>(drawCmdBuffers.size()), drawCmdBuffers.data());
-      setupCommandBuffers();
-
-      // recreate fences (number of swapchain images may have changed on resize)
-      for (auto& fence : waitFences) {
-        vkDestroyFence(device, fence, nullptr);
-      }
-      createFences();
-
-      vkDeviceWaitIdle(device);
+      // command buffers are rerecorded on the next frames: the scene pass sees the new extent,
+      // and the framebuffer is only referenced by the primary command buffer
+      updateRenderScales();
 
       // update camera aspect ratio
       if ((width > 0.0f) && (height > 0.0f)) {
@@ -879,25 +3010,54 @@ class ShadowMapping {
 
         // unload model and shaders
         scenes.clear();
+        vkglTF::geometryArena = nullptr;
+        geometryArena.destroy();
         for (auto& shaderModule : shaderModules) {
           vkDestroyShaderModule(device, shaderModule, nullptr);
         }
 
         // cleanup depth sampler, depth attachment and framebuffers
         vkDestroySampler(device, offscreenPass.depthSampler, nullptr);
+        vkDestroySampler(device, offscreenPass.shadowSampler, nullptr);
         offscreenPass.depth.destroy(device);
+        if (useMomentShadows) {
+          vkDestroySampler(device, offscreenPass.momentsSampler, nullptr);
+          vkDestroyImageView(device, offscreenPass.momentsTarget, nullptr);
+          offscreenPass.moments.destroy(device);
+          offscreenPass.momentsBlur.destroy(device);
+          vkDestroyPipeline(device, momentBlur.pipeline, nullptr);
+          vkDestroyPipelineLayout(device, momentBlur.layout, nullptr);
+          vkDestroyDescriptorSetLayout(device, momentBlur.descriptorLayout, nullptr);
+          vkDestroyDescriptorPool(device, momentBlur.pool, nullptr);
+        }
+        vkDestroySampler(device, shadowAtlas.sampler, nullptr);
+        shadowAtlas.depth.destroy(device);
+        vkDestroyFramebuffer(device, shadowAtlas.frameBuffer, nullptr);
+        if (useDepthReduction) {
+          vkDestroyImageView(device, scenePass.depthSampled, nullptr);
+          vkDestroySampler(device, depthReduction.sampler, nullptr);
+          vkDestroyPipeline(device, depthReduction.pipeline, nullptr);
+          vkDestroyPipelineLayout(device, depthReduction.layout, nullptr);
+          vkDestroyDescriptorSetLayout(device, depthReduction.descriptorLayout, nullptr);
+          vkDestroyDescriptorPool(device, depthReduction.pool, nullptr);
+          depthReduction.ring.destroy();
+        }
         scenePass.depth.destroy(device);
+        if (scenePass.upscale) {
+          scenePass.color.destroy(device);
+        }
         vkDestroyFramebuffer(device, offscreenPass.frameBuffer, nullptr);
         for (auto& framebuffer : scenePass.frameBuffers) {
           vkDestroyFramebuffer(device, framebuffer, nullptr);
         }
+        vkDestroyFramebuffer(device, scenePass.prepassFrameBuffer, nullptr);
 
         // swap chain and surface
         swapChain.cleanup();
 
         // uniform buffers
-        offscreenPass.uniformBuffer.destroy();
-        scenePass.uniformBuffer.destroy();
+        uniformRing.destroy();
+        lightRing.destroy();
 
         // descriptor pool & layout
         vkDestroyDescriptorPool(device, descriptors.pool, nullptr);
@@ -906,17 +3066,36 @@ class ShadowMapping {
         // pipelines & render passes
         vkDestroyPipeline(device, pipelines.debug, nullptr);
         vkDestroyPipeline(device, pipelines.offscreen, nullptr);
+        if (offscreenPass.imageLayers == 6) {
+          vkDestroyPipeline(device, pipelines.offscreenSpot, nullptr);
+          vkDestroyRenderPass(device, offscreenPass.spotRenderPass, nullptr);
+          vkDestroyRenderPass(device, offscreenPass.spotRenderPassUpdate, nullptr);
+          vkDestroyFramebuffer(device, offscreenPass.spotFrameBuffer, nullptr);
+        }
+        vkDestroyPipeline(device, pipelines.shadowAtlas, nullptr);
         vkDestroyPipeline(device, pipelines.sceneShadow, nullptr);
+        vkDestroyPipeline(device, pipelines.sceneShadowEqual, nullptr);
+        vkDestroyPipeline(device, pipelines.depthPrepass, nullptr);
         vkDestroyPipelineLayout(device, pipelines.layout, nullptr);
-      	vkDestroyPipelineCache(device, pipelines.cache, nullptr);
+        vkDestroyPipelineCache(device, pipelines.cache, nullptr);
         vkDestroyRenderPass(device, offscreenPass.renderPass, nullptr);
+        vkDestroyRenderPass(device, offscreenPass.renderPassUpdate, nullptr);
+        vkDestroyRenderPass(device, shadowAtlas.renderPass, nullptr);
         vkDestroyRenderPass(device, scenePass.renderPass, nullptr);
-
-        // semaphores & fences
-        vkDestroySemaphore(device, semaphPresentComplete, nullptr);
-        vkDestroySemaphore(device, semaphRenderComplete, nullptr);
-        for (auto& fence : waitFences) {
-          vkDestroyFence(device, fence, nullptr);
+        vkDestroyRenderPass(device, scenePass.renderPassLoadDepth, nullptr);
+        vkDestroyRenderPass(device, scenePass.prepassRenderPass, nullptr);
+
+        // per-frame command pools, semaphores & fences
+        for (auto& frame : frames) {
+          vk::destroyThreadCommandPools(device, frame.offscreenSecondaries);
+          vk::destroyThreadCommandPools(device, frame.sceneSecondaries);
+          vk::destroyThreadCommandPools(device, frame.prepassSecondaries);
+          vkDestroyQueryPool(device, frame.timestampQueries, nullptr);
+          vkDestroyQueryPool(device, frame.statisticsQueries, nullptr);
+          vkDestroyCommandPool(device, frame.commandPool, nullptr);
+          vkDestroySemaphore(device, frame.presentComplete, nullptr);
+          vkDestroySemaphore(device, frame.renderComplete, nullptr);
+          vkDestroyFence(device, frame.fence, nullptr);
         }
 
         // cleanup command pool and logical device
@@ -925,7 +3104,7 @@ class ShadowMapping {
         // cleanup debug messenger and instance
         vk::destroyDebugUtilsMessengerEXT(instance, debugMsgr, nullptr);
         vkDestroyInstance(instance, nullptr);
-		  }
+      }
     }
 
 };
@@ -935,6 +3114,9 @@ class ShadowMapping {
 int main(int argc, char* argv[]) {
   uint32_t w = 800, h = 600;
   bool debug = false;
+  bool cascades = false;
+  uint32_t spotLights = 0;
+  bool stats = false;
 
   // parse command line arguments
   for (int i = 1; i < argc; i++) {
@@ -949,6 +3131,16 @@ int main(int argc, char* argv[]) {
     } else if (strcmp(argv[i], "-d") == 0) {
       // show shadow map (render scene from light's point of view)
       debug = true;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      // directional light with cascaded shadow maps instead of the point light
+      cascades = true;
+    } else if (strcmp(argv[i], "-s") == 0) {
+      // number of shadowed spot lights around the scene
+      spotLights = atoi(argv[i + 1]);
+      i++;
+    } else if (strcmp(argv[i], "-p") == 0) {
+      // print the GPU times, the frame budget scales and the overdraw every few seconds
+      stats = true;
     }
   }
 
@@ -972,6 +3164,9 @@ int main(int argc, char* argv[]) {
   shadowMapping->width = w;
   shadowMapping->height = h;
   shadowMapping->displayShadowMap = debug;
+  shadowMapping->useCascades = cascades;
+  shadowMapping->spotLightCount = spotLights;
+  shadowMapping->printStats = stats;
   // shadowMapping->paused = true;
   // shadowMapping->lightPos = glm::vec3(-2.0f, -50.0f, 10.0f);
   shadowMapping->init();
@@ -9,10 +9,15 @@ using namespace vk;
 
 class Application {
   public:
+    bool clusterCulling = false; // draw the meshlets left by a compute culling pass (-cull)
+    bool meshShaders = false;    // draw the meshlets with task and mesh shaders (-mesh)
+
     void run() {
       initWindow();
 
       kilauea = Kilauea(window);
+      kilauea.useClusterCulling = clusterCulling;
+      kilauea.useMeshShaders = meshShaders;
       kilauea.init();
 
       // resize callback
@@ -50,9 +55,18 @@ class Application {
     }
 };
 
-int main() {
+int main(int argc, char* argv[]) {
   Application app;
 
+  // parse command line arguments
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-cull") == 0) {
+      app.clusterCulling = true;
+    } else if (strcmp(argv[i], "-mesh") == 0) {
+      app.meshShaders = true;
+    }
+  }
+
   try {
     app.run();
   } catch (const std::exception& e) {
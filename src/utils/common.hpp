@@ -30,6 +30,7 @@
 
 // standard
 #include <iostream>  // std::cerr, std::endl
+#include <iomanip>   // std::setprecision
 #include <stdexcept> // std::exception, std::runtime_error
 #include <fstream>   // std::ifstream
 #include <cstdlib>   // EXIT_SUCCESS, EXIT_FAILURE
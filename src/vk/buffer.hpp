@@ -3,16 +3,25 @@
 #include "../utils/common.hpp"
 #include "vertex.hpp"
 
+#include <base/VulkanGeometryArena.hpp>
+#include <base/VulkanMeshOptimizer.hpp>
+#include <base/VulkanUniformRing.hpp>
+
 namespace vk {
 
 
 // more about alignas at https://docs.vulkan.org/tutorial/latest/05_Uniform_buffers/01_Descriptor_pool_and_sets.html#_alignment_requirements
+// per-frame data, sub-allocated from the uniform ring and bound with a dynamic offset
 struct UniformBufferObject {
-  alignas(16) glm::mat4 model;
   alignas(16) glm::mat4 view;
   alignas(16) glm::mat4 proj;
 };
 
+// per-draw data, recorded in the command buffer with vkCmdPushConstants (at most 128 bytes are guaranteed)
+struct PushConstants {
+  alignas(16) glm::mat4 model;
+};
+
 
 uint32_t findMemoryType(VkPhysicalDevice physicalDevice, uint32_t typeFilter,
                         VkMemoryPropertyFlags properties) {
@@ -111,98 +120,47 @@ void copyBuffer(VkDevice device, VkCommandPool commandPool, VkQueue graphicsQueu
 }
 
 
-// create a vertex buffer in device local memory
-void createVertexBuffer(VkDevice device, VkPhysicalDevice physicalDevice, VkCommandPool commandPool,
-                        VkQueue graphicsQueue, const std::vector<Vertex>& vertices,
-                        VkBuffer& vertexBuffer, VkDeviceMemory& vertexBufferMemory) {
-
-  // create a temporary buffer in a memory that is accessible by both CPU and GPU
-  VkBuffer stagingBuffer;
-  VkDeviceMemory stagingBufferMemory;
-  VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
-  createBuffer(device, physicalDevice, bufferSize,
-               VK_BUFFER_USAGE_TRANSFER_SRC_BIT,     // buffer is used as the source in a memory transfer operation
-               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | // memory is mappable by the host
-               VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, // memory is coherent, meaning that writes are visible to the device
-               stagingBuffer, stagingBufferMemory);
-
-  // map memory in the CPU to the staging buffer, copy vertices into it, unmap
-  void* data;
-  vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-  memcpy(data, vertices.data(), (size_t) bufferSize);
-  vkUnmapMemory(device, stagingBufferMemory);
-
-  // create the final vertex buffer in device local memory (not accessible by CPU)
-  createBuffer(device, physicalDevice, bufferSize,
-               VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, // local device memory
-               vertexBuffer, vertexBufferMemory);
-
-  // copy the staging buffer to the vertex buffer
-  copyBuffer(device, commandPool, graphicsQueue, stagingBuffer, vertexBuffer, bufferSize);
+// copy the vertices and indices of a mesh into free ranges of the shared geometry arena (vertex stream 0,
+// indices of the arena index type), the mesh is then drawn with firstIndex / vertexOffset of the allocation
+vks::GeometryArena::Allocation uploadMesh(VkCommandPool commandPool, VkQueue graphicsQueue,
+                                          const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices,
+                                          vks::GeometryArena& arena) {
+  if (arena.stride(0) != sizeof(Vertex)) {
+    throw std::runtime_error("failed to upload mesh: the vertex size does not match the geometry arena!");
+  }
+  if (arena.getIndexType() == VK_INDEX_TYPE_UINT16 && vertices.size() > 65536) {
+    throw std::runtime_error("failed to upload mesh: too many vertices for 16 bit indices!");
+  }
+  std::vector<uint8_t> packedIndices = vks::mesh::packIndices(indices.data(), indices.size(), arena.getIndexType());
 
-  // cleanup of temporary buffer
-  vkDestroyBuffer(device, stagingBuffer, nullptr);
-  vkFreeMemory(device, stagingBufferMemory, nullptr);
+  vks::GeometryArena::Allocation mesh = arena.allocate(static_cast<uint32_t>(vertices.size()), static_cast<uint32_t>(indices.size()));
+  arena.upload(commandPool, graphicsQueue, mesh, {vertices.data()}, packedIndices.data());
+  return mesh;
 }
 
 
-// create an index buffer in device local memory
-void createIndexBuffer(VkDevice device, VkPhysicalDevice physicalDevice, VkCommandPool commandPool,
-                       VkQueue graphicsQueue, const std::vector<uint32_t>& indices,
-                       VkBuffer& indexBuffer, VkDeviceMemory& indexBufferMemory) {
-
-  VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
-
-  // create a temporary buffer in a memory that is accessible by both CPU and GPU
+// create a buffer in device local memory with the given usage, filled with size bytes of data
+void createDeviceLocalBuffer(VkDevice device, VkPhysicalDevice physicalDevice, VkCommandPool commandPool,
+                             VkQueue graphicsQueue, const void* data, VkDeviceSize size,
+                             VkBufferUsageFlags usage, VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
   VkBuffer stagingBuffer;
   VkDeviceMemory stagingBufferMemory;
-  createBuffer(device, physicalDevice, bufferSize,
-               VK_BUFFER_USAGE_TRANSFER_SRC_BIT,     // buffer is used as the source in a memory transfer operation
-               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | // memory is mappable by the host
-               VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, // memory is coherent, meaning that writes are visible to the device
+  createBuffer(device, physicalDevice, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
                stagingBuffer, stagingBufferMemory);
 
-  // map memory in the CPU to the staging buffer, copy indices into it, unmap
-  void* data;
-  vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-  memcpy(data, indices.data(), (size_t) bufferSize);
+  void* mapped;
+  vkMapMemory(device, stagingBufferMemory, 0, size, 0, &mapped);
+  memcpy(mapped, data, (size_t) size);
   vkUnmapMemory(device, stagingBufferMemory);
 
-  // create the final index buffer in device local memory (not accessible by CPU)
-  createBuffer(device, physicalDevice, bufferSize,
-               VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, // local device memory
-               indexBuffer, indexBufferMemory);
-
-  // copy the staging buffer to the index buffer
-  copyBuffer(device, commandPool, graphicsQueue, stagingBuffer, indexBuffer, bufferSize);
+  createBuffer(device, physicalDevice, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage,
+               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, bufferMemory);
+  copyBuffer(device, commandPool, graphicsQueue, stagingBuffer, buffer, size);
 
-  // cleanup of temporary buffer
   vkDestroyBuffer(device, stagingBuffer, nullptr);
   vkFreeMemory(device, stagingBufferMemory, nullptr);
 }
 
 
-// create uniform buffers for each frame in CPU visible memory
-void createUniformBuffers(VkDevice device, VkPhysicalDevice physicalDevice,
-                          std::vector<VkBuffer>& uniformBuffers,
-                          std::vector<VkDeviceMemory>& uniformBuffersMemory,
-                          std::vector<void*>& uniformBuffersMapped) {
-
-  VkDeviceSize bufferSize = sizeof(UniformBufferObject);
-  uniformBuffers.resize(MAX_FRAMES_IN_FLIGHT);
-  uniformBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
-  uniformBuffersMapped.resize(MAX_FRAMES_IN_FLIGHT);
-
-  for (size_t i=0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-    createBuffer(device, physicalDevice, bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                 uniformBuffers[i], uniformBuffersMemory[i]);
-
-    // persistent mapping: map the buffers once and keep them mapped during app lifetime
-    vkMapMemory(device, uniformBuffersMemory[i], 0, bufferSize, 0, &uniformBuffersMapped[i]);
-  }
-}
-
 } // namespace vk
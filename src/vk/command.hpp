@@ -1,17 +1,24 @@
 #pragma once
 
 #include "../utils/common.hpp"
+#include "buffer.hpp"
 #include "queue_family.hpp"
 #include "vertex.hpp"
 
+#include <base/VulkanGeometryArena.hpp>
 #include <base/VulkanTools.h>
 #include <base/VulkanInitializers.hpp>
 
+#ifdef OPENMP
+#include <omp.h>
+#endif
+
 namespace vk {
 
 // the simplest way to create a command pool
-void createCommandPool(VkDevice device, uint32_t queueFamilyIndex, VkCommandPool& commandPool) {
-  VkCommandPoolCreateInfo cmdPoolInfo = vks::initializers::commandPoolCreateInfo(queueFamilyIndex, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
+void createCommandPool(VkDevice device, uint32_t queueFamilyIndex, VkCommandPool& commandPool,
+                       VkCommandPoolCreateFlags flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT) {
+  VkCommandPoolCreateInfo cmdPoolInfo = vks::initializers::commandPoolCreateInfo(queueFamilyIndex, flags);
   VK_CHECK_RESULT(vkCreateCommandPool(device, &cmdPoolInfo, nullptr, &commandPool));
 }
 
@@ -55,8 +62,9 @@ void createCommandBuffers(VkDevice device, VkCommandPool commandPool, std::vecto
 void recordCommandBuffer(VkCommandBuffer commandBuffer, VkRenderPass renderPass, VkExtent2D swapChainExtent,
                          std::vector<VkFramebuffer>& swapChainFramebuffers, uint32_t imageIndex,
                          VkPipeline graphicsPipeline, bool useDynamicStates, VkBuffer vertexBuffer,
-                         VkBuffer indexBuffer, uint32_t indexBufferSize, VkPipelineLayout pipelineLayout,
-                         VkDescriptorSet& descriptorSet) {
+                         VkBuffer indexBuffer, const vks::GeometryArena::Allocation& mesh, VkIndexType indexType,
+                         VkPipelineLayout pipelineLayout, VkDescriptorSet descriptorSet, uint32_t uniformOffset,
+                         const PushConstants& pushConstants) {
   VkCommandBufferBeginInfo beginInfo{};
   beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
   beginInfo.pInheritanceInfo = nullptr; // only relevant for secondary command buffers
@@ -122,14 +130,17 @@ void recordCommandBuffer(VkCommandBuffer commandBuffer, VkRenderPass renderPass,
   vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
 
   // bind index buffer (UINT16 or UINT32)
-  vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+  vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, indexType);
 
-  // bind the descriptor set
+  // bind the descriptor set, the dynamic offset selects the uniform data of this frame in the ring
   vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                          pipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+                          pipelineLayout, 0, 1, &descriptorSet, 1, &uniformOffset);
+
+  // per-draw values are recorded in the command buffer itself
+  vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstants), &pushConstants);
 
-  // draw !!
-  vkCmdDrawIndexed(commandBuffer, indexBufferSize, 1, 0, 0, 0);
+  // draw !! (the mesh is a range of the shared vertex and index buffers)
+  vkCmdDrawIndexed(commandBuffer, mesh.indexCount, 1, mesh.firstIndex, mesh.firstVertex, 0);
 
   vkCmdEndRenderPass(commandBuffer);
 
@@ -138,4 +149,176 @@ void recordCommandBuffer(VkCommandBuffer commandBuffer, VkRenderPass renderPass,
   }
 }
 
+
+
+/************************ multithreaded recording ************************/
+
+// number of threads used to record secondary command buffers
+// (build with `make OPENMP=1` to record in parallel, otherwise recording is serial)
+uint32_t getRecordingThreadCount() {
+#ifdef OPENMP
+  return static_cast<uint32_t>(omp_get_max_threads());
+#else
+  return 1;
+#endif
+}
+
+// one command pool per recording thread: a pool, and the command buffers allocated
+// from it, must never be used by two threads at the same time
+struct ThreadCommandPools {
+  std::vector<VkCommandPool> pools;                    // one pool per thread
+  std::vector<std::vector<VkCommandBuffer>> secondary; // secondary command buffers of each pool
+
+  uint32_t threadCount() const { return static_cast<uint32_t>(pools.size()); }
+
+  // job j is always recorded by thread j % threadCount (see recordParallel)
+  VkCommandBuffer& buffer(uint32_t job) {
+    return secondary[job % threadCount()][job / threadCount()];
+  }
+};
+
+// create one pool per thread, each with enough secondary command buffers for jobCount jobs.
+// the pools are meant to be reset as a whole with vkResetCommandPool, use TRANSIENT_BIT
+// in flags if they are rerecorded every frame
+void createThreadCommandPools(VkDevice device, uint32_t queueFamilyIndex, uint32_t threadCount,
+                              uint32_t jobCount, ThreadCommandPools& threadPools,
+                              VkCommandPoolCreateFlags flags = 0) {
+  threadPools.pools.resize(threadCount);
+  threadPools.secondary.resize(threadCount);
+  uint32_t buffersPerThread = (jobCount + threadCount - 1) / threadCount;
+  for (uint32_t t = 0; t < threadCount; t++) {
+    createCommandPool(device, queueFamilyIndex, threadPools.pools[t], flags);
+    threadPools.secondary[t].resize(buffersPerThread);
+    if (buffersPerThread > 0) {
+      VkCommandBufferAllocateInfo allocInfo = vks::initializers::commandBufferAllocateInfo(
+            threadPools.pools[t], VK_COMMAND_BUFFER_LEVEL_SECONDARY, buffersPerThread);
+      VK_CHECK_RESULT(vkAllocateCommandBuffers(device, &allocInfo, threadPools.secondary[t].data()));
+    }
+  }
+}
+
+// destroying a pool also frees all the command buffers allocated from it
+void destroyThreadCommandPools(VkDevice device, ThreadCommandPools& threadPools) {
+  for (auto& pool : threadPools.pools) {
+    vkDestroyCommandPool(device, pool, nullptr);
+  }
+  threadPools.pools.clear();
+  threadPools.secondary.clear();
+}
+
+// begin a secondary command buffer that will be executed inside the given render pass
+// note: secondary command buffers do not inherit any state (pipeline, viewport, buffers...)
+// pipelineStatistics: statistics the pipeline statistics query active in the primary command buffer may count
+// (needs the pipelineStatisticsQuery feature, and inheritedQueries to execute the secondary while a query is active)
+void beginSecondaryCommandBuffer(VkCommandBuffer commandBuffer, VkRenderPass renderPass,
+                                 uint32_t subpass, VkFramebuffer framebuffer,
+                                 VkQueryPipelineStatisticFlags pipelineStatistics = 0) {
+  VkCommandBufferInheritanceInfo inheritanceInfo = vks::initializers::commandBufferInheritanceInfo();
+  inheritanceInfo.renderPass = renderPass;
+  inheritanceInfo.subpass = subpass;
+  inheritanceInfo.framebuffer = framebuffer; // optional, but may help the driver
+  inheritanceInfo.pipelineStatistics = pipelineStatistics;
+
+  VkCommandBufferBeginInfo beginInfo = vks::initializers::commandBufferBeginInfo();
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+  beginInfo.pInheritanceInfo = &inheritanceInfo;
+  VK_CHECK_RESULT(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+}
+
+// call record(job, thread) for every job in [0, jobCount), spread over threadCount threads.
+// job j is always recorded by thread j % threadCount, so each thread only touches its own pool.
+// if OpenMP gives us fewer threads than asked, a thread takes over the jobs of the missing ones.
+template <typename RecordFunc>
+void recordParallel(uint32_t jobCount, uint32_t threadCount, RecordFunc record) {
+#ifdef OPENMP
+  #pragma omp parallel num_threads(threadCount)
+#endif
+  {
+    uint32_t thread = 0, runningThreads = 1;
+#ifdef OPENMP
+    thread = static_cast<uint32_t>(omp_get_thread_num());
+    runningThreads = static_cast<uint32_t>(omp_get_num_threads());
+#endif
+    for (uint32_t t = thread; t < threadCount; t += runningThreads) {
+      for (uint32_t job = t; job < jobCount; job += threadCount) {
+        record(job, t);
+      }
+    }
+  }
+}
+
+// same as recordCommandBuffer, but the draw is split into drawChunks secondary command
+// buffers recorded in parallel (one per job) and executed from the primary command buffer
+void recordCommandBufferParallel(VkDevice device, VkCommandBuffer commandBuffer, ThreadCommandPools& threadPools,
+                                 uint32_t drawChunks, VkRenderPass renderPass, VkExtent2D swapChainExtent,
+                                 std::vector<VkFramebuffer>& swapChainFramebuffers, uint32_t imageIndex,
+                                 VkPipeline graphicsPipeline, VkBuffer vertexBuffer,
+                                 VkBuffer indexBuffer, const vks::GeometryArena::Allocation& mesh, VkIndexType indexType,
+                                 VkPipelineLayout pipelineLayout, VkDescriptorSet descriptorSet, uint32_t uniformOffset,
+                                 const PushConstants& pushConstants) {
+  VkFramebuffer framebuffer = swapChainFramebuffers[imageIndex];
+
+  // the pools only hold the command buffers of this frame, so they can all be reset at once
+  for (auto& pool : threadPools.pools) {
+    VK_CHECK_RESULT(vkResetCommandPool(device, pool, 0));
+  }
+
+  // record the chunks of indices, each chunk is a complete list of triangles
+  uint32_t triangles = mesh.indexCount / 3;
+  recordParallel(drawChunks, threadPools.threadCount(), [&](uint32_t job, uint32_t thread) {
+    VkCommandBuffer secondary = threadPools.buffer(job);
+    beginSecondaryCommandBuffer(secondary, renderPass, 0, framebuffer);
+
+    vkCmdBindPipeline(secondary, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+
+    // viewport and scissor are dynamic states, they must be set in every secondary command buffer
+    VkViewport viewport = vks::initializers::viewport((float)swapChainExtent.width, (float)swapChainExtent.height, 0.0f, 1.0f);
+    vkCmdSetViewport(secondary, 0, 1, &viewport);
+    VkRect2D scissor = vks::initializers::rect2D(swapChainExtent.width, swapChainExtent.height, 0, 0);
+    vkCmdSetScissor(secondary, 0, 1, &scissor);
+
+    VkDeviceSize offsets[] = {0};
+    vkCmdBindVertexBuffers(secondary, 0, 1, &vertexBuffer, offsets);
+    vkCmdBindIndexBuffer(secondary, indexBuffer, 0, indexType);
+    vkCmdBindDescriptorSets(secondary, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            pipelineLayout, 0, 1, &descriptorSet, 1, &uniformOffset);
+    vkCmdPushConstants(secondary, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstants), &pushConstants);
+
+    uint32_t firstTriangle = triangles * job / drawChunks;
+    uint32_t lastTriangle  = triangles * (job + 1) / drawChunks;
+    if (lastTriangle > firstTriangle) {
+      vkCmdDrawIndexed(secondary, 3 * (lastTriangle - firstTriangle), 1, mesh.firstIndex + 3 * firstTriangle, mesh.firstVertex, 0);
+    }
+
+    VK_CHECK_RESULT(vkEndCommandBuffer(secondary));
+  });
+
+  // primary command buffer: begin the render pass and execute the secondary command buffers
+  VkCommandBufferBeginInfo beginInfo = vks::initializers::commandBufferBeginInfo();
+  VK_CHECK_RESULT(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+
+  std::array<VkClearValue, 2> clearValues{};
+  clearValues[0].color = {{0.1f, 0.1f, 0.1f, 1.0f}}; // gray
+  clearValues[1].depthStencil = {1.0f, 0};           // 1.0f is the far plane
+
+  VkRenderPassBeginInfo renderPassInfo = vks::initializers::renderPassBeginInfo();
+  renderPassInfo.renderPass = renderPass;
+  renderPassInfo.framebuffer = framebuffer;
+  renderPassInfo.renderArea.offset = {0, 0};
+  renderPassInfo.renderArea.extent = swapChainExtent;
+  renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
+  renderPassInfo.pClearValues = clearValues.data();
+
+  vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+  std::vector<VkCommandBuffer> secondaries(drawChunks);
+  for (uint32_t job = 0; job < drawChunks; job++) {
+    secondaries[job] = threadPools.buffer(job);
+  }
+  vkCmdExecuteCommands(commandBuffer, drawChunks, secondaries.data());
+
+  vkCmdEndRenderPass(commandBuffer);
+  VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer));
+}
+
 } // namespace vk
@@ -7,9 +7,10 @@
 namespace vk {
 
 // create a logical device and a graphics queue
+// enableMeshShaders enables VK_EXT_mesh_shader, check it with checkMeshShaderSupport first
 void createLogicalDevice(VkPhysicalDevice physDevice, VkDevice& device,
                          QueueFamilyIndices indices, VkQueue *graphicsQueue,
-                         VkQueue *presentQueue) {
+                         VkQueue *presentQueue, bool enableMeshShaders = false) {
   // contains a bool for every feature in Vulkan
   // enable the desired features here
   VkPhysicalDeviceFeatures deviceFeatures{};
@@ -38,8 +39,22 @@ void createLogicalDevice(VkPhysicalDevice physDevice, VkDevice& device,
 
   // logical device extensions
   // TODO: deviceExtensions is defined in physical_device.hpp
-  createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-  createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+  std::vector<const char*> extensions(deviceExtensions.begin(), deviceExtensions.end());
+
+  // task and mesh shaders are optional features, chained to the create info
+#ifdef VK_EXT_mesh_shader
+  VkPhysicalDeviceMeshShaderFeaturesEXT meshShaderFeatures{};
+  meshShaderFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MESH_SHADER_FEATURES_EXT;
+  if (enableMeshShaders) {
+    meshShaderFeatures.taskShader = VK_TRUE;
+    meshShaderFeatures.meshShader = VK_TRUE;
+    createInfo.pNext = &meshShaderFeatures;
+    extensions.push_back(VK_EXT_MESH_SHADER_EXTENSION_NAME);
+  }
+#endif
+
+  createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+  createInfo.ppEnabledExtensionNames = extensions.data();
 
   // the validation layers per device are deprecated
   // recent versions of Vulkan ignore the following parameters
@@ -69,7 +69,7 @@ void createInstance(VkInstance& instance) {
   appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
   appInfo.pEngineName = "No Engine";
   appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-  appInfo.apiVersion = VK_API_VERSION_1_0;
+  appInfo.apiVersion = VK_API_VERSION_1_2; // vkGetPhysicalDeviceFeatures2, SPIR-V 1.4 for mesh shaders
 
   // required information, global
   VkInstanceCreateInfo createInfo{};
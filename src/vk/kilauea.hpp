@@ -11,6 +11,7 @@
 #include "device.hpp"
 #include "framebuffer.hpp"
 #include "instance.hpp"
+#include "meshlet.hpp"
 #include "model.hpp"
 #include "physical_device.hpp"
 #include "pipeline.hpp"
@@ -30,31 +31,42 @@ class Kilauea {
     Kilauea() = default;
     Kilauea(GLFWwindow* window) : window(window) {};
 
+    // optional meshlet paths, set before init (the draws are recorded in secondary command buffers otherwise)
+    bool useClusterCulling = false;  // cull meshlets in a compute pass and draw the rest indirectly
+    bool useMeshShaders = false;     // draw meshlets with task and mesh shaders, if the device supports them
+
 
     void init() {
       loadModel(vertices, indices);
+      indexType = vks::mesh::indexTypeFor(static_cast<uint32_t>(vertices.size()));
       createInstance(instance);
       setupDebugMessenger(instance, debugMsgr);
       createSurface(instance, surface);
       pickPhysicalDevice(instance, surface, physicalDevice, queueFamilies);
-      createLogicalDevice(physicalDevice, device, queueFamilies, &graphicsQueue, &presentQueue);
+      useMeshShaders = useMeshShaders && checkMeshShaderSupport(physicalDevice);
+      createLogicalDevice(physicalDevice, device, queueFamilies, &graphicsQueue, &presentQueue, useMeshShaders);
       createSwapChain(physicalDevice, device, surface, window, swapChain, swapChainImages, swapChainImageFormat, swapChainExtent);
       createImageViews(device, swapChainImages, swapChainImageFormat, swapChainImageViews);
       createRenderPass(device, swapChainImageFormat, findDepthFormat(physicalDevice), renderPass);
       createDescriptorSetLayout(device, descriptorSetLayout);
-      createGraphicsPipeline(device, swapChainExtent, renderPass, useDynamicStates, descriptorSetLayout, pipelineLayout, graphicsPipeline);
+      createGraphicsPipeline(device, swapChainExtent, renderPass, useDynamicStates, useVertexPulling,
+                             descriptorSetLayout, pipelineLayout, graphicsPipeline);
       createCommandPool(device, physicalDevice, surface, queueFamilies, commandPool);
       createDepthResources(device, physicalDevice, swapChainExtent, depthImage, depthImageMemory, depthImageView);
       createFramebuffers(device, swapChainExtent, renderPass, swapChainImageViews, depthImageView, swapChainFramebuffers);
       createTextureImage(device, physicalDevice, commandPool, graphicsQueue, textureImage, textureImageMemory);
       createTextureImageView(device, textureImage, textureImageView);
       createTextureSampler(device, physicalDevice, textureSampler);
-      createVertexBuffer(device, physicalDevice, commandPool, graphicsQueue, vertices, vertexBuffer, vertexBufferMemory);
-      createIndexBuffer(device, physicalDevice, commandPool, graphicsQueue, indices, indexBuffer, indexBufferMemory);
-      createUniformBuffers(device, physicalDevice, uniformBuffers, uniformBuffersMemory, uniformBuffersMapped);
+      createGeometry();
+      uniformRing.create(device, physicalDevice, sizeof(UniformBufferObject), MAX_FRAMES_IN_FLIGHT);
       createDescriptorPool(device, descriptorPool);
-      createDescriptorSets(device, descriptorPool, descriptorSetLayout, textureImageView, textureSampler, uniformBuffers, descriptorSets);
+      createDescriptorSet(device, descriptorPool, descriptorSetLayout, textureImageView, textureSampler, uniformRing,
+                          geometryArena.vertexBuffer(0, mesh.chunk), descriptorSet);
+      if (useClusterCulling || useMeshShaders) {
+        createMeshletResources();
+      }
       createCommandBuffers(device, commandPool, commandBuffers);
+      createSecondaryCommandPools();
       createSyncObjects();
     }
 
@@ -71,10 +83,7 @@ class Kilauea {
       vkFreeMemory(device, textureImageMemory, nullptr);
 
       // uniform buffers and descriptor sets
-      for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-        vkDestroyBuffer(device, uniformBuffers[i], nullptr);
-        vkFreeMemory(device, uniformBuffersMemory[i], nullptr);
-      }
+      uniformRing.destroy();
       vkDestroyDescriptorPool(device, descriptorPool, nullptr);
       vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
 
@@ -83,11 +92,14 @@ class Kilauea {
       vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
       vkDestroyRenderPass(device, renderPass, nullptr);
 
+      // meshlets
+      if (useClusterCulling || useMeshShaders) {
+        destroyMeshletResources();
+      }
+
       // vertex and index buffers
-      vkDestroyBuffer(device, vertexBuffer, nullptr);
-      vkFreeMemory(device, vertexBufferMemory, nullptr);
-      vkDestroyBuffer(device, indexBuffer, nullptr);
-      vkFreeMemory(device, indexBufferMemory, nullptr);
+      geometryArena.free(mesh);
+      geometryArena.destroy();
 
       // semaphores and fences
       for (size_t i=0; i < MAX_FRAMES_IN_FLIGHT; i++) {
@@ -96,6 +108,9 @@ class Kilauea {
         vkDestroyFence(device, inFlightFences[i], nullptr);
       }
 
+      for (auto& threadPools : secondaryPools) {
+        destroyThreadCommandPools(device, threadPools);
+      }
       vkDestroyCommandPool(device, commandPool, nullptr);
       vkDestroyDevice(device, nullptr);
 
@@ -128,10 +143,29 @@ class Kilauea {
 
       // record the command buffer
       vkResetCommandBuffer(commandBuffers[curFrame], 0); // 0 flags
-      recordCommandBuffer(commandBuffers[curFrame], renderPass, swapChainExtent,
-                          swapChainFramebuffers, imageIndex, graphicsPipeline,
-                          useDynamicStates, vertexBuffer, indexBuffer,
-                          (uint32_t)indices.size(), pipelineLayout, descriptorSets[curFrame]);
+      // the parallel path sets viewport and scissor in every secondary command buffer (dynamic states)
+      if (useMeshShaders) {
+#ifdef VK_EXT_mesh_shader
+        recordCommandBufferMeshShading(commandBuffers[curFrame], meshShading, meshletBuffers,
+                                       renderPass, swapChainExtent, swapChainFramebuffers, imageIndex,
+                                       uniformOffset, pushConstants);
+#endif
+      } else if (useClusterCulling && useDynamicStates) {
+        recordCommandBufferCulled(commandBuffers[curFrame], clusterCulling, meshletBuffers, curFrame,
+                                  renderPass, swapChainExtent, swapChainFramebuffers, imageIndex,
+                                  graphicsPipeline, geometryArena.vertexBuffer(0, mesh.chunk), pipelineLayout, descriptorSet,
+                                  uniformOffset, pushConstants);
+      } else if (useSecondaryCommandBuffers && useDynamicStates) {
+        recordCommandBufferParallel(device, commandBuffers[curFrame], secondaryPools[curFrame], drawChunks,
+                                    renderPass, swapChainExtent, swapChainFramebuffers, imageIndex,
+                                    graphicsPipeline, geometryArena.vertexBuffer(0, mesh.chunk), geometryArena.getIndexBuffer(mesh.chunk),
+                                    mesh, indexType, pipelineLayout, descriptorSet, uniformOffset, pushConstants);
+      } else {
+        recordCommandBuffer(commandBuffers[curFrame], renderPass, swapChainExtent,
+                            swapChainFramebuffers, imageIndex, graphicsPipeline,
+                            useDynamicStates, geometryArena.vertexBuffer(0, mesh.chunk), geometryArena.getIndexBuffer(mesh.chunk),
+                            mesh, indexType, pipelineLayout, descriptorSet, uniformOffset, pushConstants);
+      }
 
       // semaphores used to signal that the image is ready
       VkSemaphore waitSemaphores[]   = {imageAvailableSemaphores[curFrame]};
@@ -224,24 +258,34 @@ class Kilauea {
     std::vector<VkSemaphore> imageAvailableSemaphores; // signal that an image is available
     std::vector<VkSemaphore> renderFinishedSemaphores; // signal that rendering has finished
     std::vector<VkFence> inFlightFences;               // block the next frame until the current one is finished
+    std::vector<ThreadCommandPools> secondaryPools;    // per-thread pools of secondary command buffers
 
     // uniform buffer
     VkDescriptorPool descriptorPool;                   // pool for submitting descriptor sets (uniform buffers)
     VkDescriptorSetLayout descriptorSetLayout;         // describe the layout of a descriptor set
-    std::vector<VkDescriptorSet> descriptorSets;       // descriptor sets for the uniform buffers
-    std::vector<VkBuffer> uniformBuffers;              // uniform buffers
-    std::vector<VkDeviceMemory> uniformBuffersMemory;  // memory for the uniform buffers
-    std::vector<void*> uniformBuffersMapped;           // pointer to the mapped uniform buffers
+    VkDescriptorSet descriptorSet;                     // shared by all frames, bound with the offset of the frame
+    vks::UniformRing uniformRing;                      // one region per frame in flight, persistently mapped
+    uint32_t uniformOffset = 0;                        // dynamic offset of the uniform data of the current frame
+    PushConstants pushConstants{};                     // per-draw data (model matrix)
 
-    // vertex buffer
+    // vertices and indices of the model
     std::vector<Vertex> vertices;
-    VkBuffer vertexBuffer;
-    VkDeviceMemory vertexBufferMemory;
-
-    // index buffer
     std::vector<uint32_t> indices;
-    VkBuffer indexBuffer;
-    VkDeviceMemory indexBufferMemory;
+    VkIndexType indexType;             // UINT16 if the model has less than 65536 vertices
+
+    // vertex and index buffers shared by all meshes, the model is a range of them
+    vks::GeometryArena geometryArena;
+    vks::GeometryArena::Allocation mesh;
+    uint32_t arenaVertexCapacity = 1 << 20;
+    uint32_t arenaIndexCapacity = 1 << 22;
+
+    // meshlets, culled on the GPU before drawing
+    vks::mesh::Meshlets meshlets;
+    MeshletBuffers meshletBuffers;
+    ClusterCulling clusterCulling;
+#ifdef VK_EXT_mesh_shader
+    MeshShading meshShading;
+#endif
 
     // depth buffer
     VkImage depthImage;
@@ -257,6 +301,9 @@ class Kilauea {
     // state
     uint32_t curFrame = 0;           // index of the current frame (used in buffers and semaphores)
     bool useDynamicStates = true;    // whether to use dynamic states in the pipeline (viewport, scissor)
+    bool useVertexPulling = false;   // fetch the vertices from a storage buffer in the vertex shader, no vertex input state
+    bool useSecondaryCommandBuffers = true; // record the draws in parallel into secondary command buffers
+    uint32_t drawChunks = 8;         // number of secondary command buffers the draws are split into
     bool framebufferResized = false; // flag to recreate the swap chain after a resize
 
 
@@ -267,6 +314,47 @@ class Kilauea {
       }
     }
 
+    // the secondary command buffers are rerecorded every frame, so each frame in flight needs its own
+    // pools: the ones of the current frame can be reset while the GPU still reads the previous frame
+    void createSecondaryCommandPools() {
+      secondaryPools.resize(MAX_FRAMES_IN_FLIGHT);
+      for (auto& threadPools : secondaryPools) {
+        createThreadCommandPools(device, queueFamilies.graphicsFamily.value(),
+                                 getRecordingThreadCount(), drawChunks, threadPools,
+                                 VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+      }
+    }
+
+    // the arena vertex buffer is also a storage buffer: the mesh shaders (see meshlet.hpp) and the
+    // vertex shader with useVertexPulling fetch the vertices from it
+    void createGeometry() {
+      geometryArena.create(device, physicalDevice, {sizeof(Vertex)}, arenaVertexCapacity, arenaIndexCapacity,
+                           indexType, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+      mesh = uploadMesh(commandPool, graphicsQueue, vertices, indices, geometryArena);
+    }
+
+    void createMeshletResources() {
+      buildMeshlets(vertices, indices, mesh.firstVertex, meshlets);
+      createMeshletBuffers(device, physicalDevice, commandPool, graphicsQueue, meshlets, meshletBuffers);
+      createClusterCulling(device, physicalDevice, meshletBuffers, uniformRing, clusterCulling);
+#ifdef VK_EXT_mesh_shader
+      if (useMeshShaders) {
+        createMeshShading(device, renderPass, meshletBuffers, geometryArena.vertexBuffer(0, mesh.chunk), uniformRing,
+                          textureImageView, textureSampler, meshShading);
+      }
+#endif
+    }
+
+    void destroyMeshletResources() {
+#ifdef VK_EXT_mesh_shader
+      if (useMeshShaders) {
+        destroyMeshShading(device, meshShading);
+      }
+#endif
+      destroyClusterCulling(device, clusterCulling);
+      destroyMeshletBuffers(device, meshletBuffers);
+    }
+
     void createSyncObjects() {
       imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
       renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
@@ -331,9 +419,11 @@ class Kilauea {
       auto currentTime = std::chrono::high_resolution_clock::now();
       float time = std::chrono::duration<float, std::chrono::seconds::period>(currentTime - startTime).count();
 
+      // the model matrix changes with every draw, it is pushed when recording
+      pushConstants.model = glm::rotate(glm::mat4(1.0f), time * glm::radians(40.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+
       // update the uniform buffer
       UniformBufferObject ubo{};
-      ubo.model = glm::rotate(glm::mat4(1.0f), time * glm::radians(40.0f), glm::vec3(0.0f, 0.0f, 1.0f));
       ubo.view = glm::lookAt(glm::vec3(2.0f, 2.0f, 2.0f),
                             glm::vec3(0.0f, 0.0f, 0.0f),
                             glm::vec3(0.0f, 0.0f, 1.0f));
@@ -344,8 +434,9 @@ class Kilauea {
       // the Y coordinate of the clip coordinates is inverted in Vulkan (contrary to OpenGL)
       ubo.proj[1][1] *= -1;
 
-      // copy the updated data to the mapped memory (visible to the GPU)
-      memcpy(uniformBuffersMapped[curFrame], &ubo, sizeof(ubo));
+      // copy the updated data to the region of this frame in the ring (the fence of the frame was waited on)
+      uniformRing.beginFrame(curFrame);
+      uniformOffset = uniformRing.push(ubo);
     }
 
 
@@ -0,0 +1,412 @@
+#pragma once
+
+#include "../utils/common.hpp"
+#include "../utils/utils.hpp"
+#include "buffer.hpp"
+#include "pipeline.hpp"
+#include "vertex.hpp"
+
+#include <base/VulkanInitializers.hpp>
+#include <base/VulkanMeshlets.hpp>
+#include <base/VulkanTools.h>
+
+namespace vk {
+
+// meshlets of the model in device local storage buffers, read by cull.comp or tutorial.task/.mesh
+struct MeshletBuffers {
+  uint32_t meshletCount = 0;
+  uint32_t triangleCount = 0;
+  VkBuffer meshlets;               // vks::mesh::Meshlet, bounding sphere and normal cone of each meshlet
+  VkDeviceMemory meshletsMemory;
+  VkBuffer vertices;               // meshlet local vertex -> index in the vertex buffer
+  VkDeviceMemory verticesMemory;
+  VkBuffer triangles;              // 3 local vertex indices packed in 8 bits each
+  VkDeviceMemory trianglesMemory;
+};
+
+// split the (optimized) index buffer into meshlets of at most 64 vertices and 124 triangles,
+// firstVertex is the index of the first vertex of the mesh in the shared vertex buffer
+void buildMeshlets(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices,
+                   uint32_t firstVertex, vks::mesh::Meshlets& meshlets) {
+  const float* positions = reinterpret_cast<const float*>(
+    vertices.data()->data + VertexLayout::offset<vks::VertexSemantic::Position>());
+  vks::mesh::buildMeshlets(meshlets, indices.data(), indices.size(), positions, sizeof(Vertex),
+                           static_cast<uint32_t>(vertices.size()), firstVertex);
+}
+
+void createMeshletBuffers(VkDevice device, VkPhysicalDevice physicalDevice, VkCommandPool commandPool,
+                          VkQueue graphicsQueue, const vks::mesh::Meshlets& meshlets,
+                          MeshletBuffers& buffers) {
+  buffers.meshletCount = static_cast<uint32_t>(meshlets.meshlets.size());
+  buffers.triangleCount = static_cast<uint32_t>(meshlets.triangles.size());
+  createDeviceLocalBuffer(device, physicalDevice, commandPool, graphicsQueue,
+                          meshlets.meshlets.data(), meshlets.meshlets.size() * sizeof(vks::mesh::Meshlet),
+                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, buffers.meshlets, buffers.meshletsMemory);
+  createDeviceLocalBuffer(device, physicalDevice, commandPool, graphicsQueue,
+                          meshlets.vertices.data(), meshlets.vertices.size() * sizeof(uint32_t),
+                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, buffers.vertices, buffers.verticesMemory);
+  createDeviceLocalBuffer(device, physicalDevice, commandPool, graphicsQueue,
+                          meshlets.triangles.data(), meshlets.triangles.size() * sizeof(uint32_t),
+                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, buffers.triangles, buffers.trianglesMemory);
+}
+
+void destroyMeshletBuffers(VkDevice device, MeshletBuffers& buffers) {
+  vkDestroyBuffer(device, buffers.meshlets, nullptr);
+  vkFreeMemory(device, buffers.meshletsMemory, nullptr);
+  vkDestroyBuffer(device, buffers.vertices, nullptr);
+  vkFreeMemory(device, buffers.verticesMemory, nullptr);
+  vkDestroyBuffer(device, buffers.triangles, nullptr);
+  vkFreeMemory(device, buffers.trianglesMemory, nullptr);
+}
+
+
+// begin the main render pass, cleared as in recordCommandBuffer, with the dynamic viewport and scissor
+void beginMeshletRenderPass(VkCommandBuffer commandBuffer, VkRenderPass renderPass,
+                            VkFramebuffer framebuffer, VkExtent2D swapChainExtent) {
+  std::array<VkClearValue, 2> clearValues{};
+  clearValues[0].color = {{0.1f, 0.1f, 0.1f, 1.0f}}; // gray
+  clearValues[1].depthStencil = {1.0f, 0};           // 1.0f is the far plane
+
+  VkRenderPassBeginInfo renderPassInfo = vks::initializers::renderPassBeginInfo();
+  renderPassInfo.renderPass = renderPass;
+  renderPassInfo.framebuffer = framebuffer;
+  renderPassInfo.renderArea.offset = {0, 0};
+  renderPassInfo.renderArea.extent = swapChainExtent;
+  renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
+  renderPassInfo.pClearValues = clearValues.data();
+  vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+  VkViewport viewport = vks::initializers::viewport((float)swapChainExtent.width, (float)swapChainExtent.height, 0.0f, 1.0f);
+  vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+  VkRect2D scissor = vks::initializers::rect2D(swapChainExtent.width, swapChainExtent.height, 0, 0);
+  vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+}
+
+
+
+/************************ compute cluster culling ************************/
+
+// a compute pass culls the meshlets against the view frustum and their normal cone, and
+// writes the triangles of the visible ones to a compacted index buffer. the existing graphics
+// pipeline draws it with vkCmdDrawIndexedIndirect, the CPU never reads the visible count back.
+// the compacted buffers are written every frame, so each frame in flight needs its own
+struct ClusterCulling {
+  VkDescriptorSetLayout descriptorSetLayout;
+  VkDescriptorPool descriptorPool;
+  std::vector<VkDescriptorSet> descriptorSets;    // one per frame (the compacted outputs)
+  VkPipelineLayout pipelineLayout;
+  VkPipeline pipeline;
+  std::vector<VkBuffer> indexBuffers;             // compacted indices, always UINT32
+  std::vector<VkDeviceMemory> indexBuffersMemory;
+  std::vector<VkBuffer> drawBuffers;              // VkDrawIndexedIndirectCommand
+  std::vector<VkDeviceMemory> drawBuffersMemory;
+};
+
+void createClusterCulling(VkDevice device, VkPhysicalDevice physicalDevice, const MeshletBuffers& meshlets,
+                          const vks::UniformRing& uniformRing, ClusterCulling& culling) {
+  // per-frame output buffers, large enough to hold all the triangles
+  culling.indexBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+  culling.indexBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+  culling.drawBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+  culling.drawBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+  for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    createBuffer(device, physicalDevice, 3 * meshlets.triangleCount * sizeof(uint32_t),
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, culling.indexBuffers[i], culling.indexBuffersMemory[i]);
+    createBuffer(device, physicalDevice, sizeof(VkDrawIndexedIndirectCommand),
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                 VK_BUFFER_USAGE_TRANSFER_DST_BIT, // reset with vkCmdUpdateBuffer
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, culling.drawBuffers[i], culling.drawBuffersMemory[i]);
+  }
+
+  // descriptor set: the uniform buffer (dynamic offset in the ring), the meshlets, and the compacted outputs
+  std::vector<VkDescriptorSetLayoutBinding> bindings = {
+    vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT, 0),
+    vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 1),
+    vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2),
+    vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 3),
+    vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 4),
+    vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 5),
+  };
+  VkDescriptorSetLayoutCreateInfo layoutInfo = vks::initializers::descriptorSetLayoutCreateInfo(bindings);
+  VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &culling.descriptorSetLayout));
+
+  std::vector<VkDescriptorPoolSize> poolSizes = {
+    vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, MAX_FRAMES_IN_FLIGHT),
+    vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 5 * MAX_FRAMES_IN_FLIGHT),
+  };
+  VkDescriptorPoolCreateInfo poolInfo = vks::initializers::descriptorPoolCreateInfo(poolSizes, MAX_FRAMES_IN_FLIGHT);
+  VK_CHECK_RESULT(vkCreateDescriptorPool(device, &poolInfo, nullptr, &culling.descriptorPool));
+
+  std::vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT, culling.descriptorSetLayout);
+  VkDescriptorSetAllocateInfo allocInfo = vks::initializers::descriptorSetAllocateInfo(
+    culling.descriptorPool, layouts.data(), MAX_FRAMES_IN_FLIGHT);
+  culling.descriptorSets.resize(MAX_FRAMES_IN_FLIGHT);
+  VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, culling.descriptorSets.data()));
+
+  for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    VkDescriptorBufferInfo bufferInfos[] = {
+      uniformRing.descriptor(sizeof(UniformBufferObject)),
+      {meshlets.meshlets, 0, VK_WHOLE_SIZE},
+      {meshlets.vertices, 0, VK_WHOLE_SIZE},
+      {meshlets.triangles, 0, VK_WHOLE_SIZE},
+      {culling.indexBuffers[i], 0, VK_WHOLE_SIZE},
+      {culling.drawBuffers[i], 0, VK_WHOLE_SIZE},
+    };
+    std::vector<VkWriteDescriptorSet> writes;
+    for (uint32_t binding = 0; binding < 6; binding++) {
+      VkDescriptorType type = binding == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      writes.push_back(vks::initializers::writeDescriptorSet(culling.descriptorSets[i], type, binding, &bufferInfos[binding]));
+    }
+    vkUpdateDescriptorSets(device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+  }
+
+  // compute pipeline, the model matrix is pushed as in the graphics pipeline
+  VkPushConstantRange pushConstantRange = vks::initializers::pushConstantRange(VK_SHADER_STAGE_COMPUTE_BIT, sizeof(PushConstants), 0);
+  VkPipelineLayoutCreateInfo pipelineLayoutInfo = vks::initializers::pipelineLayoutCreateInfo(&culling.descriptorSetLayout);
+  pipelineLayoutInfo.pushConstantRangeCount = 1;
+  pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+  VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &culling.pipelineLayout));
+
+  auto compShaderCode = readFile("build/cull.comp.spv");
+  VkShaderModule compShaderModule = createShaderModule(device, compShaderCode);
+  VkComputePipelineCreateInfo pipelineInfo = vks::initializers::computePipelineCreateInfo(culling.pipelineLayout);
+  pipelineInfo.stage = vks::initializers::pipelineShaderStageCreateInfo(VK_SHADER_STAGE_COMPUTE_BIT, compShaderModule);
+  VK_CHECK_RESULT(vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &culling.pipeline));
+  vkDestroyShaderModule(device, compShaderModule, nullptr);
+}
+
+void destroyClusterCulling(VkDevice device, ClusterCulling& culling) {
+  vkDestroyPipeline(device, culling.pipeline, nullptr);
+  vkDestroyPipelineLayout(device, culling.pipelineLayout, nullptr);
+  vkDestroyDescriptorPool(device, culling.descriptorPool, nullptr);
+  vkDestroyDescriptorSetLayout(device, culling.descriptorSetLayout, nullptr);
+  for (size_t i = 0; i < culling.indexBuffers.size(); i++) {
+    vkDestroyBuffer(device, culling.indexBuffers[i], nullptr);
+    vkFreeMemory(device, culling.indexBuffersMemory[i], nullptr);
+    vkDestroyBuffer(device, culling.drawBuffers[i], nullptr);
+    vkFreeMemory(device, culling.drawBuffersMemory[i], nullptr);
+  }
+}
+
+// same as recordCommandBuffer, but the triangles come from the compacted index buffer of this frame
+// note: the graphics queue is used for the dispatch (graphics families always support compute)
+void recordCommandBufferCulled(VkCommandBuffer commandBuffer, ClusterCulling& culling, const MeshletBuffers& meshlets,
+                               uint32_t curFrame, VkRenderPass renderPass, VkExtent2D swapChainExtent,
+                               std::vector<VkFramebuffer>& swapChainFramebuffers, uint32_t imageIndex,
+                               VkPipeline graphicsPipeline, VkBuffer vertexBuffer,
+                               VkPipelineLayout pipelineLayout, VkDescriptorSet descriptorSet, uint32_t uniformOffset,
+                               const PushConstants& pushConstants) {
+  VkCommandBufferBeginInfo beginInfo = vks::initializers::commandBufferBeginInfo();
+  VK_CHECK_RESULT(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+
+  // reset the draw command: no index yet, one instance
+  VkBuffer drawBuffer = culling.drawBuffers[curFrame];
+  VkDrawIndexedIndirectCommand drawCommand{0, 1, 0, 0, 0};
+  vkCmdUpdateBuffer(commandBuffer, drawBuffer, 0, sizeof(drawCommand), &drawCommand);
+
+  VkBufferMemoryBarrier resetBarrier = vks::initializers::bufferMemoryBarrier();
+  resetBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  resetBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  resetBarrier.buffer = drawBuffer;
+  resetBarrier.size = VK_WHOLE_SIZE;
+  vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       0, 0, nullptr, 1, &resetBarrier, 0, nullptr);
+
+  // cull: one workgroup per meshlet
+  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, culling.pipeline);
+  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, culling.pipelineLayout,
+                          0, 1, &culling.descriptorSets[curFrame], 1, &uniformOffset);
+  vkCmdPushConstants(commandBuffer, culling.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &pushConstants);
+  vkCmdDispatch(commandBuffer, meshlets.meshletCount, 1, 1);
+
+  // the draw command and the indices must be written before they are read by the draw
+  std::array<VkBufferMemoryBarrier, 2> cullBarriers{};
+  cullBarriers[0] = vks::initializers::bufferMemoryBarrier();
+  cullBarriers[0].srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  cullBarriers[0].dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+  cullBarriers[0].buffer = drawBuffer;
+  cullBarriers[0].size = VK_WHOLE_SIZE;
+  cullBarriers[1] = vks::initializers::bufferMemoryBarrier();
+  cullBarriers[1].srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  cullBarriers[1].dstAccessMask = VK_ACCESS_INDEX_READ_BIT;
+  cullBarriers[1].buffer = culling.indexBuffers[curFrame];
+  cullBarriers[1].size = VK_WHOLE_SIZE;
+  vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                       0, 0, nullptr, static_cast<uint32_t>(cullBarriers.size()), cullBarriers.data(), 0, nullptr);
+
+  // draw the visible triangles with the regular graphics pipeline
+  beginMeshletRenderPass(commandBuffer, renderPass, swapChainFramebuffers[imageIndex], swapChainExtent);
+  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+  VkDeviceSize offsets[] = {0};
+  vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertexBuffer, offsets);
+  vkCmdBindIndexBuffer(commandBuffer, culling.indexBuffers[curFrame], 0, VK_INDEX_TYPE_UINT32);
+  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                          pipelineLayout, 0, 1, &descriptorSet, 1, &uniformOffset);
+  vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstants), &pushConstants);
+  vkCmdDrawIndexedIndirect(commandBuffer, drawBuffer, 0, 1, sizeof(VkDrawIndexedIndirectCommand));
+  vkCmdEndRenderPass(commandBuffer);
+
+  VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer));
+}
+
+
+
+/************************ mesh shading (VK_EXT_mesh_shader) ************************/
+
+#ifdef VK_EXT_mesh_shader
+
+// the task shader culls the meshlets (same tests as cull.comp) and launches one mesh shader
+// workgroup per visible meshlet, which pulls its vertices from the vertex buffer
+struct MeshShading {
+  VkDescriptorSetLayout descriptorSetLayout;
+  VkDescriptorPool descriptorPool;
+  VkDescriptorSet descriptorSet; // shared by all frames (dynamic uniform buffer)
+  VkPipelineLayout pipelineLayout;
+  VkPipeline pipeline;
+  PFN_vkCmdDrawMeshTasksEXT vkCmdDrawMeshTasksEXT = nullptr;
+};
+
+// per-draw data of the task and mesh shaders
+struct MeshShadingPushConstants {
+  alignas(16) glm::mat4 model;
+  uint32_t meshletCount; // the task shader skips the invocations past the end
+};
+
+const uint32_t MESHLETS_PER_TASK = 32; // local size of tutorial.task
+
+void createMeshShading(VkDevice device, VkRenderPass renderPass, const MeshletBuffers& meshlets,
+                       VkBuffer vertexBuffer, const vks::UniformRing& uniformRing,
+                       VkImageView textureImageView, VkSampler textureSampler, MeshShading& meshShading) {
+  // tutorial.mesh reads the vertices as 4 words: position (3 floats) and texture coordinates (2 halfs)
+  static_assert(VertexLayout::stride == 16 && VertexLayout::offset<vks::VertexSemantic::UV>() == 12,
+                "tutorial.mesh expects a Float3 position followed by Half2 texture coordinates");
+
+  meshShading.vkCmdDrawMeshTasksEXT = reinterpret_cast<PFN_vkCmdDrawMeshTasksEXT>(
+    vkGetDeviceProcAddr(device, "vkCmdDrawMeshTasksEXT"));
+  if (!meshShading.vkCmdDrawMeshTasksEXT) {
+    throw std::runtime_error("failed to load vkCmdDrawMeshTasksEXT!");
+  }
+
+  // same bindings as the graphics pipeline (0 uniform buffer, 1 texture), then the meshlets and vertices
+  const VkShaderStageFlags meshStages = VK_SHADER_STAGE_TASK_BIT_EXT | VK_SHADER_STAGE_MESH_BIT_EXT;
+  std::vector<VkDescriptorSetLayoutBinding> bindings = {
+    vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, meshStages, 0),
+    vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 1),
+    vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, meshStages, 2),
+    vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_MESH_BIT_EXT, 3),
+    vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_MESH_BIT_EXT, 4),
+    vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_MESH_BIT_EXT, 5),
+  };
+  VkDescriptorSetLayoutCreateInfo layoutInfo = vks::initializers::descriptorSetLayoutCreateInfo(bindings);
+  VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &meshShading.descriptorSetLayout));
+
+  std::vector<VkDescriptorPoolSize> poolSizes = {
+    vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1),
+    vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1),
+    vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4),
+  };
+  VkDescriptorPoolCreateInfo poolInfo = vks::initializers::descriptorPoolCreateInfo(poolSizes, 1);
+  VK_CHECK_RESULT(vkCreateDescriptorPool(device, &poolInfo, nullptr, &meshShading.descriptorPool));
+
+  VkDescriptorSetAllocateInfo allocInfo = vks::initializers::descriptorSetAllocateInfo(
+    meshShading.descriptorPool, &meshShading.descriptorSetLayout, 1);
+  VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &meshShading.descriptorSet));
+
+  VkDescriptorSet set = meshShading.descriptorSet;
+  VkDescriptorBufferInfo uniformInfo = uniformRing.descriptor(sizeof(UniformBufferObject));
+  VkDescriptorImageInfo imageInfo = vks::initializers::descriptorImageInfo(
+    textureSampler, textureImageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+  VkDescriptorBufferInfo storageInfos[] = {
+    {meshlets.meshlets, 0, VK_WHOLE_SIZE},
+    {meshlets.vertices, 0, VK_WHOLE_SIZE},
+    {meshlets.triangles, 0, VK_WHOLE_SIZE},
+    {vertexBuffer, 0, VK_WHOLE_SIZE},
+  };
+  std::vector<VkWriteDescriptorSet> writes = {
+    vks::initializers::writeDescriptorSet(set, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 0, &uniformInfo),
+    vks::initializers::writeDescriptorSet(set, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, &imageInfo),
+  };
+  for (uint32_t j = 0; j < 4; j++) {
+    writes.push_back(vks::initializers::writeDescriptorSet(set, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2 + j, &storageInfos[j]));
+  }
+  vkUpdateDescriptorSets(device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+
+  // the model matrix and the number of meshlets, read by both the task and the mesh shader
+  VkPushConstantRange pushConstantRange = vks::initializers::pushConstantRange(
+    meshStages, sizeof(MeshShadingPushConstants), 0);
+  VkPipelineLayoutCreateInfo pipelineLayoutInfo = vks::initializers::pipelineLayoutCreateInfo(&meshShading.descriptorSetLayout);
+  pipelineLayoutInfo.pushConstantRangeCount = 1;
+  pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+  VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &meshShading.pipelineLayout));
+
+  // task, mesh and fragment stages, no vertex input nor input assembly
+  auto taskShaderCode = readFile("build/tutorial.task.spv");
+  auto meshShaderCode = readFile("build/tutorial.mesh.spv");
+  auto fragShaderCode = readFile("build/tutorial.frag.spv");
+  std::array<VkPipelineShaderStageCreateInfo, 3> shaderStages = {
+    vks::initializers::pipelineShaderStageCreateInfo(VK_SHADER_STAGE_TASK_BIT_EXT, createShaderModule(device, taskShaderCode)),
+    vks::initializers::pipelineShaderStageCreateInfo(VK_SHADER_STAGE_MESH_BIT_EXT, createShaderModule(device, meshShaderCode)),
+    vks::initializers::pipelineShaderStageCreateInfo(VK_SHADER_STAGE_FRAGMENT_BIT, createShaderModule(device, fragShaderCode)),
+  };
+
+  // fixed functions as in createGraphicsPipeline (dynamic viewport and scissor)
+  VkPipelineViewportStateCreateInfo viewportState = vks::initializers::pipelineViewportStateCreateInfo(1, 1);
+  std::vector<VkDynamicState> dynamicStates = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
+  VkPipelineDynamicStateCreateInfo dynamicState = vks::initializers::pipelineDynamicStateCreateInfo(dynamicStates);
+  VkPipelineRasterizationStateCreateInfo rasterizer = vks::initializers::pipelineRasterizationStateCreateInfo(
+    VK_POLYGON_MODE_FILL, VK_CULL_MODE_NONE, VK_FRONT_FACE_COUNTER_CLOCKWISE);
+  VkPipelineMultisampleStateCreateInfo multisampling = vks::initializers::pipelineMultisampleStateCreateInfo(VK_SAMPLE_COUNT_1_BIT);
+  VkPipelineDepthStencilStateCreateInfo depthStencil = vks::initializers::pipelineDepthStencilStateCreateInfo(
+    VK_TRUE, VK_TRUE, VK_COMPARE_OP_LESS);
+  VkPipelineColorBlendAttachmentState colorBlendAttachment = vks::initializers::pipelineColorBlendAttachmentState(0xf, VK_FALSE);
+  VkPipelineColorBlendStateCreateInfo colorBlending = vks::initializers::pipelineColorBlendStateCreateInfo(1, &colorBlendAttachment);
+
+  VkGraphicsPipelineCreateInfo pipelineInfo = vks::initializers::pipelineCreateInfo(meshShading.pipelineLayout, renderPass);
+  pipelineInfo.stageCount = static_cast<uint32_t>(shaderStages.size());
+  pipelineInfo.pStages = shaderStages.data();
+  pipelineInfo.pViewportState = &viewportState;
+  pipelineInfo.pRasterizationState = &rasterizer;
+  pipelineInfo.pMultisampleState = &multisampling;
+  pipelineInfo.pDepthStencilState = &depthStencil;
+  pipelineInfo.pColorBlendState = &colorBlending;
+  pipelineInfo.pDynamicState = &dynamicState;
+  VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &meshShading.pipeline));
+
+  for (auto& stage : shaderStages) {
+    vkDestroyShaderModule(device, stage.module, nullptr);
+  }
+}
+
+void destroyMeshShading(VkDevice device, MeshShading& meshShading) {
+  vkDestroyPipeline(device, meshShading.pipeline, nullptr);
+  vkDestroyPipelineLayout(device, meshShading.pipelineLayout, nullptr);
+  vkDestroyDescriptorPool(device, meshShading.descriptorPool, nullptr);
+  vkDestroyDescriptorSetLayout(device, meshShading.descriptorSetLayout, nullptr);
+}
+
+void recordCommandBufferMeshShading(VkCommandBuffer commandBuffer, MeshShading& meshShading, const MeshletBuffers& meshlets,
+                                    VkRenderPass renderPass, VkExtent2D swapChainExtent,
+                                    std::vector<VkFramebuffer>& swapChainFramebuffers, uint32_t imageIndex,
+                                    uint32_t uniformOffset, const PushConstants& pushConstants) {
+  VkCommandBufferBeginInfo beginInfo = vks::initializers::commandBufferBeginInfo();
+  VK_CHECK_RESULT(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+
+  beginMeshletRenderPass(commandBuffer, renderPass, swapChainFramebuffers[imageIndex], swapChainExtent);
+  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, meshShading.pipeline);
+  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, meshShading.pipelineLayout,
+                          0, 1, &meshShading.descriptorSet, 1, &uniformOffset);
+  MeshShadingPushConstants meshPushConstants{pushConstants.model, meshlets.meshletCount};
+  vkCmdPushConstants(commandBuffer, meshShading.pipelineLayout, VK_SHADER_STAGE_TASK_BIT_EXT | VK_SHADER_STAGE_MESH_BIT_EXT,
+                     0, sizeof(MeshShadingPushConstants), &meshPushConstants);
+  uint32_t taskCount = (meshlets.meshletCount + MESHLETS_PER_TASK - 1) / MESHLETS_PER_TASK;
+  meshShading.vkCmdDrawMeshTasksEXT(commandBuffer, taskCount, 1, 1);
+  vkCmdEndRenderPass(commandBuffer);
+
+  VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer));
+}
+
+#endif // VK_EXT_mesh_shader
+
+} // namespace vk
@@ -3,9 +3,13 @@
 #include "../utils/common.hpp"
 #include "vertex.hpp"
 
+#include <base/VulkanMeshOptimizer.hpp>
+
 namespace vk {
 
-  void loadModel(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+  // load the model and, if optimize is set, reorder its triangles and vertices for the
+  // post-transform vertex cache, overdraw and vertex fetch (see vks::mesh::optimizeMesh)
+  void loadModel(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, bool optimize = true) {
     tinyobj::attrib_t attrib;
     std::vector<tinyobj::shape_t> shapes;
     std::vector<tinyobj::material_t> materials;
@@ -21,21 +25,19 @@ namespace vk {
       for (const auto& index : shape.mesh.indices) {
         Vertex vertex{};
 
-        vertex.pos = {
+        VertexLayout::set<vks::VertexSemantic::Position>(vertex, glm::vec3(
           attrib.vertices[3 * index.vertex_index + 0],
           attrib.vertices[3 * index.vertex_index + 1],
           attrib.vertices[3 * index.vertex_index + 2]
-        };
+        ));
 
         // flip the y-axis
-        vertex.texCoord = {
+        VertexLayout::set<vks::VertexSemantic::UV>(vertex, glm::vec2(
                  attrib.texcoords[2 * index.texcoord_index + 0],
           1.0f - attrib.texcoords[2 * index.texcoord_index + 1]
-        };
-
-        vertex.color = {1.0f, 1.0f, 1.0f};
+        ));
 
-        // only insert new (unique) vertices
+        // only insert new (unique) vertices, compared after quantization
         if (uniqueVertices.count(vertex) == 0) {
           uniqueVertices[vertex] = static_cast<uint32_t>(vertices.size());
           vertices.push_back(vertex);
@@ -44,6 +46,16 @@ namespace vk {
         indices.push_back(uniqueVertices[vertex]);
       }
     }
+
+    if (optimize) {
+      const uint32_t vertexCount = static_cast<uint32_t>(vertices.size());
+      auto before = vks::mesh::analyzeVertexCache(indices.data(), indices.size(), vertexCount);
+      vks::mesh::optimizeMesh(indices.data(), indices.size(), vertices.data(), vertexCount,
+                              VertexLayout::offset<vks::VertexSemantic::Position>());
+      auto after = vks::mesh::analyzeVertexCache(indices.data(), indices.size(), vertexCount);
+      std::cout << "Optimized " << MODEL_PATH << ": ACMR " << before.acmr << " -> " << after.acmr
+                << ", ATVR " << before.atvr << " -> " << after.atvr << std::endl;
+    }
   }
 
 } // namespace vk
\ No newline at end of file
@@ -38,6 +38,37 @@ bool checkDeviceExtensionSupport(VkPhysicalDevice physDevice) {
   return requiredExtensions.empty();
 }
 
+// optional: task and mesh shaders (VK_EXT_mesh_shader), used to draw meshlets without the vertex pipeline
+bool checkMeshShaderSupport(VkPhysicalDevice physDevice) {
+#ifdef VK_EXT_mesh_shader
+  VkPhysicalDeviceProperties deviceProperties;
+  vkGetPhysicalDeviceProperties(physDevice, &deviceProperties);
+  if (deviceProperties.apiVersion < VK_API_VERSION_1_2)
+    return false;
+
+  uint32_t extensionCount;
+  vkEnumerateDeviceExtensionProperties(physDevice, nullptr, &extensionCount, nullptr);
+  std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+  vkEnumerateDeviceExtensionProperties(physDevice, nullptr, &extensionCount, availableExtensions.data());
+  bool found = false;
+  for (const auto& extension : availableExtensions) {
+    found |= strcmp(extension.extensionName, VK_EXT_MESH_SHADER_EXTENSION_NAME) == 0;
+  }
+  if (!found)
+    return false;
+
+  VkPhysicalDeviceMeshShaderFeaturesEXT meshShaderFeatures{};
+  meshShaderFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MESH_SHADER_FEATURES_EXT;
+  VkPhysicalDeviceFeatures2 deviceFeatures2{};
+  deviceFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  deviceFeatures2.pNext = &meshShaderFeatures;
+  vkGetPhysicalDeviceFeatures2(physDevice, &deviceFeatures2);
+  return meshShaderFeatures.taskShader && meshShaderFeatures.meshShader;
+#else
+  return false; // vulkan headers older than the extension
+#endif
+}
+
 int rateDeviceSuitability(VkPhysicalDevice physDevice, VkSurfaceKHR surface) {
   // name, supported vulkan version, memory properties, queue families, extensions,
   // swap chain support, device type, etc
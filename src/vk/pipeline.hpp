@@ -2,6 +2,7 @@
 
 #include "../utils/common.hpp"
 #include "../utils/utils.hpp"
+#include "buffer.hpp"
 #include "vertex.hpp"
 
 namespace vk {
@@ -21,11 +22,12 @@ VkShaderModule createShaderModule(VkDevice device, std::vector<char>& code) {
 }
 
 void createGraphicsPipeline(VkDevice device, VkExtent2D swapChainExtent, VkRenderPass renderPass,
-                            bool useDynamicStates, VkDescriptorSetLayout descriptorSetLayout,
+                            bool useDynamicStates, bool useVertexPulling, VkDescriptorSetLayout descriptorSetLayout,
                             VkPipelineLayout& pipelineLayout, VkPipeline& graphicsPipeline) {
 
   // create temporary shader modules
-  auto vertShaderCode = readFile("build/tutorial.vert.spv");
+  // with vertex pulling, the vertex shader reads the vertices from a storage buffer (binding 2) by gl_VertexIndex
+  auto vertShaderCode = readFile(useVertexPulling ? "build/tutorial_pull.vert.spv" : "build/tutorial.vert.spv");
   auto fragShaderCode = readFile("build/tutorial.frag.spv");
   VkShaderModule vertShaderModule = createShaderModule(device, vertShaderCode);
   VkShaderModule fragShaderModule = createShaderModule(device, fragShaderCode);
@@ -47,15 +49,19 @@ void createGraphicsPipeline(VkDevice device, VkExtent2D swapChainExtent, VkRende
   // save the shader stages
   VkPipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo, fragShaderStageInfo};
 
-  // vertex shader input
-  auto bindingDescription = Vertex::getBindingDescription();
-  auto attributeDescriptions = Vertex::getAttributeDescriptions();
+  // vertex shader input (none with vertex pulling: the shader decodes vk::VertexLayout itself)
+  static_assert(VertexLayout::stride == 16 && VertexLayout::offset<vks::VertexSemantic::UV>() == 12,
+                "tutorial_pull.vert expects a Float3 position followed by Half2 texture coordinates");
+  auto bindingDescription = VertexLayout::bindingDescription(0);
+  auto attributeDescriptions = VertexLayout::attributeDescriptions(0);
   VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
   vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-  vertexInputInfo.vertexBindingDescriptionCount = 1;
-  vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
-  vertexInputInfo.pVertexBindingDescriptions = &bindingDescription; // per-vertex data format
-  vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
+  if (!useVertexPulling) {
+    vertexInputInfo.vertexBindingDescriptionCount = 1;
+    vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
+    vertexInputInfo.pVertexBindingDescriptions = &bindingDescription; // per-vertex data format
+    vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
+  }
 
   // input assembly - options:
   // VK_PRIMITIVE_TOPOLOGY_POINT_LIST: points from vertices
@@ -189,12 +195,17 @@ void createGraphicsPipeline(VkDevice device, VkExtent2D swapChainExtent, VkRende
 
   // pipeline layout - uniform values that are global to the pipeline
   // and can be changed at drawing time without recreating the pipeline
+  // per-draw values (the model matrix) are push constants, recorded directly in the command buffer
+  VkPushConstantRange pushConstantRange{};
+  pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  pushConstantRange.offset = 0;
+  pushConstantRange.size = sizeof(PushConstants);
   VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
   pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
   pipelineLayoutInfo.setLayoutCount = 1;
   pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout; // descriptor set layout for uniform values
-  pipelineLayoutInfo.pushConstantRangeCount = 0;
-  pipelineLayoutInfo.pPushConstantRanges = nullptr; // another way of passing dynamic values to shaders
+  pipelineLayoutInfo.pushConstantRangeCount = 1;
+  pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
   if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
     throw std::runtime_error("failed to create pipeline layout!");
   }